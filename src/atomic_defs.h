@@ -10,6 +10,7 @@
 #define ATOMIC_DECREMENT(_v) (void)__sync_fetch_and_sub(&(_v), 1)
 #define ATOMIC_INCREASE(_v, _n) __sync_add_and_fetch(&(_v), (_n))
 #define ATOMIC_DECREASE(_v, _n) __sync_sub_and_fetch(&(_v), (_n))
+#define ATOMIC_OR_RELAXED(_v, _n) (void)__atomic_fetch_or(&(_v), (_n), __ATOMIC_RELAXED)
 #define ATOMIC_CAS(_v, _o, _n) __sync_bool_compare_and_swap(&(_v), (_o), (_n))
 #define ATOMIC_CAS_ACQ_REL(_v, _expected, _desired) \
     __atomic_compare_exchange_n(&(_v), &(_expected), (_desired), false, \
@@ -48,26 +49,41 @@
 #define MUTEX_DESTROY(_mutex) pthread_mutex_destroy(&(_mutex))
 #define MUTEX_LOCK(_mutex) if (__builtin_expect(pthread_mutex_lock(&(_mutex)) != 0, 0)) { abort(); }
 #define MUTEX_UNLOCK(_mutex) if (__builtin_expect(pthread_mutex_unlock(&(_mutex)) != 0, 0)) { abort(); }
+#define MUTEX_TRYLOCK(_mutex) (pthread_mutex_trylock(&(_mutex)) == 0)
+#define RWLOCK_INIT(_lock) if (__builtin_expect(pthread_rwlock_init(&(_lock), 0) != 0, 0)) { abort(); }
+#define RWLOCK_DESTROY(_lock) pthread_rwlock_destroy(&(_lock))
+#define RWLOCK_RDLOCK(_lock) if (__builtin_expect(pthread_rwlock_rdlock(&(_lock)) != 0, 0)) { abort(); }
+#define RWLOCK_WRLOCK(_lock) if (__builtin_expect(pthread_rwlock_wrlock(&(_lock)) != 0, 0)) { abort(); }
+#define RWLOCK_UNLOCK(_lock) if (__builtin_expect(pthread_rwlock_unlock(&(_lock)) != 0, 0)) { abort(); }
 #ifdef __MACH__
 #define SPIN_INIT(_mutex) ((_mutex) = 0)
 #define SPIN_DESTROY(_mutex)
 #define SPIN_LOCK(_mutex) OSSpinLockLock(&(_mutex))
 #define SPIN_UNLOCK(_mutex) OSSpinLockUnlock(&(_mutex))
+#define SPIN_TRYLOCK(_mutex) OSSpinLockTry(&(_mutex))
 #else
 #define SPIN_INIT(_mutex) pthread_spin_init(&(_mutex), 0)
 #define SPIN_DESTROY(_mutex) pthread_spin_destroy(&(_mutex))
 #define SPIN_LOCK(_mutex) if (__builtin_expect(pthread_spin_lock(&(_mutex)) != 0, 0)) { abort(); }
 #define SPIN_UNLOCK(_mutex) if (__builtin_expect(pthread_spin_unlock(&(_mutex)) != 0, 0)) { abort(); }
+#define SPIN_TRYLOCK(_mutex) (pthread_spin_trylock(&(_mutex)) == 0)
 #endif
 #else
 #define MUTEX_INIT(_mutex)
 #define MUTEX_DESTROY(_mutex)
 #define MUTEX_LOCK(_mutex)
 #define MUTEX_UNLOCK(_mutex)
+#define MUTEX_TRYLOCK(_mutex) (1)
+#define RWLOCK_INIT(_lock)
+#define RWLOCK_DESTROY(_lock)
+#define RWLOCK_RDLOCK(_lock)
+#define RWLOCK_WRLOCK(_lock)
+#define RWLOCK_UNLOCK(_lock)
 #define SPIN_INIT(_mutex)
 #define SPIN_DESTROY(_mutex)
 #define SPIN_LOCK(_mutex)
 #define SPIN_UNLOCK(_mutex)
+#define SPIN_TRYLOCK(_mutex) (1)
 #endif
 
 #endif //ATOMIC_DEFS_H
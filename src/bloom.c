@@ -0,0 +1,372 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "atomic_defs.h"
+#include "hashtable.h"
+#include "bloom.h"
+
+#define BLOOM_DEFAULT_FP_RATE 0.01
+
+// 8 words of 32 bits per block, one bit set in each of them
+#define BLOOM_LANES 8
+
+// counting filters keep 32 4-bit counters for each lane (4 words)
+#define BLOOM_COUNTER_WORDS 4
+#define BLOOM_COUNTER_MAX 0xf
+
+// keys are hashed with a fixed seed, so that serialized
+// filters can be loaded (and merged) by any process
+#define BLOOM_SEED 0x9e3779b97f4a7c15ULL
+
+#define BLOOM_MAGIC "hlbloom"
+#define BLOOM_VERSION 1
+
+struct _bloom_filter_s {
+    uint32_t *words;
+    size_t nblocks;
+    int counting;
+};
+
+typedef struct _bloom_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t counting;
+    uint64_t nblocks;
+} bloom_header_t;
+
+// multipliers used to select the bit to set in each lane of a block
+// (the same ones used by the split block bloom filters of parquet)
+static const uint32_t bloom_salt[BLOOM_LANES] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static inline size_t
+bloom_block_words(bloom_filter_t *bf)
+{
+    return bf->counting ? BLOOM_LANES * BLOOM_COUNTER_WORDS : BLOOM_LANES;
+}
+
+// the hashes handed to us are often used to index a table as well
+// (and those of a shard all share the same high bits), the block and the
+// bits within it must not depend on them, so they are mixed again
+static inline uint64_t
+bloom_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint32_t *
+bloom_block(bloom_filter_t *bf, uint64_t h)
+{
+    // multiply-shift instead of a modulo to select the block
+    size_t index = (size_t)(((h >> 32) * (uint64_t)bf->nblocks) >> 32);
+    return bf->words + index * bloom_block_words(bf);
+}
+
+// the position of the bit to set (or counter to update) in each lane
+static inline void
+bloom_positions(uint32_t key, uint32_t positions[BLOOM_LANES])
+{
+    int i;
+    for (i = 0; i < BLOOM_LANES; i++)
+        positions[i] = (key * bloom_salt[i]) >> 27;
+}
+
+static bloom_filter_t *
+bloom_alloc(size_t nblocks, int counting)
+{
+    if (!nblocks || nblocks > UINT32_MAX)
+        return NULL;
+
+    bloom_filter_t *bf = calloc(1, sizeof(bloom_filter_t));
+    if (!bf)
+        return NULL;
+
+    bf->nblocks = nblocks;
+    bf->counting = counting;
+
+    // the blocks are aligned to their size: a block of a plain filter is
+    // a single cache line, the 128 bytes of a counting one span two lines
+    // (an adjacent pair, which most cpus prefetch together)
+    size_t align = bloom_block_words(bf) * sizeof(uint32_t);
+    if (posix_memalign((void **)&bf->words, align, bloom_size(bf)) != 0) {
+        free(bf);
+        return NULL;
+    }
+    bloom_clear(bf);
+
+    return bf;
+}
+
+static bloom_filter_t *
+bloom_create_internal(size_t capacity, double fp_rate, int counting)
+{
+    if (fp_rate <= 0 || fp_rate >= 1)
+        fp_rate = BLOOM_DEFAULT_FP_RATE;
+    if (!capacity)
+        capacity = 1;
+
+    // the optimal number of bits per key for 8 bits set in each block
+    // (which accounts for the collisions within a lane, but not for the
+    // uneven load of the blocks, hence the additional 10%)
+    double bits = -8.0 * capacity / log(1.0 - pow(fp_rate, 1.0 / BLOOM_LANES));
+    size_t nblocks = (size_t)ceil(bits * 1.1 / (BLOOM_LANES * 32));
+
+    return bloom_alloc(nblocks, counting);
+}
+
+bloom_filter_t *
+bloom_create(size_t capacity, double fp_rate)
+{
+    return bloom_create_internal(capacity, fp_rate, 0);
+}
+
+bloom_filter_t *
+bloom_create_counting(size_t capacity, double fp_rate)
+{
+    return bloom_create_internal(capacity, fp_rate, 1);
+}
+
+void
+bloom_destroy(bloom_filter_t *bf)
+{
+    free(bf->words);
+    free(bf);
+}
+
+void
+bloom_clear(bloom_filter_t *bf)
+{
+    memset(bf->words, 0, bloom_size(bf));
+}
+
+size_t
+bloom_size(bloom_filter_t *bf)
+{
+    return bf->nblocks * bloom_block_words(bf) * sizeof(uint32_t);
+}
+
+static inline void
+bloom_counter_increment(uint32_t *word, int shift)
+{
+    uint32_t old = ATOMIC_READ_RELAXED(*word);
+    for (;;) {
+        // saturated counters are never touched again
+        if (((old >> shift) & BLOOM_COUNTER_MAX) == BLOOM_COUNTER_MAX)
+            return;
+        uint32_t prev = ATOMIC_CAS_RETURN(*word, old, old + (1U << shift));
+        if (prev == old)
+            return;
+        old = prev;
+    }
+}
+
+static inline void
+bloom_counter_decrement(uint32_t *word, int shift)
+{
+    uint32_t old = ATOMIC_READ_RELAXED(*word);
+    for (;;) {
+        uint32_t counter = (old >> shift) & BLOOM_COUNTER_MAX;
+        // we can't know how many keys a saturated counter accounts for
+        if (counter == 0 || counter == BLOOM_COUNTER_MAX)
+            return;
+        uint32_t prev = ATOMIC_CAS_RETURN(*word, old, old - (1U << shift));
+        if (prev == old)
+            return;
+        old = prev;
+    }
+}
+
+void
+bloom_add_hash(bloom_filter_t *bf, uint64_t hash)
+{
+    uint64_t h = bloom_mix(hash);
+    uint32_t *block = bloom_block(bf, h);
+    uint32_t positions[BLOOM_LANES];
+    bloom_positions((uint32_t)h, positions);
+
+    int i;
+    if (bf->counting) {
+        for (i = 0; i < BLOOM_LANES; i++) {
+            uint32_t *word = block + i * BLOOM_COUNTER_WORDS + (positions[i] >> 3);
+            bloom_counter_increment(word, (positions[i] & 7) * 4);
+        }
+        return;
+    }
+
+    for (i = 0; i < BLOOM_LANES; i++) {
+        uint32_t mask = 1U << positions[i];
+        // don't dirty the cache line if the bit is already set
+        if (!(ATOMIC_READ_RELAXED(block[i]) & mask))
+            ATOMIC_OR_RELAXED(block[i], mask);
+    }
+}
+
+int
+bloom_test_hash(bloom_filter_t *bf, uint64_t hash)
+{
+    uint64_t h = bloom_mix(hash);
+    uint32_t *block = bloom_block(bf, h);
+
+    int i;
+    if (bf->counting) {
+        uint32_t positions[BLOOM_LANES];
+        bloom_positions((uint32_t)h, positions);
+        for (i = 0; i < BLOOM_LANES; i++) {
+            uint32_t word = ATOMIC_READ_RELAXED(block[i * BLOOM_COUNTER_WORDS + (positions[i] >> 3)]);
+            if (!((word >> ((positions[i] & 7) * 4)) & BLOOM_COUNTER_MAX))
+                return 0;
+        }
+        return 1;
+    }
+
+#ifdef __AVX2__
+    const __m256i salt = _mm256_loadu_si256((const __m256i *)bloom_salt);
+    __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32((uint32_t)h), salt), 27);
+    __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+    // NOTE : concurrent adds can only set more bits
+    return _mm256_testc_si256(_mm256_load_si256((const __m256i *)block), mask);
+#else
+    uint32_t positions[BLOOM_LANES];
+    bloom_positions((uint32_t)h, positions);
+    uint32_t missing = 0;
+    for (i = 0; i < BLOOM_LANES; i++)
+        missing |= ~ATOMIC_READ_RELAXED(block[i]) & (1U << positions[i]);
+    return !missing;
+#endif
+}
+
+int
+bloom_remove_hash(bloom_filter_t *bf, uint64_t hash)
+{
+    if (!bf->counting)
+        return -1;
+
+    uint64_t h = bloom_mix(hash);
+    uint32_t *block = bloom_block(bf, h);
+    uint32_t positions[BLOOM_LANES];
+    bloom_positions((uint32_t)h, positions);
+
+    int i;
+    for (i = 0; i < BLOOM_LANES; i++) {
+        uint32_t *word = block + i * BLOOM_COUNTER_WORDS + (positions[i] >> 3);
+        bloom_counter_decrement(word, (positions[i] & 7) * 4);
+    }
+    return 0;
+}
+
+void
+bloom_add(bloom_filter_t *bf, const void *key, size_t klen)
+{
+    bloom_add_hash(bf, ht_hash_wyhash(key, klen, BLOOM_SEED));
+}
+
+int
+bloom_test(bloom_filter_t *bf, const void *key, size_t klen)
+{
+    return bloom_test_hash(bf, ht_hash_wyhash(key, klen, BLOOM_SEED));
+}
+
+int
+bloom_remove(bloom_filter_t *bf, const void *key, size_t klen)
+{
+    return bloom_remove_hash(bf, ht_hash_wyhash(key, klen, BLOOM_SEED));
+}
+
+int
+bloom_merge(bloom_filter_t *dst, bloom_filter_t *src)
+{
+    if (dst->nblocks != src->nblocks || dst->counting != src->counting)
+        return -1;
+
+    size_t i, nwords = bloom_size(src) / sizeof(uint32_t);
+    for (i = 0; i < nwords; i++) {
+        uint32_t word = ATOMIC_READ_RELAXED(src->words[i]);
+        if (!word)
+            continue;
+
+        if (!dst->counting) {
+            ATOMIC_OR_RELAXED(dst->words[i], word);
+            continue;
+        }
+
+        // counters are summed up, saturating at BLOOM_COUNTER_MAX
+        int shift;
+        for (shift = 0; shift < 32; shift += 4) {
+            uint32_t n = (word >> shift) & BLOOM_COUNTER_MAX;
+            while (n--)
+                bloom_counter_increment(&dst->words[i], shift);
+        }
+    }
+
+    return 0;
+}
+
+size_t
+bloom_serialized_size(bloom_filter_t *bf)
+{
+    return sizeof(bloom_header_t) + bloom_size(bf);
+}
+
+size_t
+bloom_serialize(bloom_filter_t *bf, void *buf, size_t size)
+{
+    size_t needed = bloom_serialized_size(bf);
+    if (size < needed)
+        return 0;
+
+    bloom_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BLOOM_MAGIC, sizeof(BLOOM_MAGIC));
+    header.version = BLOOM_VERSION;
+    header.counting = bf->counting;
+    header.nblocks = bf->nblocks;
+
+    memcpy(buf, &header, sizeof(header));
+    memcpy((char *)buf + sizeof(header), bf->words, bloom_size(bf));
+
+    return needed;
+}
+
+bloom_filter_t *
+bloom_deserialize(const void *buf, size_t size)
+{
+    bloom_header_t header;
+    if (size < sizeof(header))
+        return NULL;
+
+    memcpy(&header, buf, sizeof(header));
+    if (memcmp(header.magic, BLOOM_MAGIC, sizeof(BLOOM_MAGIC)) != 0 ||
+        header.version != BLOOM_VERSION || header.counting > 1 ||
+        !header.nblocks || header.nblocks > UINT32_MAX)
+    {
+        return NULL;
+    }
+
+    // the size of the bit array must match the header before allocating
+    // anything, the buffer might be corrupted (or crafted)
+    uint64_t block_bytes = (header.counting ? BLOOM_LANES * BLOOM_COUNTER_WORDS : BLOOM_LANES) * sizeof(uint32_t);
+    if ((size - sizeof(header)) / block_bytes != header.nblocks ||
+        (size - sizeof(header)) % block_bytes != 0)
+    {
+        return NULL;
+    }
+
+    bloom_filter_t *bf = bloom_alloc(header.nblocks, header.counting);
+    if (!bf)
+        return NULL;
+
+    memcpy(bf->words, (const char *)buf + sizeof(header), bloom_size(bf));
+
+    return bf;
+}
@@ -0,0 +1,168 @@
+/**
+ * @file bloom.h
+ *
+ * @brief Blocked Bloom filters
+ *
+ * Every key is mapped to a single 256-bit block (half a cache line) in which
+ * 8 bits are set, one in each 32-bit word of the block. Testing a key costs
+ * hence a single cache miss, and the 8 probes can be computed and checked
+ * in parallel (with AVX2, if available, in a couple of instructions).
+ *
+ * Keys can be added concurrently by multiple threads (also while others are
+ * testing the filter). A counting variant, keeping a 4-bit counter for each
+ * bit of the filter, allows to remove keys as well.
+ *
+ */
+
+#ifndef HL_BLOOM_H
+#define HL_BLOOM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @brief Opaque structure representing a bloom filter
+ */
+typedef struct _bloom_filter_s bloom_filter_t;
+
+/**
+ * @brief Create a new bloom filter
+ * @param capacity : The number of keys the filter is expected to hold
+ * @param fp_rate  : The acceptable rate of false positives once the filter
+ *                   holds 'capacity' keys (for instance 0.01).
+ *                   If 0 the default rate (1%) will be used
+ * @return A newly allocated and initialized bloom filter
+ */
+bloom_filter_t *bloom_create(size_t capacity, double fp_rate);
+
+/**
+ * @brief Create a new counting bloom filter, which allows removing keys
+ * @param capacity : The number of keys the filter is expected to hold
+ * @param fp_rate  : The acceptable rate of false positives
+ * @return A newly allocated and initialized counting bloom filter
+ * @note A counting filter uses 4 times the memory of a plain one.
+ *       Counters which reached their maximum value (15) stay saturated,
+ *       so removing keys can never introduce false negatives
+ */
+bloom_filter_t *bloom_create_counting(size_t capacity, double fp_rate);
+
+/**
+ * @brief Release all the resources used by a bloom filter
+ * @param bf : A valid pointer to a bloom_filter_t structure
+ */
+void bloom_destroy(bloom_filter_t *bf);
+
+/**
+ * @brief Remove all the keys from the filter
+ * @param bf : A valid pointer to a bloom_filter_t structure
+ * @note This function is not thread-safe
+ */
+void bloom_clear(bloom_filter_t *bf);
+
+/**
+ * @brief Add a key to the filter
+ * @param bf   : A valid pointer to a bloom_filter_t structure
+ * @param key  : The key to add
+ * @param klen : The length of the key
+ */
+void bloom_add(bloom_filter_t *bf, const void *key, size_t klen);
+
+/**
+ * @brief Check if a key might have been added to the filter
+ * @param bf   : A valid pointer to a bloom_filter_t structure
+ * @param key  : The key to look for
+ * @param klen : The length of the key
+ * @return 1 if the key might have been added to the filter,
+ *         0 if it has definitely not been added
+ */
+int bloom_test(bloom_filter_t *bf, const void *key, size_t klen);
+
+/**
+ * @brief Remove a key from a counting filter
+ * @param bf   : A valid pointer to a bloom_filter_t structure
+ * @param key  : The key to remove
+ * @param klen : The length of the key
+ * @return 0 on success, -1 if the filter is not a counting one
+ * @note Only keys which have been actually added can be removed,
+ *       removing any other key might introduce false negatives
+ */
+int bloom_remove(bloom_filter_t *bf, const void *key, size_t klen);
+
+/**
+ * @brief Add a key given its 64-bit hash
+ * @param bf   : A valid pointer to a bloom_filter_t structure
+ * @param hash : The hash of the key
+ * @note The bits of the hash are mixed again before being used,
+ *       so it's safe to pass hashes already used to index a table
+ */
+void bloom_add_hash(bloom_filter_t *bf, uint64_t hash);
+
+/**
+ * @brief Check if a key might have been added given its 64-bit hash
+ * @param bf   : A valid pointer to a bloom_filter_t structure
+ * @param hash : The hash of the key
+ * @return 1 if the key might have been added to the filter,
+ *         0 if it has definitely not been added
+ */
+int bloom_test_hash(bloom_filter_t *bf, uint64_t hash);
+
+/**
+ * @brief Remove a key from a counting filter given its 64-bit hash
+ * @param bf   : A valid pointer to a bloom_filter_t structure
+ * @param hash : The hash of the key
+ * @return 0 on success, -1 if the filter is not a counting one
+ */
+int bloom_remove_hash(bloom_filter_t *bf, uint64_t hash);
+
+/**
+ * @brief Add all the keys of a filter to another one
+ * @param dst : The filter to add the keys to
+ * @param src : The filter to take the keys from
+ * @return 0 on success, -1 if the two filters have not been created
+ *         with the same geometry (capacity, rate and type)
+ * @note Keys can be concurrently added to the destination filter
+ */
+int bloom_merge(bloom_filter_t *dst, bloom_filter_t *src);
+
+/**
+ * @brief Return the size (in bytes) of the bit array of the filter
+ * @param bf : A valid pointer to a bloom_filter_t structure
+ * @return The size of the bit array
+ */
+size_t bloom_size(bloom_filter_t *bf);
+
+/**
+ * @brief Return the number of bytes needed to serialize the filter
+ * @param bf : A valid pointer to a bloom_filter_t structure
+ * @return The size of the serialized filter
+ */
+size_t bloom_serialized_size(bloom_filter_t *bf);
+
+/**
+ * @brief Serialize the filter into the provided buffer
+ * @param bf   : A valid pointer to a bloom_filter_t structure
+ * @param buf  : The buffer to serialize the filter to
+ * @param size : The size of the buffer
+ * @return The number of bytes written, 0 if the buffer is too small
+ * @note The bit array is stored in the host byte order
+ */
+size_t bloom_serialize(bloom_filter_t *bf, void *buf, size_t size);
+
+/**
+ * @brief Create a new filter from a serialized one
+ * @param buf  : The buffer holding the serialized filter
+ * @param size : The size of the buffer
+ * @return A newly allocated bloom filter or NULL if the buffer
+ *         doesn't contain a valid filter
+ */
+bloom_filter_t *bloom_deserialize(const void *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -15,6 +15,7 @@ static char *graph_error_messages[] = {
 struct _graph_s {
     char *label;
     hashtable_t *nodes;
+    ht_intern_pool_t *intern_pool;
     graph_free_value_callback_t free_value_cb;
     int errno;
 };
@@ -48,7 +49,10 @@ graph_node_destroy(graph_node_t *node)
         free(connection);
     }
 
-    free(node->label);
+    if (node->graph && node->graph->intern_pool)
+        ht_intern_release(node->graph->intern_pool, node->label);
+    else
+        free(node->label);
     free(node);
 }
 
@@ -76,6 +80,15 @@ graph_create(char *label, graph_free_value_callback_t free_value_cb)
     return graph;
 }
 
+int
+graph_set_intern_pool(graph_t *graph, ht_intern_pool_t *pool)
+{
+    if (ht_set_intern_pool(graph->nodes, pool) != 0)
+        return -1;
+    graph->intern_pool = pool;
+    return 0;
+}
+
 void
 graph_destroy(graph_t *graph)
 {
@@ -118,7 +131,16 @@ graph_node_create(graph_t *graph, char *label, void *value, size_t vlen)
         return NULL;
     }
 
-    node->label = strdup(label);
+    if (graph->intern_pool)
+        node->label = (char *)ht_intern(graph->intern_pool, label, strlen(label));
+    else
+        node->label = strdup(label);
+
+    if (!node->label) {
+        graph->errno = EGRAPHNOMEM;
+        free(node);
+        return NULL;
+    }
 
     node->value = value;
     node->vlen = vlen;
@@ -130,9 +152,11 @@ graph_node_add(graph_t *graph, char *label, void *value, size_t vsize)
 {
     // first check if we already have a node with the same name
     graph_node_t *node = graph_node_create(graph, label, value, vsize);
+    if (!node)
+        return NULL;
     node->graph = graph;
     TAILQ_INIT(&node->connections);
-    if (ht_set(graph->nodes, label, strlen(label), node, sizeof(graph_node_t)) != 0) {
+    if (ht_set(graph->nodes, node->label, strlen(node->label), node, sizeof(graph_node_t)) != 0) {
         graph->errno = EGRAPHTABLEERR;
         graph_node_destroy(node);
         return NULL;
@@ -2,6 +2,7 @@
 #define HT_GRAPH_H
 
 #include <sys/types.h>
+#include "hashtable.h"
 
 #define EGRAPHNOERR              600
 #define EGRAPHNONODE             601
@@ -25,6 +26,17 @@ typedef void (*graph_free_value_callback_t)(void *);
 graph_t *graph_create(char *label, graph_free_value_callback_t free_value_cb);
 void graph_destroy(graph_t *graph);
 
+/**
+ * @brief Store the labels of the nodes in a pool of interned keys
+ * @param graph A pointer to a valid and initialized graph structure
+ * @param pool A valid pointer to an ht_intern_pool_t structure
+ *             (possibly shared with other graphs and tables)
+ * @return 0 on success; -1 if the graph already contains some node
+ * @note Each label is then stored only once, both in the node and in
+ *       the table used to look nodes up by label
+ */
+int graph_set_intern_pool(graph_t *graph, ht_intern_pool_t *pool);
+
 
 /**
  * @brief Select a node by its label
@@ -1,13 +1,28 @@
 #include <sys/types.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <limits.h>
 #include <strings.h>
 #include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 #include "bsd_queue.h"
 #include "atomic_defs.h"
 #include "hashtable.h"
+#include "bloom.h"
 
 #ifdef USE_PACKED_STRUCTURES
 #define PACK_IF_NECESSARY __attribute__((packed))
@@ -15,22 +30,45 @@
 #define PACK_IF_NECESSARY
 #endif
 
+// NOTE : interned keys (see ht_intern()) are compared by pointer first,
+//        without touching the memory they are stored in
 #define HT_KEY_EQUALS(_k1, _kl1, _k2, _kl2) \
-            (((char *)(_k1))[0] == ((char *)(_k2))[0] && \
-            (_kl1) == (_kl2) && \
-            memcmp((_k1), (_k2), (_kl1)) == 0)
+            ((_kl1) == (_kl2) && \
+             ((void *)(_k1) == (void *)(_k2) || \
+              (((char *)(_k1))[0] == ((char *)(_k2))[0] && \
+               memcmp((_k1), (_k2), (_kl1)) == 0)))
 
 
+// numeric values updated in place (see ht_incr())
+typedef union _ht_num {
+    int64_t i;
+    double d;
+} ht_num_t;
+
 typedef struct _ht_item {
-    uint32_t hash;
+    uint64_t hash;
     char     kbuf[32];
     void    *key;
     size_t   klen;
     void    *data;
+    // numeric values are stored in the item itself, with data pointing here
+    ht_num_t num;
+    int      num_double; // 1 if num holds a double, 0 if it holds an int64
     size_t   dlen;
+    uint64_t expire; // 0 if the item doesn't expire
+    struct _ht_timer *timer;
     TAILQ_ENTRY(_ht_item) next;
 } PACK_IF_NECESSARY ht_item_t;
 
+// given the address of the data pointer of an item
+// (which is what the ht_pair_callback_t callbacks get)
+#define HT_ITEM_NUM(_data_ptr) \
+    ((ht_num_t *)((char *)(_data_ptr) + offsetof(ht_item_t, num) - offsetof(ht_item_t, data)))
+
+// NOTE : only the data pointer is read, so this is safe also for the
+//        slots of a flat table (which never hold numeric values)
+#define HT_VALUE_INLINE(_data_ptr) (*(_data_ptr) == (void *)HT_ITEM_NUM(_data_ptr))
+
 typedef struct _ht_item_list {
     TAILQ_HEAD(, _ht_item) head;
 #ifdef THREAD_SAFE
@@ -40,37 +78,505 @@ typedef struct _ht_item_list {
     pthread_spinlock_t lock;
 #endif
 #endif
+    uint32_t seq; // odd while the list is being modified
     size_t index;
     TAILQ_ENTRY(_ht_item_list) iterator_next;
 } PACK_IF_NECESSARY ht_items_list_t;
 
+// writers serialize on the spinlock and bump the sequence counter before and
+// after modifying the list, so that lockless readers can detect the change
+#define HT_LIST_LOCK(_table, _list) do { \
+    if (!SPIN_TRYLOCK((_list)->lock)) { \
+        HT_STATS_INCREMENT(_table, lock_contended); \
+        SPIN_LOCK((_list)->lock); \
+    } \
+    ATOMIC_STORE_RELAXED((_list)->seq, (_list)->seq + 1); \
+    __atomic_thread_fence(__ATOMIC_RELEASE); \
+} while (0)
+
+#define HT_LIST_UNLOCK(_list) do { \
+    ATOMIC_STORE_RELEASE((_list)->seq, (_list)->seq + 1); \
+    SPIN_UNLOCK((_list)->lock); \
+} while (0)
+
+// lockless readers follow the first and the next pointers of the items while
+// the list is being modified, so those are stored atomically (the release
+// store publishing an item makes it complete before readers can reach it).
+// The pointers going backwards are used only by the writers
+#define HT_LIST_INSERT_TAIL(_list, _item) do { \
+    ATOMIC_STORE_RELAXED(TAILQ_NEXT((_item), next), NULL); \
+    (_item)->next.tqe_prev = (_list)->head.tqh_last; \
+    ATOMIC_STORE_RELEASE(*(_list)->head.tqh_last, (_item)); \
+    (_list)->head.tqh_last = &TAILQ_NEXT((_item), next); \
+} while (0)
+
+#define HT_LIST_REMOVE(_list, _item) do { \
+    ht_item_t *_next = TAILQ_NEXT((_item), next); \
+    if (_next) \
+        _next->next.tqe_prev = (_item)->next.tqe_prev; \
+    else \
+        (_list)->head.tqh_last = (_item)->next.tqe_prev; \
+    ATOMIC_STORE_RELAXED(*(_item)->next.tqe_prev, _next); \
+} while (0)
+
 typedef struct {
     TAILQ_HEAD(, _ht_item_list) head;
 } PACK_IF_NECESSARY ht_iterator_list_t;
 
-// NOTE : order here matters (and also numbering)
-typedef enum {
-    HT_STATUS_CLEAR = 0,
-    HT_STATUS_WRITE = 1,
-    HT_STATUS_GROW  = 2,
-    HT_STATUS_IDLE  = 3,
-    HT_STATUS_READ  = 4
-} PACK_IF_NECESSARY ht_status_t;
+// the finalizer of murmur3, spreading all the bits of the hash over the high
+// ones (which are always 0 for 32-bit hash functions, and are used to pick
+// the shards while the low ones pick the bucket)
+static inline uint64_t
+ht_mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * Cache mode
+ *
+ * Items of a cache table carry some extra state used to pick the ones to
+ * evict. Items are kept in per-shard queues (sharded on the high bits of
+ * the remixed hash) protected by a spinlock which is never taken on lookups: a hit
+ * only sets the referenced flag of the item, and the queues are reordered
+ * lazily when looking for a victim.
+ * With the CLOCK policy referenced items are given a second chance and
+ * moved to the back of the queue, with the segmented LRU policy they are
+ * promoted to the protected segment, which can't take more than
+ * HT_CACHE_PROTECTED_PCT percent of the shard (the least recently
+ * promoted items are demoted back to the probation segment).
+ */
+#define HT_CACHE_SHARDS 16
+#define HT_CACHE_SHARD(_hash) (ht_mix64(_hash) >> 60)
+#define HT_CACHE_PROTECTED_PCT 80
+#define HT_CACHE_INITIAL_SIZE_MAX (1 << 20)
+
+typedef struct _ht_cache_item {
+    ht_item_t item; // must be first
+    TAILQ_ENTRY(_ht_cache_item) cache_next;
+    size_t cost;
+    uint8_t referenced;
+    uint8_t protected;
+} ht_cache_item_t;
+
+typedef struct _ht_cache_shard {
+#ifdef THREAD_SAFE
+#ifdef __MACH__
+    OSSpinLock lock;
+#else
+    pthread_spinlock_t lock;
+#endif
+#endif
+    TAILQ_HEAD(, _ht_cache_item) probation;
+    TAILQ_HEAD(, _ht_cache_item) protected;
+    size_t count;
+    size_t nprotected;
+} __attribute__((aligned(64))) ht_cache_shard_t;
+
+typedef struct _ht_cache {
+    ht_cache_policy_t policy;
+    size_t max_items;
+    size_t max_bytes;
+    size_t bytes;
+    ht_free_item_callback_t evict_cb;
+    ht_cache_shard_t shards[HT_CACHE_SHARDS];
+} ht_cache_t;
+
+/*
+ * Hierarchical timing wheel
+ *
+ * Items with a TTL have a timer in one of the HT_WHEEL_SLOTS slots of one
+ * of the HT_WHEEL_LEVELS levels of the wheel. Each slot of the first level
+ * covers one tick (a millisecond), each slot of the next level covers a
+ * whole turn of the previous one. When the first level completes a turn,
+ * the timers in the current slot of the next level are cascaded down to
+ * the levels below, so every timer is moved at most HT_WHEEL_LEVELS times
+ * before expiring. Timers further away than the span of the whole wheel
+ * (about 4.6 hours) wait in the last level and are put back when cascaded.
+ */
+#define HT_WHEEL_BITS 6
+#define HT_WHEEL_SLOTS (1 << HT_WHEEL_BITS)
+#define HT_WHEEL_LEVELS 4
+#define HT_WHEEL_SPAN (1ULL << (HT_WHEEL_BITS * HT_WHEEL_LEVELS))
+
+typedef struct _ht_timer {
+    TAILQ_ENTRY(_ht_timer) next;
+    ht_item_t *item; // NULL if cancelled while firing
+    uint64_t hash;
+    uint64_t expire;
+    uint8_t level;
+    uint8_t slot;
+    uint8_t firing;
+} ht_timer_t;
+
+typedef TAILQ_HEAD(_ht_timer_list, _ht_timer) ht_timer_list_t;
+
+typedef struct _ht_wheel {
+#ifdef THREAD_SAFE
+    pthread_mutex_t lock;
+#endif
+    uint64_t now; // last tick processed
+    size_t count;
+    uint64_t bitmap[HT_WHEEL_LEVELS]; // non-empty slots
+    ht_timer_list_t slots[HT_WHEEL_LEVELS][HT_WHEEL_SLOTS];
+} ht_wheel_t;
+
+/*
+ * Layout of the images written by ht_save() (all offsets are relative to the
+ * beginning of the file, so the image can be mapped at any address):
+ *
+ *   header | entries | slots | buckets
+ *
+ * Each entry is an ht_image_entry_t followed by the key and the value, both
+ * padded to 8 bytes. The slots (hash and offset of each entry) are sorted by
+ * bucket, and the buckets array holds the index of the first slot of each
+ * bucket (plus a last one marking the end of the slots).
+ * Everything is stored in the native byte order, an image written on a
+ * machine with a different endianness is rejected because of the version.
+ * Only the header and the index (slots and buckets) are checked when the
+ * image is opened, the entries are checked by ht_image_verify().
+ */
+#define HT_IMAGE_MAGIC "LIBHLHT"
+#define HT_IMAGE_VERSION 2
+#define HT_IMAGE_ALIGN(_len) (((_len) + 7) & ~((uint64_t)7))
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t hash_function;
+    uint64_t seed;
+    uint64_t count;
+    uint64_t nbuckets;
+    uint64_t slots_offset;
+    uint64_t buckets_offset;
+    uint64_t size;
+    // checksum of the entries
+    uint32_t data_crc;
+    // checksum of the slots and of the buckets
+    uint32_t index_crc;
+    // checksum of the header itself (computed with this field set to 0)
+    uint32_t header_crc;
+    uint32_t unused;
+} ht_image_header_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;
+} ht_image_slot_t;
+
+typedef struct {
+    uint64_t klen;
+    uint64_t dlen;
+} ht_image_entry_t;
+
+typedef struct _ht_image {
+    char *path;
+    char *base;
+    size_t size;
+    size_t count;
+    size_t nbuckets;
+    uint32_t hash_function;
+    uint64_t seed;
+    uint64_t data_end; // the entries are between the header and here
+    uint32_t data_crc;
+    ht_image_slot_t *slots;
+    uint64_t *buckets;
+    // keys of the image deleted from the table (or expired from the overlay)
+    hashtable_t *deleted;
+    // keys of the image which have been replaced in the overlay
+    size_t shadowed;
+    // set by ht_clear(), the image isn't part of the table anymore
+    int hidden;
+    // images replaced by ht_compact(), values pointing into them
+    // must stay valid until the table is destroyed
+    struct _ht_image *prev;
+} ht_image_t;
+
+// marks a bucket which has been already migrated to the next bucket array
+#define HT_BUCKET_MOVED ((ht_items_list_t *)0x01)
+
+// the size of the bucket arrays is always a power of two
+#define HT_BUCKET_INDEX(_hash, _size) ((_hash) & ((_size) - 1))
+
+// number of buckets migrated by each operation while the table is growing
+#define HT_GROW_STEP 4
+
+/*
+ * While the table is growing there are two bucket arrays linked together:
+ * the old one (table->buckets) and the new one (table->buckets->next).
+ * Buckets are migrated incrementally, a few at a time, and the slot of a
+ * migrated bucket is set to HT_BUCKET_MOVED in the old array, so the right
+ * bucket for a given hash is always the first non-moved slot found
+ * walking the chain of arrays.
+ */
+typedef struct _ht_buckets {
+    size_t size;
+    size_t migrate_index;
+    struct _ht_buckets *next;
+    ht_items_list_t *lists[];
+} PACK_IF_NECESSARY ht_buckets_t;
+
+/*
+ * Open-addressing (flat) engine
+ *
+ * Slots are stored inline in a single array and a parallel array of control
+ * bytes holds, for each slot, either a 7-bit tag taken from the hash of the
+ * key stored there or one of the EMPTY/DELETED markers.
+ * Lookups scan the control bytes of an aligned group of HT_FLAT_GROUP_WIDTH
+ * slots at once (using SSE2 when available) and only touch the slots whose
+ * tag matches.
+ */
+#define HT_FLAT_GROUP_WIDTH 16
+
+#define HT_FLAT_CTRL_EMPTY   ((int8_t)-128) // 0x80
+#define HT_FLAT_CTRL_DELETED ((int8_t)-2)   // 0xFE
+
+#define HT_FLAT_H1(_hash) ((_hash) >> 7)
+#define HT_FLAT_H2(_hash) ((int8_t)((_hash) & 0x7f))
+
+// max load factor is 7/8
+#define HT_FLAT_MAX_LOAD(_capacity) ((_capacity) - ((_capacity) >> 3))
+
+typedef struct _ht_flat_slot {
+    uint64_t hash;
+    void    *data;
+    size_t   dlen;
+    uint32_t klen;
+    union {
+        char  kbuf[32];
+        void *kptr;
+    } key;
+} PACK_IF_NECESSARY ht_flat_slot_t;
+
+#define HT_FLAT_SLOT_KEY(_slot) \
+    ((_slot)->klen > sizeof((_slot)->key.kbuf) ? (_slot)->key.kptr : (void *)(_slot)->key.kbuf)
+
+typedef struct _ht_flat {
+    int8_t         *ctrl;
+    ht_flat_slot_t *slots;
+    size_t          capacity;
+    size_t          growth_left;
+#ifdef THREAD_SAFE
+    // NOTE : a single lock guards the whole table, a probe sequence
+    //        can cross any group and growing relocates all the slots.
+    //        Writers are serialized and every lookup takes it for reading
+    pthread_rwlock_t lock;
+#endif
+} ht_flat_t;
+
+/*
+ * Slab allocator
+ *
+ * Items, bucket lists and the keys which don't fit in the inline buffers
+ * are carved out of chunks owned by the table and recycled through free
+ * lists, so that churning keys doesn't hit the global allocator.
+ * Each slab is split in HT_SLAB_SHARDS shards and every thread sticks to
+ * one of them, so threads don't contend on the same free list.
+ * Chunks are released only when the table is destroyed.
+ */
+#define HT_SLAB_SHARDS 8
+
+// the first chunk of a shard holds this many objects,
+// each new chunk doubles the size of the previous one
+#define HT_SLAB_CHUNK_OBJECTS 16
+#define HT_SLAB_CHUNK_MAX (64 << 10)
+
+// keys which don't fit in the inline buffers go in one of these size classes
+// (64, 128, 256, 512 and 1024 bytes), longer ones are allocated with malloc()
+#define HT_KEY_CLASSES 5
+#define HT_KEY_CLASS_MIN 64
+#define HT_KEY_CLASS_MAX (HT_KEY_CLASS_MIN << (HT_KEY_CLASSES - 1))
+
+typedef struct _ht_slab_chunk {
+    struct _ht_slab_chunk *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(16)));
+} ht_slab_chunk_t;
+
+typedef struct _ht_slab_object {
+    struct _ht_slab_object *next;
+} ht_slab_object_t;
+
+typedef struct _ht_slab_shard {
+#ifdef THREAD_SAFE
+#ifdef __MACH__
+    OSSpinLock lock;
+#else
+    pthread_spinlock_t lock;
+#endif
+#endif
+    ht_slab_object_t *free;
+    ht_slab_chunk_t *chunks; // the one we are carving objects out of comes first
+    char pad[64 - 3 * sizeof(void *)]; // keep shards on separate cache lines
+} ht_slab_shard_t;
+
+typedef struct _ht_slab {
+    size_t object_size;
+    ht_slab_shard_t shards[HT_SLAB_SHARDS];
+} ht_slab_t;
+
+/*
+ * Key arena
+ *
+ * Tables with a key arena (see ht_set_key_arena()) carve the keys which
+ * don't fit in the inline buffers out of big chunks, just bumping an offset,
+ * instead of rounding them up to one of the key size classes.
+ * Each key is preceded by a pointer to its chunk, which keeps track of how
+ * many of its bytes are still in use, so that once enough memory has been
+ * wasted by released keys the ones still living in the emptiest chunks can
+ * be moved elsewhere and those chunks released (see ht_compact_keys()).
+ */
+#define HT_ARENA_CHUNK_SIZE (64 << 10)
+
+// keys keep the chunk header aligned
+#define HT_ARENA_KEY_SIZE(_klen) \
+    ((sizeof(struct _ht_arena_chunk *) + (_klen) + 7) & ~((size_t)7))
+
+typedef struct _ht_arena_chunk {
+    struct _ht_arena_chunk *next;
+    size_t size;
+    size_t used;
+    size_t live;  // bytes of the keys still in use
+    int evacuate; // keys are being moved out of this chunk
+    char data[] __attribute__((aligned(16)));
+} ht_arena_chunk_t;
+
+typedef struct _ht_arena_shard {
+#ifdef THREAD_SAFE
+#ifdef __MACH__
+    OSSpinLock lock;
+#else
+    pthread_spinlock_t lock;
+#endif
+#endif
+    ht_arena_chunk_t *chunks; // the one we are bumping into comes first
+    char pad[64 - 2 * sizeof(void *)]; // keep shards on separate cache lines
+} ht_arena_shard_t;
+
+typedef struct _ht_arena {
+    ht_arena_shard_t shards[HT_SLAB_SHARDS];
+    size_t bytes;     // memory allocated for the chunks
+    size_t live;      // bytes of the keys still in use
+    size_t min_waste; // wasted bytes needed before compacting again
+} ht_arena_t;
+
+/*
+ * Statistics
+ *
+ * Counters updated on the hot paths are split in HT_SLAB_SHARDS shards
+ * (each thread sticking to one of them, like for the slabs), on separate
+ * cache lines, and summed up by ht_stats().
+ * Building with HT_NO_STATS defined compiles them out.
+ */
+typedef struct _ht_stats_shard {
+    uint64_t lock_contended;
+    uint64_t lookup_retries;
+    char pad[64 - 2 * sizeof(uint64_t)];
+} ht_stats_shard_t;
+
+#ifdef HT_NO_STATS
+#define HT_STATS_INCREMENT(_table, _counter)
+#else
+#define HT_STATS_INCREMENT(_table, _counter) \
+    __atomic_fetch_add(&(_table)->stats[ht_thread_shard()]._counter, 1, __ATOMIC_RELAXED)
+#endif
+
+static inline uint64_t
+ht_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// memory unlinked from the table is kept in one of these bags,
+// selected by the epoch at which it has been retired
+#define HT_LIMBO_BAGS 3
+
+// number of retired pointers after which we try reclaiming memory
+#define HT_LIMBO_BATCH 64
+
+typedef struct _ht_retired {
+    void *ptr;
+    void (*free_cb)(hashtable_t *, void *);
+} ht_retired_t;
+
+typedef struct _ht_limbo {
+    uint64_t epoch;
+    size_t count;
+    size_t size;
+    ht_retired_t *entries;
+} ht_limbo_t;
+
+typedef struct _ht_reclaim {
+#ifdef THREAD_SAFE
+#ifdef __MACH__
+    OSSpinLock lock;
+#else
+    pthread_spinlock_t lock;
+#endif
+#endif
+    ht_limbo_t limbo[HT_LIMBO_BAGS];
+} ht_reclaim_t;
 
 struct _hashtable_s {
     size_t size;
     size_t max_size;
     size_t count;
-    ht_status_t status;
-    uint32_t seed;
-    ht_items_list_t **items;
+    uint64_t seed;
+    ht_hash_callback_t hash_cb;
+    ht_buckets_t *buckets;
+    int growing;
     ht_free_item_callback_t free_item_cb;
+    // values are released once no reader can be using them anymore
+    int deferred_free;
     ht_iterator_list_t *iterator_list;
+    ht_iterator_list_t retired_lists;
 #ifdef THREAD_SAFE
     pthread_mutex_t iterator_lock;
+#endif
+    ht_reclaim_t reclaim;
+    ht_slab_t item_slab;
+    ht_slab_t list_slab;
+    ht_slab_t key_slabs[HT_KEY_CLASSES];
+    // lists set aside for the ongoing migration, so that it can't
+    // run out of memory once it started (protected by the iterator lock)
+    ht_iterator_list_t reserved_lists;
+    size_t nreserved;
+    ht_cache_t *cache;
+    ht_wheel_t *wheel;
+    ht_image_t *image;
+    ht_slab_t timer_slab;
+    ht_flat_t *flat;
+    // sub-tables of a sharded table, selected by the high bits of the remixed hash
+    hashtable_t **shards;
+    size_t nshards;
+    int shard_shift;
+    // completed grows and time spent migrating (protected by the iterator lock)
+    size_t grows;
+    uint64_t grow_time_ns;
+    size_t big_key_bytes;
+    ht_arena_t *arena;
+    ht_intern_pool_t *intern_pool;
+    // filter of the stored keys and the one being built while growing
+    bloom_filter_t *bloom;
+    bloom_filter_t *bloom_next;
+    double bloom_fp_rate;
+    int bloom_counting;
+#ifndef HT_NO_STATS
+    ht_stats_shard_t stats[HT_SLAB_SHARDS];
 #endif
 } PACK_IF_NECESSARY;
 
+#define HT_SHARD_INDEX(_table, _hash) (ht_mix64(_hash) >> (_table)->shard_shift)
+#define HT_SHARD(_table, _hash) ((_table)->shards[HT_SHARD_INDEX(_table, _hash)])
+
 typedef struct _ht_iterator_callback {
     int (*cb)();
     void *user;
@@ -83,434 +589,780 @@ typedef struct _ht_collector_arg {
     size_t count;
 } ht_collector_arg_t;
 
-static inline uint32_t
-ht_hash_one_at_a_time(hashtable_t *table, const unsigned char *str, const ssize_t len)
+#ifdef THREAD_SAFE
+static int ht_thread_shard_next = 0;
+static __thread int ht_thread_shard_index = -1;
+#endif
+
+// the shard (of the slabs and of the statistics) the calling thread sticks to
+static inline int
+ht_thread_shard()
 {
-    const unsigned char * const end = (const unsigned char *)str + len;
-    uint32_t hash = table->seed + len;
-    while (str < end) {
-        hash += *str++;
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
-    }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    return (hash + (hash << 15));
+#ifdef THREAD_SAFE
+    if (__builtin_expect(ht_thread_shard_index < 0, 0))
+        ht_thread_shard_index = __sync_fetch_and_add(&ht_thread_shard_next, 1) % HT_SLAB_SHARDS;
+    return ht_thread_shard_index;
+#else
+    return 0;
+#endif
 }
 
-
-hashtable_t *
-ht_create(size_t initial_size, size_t max_size, ht_free_item_callback_t cb)
+static inline ht_slab_shard_t *
+ht_slab_shard(ht_slab_t *slab)
 {
-    hashtable_t *table = (hashtable_t *)calloc(1, sizeof(hashtable_t));
+    return &slab->shards[ht_thread_shard()];
+}
 
-    if (table && ht_init(table, initial_size, max_size, cb) != 0) {
-        free(table);
-        return NULL;
+// memory currently allocated for the slab chunks
+static size_t
+ht_slab_bytes(ht_slab_t *slab)
+{
+    size_t bytes = 0;
+    int i;
+    for (i = 0; i < HT_SLAB_SHARDS; i++) {
+        SPIN_LOCK(slab->shards[i].lock);
+        ht_slab_chunk_t *chunk;
+        for (chunk = slab->shards[i].chunks; chunk; chunk = chunk->next)
+            bytes += sizeof(ht_slab_chunk_t) + chunk->size;
+        SPIN_UNLOCK(slab->shards[i].lock);
     }
+    return bytes;
+}
 
-    return table;
+static void
+ht_slab_init(ht_slab_t *slab, size_t object_size)
+{
+    int i;
+    memset(slab, 0, sizeof(ht_slab_t));
+    slab->object_size = (object_size + 15) & ~((size_t)15);
+    for (i = 0; i < HT_SLAB_SHARDS; i++)
+        SPIN_INIT(slab->shards[i].lock);
 }
 
-int
-ht_init(hashtable_t *table,
-        size_t initial_size,
-        size_t max_size,
-        ht_free_item_callback_t cb)
+static void
+ht_slab_destroy(ht_slab_t *slab)
 {
-    table->size = initial_size > HT_SIZE_MIN ? initial_size : HT_SIZE_MIN;
-    table->max_size = max_size;
-    table->items = (ht_items_list_t **)calloc(table->size, sizeof(ht_items_list_t *));
-    if (!table->items)
-        return -1;
+    int i;
+    for (i = 0; i < HT_SLAB_SHARDS; i++) {
+        ht_slab_chunk_t *chunk = slab->shards[i].chunks;
+        while (chunk) {
+            ht_slab_chunk_t *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        SPIN_DESTROY(slab->shards[i].lock);
+    }
+    memset(slab, 0, sizeof(ht_slab_t));
+}
 
-    table->status = HT_STATUS_IDLE;
+static void *
+ht_slab_alloc(ht_slab_t *slab)
+{
+    ht_slab_shard_t *shard = ht_slab_shard(slab);
+    void *ptr = NULL;
 
-    ht_set_free_item_callback(table, cb);
-#ifdef BSD
-    table->seed = arc4random()%UINT32_MAX;
-#else
-    table->seed = random()%UINT32_MAX;
-#endif
-    table->iterator_list = calloc(1, sizeof(ht_iterator_list_t));
-    if (!table->iterator_list) {
-        free(table->items);
-        return -1;
+    SPIN_LOCK(shard->lock);
+    if (shard->free) {
+        ptr = shard->free;
+        shard->free = shard->free->next;
+    } else {
+        ht_slab_chunk_t *chunk = shard->chunks;
+        if (!chunk || chunk->used + slab->object_size > chunk->size) {
+            size_t size = chunk ? chunk->size << 1 : slab->object_size * HT_SLAB_CHUNK_OBJECTS;
+            if (size > HT_SLAB_CHUNK_MAX && chunk)
+                size = chunk->size;
+            chunk = malloc(sizeof(ht_slab_chunk_t) + size);
+            if (!chunk) {
+                SPIN_UNLOCK(shard->lock);
+                return NULL;
+            }
+            chunk->size = size;
+            chunk->used = 0;
+            chunk->next = shard->chunks;
+            shard->chunks = chunk;
+        }
+        ptr = chunk->data + chunk->used;
+        chunk->used += slab->object_size;
     }
-    TAILQ_INIT(&table->iterator_list->head);
-
-    MUTEX_INIT(table->iterator_lock);
+    SPIN_UNLOCK(shard->lock);
 
-    return 0;
+    return ptr;
 }
 
-void
-ht_set_free_item_callback(hashtable_t *table, ht_free_item_callback_t cb)
+static void
+ht_slab_free(ht_slab_t *slab, void *ptr)
 {
-    ATOMIC_SET(table->free_item_cb, cb);
+    ht_slab_shard_t *shard = ht_slab_shard(slab);
+    ht_slab_object_t *object = (ht_slab_object_t *)ptr;
+
+    SPIN_LOCK(shard->lock);
+    object->next = shard->free;
+    shard->free = object;
+    SPIN_UNLOCK(shard->lock);
 }
 
-void
-ht_clear(hashtable_t *table)
+static inline int
+ht_key_class(size_t klen)
 {
-    while(!ATOMIC_CAS(table->status, HT_STATUS_IDLE, HT_STATUS_CLEAR))
-        sched_yield();
-
-    MUTEX_LOCK(table->iterator_lock);
-    ht_items_list_t *tmplist, *list = NULL;
-    TAILQ_FOREACH_SAFE(list, &table->iterator_list->head, iterator_next, tmplist) {
-        SPIN_LOCK(list->lock);
-
-        ht_item_t *item = NULL;
-        ht_item_t *tmp;
-
-        TAILQ_FOREACH_SAFE(item, &list->head, next, tmp) {
-            TAILQ_REMOVE(&list->head, item, next);
-            if (table->free_item_cb)
-                table->free_item_cb(item->data);
-            if (item->key != item->kbuf)
-                free(item->key);
-            free(item);
-            ATOMIC_DECREMENT(table->count);
-        }
-
-        table->items[list->index] = NULL;
-        TAILQ_REMOVE(&table->iterator_list->head, list, iterator_next);
-        SPIN_UNLOCK(list->lock);
-        SPIN_DESTROY(list->lock);
-        free(list);
+    int index = 0;
+    size_t size = HT_KEY_CLASS_MIN;
+    while (size < klen) {
+        size <<= 1;
+        index++;
     }
-    MUTEX_UNLOCK(table->iterator_lock);
-
-    ATOMIC_CAS(table->status, HT_STATUS_CLEAR, HT_STATUS_IDLE);
+    return index;
 }
 
-void
-ht_destroy(hashtable_t *table)
+static void *
+ht_arena_alloc(ht_arena_t *arena, size_t klen)
 {
-    ht_clear(table);
-    free(table->items);
-    MUTEX_DESTROY(table->iterator_lock);
-    free(table->iterator_list);
-    free(table);
+    size_t size = HT_ARENA_KEY_SIZE(klen);
+    ht_arena_shard_t *shard = &arena->shards[ht_thread_shard()];
+
+    SPIN_LOCK(shard->lock);
+    ht_arena_chunk_t *chunk = shard->chunks;
+    if (!chunk || chunk->used + size > chunk->size) {
+        chunk = malloc(sizeof(ht_arena_chunk_t) + HT_ARENA_CHUNK_SIZE);
+        if (!chunk) {
+            SPIN_UNLOCK(shard->lock);
+            return NULL;
+        }
+        chunk->size = HT_ARENA_CHUNK_SIZE;
+        chunk->used = 0;
+        chunk->live = 0;
+        chunk->evacuate = 0;
+        chunk->next = shard->chunks;
+        shard->chunks = chunk;
+        ATOMIC_INCREASE(arena->bytes, sizeof(ht_arena_chunk_t) + HT_ARENA_CHUNK_SIZE);
+    }
+    ht_arena_chunk_t **header = (ht_arena_chunk_t **)(chunk->data + chunk->used);
+    chunk->used += size;
+    ATOMIC_INCREASE(chunk->live, size);
+    SPIN_UNLOCK(shard->lock);
+
+    *header = chunk;
+    ATOMIC_INCREASE(arena->live, size);
+    return header + 1;
 }
 
+// NOTE : the chunk is only released by ht_compact_keys()
 static inline void
-ht_grow_table(hashtable_t *table)
+ht_arena_free(ht_arena_t *arena, void *key, size_t klen)
 {
-    // if we are not able to change the status now, let's return.
-    // ht_grow_table() will be called again next time a new key has been set
-    if (!ATOMIC_CAS(table->status, HT_STATUS_IDLE, HT_STATUS_GROW))
-        return;
+    size_t size = HT_ARENA_KEY_SIZE(klen);
+    ht_arena_chunk_t *chunk = ((ht_arena_chunk_t **)key)[-1];
+    ATOMIC_DECREASE(chunk->live, size);
+    ATOMIC_DECREASE(arena->live, size);
+}
 
-    // extra check if the table has been already updated by another thread in the meanwhile
-    if (table->max_size && ATOMIC_READ(table->size) >= table->max_size) {
-        ATOMIC_CAS(table->status, HT_STATUS_GROW, HT_STATUS_IDLE);
-        return;
+static inline void *
+ht_key_alloc(hashtable_t *table, size_t klen)
+{
+    if (klen > HT_KEY_CLASS_MAX) {
+        void *key = malloc(klen);
+        if (key)
+            ATOMIC_INCREASE(table->big_key_bytes, klen);
+        return key;
     }
+    if (table->arena)
+        return ht_arena_alloc(table->arena, klen);
+    return ht_slab_alloc(&table->key_slabs[ht_key_class(klen)]);
+}
 
-    ht_iterator_list_t *new_iterator_list = calloc(1, sizeof(ht_iterator_list_t));
-    if (!new_iterator_list) {
-        ATOMIC_CAS(table->status, HT_STATUS_GROW, HT_STATUS_IDLE);
-        return;
-    }
+// a copy of a key which doesn't fit in the inline buffer
+static inline void *
+ht_key_store(hashtable_t *table, const void *key, size_t klen)
+{
+    if (table->intern_pool)
+        return (void *)ht_intern(table->intern_pool, key, klen);
 
-    TAILQ_INIT(&new_iterator_list->head);
+    void *copy = ht_key_alloc(table, klen);
+    if (copy)
+        memcpy(copy, key, klen);
+    return copy;
+}
 
-    size_t new_size = ATOMIC_READ(table->size) << 1;
+static inline void
+ht_key_free(hashtable_t *table, void *key, size_t klen)
+{
+    if (table->intern_pool)
+        ht_intern_release(table->intern_pool, key);
+    else if (klen > HT_KEY_CLASS_MAX) {
+        ATOMIC_DECREASE(table->big_key_bytes, klen);
+        free(key);
+    } else if (table->arena)
+        ht_arena_free(table->arena, key, klen);
+    else
+        ht_slab_free(&table->key_slabs[ht_key_class(klen)], key);
+}
 
-    if (table->max_size && new_size > table->max_size)
-        new_size = table->max_size;
+static void
+ht_slabs_init(hashtable_t *table)
+{
+    int i;
+    ht_slab_init(&table->item_slab, sizeof(ht_item_t));
+    ht_slab_init(&table->list_slab, sizeof(ht_items_list_t));
+    ht_slab_init(&table->timer_slab, sizeof(ht_timer_t));
+    for (i = 0; i < HT_KEY_CLASSES; i++)
+        ht_slab_init(&table->key_slabs[i], HT_KEY_CLASS_MIN << i);
+}
 
-    ht_items_list_t **items_list = 
-        (ht_items_list_t **)calloc(new_size, sizeof(ht_items_list_t *));
+static void
+ht_slabs_destroy(hashtable_t *table)
+{
+    int i;
+    ht_slab_destroy(&table->item_slab);
+    ht_slab_destroy(&table->list_slab);
+    ht_slab_destroy(&table->timer_slab);
+    for (i = 0; i < HT_KEY_CLASSES; i++)
+        ht_slab_destroy(&table->key_slabs[i]);
+}
 
-    if (!items_list) {
-        free(new_iterator_list);
-        ATOMIC_CAS(table->status, HT_STATUS_GROW, HT_STATUS_IDLE);
-        return;
+uint64_t
+ht_hash_one_at_a_time(const void *key, size_t klen, uint64_t seed)
+{
+    const unsigned char *str = (const unsigned char *)key;
+    const unsigned char * const end = str + klen;
+    uint32_t hash = (uint32_t)seed + klen;
+    while (str < end) {
+        hash += *str++;
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
     }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    return (hash + (hash << 15));
+}
 
-    ht_item_t *item = NULL;
+/*
+ * wyhash (by Wang Yi, released in the public domain)
+ * processes 16/48 bytes per round using 64x64->128 bit multiplications
+ */
+static const uint64_t ht_wyhash_secret[4] = {
+    0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+    0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+};
 
-    MUTEX_LOCK(table->iterator_lock);
+static inline void
+ht_wyhash_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
 
-    ht_items_list_t **old_items = table->items;
-    table->items = items_list;
-    ATOMIC_SET(table->size, new_size);
+static inline uint64_t
+ht_wyhash_mix(uint64_t a, uint64_t b)
+{
+    ht_wyhash_mum(&a, &b);
+    return a ^ b;
+}
 
-    ht_items_list_t *tmp, *list = NULL;
-    TAILQ_FOREACH_SAFE(list, &table->iterator_list->head, iterator_next, tmp) {
-        // NOTE : list->index is safe to access outside of the lock
-        ATOMIC_SET(old_items[list->index], NULL);
-        // now readers can't access this list anymore
-        SPIN_LOCK(list->lock);
-        
-        // move all the items from the old list to the new one
-        while((item = TAILQ_FIRST(&list->head))) {
-            ht_items_list_t *new_list = ATOMIC_READ(items_list[item->hash%new_size]);
-            if (!new_list) {
-                new_list = malloc(sizeof(ht_items_list_t));
-                // XXX - if malloc fails here the table is irremediably corrupted
-                //       so there is no point in handling the case.
-                //       TODO : using an internal prealloc'd bufferpool would ensure
-                //              us to always obtain a valid pointer here
-                TAILQ_INIT(&new_list->head);
-                SPIN_INIT(new_list->lock);
-                size_t index = item->hash%new_size;
-                ATOMIC_SET(items_list[index], new_list);
-                new_list->index = index;
-                TAILQ_INSERT_TAIL(&new_iterator_list->head, new_list, iterator_next);
-            }
-            TAILQ_REMOVE(&list->head, item, next);
-            TAILQ_INSERT_TAIL(&new_list->head, item, next);
+static inline uint64_t
+ht_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-        }
+static inline uint64_t
+ht_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-        // we can now unregister the list from the iterator and release it
-        TAILQ_REMOVE(&table->iterator_list->head, list, iterator_next);
-        SPIN_UNLOCK(list->lock);
-        SPIN_DESTROY(list->lock);
-        free(list);
+uint64_t
+ht_hash_wyhash(const void *key, size_t klen, uint64_t seed)
+{
+    const uint64_t *s = ht_wyhash_secret;
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t a = 0, b = 0;
+
+    seed ^= ht_wyhash_mix(seed ^ s[0], s[1]);
+
+    if (klen <= 16) {
+        if (klen >= 4) {
+            a = (ht_read32(p) << 32) | ht_read32(p + ((klen >> 3) << 2));
+            b = (ht_read32(p + klen - 4) << 32) | ht_read32(p + klen - 4 - ((klen >> 3) << 2));
+        } else if (klen > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[klen >> 1] << 8) | p[klen - 1];
+        }
+    } else {
+        size_t i = klen;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = ht_wyhash_mix(ht_read64(p) ^ s[1], ht_read64(p + 8) ^ seed);
+                see1 = ht_wyhash_mix(ht_read64(p + 16) ^ s[2], ht_read64(p + 24) ^ see1);
+                see2 = ht_wyhash_mix(ht_read64(p + 32) ^ s[3], ht_read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = ht_wyhash_mix(ht_read64(p) ^ s[1], ht_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = ht_read64(p + i - 16);
+        b = ht_read64(p + i - 8);
     }
 
-    // swap the iterator list
-    free(table->iterator_list);
-    table->iterator_list = new_iterator_list;
-    MUTEX_UNLOCK(table->iterator_lock);
+    a ^= s[1];
+    b ^= seed;
+    ht_wyhash_mum(&a, &b);
+    return ht_wyhash_mix(a ^ s[0] ^ klen, b ^ s[1]);
+}
 
-    ATOMIC_CAS(table->status, HT_STATUS_GROW, HT_STATUS_IDLE);
+/*
+ * CRC32C (Castagnoli), using the dedicated instruction when the cpu
+ * provides it (SSE4.2 on x86, the CRC extension on ARMv8) and
+ * a table-driven implementation otherwise
+ */
+static uint32_t ht_crc32c_table[256];
+static int ht_crc32c_table_ready = 0;
 
-    free(old_items);
+static uint32_t
+ht_crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    if (!ATOMIC_READ_ACQUIRE(ht_crc32c_table_ready)) {
+        // NOTE: concurrent initializations write the same values
+        uint32_t i, j;
+        for (i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (j = 0; j < 8; j++)
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : (c >> 1);
+            ATOMIC_STORE_RELAXED(ht_crc32c_table[i], c);
+        }
+        ATOMIC_STORE_RELEASE(ht_crc32c_table_ready, 1);
+    }
 
-    //fprintf(stderr, "Done growing table\n");
+    while (len--)
+        crc = ht_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
 }
 
-static inline ht_items_list_t *
-ht_get_list(hashtable_t *table, uint32_t hash)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2"))) static uint32_t
+ht_crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
 {
-    size_t index = hash%ATOMIC_READ(table->size);
-
-    // first try updating the status assuming we are the first reader requesting
-    // access to the table
-    uint32_t status;
-    do {
-        status = ATOMIC_CAS_RETURN(table->status, HT_STATUS_IDLE, HT_STATUS_READ);
-        // NOTE : if some writer is accessing the table we need to wait,
-        //        multiple readers (status greater than IDLE) are allowed.
-        //        In the unlikely event that sched_yield() fails, we break the loop
-        //        but we will still check if the status is valid and in case it's not
-        //        (so the cas operation didn't succeed) we will synchronize again with
-        //        the other threads
-    } while (status < HT_STATUS_IDLE && sched_yield() == 0);
-
-    // if some other reader is running in a background thread and has already
-    // updated the status (so it's already greater than IDLE), let's take that
-    // into account and try incrementing the status value by one
-    while (status != HT_STATUS_IDLE &&
-           !(status >= HT_STATUS_READ && ATOMIC_CAS(table->status, status, status + 1)))
-    {
-        // if we didn't succeed incrementing the status, maybe the other readers finished
-        // their job and it was already put back to IDLE
-        status = ATOMIC_CAS_RETURN(table->status, HT_STATUS_IDLE, HT_STATUS_READ);
-        if (status < HT_STATUS_IDLE) // some writer is accessing the table, we need to wait
-            sched_yield();
+#ifdef __x86_64__
+    while (len >= 8) {
+        crc = (uint32_t)_mm_crc32_u64(crc, ht_read64(p));
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len >= 4) {
+        crc = _mm_crc32_u32(crc, (uint32_t)ht_read32(p));
+        p += 4;
+        len -= 4;
     }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
 
-    status++; // status now holds the value we have updated in table->status
+static inline int
+ht_crc32c_hw_available()
+{
+    static int available = -1;
+    int rc = ATOMIC_READ_RELAXED(available);
+    if (rc < 0) {
+        __builtin_cpu_init();
+        rc = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+        ATOMIC_STORE_RELAXED(available, rc);
+    }
+    return rc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t
+ht_crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8) {
+        crc = __crc32cd(crc, ht_read64(p));
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
 
-    // we can now safely retrieve the list
-    ht_items_list_t *list = table->items[index];
+#define ht_crc32c_hw_available() (1)
+#else
+#define ht_crc32c_hw(_crc, _p, _len) ht_crc32c_sw((_crc), (_p), (_len))
+#define ht_crc32c_hw_available() (0)
+#endif
 
-    // NOTE: it's important here to lock the list while the status
-    //       has not been put back to idle yet (so writes can't happen)
-    if (list)
-        SPIN_LOCK(list->lock);
+uint64_t
+ht_hash_crc32c(const void *key, size_t klen, uint64_t seed)
+{
+    uint32_t crc = ~(uint32_t)(seed ^ (seed >> 32));
+    if (ht_crc32c_hw_available())
+        crc = ht_crc32c_hw(crc, (const uint8_t *)key, klen);
+    else
+        crc = ht_crc32c_sw(crc, (const uint8_t *)key, klen);
+
+    // spread the 32 bits of the checksum over the whole 64-bit word
+    // so that both the low and the high bits are usable by the table
+    uint64_t hash = ((uint64_t)~crc ^ ((uint64_t)klen << 32)) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 29);
+}
 
-    // now let's update the status by decrementing it
-    // NOTE: if we are the last active reader it will go down to the idle state
-    do {
-        if (ATOMIC_CAS(table->status, status, status -1))
-            break;
-        status = ATOMIC_CAS_RETURN(table->status, HT_STATUS_READ, HT_STATUS_IDLE);
-    } while (status > HT_STATUS_READ);
+static inline uint64_t
+ht_hash(hashtable_t *table, const void *key, size_t klen)
+{
+    return table->hash_cb(key, klen, table->seed);
+}
 
-    // NOTE: the returned list is already locked
-    return list;
+static inline uint32_t
+ht_flat_match(const int8_t *group, int8_t tag)
+{
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), ctrl));
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < HT_FLAT_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] == tag) << i;
+    return mask;
+#endif
 }
 
-static inline ht_items_list_t *
-ht_set_list(hashtable_t *table, uint32_t hash)
+// both EMPTY and DELETED have the sign bit set, full slots don't
+static inline uint32_t
+ht_flat_match_free(const int8_t *group)
 {
-    ht_items_list_t *list = malloc(sizeof(ht_items_list_t));
-    if (!list)
-        return NULL;
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(ctrl);
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < HT_FLAT_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] < 0) << i;
+    return mask;
+#endif
+}
 
-    SPIN_INIT(list->lock);
-    TAILQ_INIT(&list->head);
-    SPIN_LOCK(list->lock);
+static int
+ht_flat_alloc(ht_flat_t *flat, size_t capacity)
+{
+    void *ctrl = NULL;
+    void *slots = NULL;
 
-    size_t index = hash%ATOMIC_READ(table->size);
-    list->index = index;
+    if (posix_memalign(&ctrl, HT_FLAT_GROUP_WIDTH, capacity) != 0)
+        return -1;
 
-    while (!ATOMIC_CAS(table->status, HT_STATUS_IDLE, HT_STATUS_WRITE))
-        sched_yield();
+    if (posix_memalign(&slots, 64, capacity * sizeof(ht_flat_slot_t)) != 0) {
+        free(ctrl);
+        return -1;
+    }
 
-    // NOTE: once the status has been set to WRITE no other threads can access the table
+    memset(ctrl, HT_FLAT_CTRL_EMPTY, capacity);
 
-    index = hash%ATOMIC_READ(table->size);
-    list->index = index;
+    flat->ctrl = ctrl;
+    flat->slots = slots;
+    flat->capacity = capacity;
+    flat->growth_left = HT_FLAT_MAX_LOAD(capacity);
+    return 0;
+}
 
-    // NOTE: since nobody could have changed the status in the meanwhile
-    if (table->items[index]) {
-        // if there is a list already set at our index it means that some other
-        // thread succeded in setting a new list already, completing its job before
-        // we were able to update the table status.
-        // So we can release our newly created list and return the existing one
-        SPIN_UNLOCK(list->lock);
-        SPIN_DESTROY(list->lock);
-        free(list);
-        list = table->items[index];
-        SPIN_LOCK(list->lock);
-        ATOMIC_CAS(table->status, HT_STATUS_WRITE, HT_STATUS_IDLE);
-        return list;
+static inline ssize_t
+ht_flat_find(ht_flat_t *flat, uint64_t hash, void *key, size_t klen)
+{
+    size_t gmask = (flat->capacity / HT_FLAT_GROUP_WIDTH) - 1;
+    size_t g = HT_FLAT_H1(hash) & gmask;
+    int8_t tag = HT_FLAT_H2(hash);
+    size_t probe;
+
+    for (probe = 0; probe <= gmask; probe++) {
+        const int8_t *group = flat->ctrl + g * HT_FLAT_GROUP_WIDTH;
+        uint32_t match = ht_flat_match(group, tag);
+        while (match) {
+            size_t index = g * HT_FLAT_GROUP_WIDTH + __builtin_ctz(match);
+            ht_flat_slot_t *slot = &flat->slots[index];
+            if (slot->hash == hash &&
+                HT_KEY_EQUALS(HT_FLAT_SLOT_KEY(slot), slot->klen, key, klen))
+            {
+                return index;
+            }
+            match &= match - 1;
+        }
+        // a group with an empty slot terminates the probe sequence
+        if (ht_flat_match(group, HT_FLAT_CTRL_EMPTY))
+            break;
+        g = (g + probe + 1) & gmask;
+    }
+    return -1;
+}
+
+static inline ssize_t
+ht_flat_find_free(ht_flat_t *flat, uint64_t hash)
+{
+    size_t gmask = (flat->capacity / HT_FLAT_GROUP_WIDTH) - 1;
+    size_t g = HT_FLAT_H1(hash) & gmask;
+    size_t probe;
+
+    for (probe = 0; probe <= gmask; probe++) {
+        uint32_t match = ht_flat_match_free(flat->ctrl + g * HT_FLAT_GROUP_WIDTH);
+        if (match)
+            return g * HT_FLAT_GROUP_WIDTH + __builtin_ctz(match);
+        g = (g + probe + 1) & gmask;
     }
+    return -1;
+}
 
-    table->items[index] = list;
+static int
+ht_flat_resize(hashtable_t *table, size_t capacity)
+{
+    ht_flat_t *flat = table->flat;
+    ht_flat_t new_flat;
 
-    // it's safe to assume the status still WRITE,
-    // so we don't need to check if the CAS operation succeeded
-    ATOMIC_CAS(table->status, HT_STATUS_WRITE, HT_STATUS_IDLE);
+    if (ht_flat_alloc(&new_flat, capacity) != 0)
+        return -1;
 
-    MUTEX_LOCK(table->iterator_lock);
-    TAILQ_INSERT_TAIL(&table->iterator_list->head, list, iterator_next);
-    MUTEX_UNLOCK(table->iterator_lock);
+#ifndef HT_NO_STATS
+    uint64_t start = ht_now_ns();
+#endif
 
-    // NOTE: the newly created list is already locked
-    return list;
+    size_t i;
+    size_t count = 0;
+    for (i = 0; i < flat->capacity; i++) {
+        if (flat->ctrl[i] < 0)
+            continue;
+        ht_flat_slot_t *slot = &flat->slots[i];
+        // the new table has no tombstones and no duplicates,
+        // so the first free slot is the right one
+        ssize_t index = ht_flat_find_free(&new_flat, slot->hash);
+        new_flat.ctrl[index] = HT_FLAT_H2(slot->hash);
+        memcpy(&new_flat.slots[index], slot, sizeof(ht_flat_slot_t));
+        count++;
+    }
+
+    free(flat->ctrl);
+    free(flat->slots);
+    flat->ctrl = new_flat.ctrl;
+    flat->slots = new_flat.slots;
+    flat->capacity = new_flat.capacity;
+    flat->growth_left = new_flat.growth_left - count;
+
+    if (capacity > table->size)
+        table->grows++;
+    table->size = capacity;
+#ifndef HT_NO_STATS
+    table->grow_time_ns += ht_now_ns() - start;
+#endif
+    return 0;
 }
 
+// ensure there is room for one more item (NOTE: the write lock must be held)
 static inline int
-ht_set_internal(hashtable_t *table,
-                 void *key,
-                 size_t klen,
-                 void *data,
-                 size_t dlen,
-                 void **prev_data,
-                 size_t *prev_len,
-                 int copy,
-                 int inx)
+ht_flat_reserve(hashtable_t *table)
 {
-    void *prev = NULL;
-    size_t plen = 0;
+    ht_flat_t *flat = table->flat;
 
-    if (!klen)
-        return -1;
+    if (flat->growth_left)
+        return 0;
 
-    uint32_t hash = ht_hash_one_at_a_time(table, key, klen);
+    size_t count = ATOMIC_READ(table->count);
+    size_t capacity = flat->capacity;
 
-    // let's first try checking if we fall in an existing bucket list
-    ht_items_list_t *list  = ht_get_list(table, hash);
+    // if most of the used slots are tombstones, rehashing
+    // at the same size is enough to reclaim them
+    if (count > HT_FLAT_MAX_LOAD(capacity) / 2) {
+        if (table->max_size && (capacity << 1) > table->max_size) {
+            // the table can't grow anymore, we can still use
+            // any free slot left while there is one
+            return (count < capacity) ? 0 : -1;
+        }
+        capacity <<= 1;
+    }
 
-    if (!list) // if not, let's create a new bucket list
-        list = ht_set_list(table, hash);
+    return ht_flat_resize(table, capacity);
+}
 
-    if (!list)
+static inline void
+ht_flat_erase(hashtable_t *table, size_t index)
+{
+    ht_flat_t *flat = table->flat;
+    ht_flat_slot_t *slot = &flat->slots[index];
+    if (slot->klen > sizeof(slot->key.kbuf))
+        ht_key_free(table, slot->key.kptr, slot->klen);
+
+    // if the group still has an empty slot no probe sequence ever went
+    // past it, so the slot can be marked as empty instead of deleted
+    size_t g = index / HT_FLAT_GROUP_WIDTH;
+    if (ht_flat_match(flat->ctrl + g * HT_FLAT_GROUP_WIDTH, HT_FLAT_CTRL_EMPTY)) {
+        flat->ctrl[index] = HT_FLAT_CTRL_EMPTY;
+        flat->growth_left++;
+    } else {
+        flat->ctrl[index] = HT_FLAT_CTRL_DELETED;
+    }
+}
+
+static int
+ht_flat_init(hashtable_t *table, size_t initial_size)
+{
+    ht_flat_t *flat = calloc(1, sizeof(ht_flat_t));
+    if (!flat)
         return -1;
 
-    ht_item_t *item = NULL;
-    TAILQ_FOREACH(item, &list->head, next) {
-        if (/*ht_item->hash == arg->item.hash && */
-            HT_KEY_EQUALS(item->key, item->klen, key, klen))
-        {
-            prev = item->data;
-            plen = item->dlen;
-            break;
-        }
+    // room for initial_size items without exceeding the max load factor
+    size_t wanted = initial_size + (initial_size >> 3);
+    size_t capacity = HT_SIZE_MIN;
+    while (capacity < wanted)
+        capacity <<= 1;
+
+    if (ht_flat_alloc(flat, capacity) != 0) {
+        free(flat);
+        return -1;
     }
+    RWLOCK_INIT(flat->lock);
+    table->flat = flat;
+    return 0;
+}
 
-    if (!prev) {
-        ht_item_t *item = (ht_item_t *)calloc(1, sizeof(ht_item_t));
-        if (!item) {
-            //fprintf(stderr, "Can't create new item: %s\n", strerror(errno));
-            SPIN_UNLOCK(list->lock);
-            return -1;
-        }
-        item->hash = hash;
-        item->klen = klen;
+// values are released through the epoch based reclamation (see below)
+static void ht_value_release(hashtable_t *table, void *value);
 
-        if (klen > sizeof(item->kbuf)) {
-            item->key = malloc(klen);
-            if (!item->key) {
-                free(item);
-                SPIN_UNLOCK(list->lock);
-                return -1;
-            }
-        } else {
-            item->key = item->kbuf;
-        }
+static void
+ht_flat_clear(hashtable_t *table, int release_values)
+{
+    ht_flat_t *flat = table->flat;
+    size_t i;
+
+    RWLOCK_WRLOCK(flat->lock);
+    for (i = 0; i < flat->capacity; i++) {
+        if (flat->ctrl[i] < 0)
+            continue;
+        ht_flat_slot_t *slot = &flat->slots[i];
+        if (release_values)
+            ht_value_release(table, slot->data);
+        if (slot->klen > sizeof(slot->key.kbuf))
+            ht_key_free(table, slot->key.kptr, slot->klen);
+        ATOMIC_DECREMENT(table->count);
+    }
+    memset(flat->ctrl, HT_FLAT_CTRL_EMPTY, flat->capacity);
+    flat->growth_left = HT_FLAT_MAX_LOAD(flat->capacity);
+    RWLOCK_UNLOCK(flat->lock);
+}
 
-        memcpy(item->key, key, klen);
+static void
+ht_flat_destroy(hashtable_t *table)
+{
+    ht_flat_t *flat = table->flat;
+    ht_flat_clear(table, 1);
+    RWLOCK_DESTROY(flat->lock);
+    free(flat->ctrl);
+    free(flat->slots);
+    free(flat);
+    table->flat = NULL;
+}
 
-        if (copy) {
-            if (dlen) {
-                item->data = malloc(dlen);
-                if (!item->data) {
-                    if (klen > sizeof(item->kbuf))
-                        free(item->key);
-                    free(item);
-                    SPIN_UNLOCK(list->lock);
-                    return -1;
-                }
-                memcpy(item->data, data, dlen);
-            } else {
-                item->data = NULL;
-            }
-        } else {
-            item->data = data;
-        }
-        item->dlen = dlen;
+static int
+ht_flat_set(hashtable_t *table,
+            uint64_t hash,
+            void *key,
+            size_t klen,
+            void *data,
+            size_t dlen,
+            void **prev_data,
+            size_t *prev_len,
+            int copy,
+            int inx)
+{
+    ht_flat_t *flat = table->flat;
+    void *prev = NULL;
+    size_t plen = 0;
 
-        TAILQ_INSERT_TAIL(&list->head, item, next);
-        ATOMIC_INCREMENT(table->count);
-    } else {
+    if (klen > UINT32_MAX)
+        return -1;
+
+    void *dcopy = data;
+    if (copy && dlen) {
+        dcopy = malloc(dlen);
+        if (!dcopy)
+            return -1;
+        memcpy(dcopy, data, dlen);
+    } else if (copy) {
+        dcopy = NULL;
+    }
+
+    RWLOCK_WRLOCK(flat->lock);
+
+    ssize_t index = ht_flat_find(flat, hash, key, klen);
+    if (index >= 0) {
+        ht_flat_slot_t *slot = &flat->slots[index];
+        prev = slot->data;
+        plen = slot->dlen;
         if (inx) {
+            RWLOCK_UNLOCK(flat->lock);
+            if (copy)
+                free(dcopy);
             if (prev_data)
                 *prev_data = prev;
             if (prev_len)
                 *prev_len = plen;
-            SPIN_UNLOCK(list->lock);
             return 1;
         }
-        item->dlen = dlen;
-        if (copy) {
-            void *dcopy = malloc(dlen);
-            if (!dcopy) {
-                SPIN_UNLOCK(list->lock);
+        slot->data = dcopy;
+        slot->dlen = dlen;
+    } else {
+        if (ht_flat_reserve(table) != 0 || (index = ht_flat_find_free(flat, hash)) < 0) {
+            RWLOCK_UNLOCK(flat->lock);
+            if (copy)
+                free(dcopy);
+            return -1;
+        }
+
+        ht_flat_slot_t *slot = &flat->slots[index];
+        if (klen > sizeof(slot->key.kbuf)) {
+            slot->key.kptr = ht_key_store(table, key, klen);
+            if (!slot->key.kptr) {
+                RWLOCK_UNLOCK(flat->lock);
+                if (copy)
+                    free(dcopy);
                 return -1;
             }
-
-            item->data = dcopy;
-            memcpy(item->data, data, dlen);
         } else {
-            item->data = data;
+            memcpy(slot->key.kbuf, key, klen);
         }
+        slot->hash = hash;
+        slot->klen = klen;
+        slot->data = dcopy;
+        slot->dlen = dlen;
+
+        if (flat->ctrl[index] == HT_FLAT_CTRL_EMPTY && flat->growth_left)
+            flat->growth_left--;
+        flat->ctrl[index] = HT_FLAT_H2(hash);
+        ATOMIC_INCREMENT(table->count);
     }
 
-    SPIN_UNLOCK(list->lock);
-
-    size_t current_size = ATOMIC_READ(table->size);
-    if (ht_count(table) > (current_size + (current_size/3)) && 
-        (!table->max_size || current_size < table->max_size))
-    {
-        ht_grow_table(table);
-    }
+    RWLOCK_UNLOCK(flat->lock);
 
     if (prev) {
         if (prev_data)
             *prev_data = prev;
-        else if (table->free_item_cb)
-            table->free_item_cb(prev);
+        else
+            ht_value_release(table, prev);
     } else if (prev_data) {
         *prev_data = NULL;
     }
@@ -521,503 +1373,6294 @@ ht_set_internal(hashtable_t *table,
     return 0;
 }
 
-int
-ht_set(hashtable_t *table, void *key, size_t klen, void *data, size_t dlen)
+static int
+ht_flat_call(hashtable_t *table,
+             uint64_t hash,
+             void *key,
+             size_t klen,
+             ht_pair_callback_t cb,
+             void *user,
+             int readonly)
 {
-    return ht_set_internal(table, key, klen, data, dlen, NULL, NULL, 0, 0);
+    ht_flat_t *flat = table->flat;
+    int ret = -1;
+
+    if (readonly) {
+        RWLOCK_RDLOCK(flat->lock);
+    } else {
+        RWLOCK_WRLOCK(flat->lock);
+    }
+
+    ssize_t index = ht_flat_find(flat, hash, key, klen);
+    if (index >= 0) {
+        ht_flat_slot_t *slot = &flat->slots[index];
+        if (cb) {
+            ret = cb(table, key, klen, &slot->data, &slot->dlen, user);
+            if (ret == 1) {
+                ht_flat_erase(table, index);
+                ATOMIC_DECREMENT(table->count);
+                ret = 0;
+            }
+        } else {
+            ret = 0;
+        }
+    }
+
+    RWLOCK_UNLOCK(flat->lock);
+    return ret;
 }
 
-int
-ht_set_if_not_exists(hashtable_t *table, void *key, size_t klen, void *data, size_t dlen)
+static void
+ht_flat_foreach_pair(hashtable_t *table, ht_pair_iterator_callback_t cb, void *user)
 {
-    return ht_set_internal(table, key, klen, data, dlen, NULL, NULL, 0, 1);
+    ht_flat_t *flat = table->flat;
+    size_t i;
+
+    RWLOCK_WRLOCK(flat->lock);
+    for (i = 0; i < flat->capacity; i++) {
+        if (flat->ctrl[i] < 0)
+            continue;
+        ht_flat_slot_t *slot = &flat->slots[i];
+        int rc = cb(table, HT_FLAT_SLOT_KEY(slot), slot->klen, slot->data, slot->dlen, user);
+        if (rc == HT_ITERATOR_CONTINUE)
+            continue;
+        if (rc == HT_ITERATOR_STOP)
+            break;
+        // rc is either HT_ITERATOR_REMOVE or HT_ITERATOR_REMOVE_AND_STOP
+        ht_value_release(table, slot->data);
+        ht_flat_erase(table, i);
+        ATOMIC_DECREMENT(table->count);
+        if (rc == HT_ITERATOR_REMOVE_AND_STOP)
+            break;
+    }
+    RWLOCK_UNLOCK(flat->lock);
 }
 
-int
-ht_get_or_set(hashtable_t *table,
-              void *key,
-              size_t klen,
-              void *data,
-              size_t dlen,
-              void **cur_data,
-              size_t *cur_len)
+
+static inline ht_buckets_t *
+ht_buckets_create(size_t size)
 {
-    return ht_set_internal(table, key, klen, data, dlen, cur_data, cur_len, 0, 1);
+    ht_buckets_t *buckets = calloc(1, sizeof(ht_buckets_t) + size * sizeof(ht_items_list_t *));
+    if (buckets)
+        buckets->size = size;
+    return buckets;
 }
 
-int
-ht_get_and_set(hashtable_t *table,
-               void *key,
-               size_t klen,
-               void *data,
-               size_t dlen,
-               void **prev_data,
-               size_t *prev_len)
+static inline ht_items_list_t *
+ht_list_create(hashtable_t *table, size_t index)
 {
-    return ht_set_internal(table, key, klen, data, dlen, prev_data, prev_len, 0, 0);
+    ht_items_list_t *list = ht_slab_alloc(&table->list_slab);
+    if (!list)
+        return NULL;
+
+    SPIN_INIT(list->lock);
+    TAILQ_INIT(&list->head);
+    list->seq = 0;
+    list->index = index;
+    return list;
 }
 
-int
-ht_set_copy(hashtable_t *table,
-            void *key,
-            size_t klen,
-            void *data,
-            size_t dlen,
-            void **prev_data,
-            size_t *prev_len)
+static inline void
+ht_list_destroy(hashtable_t *table, ht_items_list_t *list)
 {
-    return ht_set_internal(table, key, klen, data, dlen, prev_data, prev_len, 1, 0);
+    SPIN_DESTROY(list->lock);
+    ht_slab_free(&table->list_slab, list);
 }
 
-static inline int
-ht_call_internal(hashtable_t *table,
-        void *key,
-        size_t klen,
-        ht_pair_callback_t cb,
-        void *user)
+static void
+ht_list_release(hashtable_t *table, void *ptr)
 {
-    int ret = -1;
-
-    uint32_t hash = ht_hash_one_at_a_time(table, key, klen);
+    ht_list_destroy(table, (ht_items_list_t *)ptr);
+}
 
-    ht_items_list_t *list  = ht_get_list(table, hash);
-    if (!list)
-        return ret;
+static void
+ht_buckets_release(hashtable_t *table __attribute__ ((unused)), void *ptr)
+{
+    free(ptr);
+}
 
-    ht_item_t *item = NULL;
-    ht_item_t *tmp;
-    TAILQ_FOREACH_SAFE(item, &list->head, next, tmp) {
-        if (/*ht_item->hash == arg->item.hash && */
-            HT_KEY_EQUALS(item->key, item->klen, key, klen))
-        {
-            if (cb) {
-                ret = cb(table, key, klen, &item->data, &item->dlen, user);
-                if (ret == 1) {
-                    TAILQ_REMOVE(&list->head, item, next);
-                    if (item->key != item->kbuf)
-                        free(item->key);
-                    free(item);
-                    ATOMIC_DECREMENT(table->count);
-                    ret = 0;
-                }
-            } else {
-                ret = 0;
-            }
-            break;
-        }
+// NOTE : the iterator lock must be held
+static int
+ht_reserve_lists(hashtable_t *table, size_t count)
+{
+    while (table->nreserved < count) {
+        ht_items_list_t *list = ht_list_create(table, 0);
+        if (!list)
+            return -1;
+        TAILQ_INSERT_TAIL(&table->reserved_lists.head, list, iterator_next);
+        table->nreserved++;
     }
-
-    SPIN_UNLOCK(list->lock);
-
-    return ret;
+    return 0;
 }
 
-int
-ht_call(hashtable_t *table,
-        void *key,
-        size_t klen,
-        ht_pair_callback_t cb,
-        void *user)
+// NOTE : the iterator lock must be held
+static void
+ht_release_reserved_lists(hashtable_t *table)
 {
-    return ht_call_internal(table, key, klen, cb, user);
+    ht_items_list_t *tmp, *list = NULL;
+    TAILQ_FOREACH_SAFE(list, &table->reserved_lists.head, iterator_next, tmp) {
+        TAILQ_REMOVE(&table->reserved_lists.head, list, iterator_next);
+        ht_list_destroy(table, list);
+    }
+    table->nreserved = 0;
+}
+
+// NOTE : the iterator lock must be held
+static inline ht_items_list_t *
+ht_take_reserved_list(hashtable_t *table, size_t index)
+{
+    ht_items_list_t *list = TAILQ_FIRST(&table->reserved_lists.head);
+    if (!list) // items added while growing might need more lists
+        return ht_list_create(table, index);
+    TAILQ_REMOVE(&table->reserved_lists.head, list, iterator_next);
+    table->nreserved--;
+    list->index = index;
+    return list;
+}
+
+/*
+ * Epoch based reclamation
+ *
+ * Lookups walk the bucket arrays and the bucket lists without taking any
+ * lock (or any other shared write), so memory unlinked from the table
+ * (items, lists and old bucket arrays) can't be released as soon as it's
+ * removed. Each thread announces the global epoch it observed when it
+ * starts a lookup in a private (cache-line sized) record and clears it
+ * once done. Unlinked memory is tagged with the epoch at which it has been
+ * retired and released only once the global epoch has advanced twice,
+ * which can happen only after all the threads which might still be
+ * accessing it have left their critical section.
+ * Threads which can't get a record of their own (out of memory) share a
+ * static one, serializing on a lock to enter and exit: its epoch is
+ * announced by the first of them and cleared by the last one, which can
+ * only delay the reclamation.
+ */
+#ifdef THREAD_SAFE
+typedef struct _ht_epoch_thread {
+    uint64_t epoch; // 0 when the thread is not inside a critical section
+    int nesting;
+    int in_use;
+    struct _ht_epoch_thread *next;
+} __attribute__((aligned(64))) ht_epoch_thread_t;
+
+static ht_epoch_thread_t *ht_epoch_threads = NULL;
+static uint64_t ht_epoch_global = 1;
+static pthread_key_t ht_epoch_key;
+static int ht_epoch_key_ok = 0;
+static pthread_once_t ht_epoch_key_once = PTHREAD_ONCE_INIT;
+static __thread ht_epoch_thread_t *ht_epoch_self = NULL;
+
+// the record shared by the threads which couldn't register their own
+// (its nesting counts the threads inside a critical section)
+static ht_epoch_thread_t ht_epoch_shared = { .in_use = 1 };
+static int ht_epoch_shared_lock = 0;
+static int ht_epoch_shared_linked = 0;
+static __thread int ht_epoch_shared_nesting = 0;
+
+static void
+ht_epoch_thread_exit(void *arg)
+{
+    ht_epoch_thread_t *thread = (ht_epoch_thread_t *)arg;
+    thread->nesting = 0;
+    ATOMIC_STORE_RELEASE(thread->epoch, 0);
+    // the record will be reused by the next thread needing one
+    ATOMIC_STORE_RELEASE(thread->in_use, 0);
+}
+
+static void
+ht_epoch_key_create()
+{
+    ht_epoch_key_ok = (pthread_key_create(&ht_epoch_key, ht_epoch_thread_exit) == 0);
+}
+
+static inline void
+ht_epoch_link(ht_epoch_thread_t *thread)
+{
+    do {
+        thread->next = ATOMIC_READ(ht_epoch_threads);
+    } while (!ATOMIC_CAS(ht_epoch_threads, thread->next, thread));
+}
+
+// NOTE : returns NULL if the thread can't get a record of its own
+static ht_epoch_thread_t *
+ht_epoch_thread_register()
+{
+    pthread_once(&ht_epoch_key_once, ht_epoch_key_create);
+    if (!ht_epoch_key_ok)
+        return NULL;
+
+    ht_epoch_thread_t *thread = ATOMIC_READ_ACQUIRE(ht_epoch_threads);
+    while (thread) {
+        if (!ATOMIC_READ_RELAXED(thread->in_use) && ATOMIC_CAS(thread->in_use, 0, 1))
+            break;
+        thread = thread->next;
+    }
+
+    if (!thread) {
+        void *ptr = NULL;
+        if (posix_memalign(&ptr, sizeof(ht_epoch_thread_t), sizeof(ht_epoch_thread_t)) != 0)
+            return NULL;
+        thread = (ht_epoch_thread_t *)ptr;
+        memset(thread, 0, sizeof(ht_epoch_thread_t));
+        thread->in_use = 1;
+        ht_epoch_link(thread);
+    }
+
+    if (pthread_setspecific(ht_epoch_key, thread) != 0) {
+        // without the destructor the record would never be released
+        ATOMIC_STORE_RELEASE(thread->in_use, 0);
+        return NULL;
+    }
+
+    ht_epoch_self = thread;
+    return thread;
+}
+
+static inline void
+ht_epoch_announce(ht_epoch_thread_t *thread)
+{
+    // NOTE: the global epoch might advance before our announcement is visible,
+    //       in which case we need to announce the new one
+    uint64_t epoch;
+    do {
+        epoch = ATOMIC_READ_RELAXED(ht_epoch_global);
+        __atomic_store_n(&thread->epoch, epoch, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&ht_epoch_global, __ATOMIC_SEQ_CST) != epoch);
+}
+
+static void
+ht_epoch_shared_enter()
+{
+    if (ht_epoch_shared_nesting++)
+        return;
+
+    while (!ATOMIC_CAS(ht_epoch_shared_lock, 0, 1))
+        sched_yield();
+    if (!ht_epoch_shared_linked) {
+        ht_epoch_link(&ht_epoch_shared);
+        ht_epoch_shared_linked = 1;
+    }
+    // an epoch already announced by another thread is older than
+    // (or the same as) the current one, so it's still valid for us
+    if (ht_epoch_shared.nesting++ == 0)
+        ht_epoch_announce(&ht_epoch_shared);
+    ATOMIC_STORE_RELEASE(ht_epoch_shared_lock, 0);
+}
+
+static void
+ht_epoch_shared_exit()
+{
+    if (--ht_epoch_shared_nesting)
+        return;
+
+    while (!ATOMIC_CAS(ht_epoch_shared_lock, 0, 1))
+        sched_yield();
+    if (--ht_epoch_shared.nesting == 0)
+        ATOMIC_STORE_RELEASE(ht_epoch_shared.epoch, 0);
+    ATOMIC_STORE_RELEASE(ht_epoch_shared_lock, 0);
+}
+
+static inline void
+ht_epoch_enter()
+{
+    ht_epoch_thread_t *thread = ht_epoch_self;
+    if (__builtin_expect(!thread, 0)) {
+        // a thread already using the shared record keeps using it
+        // until it leaves all its critical sections
+        if (ht_epoch_shared_nesting || !(thread = ht_epoch_thread_register())) {
+            ht_epoch_shared_enter();
+            return;
+        }
+    }
+
+    if (thread->nesting++)
+        return;
+
+    ht_epoch_announce(thread);
+}
+
+static inline void
+ht_epoch_exit()
+{
+    ht_epoch_thread_t *thread = ht_epoch_self;
+    if (__builtin_expect(!thread, 0)) {
+        ht_epoch_shared_exit();
+        return;
+    }
+    if (--thread->nesting == 0)
+        ATOMIC_STORE_RELEASE(thread->epoch, 0);
+}
+
+// the global epoch can advance only once all the threads
+// inside a critical section have observed its current value
+static uint64_t
+ht_epoch_try_advance()
+{
+    uint64_t epoch = __atomic_load_n(&ht_epoch_global, __ATOMIC_SEQ_CST);
+    ht_epoch_thread_t *thread = ATOMIC_READ_ACQUIRE(ht_epoch_threads);
+    while (thread) {
+        uint64_t thread_epoch = __atomic_load_n(&thread->epoch, __ATOMIC_SEQ_CST);
+        if (thread_epoch && thread_epoch != epoch)
+            return epoch;
+        thread = thread->next;
+    }
+    ATOMIC_CAS(ht_epoch_global, epoch, epoch + 1);
+    return ATOMIC_READ(ht_epoch_global);
+}
+
+#else
+#define ht_epoch_enter()
+#define ht_epoch_exit()
+#endif
+
+static void
+ht_limbo_release(hashtable_t *table, ht_retired_t *entries, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+        entries[i].free_cb(table, entries[i].ptr);
+    free(entries);
+}
+
+// release the memory retired at least two epochs ago
+static void
+ht_limbo_reclaim(ht_reclaim_t *reclaim, hashtable_t *table, uint64_t epoch)
+{
+    int i;
+    for (i = 0; i < HT_LIMBO_BAGS; i++) {
+        SPIN_LOCK(reclaim->lock);
+        ht_limbo_t *bag = &reclaim->limbo[i];
+        ht_retired_t *entries = NULL;
+        size_t count = 0;
+        if (bag->count && bag->epoch + 2 <= epoch) {
+            entries = bag->entries;
+            count = bag->count;
+            bag->entries = NULL;
+            bag->count = bag->size = 0;
+        }
+        SPIN_UNLOCK(reclaim->lock);
+        if (entries)
+            ht_limbo_release(table, entries, count);
+    }
+}
+
+static void
+ht_reclaim_init(ht_reclaim_t *reclaim)
+{
+    memset(reclaim->limbo, 0, sizeof(reclaim->limbo));
+    SPIN_INIT(reclaim->lock);
+}
+
+// NOTE : nobody else can be accessing the owner of the retired memory
+static void
+ht_reclaim_destroy(ht_reclaim_t *reclaim, hashtable_t *table)
+{
+    int i;
+    for (i = 0; i < HT_LIMBO_BAGS; i++) {
+        if (reclaim->limbo[i].count)
+            ht_limbo_release(table, reclaim->limbo[i].entries, reclaim->limbo[i].count);
+        else
+            free(reclaim->limbo[i].entries);
+    }
+    SPIN_DESTROY(reclaim->lock);
+}
+
+// NOTE: ptr must be already unreachable for new lookups,
+//       table is only passed along to free_cb
+static void
+ht_reclaim_retire(ht_reclaim_t *reclaim, hashtable_t *table, void *ptr, void (*free_cb)(hashtable_t *, void *))
+{
+#ifdef THREAD_SAFE
+    uint64_t epoch = __atomic_load_n(&ht_epoch_global, __ATOMIC_SEQ_CST);
+    ht_retired_t *stale = NULL;
+    size_t stale_count = 0;
+    int batch_full = 0;
+
+    SPIN_LOCK(reclaim->lock);
+    ht_limbo_t *bag = &reclaim->limbo[epoch % HT_LIMBO_BAGS];
+    if (bag->epoch != epoch) {
+        // whatever is still in this bag has been retired
+        // at least HT_LIMBO_BAGS epochs ago
+        stale = bag->entries;
+        stale_count = bag->count;
+        bag->entries = NULL;
+        bag->count = bag->size = 0;
+        bag->epoch = epoch;
+    }
+    if (bag->count == bag->size) {
+        size_t size = bag->size ? bag->size << 1 : HT_LIMBO_BATCH;
+        ht_retired_t *entries = realloc(bag->entries, size * sizeof(ht_retired_t));
+        if (!entries) {
+            SPIN_UNLOCK(reclaim->lock);
+            // no memory to defer the release. We can't wait for concurrent
+            // lookups to complete either, since the caller might be holding
+            // the lock of the bucket list they are spinning on, so we have
+            // no choice but leaking ptr
+            if (stale)
+                ht_limbo_release(table, stale, stale_count);
+            return;
+        }
+        bag->entries = entries;
+        bag->size = size;
+    }
+    bag->entries[bag->count].ptr = ptr;
+    bag->entries[bag->count].free_cb = free_cb;
+    batch_full = (++bag->count % HT_LIMBO_BATCH == 0);
+    SPIN_UNLOCK(reclaim->lock);
+
+    if (stale)
+        ht_limbo_release(table, stale, stale_count);
+
+    if (batch_full)
+        ht_limbo_reclaim(reclaim, table, ht_epoch_try_advance());
+#else
+    free_cb(table, ptr);
+#endif
+}
+
+static inline void
+ht_retire(hashtable_t *table, void *ptr, void (*free_cb)(hashtable_t *, void *))
+{
+    ht_reclaim_retire(&table->reclaim, table, ptr, free_cb);
+}
+
+static void
+ht_value_destroy(hashtable_t *table, void *ptr)
+{
+    ht_free_item_callback_t cb = ATOMIC_READ(table->free_item_cb);
+    if (cb)
+        cb(ptr);
+}
+
+// release a value which can't be reached through the table anymore.
+// With deferred frees readers which obtained it inside ht_read_begin()
+// and ht_read_end() might still be using it, so it's retired instead
+static void
+ht_value_release(hashtable_t *table, void *value)
+{
+    if (!table->free_item_cb)
+        return;
+
+    if (ATOMIC_READ(table->deferred_free))
+        ht_retire(table, value, ht_value_destroy);
+    else
+        table->free_item_cb(value);
+}
+
+static inline void
+ht_item_value_release(hashtable_t *table, ht_item_t *item)
+{
+    if (!HT_VALUE_INLINE(&item->data))
+        ht_value_release(table, item->data);
+}
+
+static void
+ht_cache_evicted_release(hashtable_t *table, void *ptr)
+{
+    table->cache->evict_cb(ptr);
+}
+
+void
+ht_read_begin()
+{
+    ht_epoch_enter();
+}
+
+void
+ht_read_end()
+{
+    ht_epoch_exit();
+}
+
+void
+ht_reclaim(hashtable_t *table)
+{
+    if (table->shards) {
+        size_t i;
+        for (i = 0; i < table->nshards; i++)
+            ht_reclaim(table->shards[i]);
+        return;
+    }
+
+#ifdef THREAD_SAFE
+    // memory is released once the epoch advanced twice since it was retired
+    ht_epoch_try_advance();
+    ht_limbo_reclaim(&table->reclaim, table, ht_epoch_try_advance());
+#endif
+}
+
+static void
+ht_item_destroy(hashtable_t *table, void *ptr)
+{
+    ht_item_t *item = (ht_item_t *)ptr;
+    if (item->key != item->kbuf)
+        ht_key_free(table, item->key, item->klen);
+    ht_slab_free(&table->item_slab, item);
+}
+
+// memory accounted to an item of a cache table
+static inline size_t
+ht_cache_cost(ht_item_t *item)
+{
+    return sizeof(ht_cache_item_t) + (item->key != item->kbuf ? item->klen : 0) + item->dlen;
+}
+
+// NOTE : the bucket list holding the item must be locked
+static void
+ht_cache_link(hashtable_t *table, ht_item_t *item)
+{
+    ht_cache_t *cache = table->cache;
+    ht_cache_item_t *citem = (ht_cache_item_t *)item;
+    ht_cache_shard_t *shard = &cache->shards[HT_CACHE_SHARD(item->hash)];
+
+    citem->cost = ht_cache_cost(item);
+    SPIN_LOCK(shard->lock);
+    TAILQ_INSERT_TAIL(&shard->probation, citem, cache_next);
+    shard->count++;
+    SPIN_UNLOCK(shard->lock);
+    ATOMIC_INCREASE(cache->bytes, citem->cost);
+}
+
+// NOTE : the bucket list holding the item must be locked
+static void
+ht_cache_unlink(hashtable_t *table, ht_item_t *item)
+{
+    ht_cache_t *cache = table->cache;
+    if (!cache)
+        return;
+
+    ht_cache_item_t *citem = (ht_cache_item_t *)item;
+    ht_cache_shard_t *shard = &cache->shards[HT_CACHE_SHARD(item->hash)];
+
+    SPIN_LOCK(shard->lock);
+    if (citem->protected) {
+        TAILQ_REMOVE(&shard->protected, citem, cache_next);
+        shard->nprotected--;
+    } else {
+        TAILQ_REMOVE(&shard->probation, citem, cache_next);
+    }
+    shard->count--;
+    SPIN_UNLOCK(shard->lock);
+    ATOMIC_DECREASE(cache->bytes, citem->cost);
+}
+
+// the item has been accessed, and its value might have been replaced
+// NOTE : the bucket list holding the item must be locked
+static void
+ht_cache_update(hashtable_t *table, ht_item_t *item)
+{
+    ht_cache_item_t *citem = (ht_cache_item_t *)item;
+    size_t cost = ht_cache_cost(item);
+    if (cost != citem->cost) {
+        ATOMIC_INCREASE(table->cache->bytes, cost - citem->cost);
+        citem->cost = cost;
+    }
+    if (!ATOMIC_READ_RELAXED(citem->referenced))
+        ATOMIC_STORE_RELAXED(citem->referenced, 1);
+}
+
+static inline uint64_t
+ht_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline int
+ht_item_expired(ht_item_t *item, uint64_t *now)
+{
+    uint64_t expire = ATOMIC_READ_RELAXED(item->expire);
+    if (!expire)
+        return 0;
+    if (!*now)
+        *now = ht_now_ms();
+    return expire <= *now;
+}
+
+static ht_wheel_t *
+ht_wheel_create()
+{
+    ht_wheel_t *wheel = calloc(1, sizeof(ht_wheel_t));
+    if (!wheel)
+        return NULL;
+
+    int level, slot;
+    for (level = 0; level < HT_WHEEL_LEVELS; level++)
+        for (slot = 0; slot < HT_WHEEL_SLOTS; slot++)
+            TAILQ_INIT(&wheel->slots[level][slot]);
+
+    MUTEX_INIT(wheel->lock);
+    wheel->now = ht_now_ms();
+    return wheel;
+}
+
+// NOTE : the wheel lock must be held
+//        timers expiring before min_expire will fire at min_expire
+static void
+ht_wheel_insert(ht_wheel_t *wheel, ht_timer_t *timer, uint64_t min_expire)
+{
+    uint64_t expire = timer->expire < min_expire ? min_expire : timer->expire;
+    uint64_t delta = expire - wheel->now;
+    if (delta >= HT_WHEEL_SPAN) {
+        delta = HT_WHEEL_SPAN - 1;
+        expire = wheel->now + delta;
+    }
+
+    int level = 0;
+    while (level < HT_WHEEL_LEVELS - 1 && delta >= 1ULL << (HT_WHEEL_BITS * (level + 1)))
+        level++;
+
+    int slot = (expire >> (HT_WHEEL_BITS * level)) & (HT_WHEEL_SLOTS - 1);
+    TAILQ_INSERT_TAIL(&wheel->slots[level][slot], timer, next);
+    wheel->bitmap[level] |= 1ULL << slot;
+    timer->level = level;
+    timer->slot = slot;
+    wheel->count++;
+}
+
+// NOTE : the wheel lock must be held
+static void
+ht_wheel_remove(ht_wheel_t *wheel, ht_timer_t *timer)
+{
+    ht_timer_list_t *slot = &wheel->slots[timer->level][timer->slot];
+    TAILQ_REMOVE(slot, timer, next);
+    if (TAILQ_EMPTY(slot))
+        wheel->bitmap[timer->level] &= ~(1ULL << timer->slot);
+    wheel->count--;
+}
+
+// NOTE : the wheel lock must be held
+static void
+ht_wheel_advance(ht_wheel_t *wheel, uint64_t now, ht_timer_list_t *fired)
+{
+    while (wheel->now < now) {
+        if (!wheel->count) {
+            wheel->now = now;
+            break;
+        }
+
+        // nothing in the first level, jump straight to the next cascade
+        if (!wheel->bitmap[0]) {
+            uint64_t boundary = (wheel->now | (HT_WHEEL_SLOTS - 1)) + 1;
+            if (boundary > now) {
+                wheel->now = now;
+                break;
+            }
+            wheel->now = boundary - 1;
+        }
+
+        uint64_t tick = ++wheel->now;
+
+        int level = 1;
+        while (level < HT_WHEEL_LEVELS && !(tick & ((1ULL << (HT_WHEEL_BITS * level)) - 1)))
+            level++;
+
+        // cascade the timers in the current slot of the levels
+        // which completed a turn, starting from the highest one
+        while (--level > 0) {
+            int slot = (tick >> (HT_WHEEL_BITS * level)) & (HT_WHEEL_SLOTS - 1);
+            ht_timer_list_t timers;
+            TAILQ_INIT(&timers);
+            TAILQ_CONCAT(&timers, &wheel->slots[level][slot], next);
+            wheel->bitmap[level] &= ~(1ULL << slot);
+            ht_timer_t *timer, *tmp;
+            TAILQ_FOREACH_SAFE(timer, &timers, next, tmp) {
+                TAILQ_REMOVE(&timers, timer, next);
+                wheel->count--;
+                ht_wheel_insert(wheel, timer, tick);
+            }
+        }
+
+        int slot = tick & (HT_WHEEL_SLOTS - 1);
+        ht_timer_t *timer, *tmp;
+        TAILQ_FOREACH_SAFE(timer, &wheel->slots[0][slot], next, tmp) {
+            TAILQ_REMOVE(&wheel->slots[0][slot], timer, next);
+            wheel->count--;
+            timer->firing = 1;
+            TAILQ_INSERT_TAIL(fired, timer, next);
+        }
+        wheel->bitmap[0] &= ~(1ULL << slot);
+    }
+}
+
+// NOTE : the bucket list holding the item must be locked
+static void
+ht_timer_cancel(hashtable_t *table, ht_item_t *item)
+{
+    ht_timer_t *timer = item->timer;
+    if (!timer)
+        return;
+
+    ht_wheel_t *wheel = table->wheel;
+    MUTEX_LOCK(wheel->lock);
+    if (timer->firing) {
+        // the expiring thread will release it
+        timer->item = NULL;
+        timer = NULL;
+    } else {
+        ht_wheel_remove(wheel, timer);
+    }
+    MUTEX_UNLOCK(wheel->lock);
+
+    if (timer)
+        ht_slab_free(&table->timer_slab, timer);
+
+    item->timer = NULL;
+    ATOMIC_STORE_RELAXED(item->expire, 0);
+}
+
+// NOTE : the bucket list holding the item must be locked
+static int
+ht_timer_set(hashtable_t *table, ht_item_t *item, uint64_t expire)
+{
+    if (!expire) {
+        ht_timer_cancel(table, item);
+        return 0;
+    }
+
+    ht_wheel_t *wheel = ATOMIC_READ(table->wheel);
+    if (!wheel) {
+        wheel = ht_wheel_create();
+        if (!wheel)
+            return -1;
+        if (!ATOMIC_CAS(table->wheel, NULL, wheel)) {
+            MUTEX_DESTROY(wheel->lock);
+            free(wheel);
+            wheel = table->wheel;
+        }
+    }
+
+    ht_timer_t *timer = item->timer;
+    if (timer) {
+        MUTEX_LOCK(wheel->lock);
+        if (!timer->firing) {
+            ht_wheel_remove(wheel, timer);
+            timer->expire = expire;
+            ht_wheel_insert(wheel, timer, wheel->now + 1);
+            MUTEX_UNLOCK(wheel->lock);
+            ATOMIC_STORE_RELAXED(item->expire, expire);
+            return 0;
+        }
+        // it's about to be released by the expiring thread
+        timer->item = NULL;
+        MUTEX_UNLOCK(wheel->lock);
+        item->timer = NULL;
+    }
+
+    timer = ht_slab_alloc(&table->timer_slab);
+    if (!timer)
+        return -1;
+
+    timer->item = item;
+    timer->hash = item->hash;
+    timer->expire = expire;
+    timer->firing = 0;
+
+    MUTEX_LOCK(wheel->lock);
+    ht_wheel_insert(wheel, timer, wheel->now + 1);
+    MUTEX_UNLOCK(wheel->lock);
+
+    item->timer = timer;
+    ATOMIC_STORE_RELAXED(item->expire, expire);
+    return 0;
+}
+
+// the entry of a slot, NULL if its key and its value don't fit in the entries
+// NOTE : the lengths are checked here rather than when opening the image,
+//        which would read all the entries (only the offsets are checked there)
+static inline ht_image_entry_t *
+ht_image_entry(ht_image_t *image, ht_image_slot_t *slot)
+{
+    ht_image_entry_t *entry = (ht_image_entry_t *)(image->base + slot->offset);
+    // both the offset and the end of the entries are aligned to 8 bytes,
+    // so the aligned length of a key fitting here fits as well
+    uint64_t room = image->data_end - slot->offset - sizeof(ht_image_entry_t);
+    if (entry->klen > room || entry->dlen > room - HT_IMAGE_ALIGN(entry->klen))
+        return NULL;
+    return entry;
+}
+
+// NOTE : the returned value points into the mapping
+static inline int
+ht_image_find(ht_image_t *image, uint64_t hash, void *key, size_t klen, void **data, size_t *dlen)
+{
+    if (ATOMIC_READ_RELAXED(image->hidden))
+        return 0;
+
+    uint64_t bucket = hash % image->nbuckets;
+    uint64_t i;
+    for (i = image->buckets[bucket]; i < image->buckets[bucket + 1]; i++) {
+        ht_image_slot_t *slot = &image->slots[i];
+        if (slot->hash != hash)
+            continue;
+
+        ht_image_entry_t *entry = ht_image_entry(image, slot);
+        if (!entry)
+            continue;
+        char *ekey = (char *)(entry + 1);
+        if (HT_KEY_EQUALS(ekey, entry->klen, key, klen)) {
+            if (data)
+                *data = entry->dlen ? ekey + HT_IMAGE_ALIGN(entry->klen) : NULL;
+            if (dlen)
+                *dlen = entry->dlen;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// check if the key is served by the image (it's not shadowed by
+// the overlay is checked by the callers, which already looked there)
+static inline int
+ht_image_visible(hashtable_t *table, uint64_t hash, void *key, size_t klen, void **data, size_t *dlen)
+{
+    ht_image_t *image = ATOMIC_READ(table->image);
+    if (!ht_image_find(image, hash, key, klen, data, dlen))
+        return 0;
+
+    if (ATOMIC_READ(image->deleted->count) && ht_exists(image->deleted, key, klen)) {
+        if (data)
+            *data = NULL;
+        if (dlen)
+            *dlen = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+// NOTE : the bucket list of the item must be locked
+//        (which is what keeps the overlay and the deleted keys consistent)
+static inline void
+ht_image_shadow(hashtable_t *table, ht_item_t *item)
+{
+    ht_image_t *image = table->image;
+    if (!ht_image_find(image, item->hash, item->key, item->klen, NULL, NULL))
+        return;
+
+    ATOMIC_INCREMENT(image->shadowed);
+    if (ATOMIC_READ(image->deleted->count))
+        ht_delete(image->deleted, item->key, item->klen, NULL, NULL);
+}
+
+// NOTE : the bucket list of the item must be locked
+static inline void
+ht_image_unshadow(hashtable_t *table, ht_item_t *item)
+{
+    ht_image_t *image = table->image;
+    if (!ht_image_find(image, item->hash, item->key, item->klen, NULL, NULL))
+        return;
+
+    // the value in the image must not show up again
+    ATOMIC_DECREMENT(image->shadowed);
+    ht_set(image->deleted, item->key, item->klen, NULL, 0);
+}
+
+// values stored in the image belong to the mapping
+static inline int
+ht_image_owns(hashtable_t *table, void *ptr)
+{
+    ht_image_t *image = ATOMIC_READ(table->image);
+    while (image) {
+        if ((char *)ptr >= image->base && (char *)ptr < image->base + image->size)
+            return 1;
+        image = image->prev;
+    }
+    return 0;
+}
+
+// NOTE : value is the address of the data pointer
+static inline void
+ht_free_value(hashtable_t *table, void **value)
+{
+    // neither numeric values nor the ones in the image have been allocated
+    if (HT_VALUE_INLINE(value))
+        return;
+    if (!table->image || !ht_image_owns(table, *value))
+        ht_value_release(table, *value);
+}
+
+// numeric values live in the item, which is released (or reused) once the
+// previous value has been handed over, so the caller gets a copy of them
+// NOTE : returns NULL if the copy can't be allocated
+static inline void *
+ht_num_copy(ht_num_t *num)
+{
+    ht_num_t *copy = malloc(sizeof(ht_num_t));
+    if (copy)
+        copy->i = ATOMIC_READ_RELAXED(num->i);
+    return copy;
+}
+
+static void
+ht_image_close(ht_image_t *image)
+{
+    while (image) {
+        ht_image_t *prev = image->prev;
+        munmap(image->base, image->size);
+        if (image->deleted)
+            ht_destroy(image->deleted);
+        free(image->path);
+        free(image);
+        image = prev;
+    }
+}
+
+static bloom_filter_t *
+ht_bloom_create(hashtable_t *table, size_t size)
+{
+    // enough for all the items we can hold before growing again
+    size_t capacity = size + size / 3;
+    return table->bloom_counting ? bloom_create_counting(capacity, table->bloom_fp_rate)
+                                 : bloom_create(capacity, table->bloom_fp_rate);
+}
+
+static void
+ht_bloom_release(hashtable_t *table __attribute__ ((unused)), void *ptr)
+{
+    bloom_destroy((bloom_filter_t *)ptr);
+}
+
+// NOTE : returns 0 only if the key is definitely not in the table
+static inline int
+ht_bloom_test(hashtable_t *table, uint64_t hash)
+{
+    if (!ATOMIC_READ_RELAXED(table->bloom))
+        return 1;
+
+    ht_epoch_enter();
+    int maybe = bloom_test_hash(ATOMIC_READ_ACQUIRE(table->bloom), hash);
+    ht_epoch_exit();
+
+    return maybe;
+}
+
+// NOTE : the bucket list must be locked
+static inline void
+ht_bloom_add(hashtable_t *table, uint64_t hash)
+{
+    if (!ATOMIC_READ_RELAXED(table->bloom))
+        return;
+
+    ht_epoch_enter();
+    // the filter being built must be checked first, once the growth
+    // completes it becomes the current one (see ht_grow_complete())
+    bloom_filter_t *next = ATOMIC_READ_ACQUIRE(table->bloom_next);
+    if (next)
+        bloom_add_hash(next, hash);
+    bloom_filter_t *bloom = ATOMIC_READ_ACQUIRE(table->bloom);
+    if (bloom != next)
+        bloom_add_hash(bloom, hash);
+    ht_epoch_exit();
+}
+
+// NOTE : the bucket list must be locked
+static inline void
+ht_bloom_remove(hashtable_t *table, uint64_t hash)
+{
+    if (!table->bloom_counting)
+        return;
+
+    // every item is in the current filter (while growing the new one might
+    // not know about it yet, so it's left alone and it will just report
+    // a few more false positives)
+    ht_epoch_enter();
+    bloom_remove_hash(ATOMIC_READ_ACQUIRE(table->bloom), hash);
+    ht_epoch_exit();
+}
+
+// undo ht_set_bloom_filter() on a table which is still empty
+static void
+ht_bloom_unset(hashtable_t *table)
+{
+    MUTEX_LOCK(table->iterator_lock);
+    bloom_filter_t *bloom = table->bloom;
+    table->bloom_counting = 0;
+    ATOMIC_STORE_RELEASE(table->bloom, NULL);
+    MUTEX_UNLOCK(table->iterator_lock);
+
+    // lookups might still be testing it
+    ht_retire(table, bloom, ht_bloom_release);
+}
+
+int
+ht_set_bloom_filter(hashtable_t *table, double fp_rate, int counting)
+{
+    if (table->flat || table->image || table->bloom || ht_count(table))
+        return -1;
+
+    size_t i;
+    for (i = 0; i < table->nshards; i++) {
+        if (ht_set_bloom_filter(table->shards[i], fp_rate, counting) != 0) {
+            // don't leave only some of the shards with a filter
+            while (i--)
+                ht_bloom_unset(table->shards[i]);
+            return -1;
+        }
+    }
+    if (table->shards)
+        return 0;
+
+    MUTEX_LOCK(table->iterator_lock);
+    table->bloom_fp_rate = fp_rate;
+    table->bloom_counting = counting;
+    bloom_filter_t *bloom = ht_bloom_create(table, table->size);
+    if (!bloom)
+        table->bloom_counting = 0;
+    ATOMIC_STORE_RELEASE(table->bloom, bloom);
+    MUTEX_UNLOCK(table->iterator_lock);
+
+    return bloom ? 0 : -1;
+}
+
+static void ht_arena_destroy(ht_arena_t *arena);
+
+int
+ht_set_key_arena(hashtable_t *table)
+{
+    if (table->flat || table->intern_pool || table->arena || ht_count(table))
+        return -1;
+
+    size_t i;
+    for (i = 0; i < table->nshards; i++) {
+        if (ht_set_key_arena(table->shards[i]) != 0) {
+            // don't leave only some of the shards with an arena
+            // (they are still empty, so nothing is using them)
+            while (i--) {
+                ht_arena_destroy(table->shards[i]->arena);
+                table->shards[i]->arena = NULL;
+            }
+            return -1;
+        }
+    }
+    if (table->shards)
+        return 0;
+
+    ht_arena_t *arena = calloc(1, sizeof(ht_arena_t));
+    if (!arena)
+        return -1;
+
+    for (i = 0; i < HT_SLAB_SHARDS; i++)
+        SPIN_INIT(arena->shards[i].lock);
+    arena->min_waste = HT_ARENA_CHUNK_SIZE * 4;
+
+    table->arena = arena;
+    return 0;
+}
+
+static void
+ht_arena_chunk_release(hashtable_t *table __attribute__ ((unused)), void *ptr)
+{
+    free(ptr);
+}
+
+// NOTE : the iterator lock must be held
+static size_t
+ht_arena_compact(hashtable_t *table)
+{
+    ht_arena_t *arena = table->arena;
+    ht_arena_chunk_t *chunk;
+    int i, evacuating = 0;
+
+    // pick the chunks which are less than half full, but the ones
+    // new keys are being carved out of
+    for (i = 0; i < HT_SLAB_SHARDS; i++) {
+        ht_arena_shard_t *shard = &arena->shards[i];
+        SPIN_LOCK(shard->lock);
+        for (chunk = shard->chunks ? shard->chunks->next : NULL; chunk; chunk = chunk->next) {
+            if (ATOMIC_READ(chunk->live) < chunk->used / 2)
+                chunk->evacuate = 1;
+            evacuating += chunk->evacuate;
+        }
+        SPIN_UNLOCK(shard->lock);
+    }
+
+    if (evacuating) {
+        ht_items_list_t *list = NULL;
+        TAILQ_FOREACH(list, &table->iterator_list->head, iterator_next) {
+            HT_LIST_LOCK(table, list);
+            ht_item_t *item = NULL;
+            TAILQ_FOREACH(item, &list->head, next) {
+                if (item->key == item->kbuf || item->klen > HT_KEY_CLASS_MAX)
+                    continue;
+                chunk = ((ht_arena_chunk_t **)item->key)[-1];
+                if (!chunk->evacuate)
+                    continue;
+                void *key = ht_arena_alloc(arena, item->klen);
+                if (!key)
+                    continue;
+                memcpy(key, item->key, item->klen);
+                // lookups still comparing the old copy are done
+                // before the chunk is actually released
+                void *old_key = item->key;
+                ATOMIC_STORE_RELEASE(item->key, key);
+                ht_arena_free(arena, old_key, item->klen);
+            }
+            HT_LIST_UNLOCK(list);
+        }
+    }
+
+    // items not linked yet (or unlinked but not released yet) might still
+    // be using some of the chunks, those will be released next time
+    ht_arena_chunk_t *empty = NULL;
+    for (i = 0; i < HT_SLAB_SHARDS; i++) {
+        ht_arena_shard_t *shard = &arena->shards[i];
+        SPIN_LOCK(shard->lock);
+        ht_arena_chunk_t **prev = shard->chunks ? &shard->chunks->next : NULL;
+        while (prev && (chunk = *prev)) {
+            if (chunk->evacuate && !ATOMIC_READ(chunk->live)) {
+                *prev = chunk->next;
+                chunk->next = empty;
+                empty = chunk;
+            } else {
+                prev = &chunk->next;
+            }
+        }
+        SPIN_UNLOCK(shard->lock);
+    }
+
+    size_t released = 0;
+    while (empty) {
+        chunk = empty;
+        empty = chunk->next;
+        released += sizeof(ht_arena_chunk_t) + chunk->size;
+        ht_retire(table, chunk, ht_arena_chunk_release);
+    }
+
+    size_t bytes = ATOMIC_DECREASE(arena->bytes, released);
+    ATOMIC_SET(arena->min_waste, bytes - ATOMIC_READ(arena->live) + HT_ARENA_CHUNK_SIZE * 4);
+
+    return released;
+}
+
+size_t
+ht_compact_keys(hashtable_t *table)
+{
+    size_t i, released = 0;
+    for (i = 0; i < table->nshards; i++)
+        released += ht_compact_keys(table->shards[i]);
+
+    if (!table->arena)
+        return released;
+
+    MUTEX_LOCK(table->iterator_lock);
+    released += ht_arena_compact(table);
+    MUTEX_UNLOCK(table->iterator_lock);
+
+    return released;
+}
+
+// NOTE : no bucket list must be locked
+static inline void
+ht_arena_check(hashtable_t *table)
+{
+    ht_arena_t *arena = table->arena;
+    size_t bytes = ATOMIC_READ_RELAXED(arena->bytes);
+    size_t live = ATOMIC_READ_RELAXED(arena->live);
+
+    // compact once most of the memory is wasted,
+    // unless we already tried and nothing changed since then
+    if (bytes - live < live || bytes - live < ATOMIC_READ_RELAXED(arena->min_waste))
+        return;
+
+    // if someone else is already iterating (or migrating) we will try again later
+    if (!MUTEX_TRYLOCK(table->iterator_lock))
+        return;
+    ht_arena_compact(table);
+    MUTEX_UNLOCK(table->iterator_lock);
+}
+
+static void
+ht_arena_destroy(ht_arena_t *arena)
+{
+    int i;
+    for (i = 0; i < HT_SLAB_SHARDS; i++) {
+        ht_arena_chunk_t *chunk = arena->shards[i].chunks;
+        while (chunk) {
+            ht_arena_chunk_t *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        SPIN_DESTROY(arena->shards[i].lock);
+    }
+    free(arena);
+}
+
+int
+ht_set_intern_pool(hashtable_t *table, ht_intern_pool_t *pool)
+{
+    if (table->image || table->arena || table->intern_pool || ht_count(table))
+        return -1;
+
+    size_t i;
+    for (i = 0; i < table->nshards; i++) {
+        if (ht_set_intern_pool(table->shards[i], pool) != 0) {
+            while (i--)
+                table->shards[i]->intern_pool = NULL;
+            return -1;
+        }
+    }
+
+    table->intern_pool = pool;
+    return 0;
+}
+
+// NOTE : the bucket list must be locked,
+//        the caller is responsible for releasing the item
+static inline void
+ht_item_unlink(hashtable_t *table, ht_items_list_t *list, ht_item_t *item)
+{
+    HT_LIST_REMOVE(list, item);
+    ht_bloom_remove(table, item->hash);
+    ht_cache_unlink(table, item);
+    ht_timer_cancel(table, item);
+    ATOMIC_DECREMENT(table->count);
+    if (table->image)
+        ht_image_unshadow(table, item);
+}
+
+// NOTE : the item is not linked to any list yet
+static ht_item_t *
+ht_item_create(hashtable_t *table, uint64_t hash, void *key, size_t klen, void *data, size_t dlen, int copy)
+{
+    ht_item_t *item = (ht_item_t *)ht_slab_alloc(&table->item_slab);
+    if (!item)
+        return NULL;
+
+    memset(item, 0, table->cache ? sizeof(ht_cache_item_t) : sizeof(ht_item_t));
+    item->hash = hash;
+    item->klen = klen;
+
+    if (klen > sizeof(item->kbuf)) {
+        item->key = ht_key_store(table, key, klen);
+        if (!item->key) {
+            ht_slab_free(&table->item_slab, item);
+            return NULL;
+        }
+    } else {
+        item->key = item->kbuf;
+        memcpy(item->key, key, klen);
+    }
+
+    if (copy) {
+        if (dlen) {
+            item->data = malloc(dlen);
+            if (!item->data) {
+                ht_item_destroy(table, item);
+                return NULL;
+            }
+            memcpy(item->data, data, dlen);
+        } else {
+            item->data = NULL;
+        }
+    } else {
+        item->data = data;
+    }
+    item->dlen = dlen;
+
+    return item;
+}
+
+// NOTE : the bucket list must be locked
+static inline void
+ht_item_link(hashtable_t *table, ht_items_list_t *list, ht_item_t *item)
+{
+    // the key must be in the filter before lockless readers can find it
+    ht_bloom_add(table, item->hash);
+    HT_LIST_INSERT_TAIL(list, item);
+    ATOMIC_INCREMENT(table->count);
+    if (table->cache)
+        ht_cache_link(table, item);
+    if (table->image)
+        ht_image_shadow(table, item);
+}
+
+// release an item which has been unlinked because it expired
+// NOTE : no bucket list must be locked
+static inline void
+ht_item_release(hashtable_t *table, ht_item_t *item)
+{
+    ht_item_value_release(table, item);
+    ht_retire(table, item, ht_item_destroy);
+}
+
+static inline uint64_t
+ht_random_seed()
+{
+#ifdef BSD
+    return ((uint64_t)arc4random() << 32) ^ arc4random();
+#else
+    return ((uint64_t)random() << 32) ^ random();
+#endif
+}
+
+/*
+ * Intern pool
+ *
+ * Keys shared by multiple tables (see ht_set_intern_pool()) are stored
+ * only once, with a reference count, in a pool split in HT_INTERN_SHARDS
+ * shards (selected by the high bits of the hash of the key), each one with
+ * its own lock and bucket array.
+ */
+#define HT_INTERN_SHARDS 16
+#define HT_INTERN_SHARD_BITS 4
+#define HT_INTERN_SIZE_MIN 64
+
+typedef struct _ht_interned {
+    struct _ht_interned *next;
+    uint64_t hash;
+    size_t refcnt;
+    size_t klen;
+    char key[] __attribute__((aligned(16))); // always NUL terminated
+} ht_interned_t;
+
+typedef struct _ht_intern_shard {
+#ifdef THREAD_SAFE
+#ifdef __MACH__
+    OSSpinLock lock;
+#else
+    pthread_spinlock_t lock;
+#endif
+#endif
+    ht_interned_t **buckets;
+    size_t size;
+    size_t count;
+} __attribute__((aligned(64))) ht_intern_shard_t;
+
+struct _ht_intern_pool_s {
+    ht_intern_shard_t shards[HT_INTERN_SHARDS];
+    uint64_t seed;
+};
+
+#define HT_INTERN_SHARD(_pool, _hash) \
+    (&(_pool)->shards[(_hash) >> (64 - HT_INTERN_SHARD_BITS)])
+
+ht_intern_pool_t *
+ht_intern_pool_create()
+{
+    ht_intern_pool_t *pool = NULL;
+    if (posix_memalign((void **)&pool, 64, sizeof(ht_intern_pool_t)) != 0)
+        return NULL;
+    memset(pool, 0, sizeof(ht_intern_pool_t));
+
+    int i;
+    for (i = 0; i < HT_INTERN_SHARDS; i++) {
+        ht_intern_shard_t *shard = &pool->shards[i];
+        shard->buckets = calloc(HT_INTERN_SIZE_MIN, sizeof(ht_interned_t *));
+        if (!shard->buckets) {
+            while (i--)
+                free(pool->shards[i].buckets);
+            free(pool);
+            return NULL;
+        }
+        shard->size = HT_INTERN_SIZE_MIN;
+        SPIN_INIT(shard->lock);
+    }
+    pool->seed = ht_random_seed();
+
+    return pool;
+}
+
+void
+ht_intern_pool_destroy(ht_intern_pool_t *pool)
+{
+    int i;
+    for (i = 0; i < HT_INTERN_SHARDS; i++) {
+        ht_intern_shard_t *shard = &pool->shards[i];
+        size_t j;
+        for (j = 0; j < shard->size; j++) {
+            ht_interned_t *entry = shard->buckets[j];
+            while (entry) {
+                ht_interned_t *next = entry->next;
+                free(entry);
+                entry = next;
+            }
+        }
+        free(shard->buckets);
+        SPIN_DESTROY(shard->lock);
+    }
+    free(pool);
+}
+
+// NOTE : the shard lock must be held
+static void
+ht_intern_grow(ht_intern_shard_t *shard)
+{
+    size_t size = shard->size << 1;
+    ht_interned_t **buckets = calloc(size, sizeof(ht_interned_t *));
+    if (!buckets)
+        return; // chains will just get longer
+
+    size_t i;
+    for (i = 0; i < shard->size; i++) {
+        ht_interned_t *entry = shard->buckets[i];
+        while (entry) {
+            ht_interned_t *next = entry->next;
+            size_t index = HT_BUCKET_INDEX(entry->hash, size);
+            entry->next = buckets[index];
+            buckets[index] = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->size = size;
+}
+
+const void *
+ht_intern(ht_intern_pool_t *pool, const void *key, size_t klen)
+{
+    uint64_t hash = ht_hash_wyhash(key, klen, pool->seed);
+    ht_intern_shard_t *shard = HT_INTERN_SHARD(pool, hash);
+
+    SPIN_LOCK(shard->lock);
+    ht_interned_t *entry = shard->buckets[HT_BUCKET_INDEX(hash, shard->size)];
+    while (entry) {
+        if (entry->hash == hash && HT_KEY_EQUALS(entry->key, entry->klen, key, klen))
+            break;
+        entry = entry->next;
+    }
+
+    if (entry) {
+        entry->refcnt++;
+    } else {
+        entry = malloc(sizeof(ht_interned_t) + klen + 1);
+        if (!entry) {
+            SPIN_UNLOCK(shard->lock);
+            return NULL;
+        }
+        entry->hash = hash;
+        entry->refcnt = 1;
+        entry->klen = klen;
+        memcpy(entry->key, key, klen);
+        entry->key[klen] = 0;
+
+        if (++shard->count > shard->size)
+            ht_intern_grow(shard);
+        size_t index = HT_BUCKET_INDEX(hash, shard->size);
+        entry->next = shard->buckets[index];
+        shard->buckets[index] = entry;
+    }
+    SPIN_UNLOCK(shard->lock);
+
+    return entry->key;
+}
+
+void
+ht_intern_release(ht_intern_pool_t *pool, const void *key)
+{
+    ht_interned_t *entry = (ht_interned_t *)((char *)key - offsetof(ht_interned_t, key));
+    ht_intern_shard_t *shard = HT_INTERN_SHARD(pool, entry->hash);
+
+    SPIN_LOCK(shard->lock);
+    if (--entry->refcnt) {
+        SPIN_UNLOCK(shard->lock);
+        return;
+    }
+    ht_interned_t **prev = &shard->buckets[HT_BUCKET_INDEX(entry->hash, shard->size)];
+    while (*prev != entry)
+        prev = &(*prev)->next;
+    *prev = entry->next;
+    shard->count--;
+    SPIN_UNLOCK(shard->lock);
+
+    free(entry);
+}
+
+size_t
+ht_intern_count(ht_intern_pool_t *pool)
+{
+    size_t count = 0;
+    int i;
+    for (i = 0; i < HT_INTERN_SHARDS; i++) {
+        SPIN_LOCK(pool->shards[i].lock);
+        count += pool->shards[i].count;
+        SPIN_UNLOCK(pool->shards[i].lock);
+    }
+    return count;
+}
+
+hashtable_t *
+ht_create(size_t initial_size, size_t max_size, ht_free_item_callback_t cb)
+{
+    hashtable_t *table = (hashtable_t *)calloc(1, sizeof(hashtable_t));
+
+    if (table && ht_init(table, initial_size, max_size, cb) != 0) {
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+hashtable_t *
+ht_create_flat(size_t initial_size, size_t max_size, ht_free_item_callback_t cb)
+{
+    hashtable_t *table = (hashtable_t *)calloc(1, sizeof(hashtable_t));
+    if (!table)
+        return NULL;
+
+    ht_slabs_init(table);
+
+    if (ht_flat_init(table, initial_size) != 0) {
+        ht_slabs_destroy(table);
+        free(table);
+        return NULL;
+    }
+
+    table->size = table->flat->capacity;
+    table->max_size = max_size;
+    table->seed = ht_random_seed();
+    table->hash_cb = ht_hash_wyhash;
+    ht_set_free_item_callback(table, cb);
+    ht_reclaim_init(&table->reclaim);
+
+    return table;
+}
+
+hashtable_t *
+ht_create_sharded(size_t nshards, size_t initial_size, size_t max_size, ht_free_item_callback_t cb)
+{
+    if (nshards < 2)
+        return ht_create(initial_size, max_size, cb);
+
+    int bits = 1;
+    while ((1ULL << bits) < nshards && bits < 16)
+        bits++;
+    nshards = 1ULL << bits;
+
+    // the front table only routes the operations to the shards,
+    // none of the other fields is ever used
+    hashtable_t *table = (hashtable_t *)calloc(1, sizeof(hashtable_t));
+    if (!table)
+        return NULL;
+
+    table->shards = calloc(nshards, sizeof(hashtable_t *));
+    if (!table->shards) {
+        free(table);
+        return NULL;
+    }
+    table->nshards = nshards;
+    table->shard_shift = 64 - bits;
+    table->seed = ht_random_seed();
+    table->hash_cb = ht_hash_wyhash;
+    table->free_item_cb = cb;
+
+    size_t i;
+    for (i = 0; i < nshards; i++) {
+        hashtable_t *shard = ht_create(initial_size / nshards,
+                                       max_size ? (max_size + nshards - 1) / nshards : 0,
+                                       cb);
+        if (!shard) {
+            ht_destroy(table);
+            return NULL;
+        }
+        // the shards must agree with the front table on the hash of the keys
+        shard->seed = table->seed;
+        shard->hash_cb = table->hash_cb;
+        table->shards[i] = shard;
+    }
+
+    return table;
+}
+
+hashtable_t *
+ht_create_cache(size_t max_items, size_t max_bytes, ht_cache_policy_t policy)
+{
+    // the bucket array is sized for max_items upfront (up to a point),
+    // the table will still grow if needed
+    size_t initial_size = max_items < HT_CACHE_INITIAL_SIZE_MAX ? max_items : HT_CACHE_INITIAL_SIZE_MAX;
+    hashtable_t *table = ht_create(initial_size, 0, NULL);
+    if (!table)
+        return NULL;
+
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, sizeof(ht_cache_shard_t), sizeof(ht_cache_t)) != 0) {
+        ht_destroy(table);
+        return NULL;
+    }
+
+    ht_cache_t *cache = (ht_cache_t *)ptr;
+    memset(cache, 0, sizeof(ht_cache_t));
+    cache->policy = policy;
+    cache->max_items = max_items;
+    cache->max_bytes = max_bytes;
+
+    int i;
+    for (i = 0; i < HT_CACHE_SHARDS; i++) {
+        SPIN_INIT(cache->shards[i].lock);
+        TAILQ_INIT(&cache->shards[i].probation);
+        TAILQ_INIT(&cache->shards[i].protected);
+    }
+
+    // items of a cache table carry the eviction state
+    ht_slab_destroy(&table->item_slab);
+    ht_slab_init(&table->item_slab, sizeof(ht_cache_item_t));
+
+    table->cache = cache;
+    return table;
+}
+
+void
+ht_cache_set_eviction_callback(hashtable_t *table, ht_free_item_callback_t cb)
+{
+    if (table->cache)
+        ATOMIC_SET(table->cache->evict_cb, cb);
+}
+
+size_t
+ht_cache_bytes(hashtable_t *table)
+{
+    return table->cache ? ATOMIC_READ(table->cache->bytes) : 0;
+}
+
+int
+ht_init(hashtable_t *table,
+        size_t initial_size,
+        size_t max_size,
+        ht_free_item_callback_t cb)
+{
+    // the bucket arrays are always sized as a power of two, so that
+    // growing the table splits each bucket in exactly two (see ht_scan())
+    table->size = HT_SIZE_MIN;
+    while (table->size < initial_size)
+        table->size <<= 1;
+    table->max_size = max_size;
+    table->buckets = ht_buckets_create(table->size);
+    if (!table->buckets)
+        return -1;
+
+    ht_set_free_item_callback(table, cb);
+    table->seed = ht_random_seed();
+    table->hash_cb = ht_hash_wyhash;
+    table->iterator_list = calloc(1, sizeof(ht_iterator_list_t));
+    if (!table->iterator_list) {
+        free(table->buckets);
+        return -1;
+    }
+    TAILQ_INIT(&table->iterator_list->head);
+    TAILQ_INIT(&table->retired_lists.head);
+    TAILQ_INIT(&table->reserved_lists.head);
+    table->nreserved = 0;
+    table->cache = NULL;
+    table->wheel = NULL;
+    table->image = NULL;
+    table->flat = NULL;
+    table->bloom = NULL;
+    table->bloom_next = NULL;
+    table->arena = NULL;
+    table->intern_pool = NULL;
+    table->deferred_free = 0;
+    ht_slabs_init(table);
+
+    MUTEX_INIT(table->iterator_lock);
+    ht_reclaim_init(&table->reclaim);
+
+    return 0;
+}
+
+void
+ht_set_free_item_callback(hashtable_t *table, ht_free_item_callback_t cb)
+{
+    size_t i;
+    for (i = 0; i < table->nshards; i++)
+        ht_set_free_item_callback(table->shards[i], cb);
+
+    ATOMIC_SET(table->free_item_cb, cb);
+}
+
+void
+ht_set_deferred_free(hashtable_t *table, int deferred)
+{
+    size_t i;
+    for (i = 0; i < table->nshards; i++)
+        ht_set_deferred_free(table->shards[i], deferred);
+
+    ATOMIC_SET(table->deferred_free, deferred ? 1 : 0);
+}
+
+int
+ht_set_hash_function(hashtable_t *table, ht_hash_callback_t cb)
+{
+    // keys already stored would be looked up in the wrong bucket
+    // (and the ones in an image have been hashed already)
+    if (table->image || ht_count(table))
+        return -1;
+
+    size_t i;
+    for (i = 0; i < table->nshards; i++)
+        ht_set_hash_function(table->shards[i], cb);
+
+    ATOMIC_SET(table->hash_cb, cb ? cb : ht_hash_wyhash);
+    return 0;
+}
+
+static void
+ht_clear_internal(hashtable_t *table, int release_values)
+{
+    if (table->shards) {
+        size_t i;
+        for (i = 0; i < table->nshards; i++)
+            ht_clear_internal(table->shards[i], release_values);
+        return;
+    }
+
+    if (table->flat) {
+        ht_flat_clear(table, release_values);
+        return;
+    }
+
+    // the keys of the image can't be removed one by one,
+    // the whole image is not part of the table anymore
+    if (table->image)
+        ATOMIC_SET(table->image->hidden, 1);
+
+    // NOTE: the lists and the bucket arrays are kept, so lookups running
+    //       concurrently (and an ongoing migration) are not affected
+    MUTEX_LOCK(table->iterator_lock);
+
+    ht_items_list_t *list = NULL;
+    TAILQ_FOREACH(list, &table->iterator_list->head, iterator_next) {
+        HT_LIST_LOCK(table, list);
+
+        ht_item_t *item = NULL;
+        ht_item_t *tmp;
+
+        TAILQ_FOREACH_SAFE(item, &list->head, next, tmp) {
+            ht_item_unlink(table, list, item);
+            if (release_values)
+                ht_item_value_release(table, item);
+            ht_retire(table, item, ht_item_destroy);
+        }
+
+        HT_LIST_UNLOCK(list);
+    }
+
+    MUTEX_UNLOCK(table->iterator_lock);
+
+    if (table->image) {
+        ht_clear(table->image->deleted);
+        ATOMIC_SET(table->image->shadowed, 0);
+    }
+}
+
+void
+ht_clear(hashtable_t *table)
+{
+    ht_clear_internal(table, 1);
+}
+
+void
+ht_destroy(hashtable_t *table)
+{
+    if (table->shards) {
+        size_t i;
+        for (i = 0; i < table->nshards; i++) {
+            if (table->shards[i])
+                ht_destroy(table->shards[i]);
+        }
+        free(table->shards);
+        free(table);
+        return;
+    }
+
+    if (table->flat) {
+        ht_flat_destroy(table);
+        // values might have been retired if frees were deferred
+        ht_reclaim_destroy(&table->reclaim, table);
+        ht_slabs_destroy(table);
+        free(table);
+        return;
+    }
+
+    ht_clear(table);
+
+    // nobody can be accessing the table anymore,
+    // so everything can be released right away
+    ht_items_list_t *tmp, *list = NULL;
+    TAILQ_FOREACH_SAFE(list, &table->iterator_list->head, iterator_next, tmp) {
+        TAILQ_REMOVE(&table->iterator_list->head, list, iterator_next);
+        ht_list_destroy(table, list);
+    }
+    TAILQ_FOREACH_SAFE(list, &table->retired_lists.head, iterator_next, tmp) {
+        TAILQ_REMOVE(&table->retired_lists.head, list, iterator_next);
+        ht_list_destroy(table, list);
+    }
+    ht_release_reserved_lists(table);
+
+    ht_buckets_t *buckets = table->buckets;
+    while (buckets) {
+        ht_buckets_t *next = buckets->next;
+        free(buckets);
+        buckets = next;
+    }
+
+    // all the timers have been cancelled by ht_clear()
+    if (table->wheel) {
+        MUTEX_DESTROY(table->wheel->lock);
+        free(table->wheel);
+    }
+
+    if (table->image)
+        ht_image_close(table->image);
+
+    ht_reclaim_destroy(&table->reclaim, table);
+
+    // all the keys have been released by now
+    if (table->arena)
+        ht_arena_destroy(table->arena);
+
+    if (table->bloom)
+        bloom_destroy(table->bloom);
+    if (table->bloom_next)
+        bloom_destroy(table->bloom_next);
+
+    ht_slabs_destroy(table);
+
+    if (table->cache) {
+        int i;
+        for (i = 0; i < HT_CACHE_SHARDS; i++)
+            SPIN_DESTROY(table->cache->shards[i].lock);
+        free(table->cache);
+    }
+
+    MUTEX_DESTROY(table->iterator_lock);
+    free(table->iterator_list);
+    free(table);
+}
+
+// NOTE : the iterator lock must be held
+static inline int
+ht_migrate_bucket(hashtable_t *table, ht_buckets_t *old_buckets, size_t index)
+{
+    ht_buckets_t *new_buckets = old_buckets->next;
+    ht_items_list_t *list = old_buckets->lists[index];
+
+    // NOTE : new buckets can be created only while holding the iterator lock,
+    //        so nobody can install a new list in this slot in the meanwhile
+    if (!list) {
+        ATOMIC_SET(old_buckets->lists[index], HT_BUCKET_MOVED);
+        return 0;
+    }
+
+    HT_LIST_LOCK(table, list);
+
+    // NOTE : if the migration has to be retried the keys will be added
+    //        again, which is harmless (even for a counting filter)
+    ht_item_t *item = NULL;
+    if (table->bloom_next) {
+        TAILQ_FOREACH(item, &list->head, next)
+            bloom_add_hash(table->bloom_next, item->hash);
+    }
+
+    // make sure all the destination lists exist before moving anything,
+    // so that a failed allocation leaves the bucket untouched and the
+    // migration can simply be retried later
+    TAILQ_FOREACH(item, &list->head, next) {
+        size_t new_index = HT_BUCKET_INDEX(item->hash, new_buckets->size);
+        if (new_index == index || new_buckets->lists[new_index])
+            continue;
+        ht_items_list_t *new_list = ht_take_reserved_list(table, new_index);
+        if (!new_list) {
+            HT_LIST_UNLOCK(list);
+            return -1;
+        }
+        ATOMIC_SET(new_buckets->lists[new_index], new_list);
+        TAILQ_INSERT_TAIL(&table->iterator_list->head, new_list, iterator_next);
+    }
+
+    // when the new slot with the same index is still free (which is always
+    // the case when doubling the size) the old list is reused in place,
+    // otherwise it will be released once the whole table has been migrated
+    int reuse = (new_buckets->lists[index] == NULL);
+
+    ht_item_t *tmp;
+    TAILQ_FOREACH_SAFE(item, &list->head, next, tmp) {
+        size_t new_index = HT_BUCKET_INDEX(item->hash, new_buckets->size);
+        if (reuse && new_index == index)
+            continue;
+        ht_items_list_t *new_list = new_buckets->lists[new_index];
+        HT_LIST_REMOVE(list, item);
+        HT_LIST_LOCK(table, new_list);
+        HT_LIST_INSERT_TAIL(new_list, item);
+        HT_LIST_UNLOCK(new_list);
+    }
+
+    if (reuse) {
+        list->index = index;
+        ATOMIC_SET(new_buckets->lists[index], list);
+    } else {
+        TAILQ_REMOVE(&table->iterator_list->head, list, iterator_next);
+        TAILQ_INSERT_TAIL(&table->retired_lists.head, list, iterator_next);
+    }
+
+    // readers which already obtained the list from the old slot will notice
+    // the change (either getting the lock or validating the sequence counter)
+    // and will look it up again
+    ATOMIC_SET(old_buckets->lists[index], HT_BUCKET_MOVED);
+
+    HT_LIST_UNLOCK(list);
+    return 0;
+}
+
+// NOTE : the iterator lock must be held
+static inline void
+ht_grow_complete(hashtable_t *table)
+{
+    ht_buckets_t *old_buckets = table->buckets;
+
+    // all the slots in the old array are now marked as moved, so readers
+    // which still see it will follow the link to the new one. The old array
+    // and the lists which have not been reused can be released as soon as
+    // all of them are done
+    ATOMIC_STORE_RELEASE(table->buckets, old_buckets->next);
+    ATOMIC_CAS(table->growing, 1, 0);
+
+    // all the keys are now in the new filter as well
+    // NOTE : it must become the current one before it's not
+    //        the new one anymore (see ht_bloom_add())
+    bloom_filter_t *bloom = table->bloom_next;
+    if (bloom) {
+        bloom_filter_t *old_bloom = table->bloom;
+        ATOMIC_STORE_RELEASE(table->bloom, bloom);
+        ATOMIC_STORE_RELEASE(table->bloom_next, NULL);
+        ht_retire(table, old_bloom, ht_bloom_release);
+    }
+
+    ht_items_list_t *tmp, *list = NULL;
+    TAILQ_FOREACH_SAFE(list, &table->retired_lists.head, iterator_next, tmp) {
+        TAILQ_REMOVE(&table->retired_lists.head, list, iterator_next);
+        ht_retire(table, list, ht_list_release);
+    }
+    ht_release_reserved_lists(table);
+
+    ht_retire(table, old_buckets, ht_buckets_release);
+
+    //fprintf(stderr, "Done growing table\n");
+}
+
+// NOTE : the iterator lock must be held
+static size_t
+ht_migrate_buckets(hashtable_t *table, size_t max_buckets)
+{
+    ht_buckets_t *old_buckets = table->buckets;
+    if (!old_buckets->next)
+        return 0;
+
+#ifndef HT_NO_STATS
+    uint64_t start = ht_now_ns();
+#endif
+    size_t i;
+    for (i = 0; i < max_buckets && old_buckets->migrate_index < old_buckets->size; i++) {
+        if (ht_migrate_bucket(table, old_buckets, old_buckets->migrate_index) != 0)
+            break;
+        old_buckets->migrate_index++;
+    }
+
+    size_t left = old_buckets->size - old_buckets->migrate_index;
+    if (!left) {
+        ht_grow_complete(table);
+        table->grows++;
+    }
+#ifndef HT_NO_STATS
+    table->grow_time_ns += ht_now_ns() - start;
+#endif
+
+    return left;
+}
+
+size_t
+ht_grow_step(hashtable_t *table, size_t max_buckets)
+{
+    if (table->shards) {
+        size_t i, left = 0;
+        for (i = 0; i < table->nshards; i++)
+            left += ht_grow_step(table->shards[i], max_buckets);
+        return left;
+    }
+
+    if (!ATOMIC_READ(table->growing))
+        return 0;
+
+    // if someone else is already migrating (or iterating) let's just
+    // go ahead, the migration will progress on the next operation
+    if (!MUTEX_TRYLOCK(table->iterator_lock))
+        return 1;
+
+    size_t left = ht_migrate_buckets(table, max_buckets);
+
+    MUTEX_UNLOCK(table->iterator_lock);
+    return left;
+}
+
+// start doubling the size of the table
+// NOTE : the iterator lock must be held
+static int
+ht_grow_start(hashtable_t *table)
+{
+    // extra check if the table has been already updated by another thread in the meanwhile
+    size_t size = table->buckets->size;
+    if (table->buckets->next || (table->max_size && (size << 1) > table->max_size))
+        return -1;
+
+    // NOTE : the size is doubled (or not changed at all if that would
+    //        exceed max_size), so that it always stays a power of two
+    size_t new_size = size << 1;
+
+    // NOTE : the new array is only linked here, items will be
+    //        moved incrementally by ht_grow_step()
+    ht_buckets_t *new_buckets = ht_buckets_create(new_size);
+    if (!new_buckets)
+        return -1;
+
+    // set aside all the lists the migration might need, if we can't
+    // get them now we will try growing again later
+    // (only the upper half of the new buckets needs new lists)
+    size_t count = ATOMIC_READ(table->count);
+    if (ht_reserve_lists(table, count < size ? count : size) != 0) {
+        ht_release_reserved_lists(table);
+        free(new_buckets);
+        return -1;
+    }
+
+    // keys stored from now on are added to the new filter as well,
+    // the ones already in the table as their bucket is migrated
+    // (if it can't be created we just keep using the old one)
+    if (table->bloom)
+        ATOMIC_STORE_RELEASE(table->bloom_next, ht_bloom_create(table, new_size));
+    ATOMIC_SET(table->buckets->next, new_buckets);
+    ATOMIC_SET(table->size, new_size);
+    ATOMIC_SET(table->growing, 1);
+
+    return 0;
+}
+
+static inline void
+ht_grow_table(hashtable_t *table)
+{
+    if (ATOMIC_READ(table->growing)) {
+        ht_grow_step(table, HT_GROW_STEP);
+        return;
+    }
+
+    // if we are not able to get the lock now, let's return.
+    // ht_grow_table() will be called again next time a new key has been set
+    if (!MUTEX_TRYLOCK(table->iterator_lock))
+        return;
+
+    ht_grow_start(table);
+
+    MUTEX_UNLOCK(table->iterator_lock);
+}
+
+// lets the readers help migrating the table they looked into
+// NOTE : only the shards grow, the front table of a sharded
+//        table is never flagged as growing
+static inline void
+ht_grow_help(hashtable_t *table, uint64_t hash)
+{
+    if (table->shards)
+        table = HT_SHARD(table, hash);
+
+    if (ATOMIC_READ(table->growing))
+        ht_grow_step(table, HT_GROW_STEP);
+}
+
+static inline ht_items_list_t *
+ht_get_list(hashtable_t *table, uint64_t hash)
+{
+    // the bucket arrays can't be released while we are walking them
+    ht_epoch_enter();
+
+    ht_buckets_t *buckets = ATOMIC_READ_ACQUIRE(table->buckets);
+    ht_items_list_t *list = NULL;
+    for (;;) {
+        size_t index = HT_BUCKET_INDEX(hash, buckets->size);
+        list = ATOMIC_READ_ACQUIRE(buckets->lists[index]);
+        if (list == HT_BUCKET_MOVED) {
+            buckets = ATOMIC_READ_ACQUIRE(buckets->next);
+            continue;
+        }
+
+        if (!list)
+            break;
+
+        HT_LIST_LOCK(table, list);
+
+        // the bucket might have been migrated while we were waiting for the lock
+        if (ATOMIC_READ_ACQUIRE(buckets->lists[index]) == list)
+            break;
+
+        HT_LIST_UNLOCK(list);
+    }
+
+    // NOTE: a locked list can't be migrated (and hence released)
+    ht_epoch_exit();
+
+    // NOTE: the returned list is already locked
+    return list;
+}
+
+/*
+ * Lockless lookup, used by ht_get() and ht_exists().
+ * The list is traversed without taking its lock, relying on the sequence
+ * counter to detect concurrent modifications (in which case the lookup is
+ * retried) and on the epoch based reclamation to ensure that nothing we
+ * are looking at can be released in the meanwhile.
+ * Keys missing from the overlay of a mapped table are then looked up in the
+ * image, unless overlay_only is set (in which case any item matching the key
+ * is reported, even if expired)
+ */
+static inline int
+ht_lookup_internal(hashtable_t *table, uint64_t hash, void *key, size_t klen,
+                   void **data, size_t *dlen, int overlay_only)
+{
+    int found = 0;
+    uint64_t now = 0;
+
+    if (table->shards)
+        table = HT_SHARD(table, hash);
+
+    // definite misses don't need to look at the buckets at all
+    if (!ht_bloom_test(table, hash))
+        return 0;
+
+    ht_epoch_enter();
+
+    for (;;) {
+        ht_buckets_t *buckets = ATOMIC_READ_ACQUIRE(table->buckets);
+        size_t index = HT_BUCKET_INDEX(hash, buckets->size);
+        ht_items_list_t *list = ATOMIC_READ_ACQUIRE(buckets->lists[index]);
+        while (list == HT_BUCKET_MOVED) {
+            buckets = ATOMIC_READ_ACQUIRE(buckets->next);
+            index = HT_BUCKET_INDEX(hash, buckets->size);
+            list = ATOMIC_READ_ACQUIRE(buckets->lists[index]);
+        }
+
+        void *value = NULL;
+        size_t vlen = 0;
+
+        found = 0;
+        if (!list) {
+            if (!table->image || overlay_only)
+                break;
+            // keys of the image are only deleted (or shadowed) with their
+            // bucket list locked, so nothing changed if there is still no list
+            found = ht_image_visible(table, hash, key, klen, &value, &vlen);
+            if (ATOMIC_READ_ACQUIRE(buckets->lists[index]) != NULL)
+                continue;
+            if (found) {
+                if (data)
+                    *data = value;
+                if (dlen)
+                    *dlen = vlen;
+            }
+            break;
+        }
+
+        uint32_t seq = ATOMIC_READ_ACQUIRE(list->seq);
+        if (seq & 1) {
+            HT_STATS_INCREMENT(table, lookup_retries);
+            continue;
+        }
+
+        int matched = 0;
+        int hops = 0;
+        ht_item_t *item = ATOMIC_READ_ACQUIRE(TAILQ_FIRST(&list->head));
+        while (item) {
+            if (item->hash == hash && HT_KEY_EQUALS(item->key, item->klen, key, klen)) {
+                value = ATOMIC_READ_RELAXED(item->data);
+                vlen = ATOMIC_READ_RELAXED(item->dlen);
+                matched = 1;
+                // expired items are not visible anymore,
+                // even if they haven't been removed yet
+                found = overlay_only || !ht_item_expired(item, &now);
+                break;
+            }
+            // items might have been moved to a different list in the meanwhile,
+            // don't keep following them if the list has been modified
+            if (++hops % 16 == 0 && ATOMIC_READ_ACQUIRE(list->seq) != seq)
+                break;
+            item = ATOMIC_READ_ACQUIRE(TAILQ_NEXT(item, next));
+        }
+
+        if (!matched && table->image && !overlay_only)
+            found = ht_image_visible(table, hash, key, klen, &value, &vlen);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (ATOMIC_READ_RELAXED(list->seq) == seq &&
+            ATOMIC_READ_RELAXED(buckets->lists[index]) == list)
+        {
+            if (found) {
+                if (data)
+                    *data = value;
+                if (dlen)
+                    *dlen = vlen;
+                // a plain store (and only if needed) is all a cache hit costs
+                if (table->cache && !ATOMIC_READ_RELAXED(((ht_cache_item_t *)item)->referenced))
+                    ATOMIC_STORE_RELAXED(((ht_cache_item_t *)item)->referenced, 1);
+            }
+            break;
+        }
+        HT_STATS_INCREMENT(table, lookup_retries);
+    }
+
+    ht_epoch_exit();
+
+    return found;
+}
+
+static inline int
+ht_lookup(hashtable_t *table, uint64_t hash, void *key, size_t klen, void **data, size_t *dlen)
+{
+    return ht_lookup_internal(table, hash, key, klen, data, dlen, 0);
+}
+
+// NOTE : the shard lock must be held
+static ht_cache_item_t *
+ht_cache_victim(ht_cache_t *cache, ht_cache_shard_t *shard)
+{
+    ht_cache_item_t *citem = NULL;
+    size_t scanned = 0;
+
+    // don't keep going around if hits keep marking items as referenced
+    while ((citem = TAILQ_FIRST(&shard->probation)) && scanned++ < 2 * shard->count) {
+        if (!ATOMIC_READ_RELAXED(citem->referenced))
+            return citem;
+
+        ATOMIC_STORE_RELAXED(citem->referenced, 0);
+        TAILQ_REMOVE(&shard->probation, citem, cache_next);
+
+        if (cache->policy == HT_CACHE_POLICY_CLOCK) {
+            TAILQ_INSERT_TAIL(&shard->probation, citem, cache_next);
+            continue;
+        }
+
+        citem->protected = 1;
+        TAILQ_INSERT_TAIL(&shard->protected, citem, cache_next);
+        shard->nprotected++;
+
+        while (shard->nprotected > shard->count * HT_CACHE_PROTECTED_PCT / 100) {
+            // NOTE: demoted items which have been hit in the meanwhile
+            //       will be promoted again as soon as they are examined
+            ht_cache_item_t *demoted = TAILQ_FIRST(&shard->protected);
+            TAILQ_REMOVE(&shard->protected, demoted, cache_next);
+            shard->nprotected--;
+            demoted->protected = 0;
+            TAILQ_INSERT_TAIL(&shard->probation, demoted, cache_next);
+        }
+    }
+
+    return citem ? citem : TAILQ_FIRST(&shard->protected);
+}
+
+static int
+ht_cache_evict(hashtable_t *table, ht_cache_shard_t *shard)
+{
+    ht_cache_t *cache = table->cache;
+
+    // the victim can't be released (by a concurrent delete)
+    // while we are looking for it in its bucket list
+    ht_epoch_enter();
+
+    SPIN_LOCK(shard->lock);
+    ht_cache_item_t *victim = ht_cache_victim(cache, shard);
+    SPIN_UNLOCK(shard->lock);
+
+    if (!victim) {
+        ht_epoch_exit();
+        return -1;
+    }
+
+    // NOTE : bucket lists must be locked before the shards
+    int evicted = 0;
+    int inline_value = 0;
+    void *data = NULL;
+    ht_items_list_t *list = ht_get_list(table, victim->item.hash);
+    if (list) {
+        ht_item_t *item = NULL;
+        TAILQ_FOREACH(item, &list->head, next) {
+            if (item == &victim->item) {
+                ht_item_unlink(table, list, item);
+                data = item->data;
+                inline_value = HT_VALUE_INLINE(&item->data);
+                evicted = 1;
+                break;
+            }
+        }
+        HT_LIST_UNLOCK(list);
+    }
+
+    ht_epoch_exit();
+
+    // if it was not found someone else removed it in the meanwhile
+    // NOTE : numeric values are released with the item
+    if (evicted) {
+        if (inline_value)
+            data = NULL;
+        else if (!cache->evict_cb)
+            ht_value_release(table, data);
+        else if (ATOMIC_READ(table->deferred_free))
+            ht_retire(table, data, ht_cache_evicted_release);
+        else
+            cache->evict_cb(data);
+        ht_retire(table, victim, ht_item_destroy);
+    }
+
+    return 0;
+}
+
+static inline int
+ht_cache_full(hashtable_t *table)
+{
+    ht_cache_t *cache = table->cache;
+    return ((cache->max_items && ATOMIC_READ(table->count) > cache->max_items) ||
+            (cache->max_bytes && ATOMIC_READ(cache->bytes) > cache->max_bytes));
+}
+
+// evict items (starting from the shard where the new key landed)
+// until the cache is back within its limits
+static void
+ht_cache_shrink(hashtable_t *table, uint64_t hash)
+{
+    ht_cache_t *cache = table->cache;
+    int index = HT_CACHE_SHARD(hash);
+    int empty = 0;
+
+    while (empty < HT_CACHE_SHARDS && ht_cache_full(table)) {
+        if (ht_cache_evict(table, &cache->shards[index]) == 0) {
+            empty = 0;
+            continue;
+        }
+        empty++;
+        index = (index + 1) % HT_CACHE_SHARDS;
+    }
+}
+
+// same as ht_get_list() but gives up (setting *busy)
+// if the list is currently locked by someone else
+static inline ht_items_list_t *
+ht_try_get_list(hashtable_t *table, uint64_t hash, int *busy)
+{
+    *busy = 0;
+
+    ht_epoch_enter();
+
+    ht_buckets_t *buckets = ATOMIC_READ_ACQUIRE(table->buckets);
+    ht_items_list_t *list = NULL;
+    for (;;) {
+        size_t index = HT_BUCKET_INDEX(hash, buckets->size);
+        list = ATOMIC_READ_ACQUIRE(buckets->lists[index]);
+        if (list == HT_BUCKET_MOVED) {
+            buckets = ATOMIC_READ_ACQUIRE(buckets->next);
+            continue;
+        }
+
+        if (!list)
+            break;
+
+        if (!SPIN_TRYLOCK(list->lock)) {
+            *busy = 1;
+            list = NULL;
+            break;
+        }
+        ATOMIC_STORE_RELAXED(list->seq, list->seq + 1);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        if (ATOMIC_READ_ACQUIRE(buckets->lists[index]) == list)
+            break;
+
+        HT_LIST_UNLOCK(list);
+    }
+
+    ht_epoch_exit();
+
+    return list;
+}
+
+/*
+ * Remove the items whose timers fired since the last run.
+ * The bucket lists are only try-locked so that the expiration can be safely
+ * triggered by any operation (even from within a callback holding a list lock),
+ * timers whose list is busy are simply rescheduled for the next tick.
+ * If wait is 0 and someone else is already expiring items, nothing is done.
+ */
+static size_t
+ht_expire_internal(hashtable_t *table, int wait)
+{
+    ht_wheel_t *wheel = ATOMIC_READ(table->wheel);
+    if (!wheel)
+        return 0;
+
+    uint64_t now = ht_now_ms();
+    if (ATOMIC_READ_RELAXED(wheel->now) >= now)
+        return 0;
+
+    if (wait) {
+        MUTEX_LOCK(wheel->lock);
+    } else if (!MUTEX_TRYLOCK(wheel->lock)) {
+        return 0;
+    }
+
+    ht_timer_list_t fired;
+    TAILQ_INIT(&fired);
+    ht_wheel_advance(wheel, now, &fired);
+    MUTEX_UNLOCK(wheel->lock);
+
+    if (TAILQ_EMPTY(&fired))
+        return 0;
+
+    ht_timer_list_t busy_timers;
+    ht_timer_list_t expired_timers;
+    TAILQ_INIT(&busy_timers);
+    TAILQ_INIT(&expired_timers);
+
+    ht_timer_t *timer, *tmp;
+    TAILQ_FOREACH_SAFE(timer, &fired, next, tmp) {
+        TAILQ_REMOVE(&fired, timer, next);
+
+        // NOTE : the item is only compared against the ones in the list,
+        //        it's never dereferenced unless found there
+        MUTEX_LOCK(wheel->lock);
+        ht_item_t *item = timer->item;
+        MUTEX_UNLOCK(wheel->lock);
+
+        if (!item) { // the timer has been cancelled in the meanwhile
+            ht_slab_free(&table->timer_slab, timer);
+            continue;
+        }
+
+        int busy = 0;
+        ht_items_list_t *list = ht_try_get_list(table, timer->hash, &busy);
+        if (busy) {
+            TAILQ_INSERT_TAIL(&busy_timers, timer, next);
+            continue;
+        }
+
+        int found = 0;
+        if (list) {
+            ht_item_t *cur = NULL;
+            TAILQ_FOREACH(cur, &list->head, next) {
+                if (cur == item) {
+                    found = (item->timer == timer);
+                    break;
+                }
+            }
+            if (found && !ht_item_expired(item, &now)) {
+                // timers far in the future fire early (at the end of the wheel)
+                // and just need to be scheduled again
+                HT_LIST_UNLOCK(list);
+                TAILQ_INSERT_TAIL(&busy_timers, timer, next);
+                continue;
+            }
+            if (found) {
+                // the timer is owned by us now, don't let the unlink cancel it
+                item->timer = NULL;
+                ht_item_unlink(table, list, item);
+            }
+            HT_LIST_UNLOCK(list);
+        }
+
+        if (found)
+            TAILQ_INSERT_TAIL(&expired_timers, timer, next);
+        else
+            ht_slab_free(&table->timer_slab, timer);
+    }
+
+    if (!TAILQ_EMPTY(&busy_timers)) {
+        MUTEX_LOCK(wheel->lock);
+        TAILQ_FOREACH_SAFE(timer, &busy_timers, next, tmp) {
+            TAILQ_REMOVE(&busy_timers, timer, next);
+            if (timer->item) {
+                timer->firing = 0;
+                ht_wheel_insert(wheel, timer, wheel->now + 1);
+                timer = NULL;
+            }
+            if (timer)
+                ht_slab_free(&table->timer_slab, timer);
+        }
+        MUTEX_UNLOCK(wheel->lock);
+    }
+
+    size_t count = 0;
+    TAILQ_FOREACH_SAFE(timer, &expired_timers, next, tmp) {
+        TAILQ_REMOVE(&expired_timers, timer, next);
+        ht_item_release(table, timer->item);
+        ht_slab_free(&table->timer_slab, timer);
+        count++;
+    }
+
+    return count;
+}
+
+size_t
+ht_expire(hashtable_t *table)
+{
+    if (table->shards) {
+        size_t i, expired = 0;
+        for (i = 0; i < table->nshards; i++)
+            expired += ht_expire(table->shards[i]);
+        return expired;
+    }
+
+    if (table->flat)
+        return 0;
+    return ht_expire_internal(table, 1);
+}
+
+static inline ht_items_list_t *
+ht_set_list(hashtable_t *table, uint64_t hash)
+{
+    ht_items_list_t *list = ht_list_create(table, 0);
+    if (!list)
+        return NULL;
+
+    // NOTE: once the iterator lock is held no other thread can create new
+    //       buckets or migrate the existing ones, and the bucket arrays can't
+    //       be released either
+    MUTEX_LOCK(table->iterator_lock);
+
+    ht_buckets_t *buckets = table->buckets;
+    size_t index = HT_BUCKET_INDEX(hash, buckets->size);
+    while (buckets->lists[index] == HT_BUCKET_MOVED) {
+        buckets = buckets->next;
+        index = HT_BUCKET_INDEX(hash, buckets->size);
+    }
+
+    if (buckets->lists[index]) {
+        // if there is a list already set at our index it means that some other
+        // thread succeded in setting a new list already, completing its job before
+        // we were able to acquire the lock.
+        // So we can release our newly created list and return the existing one
+        ht_list_destroy(table, list);
+        list = buckets->lists[index];
+        HT_LIST_LOCK(table, list);
+        MUTEX_UNLOCK(table->iterator_lock);
+        return list;
+    }
+
+    list->index = index;
+    HT_LIST_LOCK(table, list);
+    ATOMIC_SET(buckets->lists[index], list);
+    TAILQ_INSERT_TAIL(&table->iterator_list->head, list, iterator_next);
+
+    MUTEX_UNLOCK(table->iterator_lock);
+
+    // NOTE: the newly created list is already locked
+    return list;
+}
+
+// the work due once a key has been stored (and the bucket list unlocked)
+static inline void
+ht_set_complete(hashtable_t *table, uint64_t hash)
+{
+    if (table->cache)
+        ht_cache_shrink(table, hash);
+
+    if (ATOMIC_READ(table->wheel))
+        ht_expire_internal(table, 0);
+
+    size_t current_size = ATOMIC_READ(table->size);
+    if (ATOMIC_READ(table->count) > (current_size + (current_size/3)) && 
+        (!table->max_size || (current_size << 1) <= table->max_size))
+    {
+        ht_grow_table(table);
+    } else if (ATOMIC_READ(table->growing)) {
+        ht_grow_step(table, HT_GROW_STEP);
+    }
+}
+
+static inline int
+ht_set_hashed(hashtable_t *table,
+              uint64_t hash,
+              void *key,
+              size_t klen,
+              void *data,
+              size_t dlen,
+              void **prev_data,
+              size_t *prev_len,
+              int copy,
+              int inx,
+              int64_t ttl)
+{
+    void *prev = NULL;
+    size_t plen = 0;
+    int prev_inline = 0;
+    uint64_t now = 0;
+    ht_item_t *expired = NULL;
+
+    if (table->shards)
+        table = HT_SHARD(table, hash);
+
+    if (!klen)
+        return -1;
+
+    // a single item can't exceed the budget of the whole cache
+    if (table->cache && table->cache->max_bytes &&
+        sizeof(ht_cache_item_t) + klen + dlen > table->cache->max_bytes)
+    {
+        return -1;
+    }
+
+    if (table->flat)
+        return ht_flat_set(table, hash, key, klen, data, dlen, prev_data, prev_len, copy, inx);
+
+    // let's first try checking if we fall in an existing bucket list
+    ht_items_list_t *list  = ht_get_list(table, hash);
+
+    if (!list) // if not, let's create a new bucket list
+        list = ht_set_list(table, hash);
+
+    if (!list)
+        return -1;
+
+    ht_item_t *item = NULL;
+    ht_item_t *cur = NULL;
+    TAILQ_FOREACH(cur, &list->head, next) {
+        if (/*ht_item->hash == arg->item.hash && */
+            HT_KEY_EQUALS(cur->key, cur->klen, key, klen))
+        {
+            if (ht_item_expired(cur, &now)) {
+                // an expired item is replaced as if it wasn't there
+                ht_item_unlink(table, list, cur);
+                expired = cur;
+                break;
+            }
+            item = cur;
+            prev = item->data;
+            plen = item->dlen;
+            prev_inline = HT_VALUE_INLINE(&item->data);
+            break;
+        }
+    }
+
+    // keys found in the image are shadowed by the new item in the overlay
+    void *image_prev = NULL;
+    size_t image_plen = 0;
+    if (!item && table->image &&
+        ht_image_visible(table, hash, key, klen, &image_prev, &image_plen) && inx)
+    {
+        if (prev_data)
+            *prev_data = image_prev;
+        if (prev_len)
+            *prev_len = image_plen;
+        HT_LIST_UNLOCK(list);
+        return 1;
+    }
+
+    if (ttl > 0 && !now)
+        now = ht_now_ms();
+
+    if (!item) {
+        item = ht_item_create(table, hash, key, klen, data, dlen, copy);
+        if (!item) {
+            //fprintf(stderr, "Can't create new item: %s\n", strerror(errno));
+            HT_LIST_UNLOCK(list);
+            if (expired)
+                ht_item_release(table, expired);
+            return -1;
+        }
+
+        if (ttl > 0 && ht_timer_set(table, item, now + ttl) != 0) {
+            if (copy)
+                free(item->data);
+            ht_item_destroy(table, item);
+            HT_LIST_UNLOCK(list);
+            if (expired)
+                ht_item_release(table, expired);
+            return -1;
+        }
+
+        ht_item_link(table, list, item);
+        item = NULL;
+    } else {
+        if (inx) {
+            if (prev_data)
+                *prev_data = prev;
+            if (prev_len)
+                *prev_len = plen;
+            HT_LIST_UNLOCK(list);
+            return 1;
+        }
+        if (ttl >= 0 && ht_timer_set(table, item, ttl ? now + ttl : 0) != 0) {
+            HT_LIST_UNLOCK(list);
+            return -1;
+        }
+        item->dlen = dlen;
+        if (copy) {
+            void *dcopy = malloc(dlen);
+            if (!dcopy) {
+                HT_LIST_UNLOCK(list);
+                return -1;
+            }
+
+            item->data = dcopy;
+            memcpy(item->data, data, dlen);
+        } else {
+            item->data = data;
+        }
+        if (prev_inline && prev_data)
+            prev = ht_num_copy(&item->num);
+        if (table->cache)
+            ht_cache_update(table, item);
+    }
+
+    HT_LIST_UNLOCK(list);
+
+    if (expired)
+        ht_item_release(table, expired);
+
+    ht_set_complete(table, hash);
+
+    // NOTE : item is still set only if an existing value has been replaced
+    if (item) {
+        if (prev_data)
+            *prev_data = prev;
+        else if (prev && !prev_inline)
+            ht_value_release(table, prev);
+    } else if (prev_data) {
+        *prev_data = image_prev;
+    }
+
+    if (prev_len)
+        *prev_len = item ? plen : image_plen;
+
+    return 0;
+}
+
+static inline int
+ht_set_internal(hashtable_t *table,
+                 void *key,
+                 size_t klen,
+                 void *data,
+                 size_t dlen,
+                 void **prev_data,
+                 size_t *prev_len,
+                 int copy,
+                 int inx)
+{
+    if (!klen)
+        return -1;
+
+    return ht_set_hashed(table, ht_hash(table, key, klen), key, klen,
+                         data, dlen, prev_data, prev_len, copy, inx, -1);
+}
+
+int
+ht_set(hashtable_t *table, void *key, size_t klen, void *data, size_t dlen)
+{
+    return ht_set_internal(table, key, klen, data, dlen, NULL, NULL, 0, 0);
+}
+
+int
+ht_set_with_ttl(hashtable_t *table, void *key, size_t klen, void *data, size_t dlen, uint64_t ttl)
+{
+    if (!klen || table->flat)
+        return -1;
+
+    return ht_set_hashed(table, ht_hash(table, key, klen), key, klen,
+                         data, dlen, NULL, NULL, 0, 0, (int64_t)ttl);
+}
+
+int
+ht_set_ttl(hashtable_t *table, void *key, size_t klen, uint64_t ttl)
+{
+    if (!klen || table->flat)
+        return -1;
+
+    uint64_t hash = ht_hash(table, key, klen);
+    if (table->shards)
+        table = HT_SHARD(table, hash);
+
+    ht_items_list_t *list = ht_get_list(table, hash);
+    if (!list)
+        return -1;
+
+    int rc = -1;
+    uint64_t now = 0;
+    ht_item_t *expired = NULL;
+    ht_item_t *item = NULL;
+    TAILQ_FOREACH(item, &list->head, next) {
+        if (HT_KEY_EQUALS(item->key, item->klen, key, klen)) {
+            if (ht_item_expired(item, &now)) {
+                ht_item_unlink(table, list, item);
+                expired = item;
+            } else {
+                rc = ht_timer_set(table, item, ttl ? ht_now_ms() + ttl : 0);
+            }
+            break;
+        }
+    }
+
+    HT_LIST_UNLOCK(list);
+
+    if (expired)
+        ht_item_release(table, expired);
+
+    if (ATOMIC_READ(table->wheel))
+        ht_expire_internal(table, 0);
+
+    return rc;
+}
+
+int
+ht_set_if_not_exists(hashtable_t *table, void *key, size_t klen, void *data, size_t dlen)
+{
+    return ht_set_internal(table, key, klen, data, dlen, NULL, NULL, 0, 1);
+}
+
+int
+ht_get_or_set(hashtable_t *table,
+              void *key,
+              size_t klen,
+              void *data,
+              size_t dlen,
+              void **cur_data,
+              size_t *cur_len)
+{
+    return ht_set_internal(table, key, klen, data, dlen, cur_data, cur_len, 0, 1);
+}
+
+int
+ht_get_and_set(hashtable_t *table,
+               void *key,
+               size_t klen,
+               void *data,
+               size_t dlen,
+               void **prev_data,
+               size_t *prev_len)
+{
+    return ht_set_internal(table, key, klen, data, dlen, prev_data, prev_len, 0, 0);
+}
+
+int
+ht_set_copy(hashtable_t *table,
+            void *key,
+            size_t klen,
+            void *data,
+            size_t dlen,
+            void **prev_data,
+            size_t *prev_len)
+{
+    return ht_set_internal(table, key, klen, data, dlen, prev_data, prev_len, 1, 0);
+}
+
+// run the callback on a key only stored in the image: the value in the
+// mapping is never changed, if the callback sets a new one it's stored
+// in the overlay instead
+// NOTE : the bucket list of the key must be locked (unless readonly)
+static int
+ht_image_call(hashtable_t *table,
+              ht_items_list_t *list,
+              uint64_t hash,
+              void *key,
+              size_t klen,
+              ht_pair_callback_t cb,
+              void *user,
+              int readonly)
+{
+    void *value = NULL;
+    size_t vlen = 0;
+    if (!ht_image_visible(table, hash, key, klen, &value, &vlen))
+        return -1;
+
+    if (!cb)
+        return 0;
+
+    void *new_value = value;
+    size_t new_vlen = vlen;
+    int ret = cb(table, key, klen, &new_value, &new_vlen, user);
+    if (readonly)
+        return ret;
+
+    if (ret == 1) {
+        ht_set(table->image->deleted, key, klen, NULL, 0);
+        return 0;
+    }
+
+    if (new_value != value || new_vlen != vlen) {
+        ht_item_t *item = ht_item_create(table, hash, key, klen, new_value, new_vlen, 0);
+        if (!item)
+            return -1;
+        ht_item_link(table, list, item);
+    }
+
+    return ret;
+}
+
+static inline int
+ht_call_hashed(hashtable_t *table,
+        uint64_t hash,
+        void *key,
+        size_t klen,
+        ht_pair_callback_t cb,
+        void *user,
+        int readonly)
+{
+    int ret = -1;
+
+    if (table->shards)
+        table = HT_SHARD(table, hash);
+
+    if (table->flat)
+        return ht_flat_call(table, hash, key, klen, cb, user, readonly);
+
+    if (readonly && !ht_bloom_test(table, hash))
+        return -1;
+
+    ht_items_list_t *list  = ht_get_list(table, hash);
+
+    // keys of the image can only be changed with their bucket list locked
+    if (!list && table->image && !readonly)
+        list = ht_set_list(table, hash);
+
+    if (!list) {
+        if (table->image)
+            ret = ht_image_call(table, NULL, hash, key, klen, cb, user, 1);
+        return ret;
+    }
+
+    uint64_t now = 0;
+    ht_item_t *expired = NULL;
+    ht_item_t *item = NULL;
+    ht_item_t *tmp;
+    TAILQ_FOREACH_SAFE(item, &list->head, next, tmp) {
+        if (/*ht_item->hash == arg->item.hash && */
+            HT_KEY_EQUALS(item->key, item->klen, key, klen))
+        {
+            if (ht_item_expired(item, &now)) {
+                ht_item_unlink(table, list, item);
+                expired = item;
+                break;
+            }
+            if (cb) {
+                ret = cb(table, key, klen, &item->data, &item->dlen, user);
+                if (ret == 1) {
+                    ht_item_unlink(table, list, item);
+                    ht_retire(table, item, ht_item_destroy);
+                    ret = 0;
+                } else if (table->cache) {
+                    ht_cache_update(table, item);
+                }
+            } else {
+                ret = 0;
+            }
+            break;
+        }
+    }
+
+    if (!item && table->image)
+        ret = ht_image_call(table, list, hash, key, klen, cb, user, readonly);
+
+    HT_LIST_UNLOCK(list);
+
+    if (expired)
+        ht_item_release(table, expired);
+
+    // the callback might have grown the value beyond the budget of the cache
+    if (table->cache && !readonly)
+        ht_cache_shrink(table, hash);
+
+    if (ATOMIC_READ(table->wheel))
+        ht_expire_internal(table, 0);
+
+    if (ATOMIC_READ(table->growing))
+        ht_grow_step(table, HT_GROW_STEP);
+
+    if (table->arena && !readonly)
+        ht_arena_check(table);
+
+    return ret;
+}
+
+static inline int
+ht_call_internal(hashtable_t *table,
+        void *key,
+        size_t klen,
+        ht_pair_callback_t cb,
+        void *user,
+        int readonly)
+{
+    return ht_call_hashed(table, ht_hash(table, key, klen), key, klen, cb, user, readonly);
+}
+
+int
+ht_call(hashtable_t *table,
+        void *key,
+        size_t klen,
+        ht_pair_callback_t cb,
+        void *user)
+{
+    return ht_call_internal(table, key, klen, cb, user, 0);
+}
+
+typedef struct {
+    void *data;
+    size_t dlen;
+    void *match;
+    size_t match_size;
+    int matched;
+    void **prev_data;
+    size_t *prev_len;
+} ht_set_if_equals_helper_arg_t;
+
+static int
+ht_set_if_equals_helper(hashtable_t *table, void *key __attribute__ ((unused)), size_t klen __attribute__ ((unused)), void **value, size_t *vlen, void *user)
+{
+    ht_set_if_equals_helper_arg_t *arg = (ht_set_if_equals_helper_arg_t *)user;
+     
+    if (arg->prev_len)
+        *arg->prev_len = *vlen;
+
+    if (arg->prev_data)
+        *arg->prev_data = *value;
+
+    if (arg->match_size == *vlen && ((char *)*value)[0] == *((char *)arg->match) &&
+        memcmp(*value, arg->match, arg->match_size) == 0)
+    {
+        arg->matched = 1;
+
+        if (!arg->prev_data)
+            ht_free_value(table, value);
+        else if (HT_VALUE_INLINE(value))
+            *arg->prev_data = ht_num_copy(HT_ITEM_NUM(value));
+
+        *value = arg->data;
+        *vlen = arg->dlen;
+    }
+
+    return 0;
+}
+
+int
+ht_set_if_equals(hashtable_t *table,
+                 void *key,
+                 size_t klen,
+                 void *data,
+                 size_t dlen,
+                 void *match,
+                 size_t match_size,
+                 void **prev_data,
+                 size_t *prev_len)
+{
+    if (!match && match_size == 0)
+        return ht_set_if_not_exists(table, key, klen, data, dlen);
+
+    ht_set_if_equals_helper_arg_t arg = {
+        .data = data,
+        .dlen = dlen,
+        .match = match,
+        .match_size = match_size,
+        .matched = 0,
+        .prev_data = prev_data,
+        .prev_len = prev_len
+    };
+    if (ht_call_internal(table, key, klen, ht_set_if_equals_helper, (void *)&arg, 0) == 0)
+    {
+        return arg.matched ? 0 : 1;
+    }
+    return -1;
+}
+
+
+typedef struct
+{
+    int  unset;
+    void **prev_data;
+    size_t *prev_len;
+    void *match;
+    size_t match_size;
+} ht_delete_helper_arg_t;
+
+static int
+ht_delete_helper(hashtable_t *table, void *key __attribute__ ((unused)), size_t klen __attribute__ ((unused)), void **value, size_t *vlen, void *user)
+{
+    ht_delete_helper_arg_t *arg = (ht_delete_helper_arg_t *)user;
+
+    if (arg->match && (arg->match_size != *vlen || memcmp(arg->match, *value, *vlen) != 0))
+        return -1;
+
+    if (arg->prev_data)
+        *arg->prev_data = HT_VALUE_INLINE(value) ? ht_num_copy(HT_ITEM_NUM(value)) : *value;
+    else
+        ht_free_value(table, value);
+    
+    if (arg->prev_len)
+        *arg->prev_len = *vlen;
+
+    if (arg->unset) {
+        *vlen = 0;
+        *value = NULL;
+        return 0;
+    }
+
+    return 1; // we want the item to be removed
+}
+
+int
+ht_unset(hashtable_t *table,
+         void *key,
+         size_t klen,
+         void **prev_data,
+         size_t *prev_len)
+{
+    ht_delete_helper_arg_t arg = {
+        .unset = 1,
+        .prev_data = prev_data,
+        .prev_len = prev_len,
+        .match = NULL,
+        .match_size = 0
+    };
+
+    return ht_call_internal(table, key, klen, ht_delete_helper, (void *)&arg, 0);
+}
+
+static inline int
+ht_delete_internal (hashtable_t *table,
+                    void *key,
+                    size_t klen,
+                    void **prev_data,
+                    size_t *prev_len,
+                    void *match,
+                    size_t match_size)
+{
+
+    ht_delete_helper_arg_t arg = {
+        .unset = 0,
+        .prev_data = prev_data,
+        .prev_len = prev_len,
+        .match = match,
+        .match_size = match_size
+    };
+
+    return ht_call_internal(table, key, klen, ht_delete_helper, (void *)&arg, 0);
+}
+
+int
+ht_delete (hashtable_t *table,
+           void *key,
+           size_t klen,
+           void **prev_data,
+           size_t *prev_len)
+{
+    return ht_delete_internal(table, key, klen, prev_data, prev_len, NULL, 0);
+}
+
+int
+ht_delete_if_equals(hashtable_t *table, void *key, size_t klen, void *match, size_t match_size)
+{
+    return ht_delete_internal(table, key, klen, NULL, NULL, match, match_size);
+}
+
+// keys are processed in batches of this size: all the keys in a batch are
+// hashed and their buckets prefetched before resolving any of them,
+// so that the cache misses overlap instead of being paid one by one
+#define HT_MULTI_BATCH 32
+
+static inline void
+ht_flat_prefetch(ht_flat_t *flat, uint64_t hash)
+{
+    size_t gmask = (flat->capacity / HT_FLAT_GROUP_WIDTH) - 1;
+    size_t g = HT_FLAT_H1(hash) & gmask;
+    __builtin_prefetch(flat->ctrl + g * HT_FLAT_GROUP_WIDTH);
+    __builtin_prefetch(&flat->slots[g * HT_FLAT_GROUP_WIDTH]);
+}
+
+// NOTE: the caller must hold the flat lock (chained tables must be inside
+//       an epoch critical section instead)
+static void
+ht_prefetch_buckets(hashtable_t *table, uint64_t *hashes, size_t count)
+{
+    size_t i;
+
+    if (table->flat) {
+        for (i = 0; i < count; i++)
+            ht_flat_prefetch(table->flat, hashes[i]);
+        return;
+    }
+
+    // first bring in the slots of the bucket array, then the list heads
+    for (i = 0; i < count; i++) {
+        hashtable_t *t = table->shards ? HT_SHARD(table, hashes[i]) : table;
+        ht_buckets_t *buckets = ATOMIC_READ_ACQUIRE(t->buckets);
+        __builtin_prefetch(&buckets->lists[HT_BUCKET_INDEX(hashes[i], buckets->size)]);
+    }
+
+    for (i = 0; i < count; i++) {
+        hashtable_t *t = table->shards ? HT_SHARD(table, hashes[i]) : table;
+        ht_buckets_t *buckets = ATOMIC_READ_ACQUIRE(t->buckets);
+        ht_items_list_t *list = ATOMIC_READ_ACQUIRE(buckets->lists[HT_BUCKET_INDEX(hashes[i], buckets->size)]);
+        if (list && list != HT_BUCKET_MOVED)
+            __builtin_prefetch(list);
+    }
+}
+
+static void
+ht_prefetch_batch(hashtable_t *table, uint64_t *hashes, size_t count)
+{
+    if (table->flat) {
+        RWLOCK_RDLOCK(table->flat->lock);
+        ht_prefetch_buckets(table, hashes, count);
+        RWLOCK_UNLOCK(table->flat->lock);
+    } else {
+        ht_epoch_enter();
+        ht_prefetch_buckets(table, hashes, count);
+        ht_epoch_exit();
+    }
+}
+
+size_t
+ht_get_multi(hashtable_t *table,
+             void **keys,
+             size_t *klens,
+             size_t n,
+             void **values,
+             size_t *dlens)
+{
+    uint64_t hashes[HT_MULTI_BATCH];
+    size_t found = 0;
+    size_t i, j;
+
+    for (i = 0; i < n; i += HT_MULTI_BATCH) {
+        size_t count = (n - i) < HT_MULTI_BATCH ? (n - i) : HT_MULTI_BATCH;
+        void **bkeys = &keys[i];
+        size_t *bklens = &klens[i];
+
+        for (j = 0; j < count; j++)
+            hashes[j] = ht_hash(table, bkeys[j], bklens[j]);
+
+        if (table->flat) {
+            // the whole batch is resolved with a single lock handshake
+            ht_flat_t *flat = table->flat;
+            RWLOCK_RDLOCK(flat->lock);
+            ht_prefetch_buckets(table, hashes, count);
+            for (j = 0; j < count; j++) {
+                ssize_t index = ht_flat_find(flat, hashes[j], bkeys[j], bklens[j]);
+                values[i + j] = index >= 0 ? flat->slots[index].data : NULL;
+                if (dlens)
+                    dlens[i + j] = index >= 0 ? flat->slots[index].dlen : 0;
+                if (index >= 0)
+                    found++;
+            }
+            RWLOCK_UNLOCK(flat->lock);
+            continue;
+        }
+
+        ht_epoch_enter();
+        ht_prefetch_buckets(table, hashes, count);
+        for (j = 0; j < count; j++) {
+            size_t dlen = 0;
+            values[i + j] = NULL;
+            if (ht_lookup(table, hashes[j], bkeys[j], bklens[j], &values[i + j], &dlen))
+                found++;
+            if (dlens)
+                dlens[i + j] = dlen;
+        }
+        ht_epoch_exit();
+    }
+
+    // the keys are spread over all the shards, ht_grow_step() helps
+    // whichever of them is growing
+    if (table->shards || ATOMIC_READ(table->growing))
+        ht_grow_step(table, HT_GROW_STEP);
+
+    return found;
+}
+
+size_t
+ht_set_multi(hashtable_t *table,
+             void **keys,
+             size_t *klens,
+             size_t n,
+             void **values,
+             size_t *dlens)
+{
+    uint64_t hashes[HT_MULTI_BATCH];
+    size_t stored = 0;
+    size_t i, j;
+
+    for (i = 0; i < n; i += HT_MULTI_BATCH) {
+        size_t count = (n - i) < HT_MULTI_BATCH ? (n - i) : HT_MULTI_BATCH;
+
+        for (j = 0; j < count; j++)
+            hashes[j] = ht_hash(table, keys[i + j], klens[i + j]);
+
+        ht_prefetch_batch(table, hashes, count);
+
+        for (j = 0; j < count; j++) {
+            if (ht_set_hashed(table, hashes[j], keys[i + j], klens[i + j],
+                              values[i + j], dlens ? dlens[i + j] : 0,
+                              NULL, NULL, 0, 0, -1) == 0)
+            {
+                stored++;
+            }
+        }
+    }
+
+    return stored;
+}
+
+size_t
+ht_delete_multi(hashtable_t *table,
+                void **keys,
+                size_t *klens,
+                size_t n,
+                void **prev_values,
+                size_t *prev_lens)
+{
+    uint64_t hashes[HT_MULTI_BATCH];
+    size_t deleted = 0;
+    size_t i, j;
+
+    for (i = 0; i < n; i += HT_MULTI_BATCH) {
+        size_t count = (n - i) < HT_MULTI_BATCH ? (n - i) : HT_MULTI_BATCH;
+
+        for (j = 0; j < count; j++)
+            hashes[j] = ht_hash(table, keys[i + j], klens[i + j]);
+
+        ht_prefetch_batch(table, hashes, count);
+
+        for (j = 0; j < count; j++) {
+            size_t k = i + j;
+            ht_delete_helper_arg_t arg = {
+                .unset = 0,
+                .prev_data = prev_values ? &prev_values[k] : NULL,
+                .prev_len = prev_lens ? &prev_lens[k] : NULL,
+                .match = NULL,
+                .match_size = 0
+            };
+            if (prev_values)
+                prev_values[k] = NULL;
+            if (prev_lens)
+                prev_lens[k] = 0;
+            if (ht_call_hashed(table, hashes[j], keys[k], klens[k], ht_delete_helper, (void *)&arg, 0) == 0)
+                deleted++;
+        }
+    }
+
+    return deleted;
+}
+
+/*
+ * Bulk loading
+ *
+ * All the keys are hashed first, then every target table (each shard of a
+ * sharded table) is grown at once to its final size. The iterator lock of
+ * the targets is held during the whole build, so that no migration can
+ * start and no other thread can create new bucket lists in the meanwhile.
+ * The buckets are split among the workers in contiguous ranges and the
+ * items are partitioned accordingly, each worker then builds the lists of
+ * its own buckets: new lists are filled before being published, so they
+ * don't need any locking, while existing ones are locked once per bucket.
+ */
+
+// inputs smaller than this are not worth an additional thread
+#define HT_BULK_MIN_ITEMS 4096
+
+typedef struct _ht_bulk ht_bulk_t;
+
+typedef struct _ht_bulk_worker {
+    ht_bulk_t *bulk;
+    int index;
+    // the range of input items hashed and partitioned by this worker
+    size_t from;
+    size_t to;
+    // the number of items for each target, then for each worker
+    // (and finally where to put the next one in the partition of each worker)
+    size_t *counts;
+    // the number of items added to each target
+    size_t *added;
+    // the lists created for each target, still to be put in its iterator list
+    ht_iterator_list_t *lists;
+    size_t stored;
+} ht_bulk_worker_t;
+
+struct _ht_bulk {
+    hashtable_t *table;
+    hashtable_t **targets;
+    size_t ntargets;
+    // the global index of the first bucket of each target
+    size_t *bases;
+    size_t nbuckets;
+    void **keys;
+    size_t *klens;
+    void **values;
+    size_t *vlens;
+    size_t n;
+    uint64_t *hashes;
+    // the items partitioned by worker, and sorted by bucket within each partition
+    size_t *parts;
+    size_t *sorted;
+    size_t *offsets;
+    // if not NULL, set for each item which has been stored
+    char *stored;
+    ht_merge_conflict_callback_t conflict_cb;
+    void *user;
+    int nthreads;
+    ht_bulk_worker_t *workers;
+};
+
+static inline size_t
+ht_bulk_target(ht_bulk_t *bulk, uint64_t hash)
+{
+    return bulk->table->shards ? (size_t)HT_SHARD_INDEX(bulk->table, hash) : 0;
+}
+
+// NOTE : the iterator lock of all the targets must be held
+static inline size_t
+ht_bulk_bucket_id(ht_bulk_t *bulk, uint64_t hash)
+{
+    size_t target = ht_bulk_target(bulk, hash);
+    return bulk->bases[target] + HT_BUCKET_INDEX(hash, bulk->targets[target]->buckets->size);
+}
+
+// the first bucket owned by a worker
+static inline size_t
+ht_bulk_first_bucket(ht_bulk_t *bulk, int worker)
+{
+    return (worker * bulk->nbuckets + bulk->nthreads - 1) / bulk->nthreads;
+}
+
+static inline int
+ht_bulk_owner(ht_bulk_t *bulk, size_t bucket_id)
+{
+    return (int)((bucket_id * bulk->nthreads) / bulk->nbuckets);
+}
+
+static void *
+ht_bulk_hash(void *arg)
+{
+    ht_bulk_worker_t *worker = (ht_bulk_worker_t *)arg;
+    ht_bulk_t *bulk = worker->bulk;
+    size_t i;
+    for (i = worker->from; i < worker->to; i++) {
+        if (!bulk->klens[i])
+            continue;
+        bulk->hashes[i] = ht_hash(bulk->table, bulk->keys[i], bulk->klens[i]);
+        worker->counts[ht_bulk_target(bulk, bulk->hashes[i])]++;
+    }
+    return NULL;
+}
+
+static void *
+ht_bulk_count(void *arg)
+{
+    ht_bulk_worker_t *worker = (ht_bulk_worker_t *)arg;
+    ht_bulk_t *bulk = worker->bulk;
+    memset(worker->counts, 0, bulk->nthreads * sizeof(size_t));
+    size_t i;
+    for (i = worker->from; i < worker->to; i++) {
+        if (bulk->klens[i])
+            worker->counts[ht_bulk_owner(bulk, ht_bulk_bucket_id(bulk, bulk->hashes[i]))]++;
+    }
+    return NULL;
+}
+
+static void *
+ht_bulk_scatter(void *arg)
+{
+    ht_bulk_worker_t *worker = (ht_bulk_worker_t *)arg;
+    ht_bulk_t *bulk = worker->bulk;
+    size_t i;
+    for (i = worker->from; i < worker->to; i++) {
+        if (bulk->klens[i])
+            bulk->parts[worker->counts[ht_bulk_owner(bulk, ht_bulk_bucket_id(bulk, bulk->hashes[i]))]++] = i;
+    }
+    return NULL;
+}
+
+// store the items of a single bucket, in the order they have been provided
+// NOTE : the iterator lock of the target must be held
+static void
+ht_bulk_fill(ht_bulk_worker_t *worker, size_t target, size_t index, size_t *items, size_t count)
+{
+    ht_bulk_t *bulk = worker->bulk;
+    hashtable_t *table = bulk->targets[target];
+    ht_buckets_t *buckets = table->buckets;
+    ht_items_list_t *list = buckets->lists[index];
+
+    // nobody else can create new lists while the iterator lock is held,
+    // so a new one can be filled before anyone else is able to see it
+    int created = 0;
+    if (!list) {
+        list = ht_list_create(table, index);
+        if (!list)
+            return;
+        created = 1;
+    } else {
+        HT_LIST_LOCK(table, list);
+    }
+
+    size_t j;
+    for (j = 0; j < count; j++) {
+        size_t i = items[j];
+        uint64_t hash = bulk->hashes[i];
+        void *key = bulk->keys[i];
+        size_t klen = bulk->klens[i];
+        void *value = bulk->values[i];
+        size_t vlen = bulk->vlens ? bulk->vlens[i] : 0;
+
+        ht_item_t *item = NULL;
+        ht_item_t *cur = NULL;
+        TAILQ_FOREACH(cur, &list->head, next) {
+            if (cur->hash == hash && HT_KEY_EQUALS(cur->key, cur->klen, key, klen)) {
+                item = cur;
+                break;
+            }
+        }
+
+        if (item && bulk->conflict_cb) {
+            void *data = item->data;
+            size_t dlen = item->dlen;
+            bulk->conflict_cb(bulk->table, item->key, item->klen, &data, &dlen, value, vlen, bulk->user);
+            item->dlen = dlen;
+            item->data = data;
+        } else if (item) {
+            void *prev = HT_VALUE_INLINE(&item->data) ? NULL : item->data;
+            item->dlen = vlen;
+            item->data = value;
+            if (prev)
+                ht_value_release(table, prev);
+        } else {
+            item = ht_item_create(table, hash, key, klen, value, vlen, 0);
+            if (!item)
+                continue;
+            // the key must be in the filter before lockless readers can find it
+            ht_bloom_add(table, hash);
+            HT_LIST_INSERT_TAIL(list, item);
+            worker->added[target]++;
+        }
+
+        worker->stored++;
+        if (bulk->stored)
+            bulk->stored[i] = 1;
+    }
+
+    if (!created) {
+        HT_LIST_UNLOCK(list);
+        return;
+    }
+
+    if (TAILQ_EMPTY(&list->head)) {
+        ht_list_destroy(table, list);
+        return;
+    }
+
+    TAILQ_INSERT_TAIL(&worker->lists[target].head, list, iterator_next);
+    // the list must be complete before lockless readers can reach it
+    ATOMIC_STORE_RELEASE(buckets->lists[index], list);
+}
+
+static void *
+ht_bulk_build(void *arg)
+{
+    ht_bulk_worker_t *worker = (ht_bulk_worker_t *)arg;
+    ht_bulk_t *bulk = worker->bulk;
+    size_t *parts = bulk->parts + bulk->offsets[worker->index];
+    size_t *sorted = bulk->sorted + bulk->offsets[worker->index];
+    size_t count = bulk->offsets[worker->index + 1] - bulk->offsets[worker->index];
+    size_t first = ht_bulk_first_bucket(bulk, worker->index);
+    size_t nslots = ht_bulk_first_bucket(bulk, worker->index + 1) - first;
+
+    if (!count)
+        return NULL;
+
+    // counting sort of our items by bucket, which keeps the order of the
+    // input for the items of the same bucket (so the last duplicate wins)
+    size_t *slots = calloc(nslots + 1, sizeof(size_t));
+    if (!slots)
+        return NULL;
+
+    size_t i;
+    for (i = 0; i < count; i++)
+        slots[ht_bulk_bucket_id(bulk, bulk->hashes[parts[i]]) - first + 1]++;
+    for (i = 1; i <= nslots; i++)
+        slots[i] += slots[i - 1];
+    for (i = 0; i < count; i++)
+        sorted[slots[ht_bulk_bucket_id(bulk, bulk->hashes[parts[i]]) - first]++] = parts[i];
+
+    // slots[i] now points to the end of the items of the bucket i
+    size_t target = 0;
+    size_t start = 0;
+    for (i = 0; i < nslots; i++) {
+        size_t end = slots[i];
+        if (end == start)
+            continue;
+        size_t bucket_id = first + i;
+        while (bucket_id >= bulk->bases[target + 1])
+            target++;
+        ht_bulk_fill(worker, target, bucket_id - bulk->bases[target], &sorted[start], end - start);
+        start = end;
+    }
+
+    free(slots);
+
+    for (target = 0; target < bulk->ntargets; target++) {
+        if (worker->added[target])
+            ATOMIC_INCREASE(bulk->targets[target]->count, worker->added[target]);
+    }
+
+    return NULL;
+}
+
+// the number of threads to use for n units of work (if nthreads is 0 or
+// negative, as many as the online cpus), at least min_units for each of them
+static int
+ht_workers_count(int nthreads, size_t n, size_t min_units)
+{
+#ifdef THREAD_SAFE
+    if (nthreads <= 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? (int)ncpus : 1;
+    }
+    if ((size_t)nthreads > n / min_units + 1)
+        nthreads = (int)(n / min_units + 1);
+    return nthreads;
+#else
+    return 1;
+#endif
+}
+
+// call cb for each of the n workers (an array of elements of the given
+// size) in its own thread, the first one is handled by the calling thread
+static void
+ht_workers_run(void *workers, size_t size, int n, void *(*cb)(void *))
+{
+    int i = 1;
+#ifdef THREAD_SAFE
+    pthread_t threads[n];
+    for (; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, cb, (char *)workers + i * size) != 0)
+            break;
+    }
+    int started = i;
+#endif
+
+    // the work of the threads which couldn't be started is done here
+    cb(workers);
+    for (; i < n; i++)
+        cb((char *)workers + i * size);
+
+#ifdef THREAD_SAFE
+    for (i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+#endif
+}
+
+static inline void
+ht_bulk_run(ht_bulk_t *bulk, void *(*cb)(void *))
+{
+    ht_workers_run(bulk->workers, sizeof(ht_bulk_worker_t), bulk->nthreads, cb);
+}
+
+// store the items one by one, used for the tables which can't be built
+// in bulk (and if any resource couldn't be allocated)
+static size_t
+ht_bulk_fallback(ht_bulk_t *bulk)
+{
+    hashtable_t *table = bulk->table;
+    size_t stored = 0;
+    size_t i;
+    for (i = 0; i < bulk->n; i++) {
+        if (bulk->stored && bulk->stored[i])
+            continue;
+
+        void *key = bulk->keys[i];
+        size_t klen = bulk->klens[i];
+        void *value = bulk->values[i];
+        size_t vlen = bulk->vlens ? bulk->vlens[i] : 0;
+        uint64_t hash = ht_hash(table, key, klen);
+
+        int rc;
+        if (bulk->conflict_cb) {
+            void *prev = NULL;
+            size_t plen = 0;
+            rc = ht_set_hashed(table, hash, key, klen, value, vlen, &prev, &plen, 0, 1, -1);
+            if (rc == 1) {
+                bulk->conflict_cb(table, key, klen, &prev, &plen, value, vlen, bulk->user);
+                void *old = NULL;
+                rc = ht_set_hashed(table, hash, key, klen, prev, plen, &old, NULL, 0, 0, -1);
+            }
+        } else {
+            rc = ht_set_hashed(table, hash, key, klen, value, vlen, NULL, NULL, 0, 0, -1);
+        }
+
+        if (rc == 0) {
+            stored++;
+            if (bulk->stored)
+                bulk->stored[i] = 1;
+        }
+    }
+    return stored;
+}
+
+// grow the table (completing an ongoing migration first) until it can
+// hold count items without growing again
+// NOTE : the iterator lock must be held
+static int
+ht_bulk_reserve(hashtable_t *table, size_t count)
+{
+    if (ht_migrate_buckets(table, SIZE_MAX) != 0)
+        return -1;
+
+    while (count > table->size + table->size / 3) {
+        // NOTE : if we can't grow anymore the buckets will just get longer
+        if (ht_grow_start(table) != 0)
+            break;
+        if (ht_migrate_buckets(table, SIZE_MAX) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static size_t
+ht_bulk_insert(ht_bulk_t *bulk)
+{
+    hashtable_t *table = bulk->table;
+    size_t stored = 0;
+    size_t i;
+    int t;
+
+    if (table->shards) {
+        bulk->targets = table->shards;
+        bulk->ntargets = table->nshards;
+    } else {
+        bulk->targets = &bulk->table;
+        bulk->ntargets = 1;
+    }
+
+    // tables with items linked elsewhere (or which can expire)
+    // are filled one item at a time
+    for (i = 0; i < bulk->ntargets; i++) {
+        hashtable_t *target = bulk->targets[i];
+        if (target->flat || target->cache || target->image || ATOMIC_READ(target->wheel))
+            return ht_bulk_fallback(bulk);
+    }
+
+    bulk->nthreads = ht_workers_count(bulk->nthreads, bulk->n, HT_BULK_MIN_ITEMS);
+
+    size_t ncounts = bulk->ntargets > (size_t)bulk->nthreads ? bulk->ntargets : (size_t)bulk->nthreads;
+    bulk->hashes = malloc(bulk->n * sizeof(uint64_t));
+    bulk->parts = malloc(bulk->n * sizeof(size_t));
+    bulk->sorted = malloc(bulk->n * sizeof(size_t));
+    bulk->bases = malloc((bulk->ntargets + 1) * sizeof(size_t));
+    bulk->offsets = malloc((bulk->nthreads + 1) * sizeof(size_t));
+    bulk->workers = calloc(bulk->nthreads, sizeof(ht_bulk_worker_t));
+    int failed = (!bulk->hashes || !bulk->parts || !bulk->sorted ||
+                  !bulk->bases || !bulk->offsets || !bulk->workers);
+
+    for (t = 0; !failed && t < bulk->nthreads; t++) {
+        ht_bulk_worker_t *worker = &bulk->workers[t];
+        worker->bulk = bulk;
+        worker->index = t;
+        worker->from = bulk->n * t / bulk->nthreads;
+        worker->to = bulk->n * (t + 1) / bulk->nthreads;
+        worker->counts = calloc(ncounts, sizeof(size_t));
+        worker->added = calloc(bulk->ntargets, sizeof(size_t));
+        worker->lists = calloc(bulk->ntargets, sizeof(ht_iterator_list_t));
+        if (!worker->counts || !worker->added || !worker->lists) {
+            failed = 1;
+            break;
+        }
+        for (i = 0; i < bulk->ntargets; i++)
+            TAILQ_INIT(&worker->lists[i].head);
+    }
+
+    if (failed)
+        goto out;
+
+    ht_bulk_run(bulk, ht_bulk_hash);
+
+    for (i = 0; i < bulk->ntargets; i++)
+        MUTEX_LOCK(bulk->targets[i]->iterator_lock);
+
+    // all the targets are grown to their final size before building any bucket
+    bulk->nbuckets = 0;
+    for (i = 0; i < bulk->ntargets; i++) {
+        hashtable_t *target = bulk->targets[i];
+        size_t incoming = 0;
+        for (t = 0; t < bulk->nthreads; t++)
+            incoming += bulk->workers[t].counts[i];
+        if (ht_bulk_reserve(target, ATOMIC_READ(target->count) + incoming) != 0)
+            failed = 1;
+        bulk->bases[i] = bulk->nbuckets;
+        bulk->nbuckets += target->buckets->size;
+    }
+    bulk->bases[bulk->ntargets] = bulk->nbuckets;
+
+    if (!failed) {
+        ht_bulk_run(bulk, ht_bulk_count);
+
+        // the partition of each worker holds the items it got from each
+        // range of the input, in order
+        size_t offset = 0;
+        for (t = 0; t < bulk->nthreads; t++) {
+            bulk->offsets[t] = offset;
+            int r;
+            for (r = 0; r < bulk->nthreads; r++) {
+                size_t count = bulk->workers[r].counts[t];
+                bulk->workers[r].counts[t] = offset;
+                offset += count;
+            }
+        }
+        bulk->offsets[bulk->nthreads] = offset;
+
+        ht_bulk_run(bulk, ht_bulk_scatter);
+        ht_bulk_run(bulk, ht_bulk_build);
+
+        for (t = 0; t < bulk->nthreads; t++) {
+            ht_bulk_worker_t *worker = &bulk->workers[t];
+            for (i = 0; i < bulk->ntargets; i++)
+                TAILQ_CONCAT(&bulk->targets[i]->iterator_list->head, &worker->lists[i].head, iterator_next);
+            stored += worker->stored;
+        }
+    }
+
+    for (i = 0; i < bulk->ntargets; i++)
+        MUTEX_UNLOCK(bulk->targets[i]->iterator_lock);
+
+out:
+    if (bulk->workers) {
+        for (t = 0; t < bulk->nthreads; t++) {
+            free(bulk->workers[t].counts);
+            free(bulk->workers[t].added);
+            free(bulk->workers[t].lists);
+        }
+    }
+    free(bulk->workers);
+    free(bulk->offsets);
+    free(bulk->bases);
+    free(bulk->sorted);
+    free(bulk->parts);
+    free(bulk->hashes);
+
+    // NOTE : nothing has been stored if we failed
+    if (failed)
+        return ht_bulk_fallback(bulk);
+
+    return stored;
+}
+
+size_t
+ht_bulk_load(hashtable_t *table,
+             void **keys,
+             size_t *klens,
+             void **values,
+             size_t *vlens,
+             size_t n,
+             int nthreads)
+{
+    if (!n)
+        return 0;
+
+    ht_bulk_t bulk = {
+        .table = table,
+        .keys = keys,
+        .klens = klens,
+        .values = values,
+        .vlens = vlens,
+        .n = n,
+        .nthreads = nthreads
+    };
+
+    return ht_bulk_insert(&bulk);
+}
+
+typedef struct {
+    void **keys;
+    size_t *klens;
+    void **values;
+    size_t *vlens;
+    size_t count;
+    size_t size;
+} ht_merge_arg_t;
+
+static ht_iterator_status_t
+ht_merge_collect(hashtable_t *table __attribute__ ((unused)), void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    ht_merge_arg_t *arg = (ht_merge_arg_t *)user;
+    if (arg->count == arg->size) {
+        // items might have been added since we counted them
+        size_t size = arg->size ? arg->size << 1 : 64;
+        void **keys = realloc(arg->keys, size * sizeof(void *));
+        if (keys)
+            arg->keys = keys;
+        size_t *klens = realloc(arg->klens, size * sizeof(size_t));
+        if (klens)
+            arg->klens = klens;
+        void **values = realloc(arg->values, size * sizeof(void *));
+        if (values)
+            arg->values = values;
+        size_t *vlens = realloc(arg->vlens, size * sizeof(size_t));
+        if (vlens)
+            arg->vlens = vlens;
+        if (!keys || !klens || !values || !vlens)
+            return HT_ITERATOR_STOP;
+        arg->size = size;
+    }
+
+    arg->keys[arg->count] = key;
+    arg->klens[arg->count] = klen;
+    arg->values[arg->count] = value;
+    arg->vlens[arg->count] = vlen;
+    arg->count++;
+    return HT_ITERATOR_CONTINUE;
+}
+
+size_t
+ht_merge(hashtable_t *dst, hashtable_t *src, ht_merge_conflict_callback_t conflict_cb, void *user)
+{
+    if (dst == src)
+        return 0;
+
+    ht_merge_arg_t arg = { NULL, NULL, NULL, NULL, 0, 0 };
+    size_t count = ht_count(src);
+    if (count) {
+        arg.keys = malloc(count * sizeof(void *));
+        arg.klens = malloc(count * sizeof(size_t));
+        arg.values = malloc(count * sizeof(void *));
+        arg.vlens = malloc(count * sizeof(size_t));
+        if (arg.keys && arg.klens && arg.values && arg.vlens)
+            arg.size = count;
+    }
+
+    // NOTE : the keys still belong to src, which is emptied only once
+    //        all of them have been copied to dst
+    ht_foreach_pair(src, ht_merge_collect, &arg);
+
+    size_t merged = 0;
+    char *stored = arg.count ? calloc(arg.count, 1) : NULL;
+    if (stored) {
+        ht_bulk_t bulk = {
+            .table = dst,
+            .keys = arg.keys,
+            .klens = arg.klens,
+            .values = arg.values,
+            .vlens = arg.vlens,
+            .n = arg.count,
+            .stored = stored,
+            .conflict_cb = conflict_cb,
+            .user = user
+        };
+        merged = ht_bulk_insert(&bulk);
+    }
+
+    // the values now belong to dst and must not be released
+    if (merged && merged == ht_count(src)) {
+        ht_clear_internal(src, 0);
+    } else if (merged) {
+        size_t i;
+        for (i = 0; i < arg.count; i++) {
+            void *prev = NULL;
+            if (stored[i])
+                ht_delete(src, arg.keys[i], arg.klens[i], &prev, NULL);
+        }
+    }
+
+    free(stored);
+    free(arg.keys);
+    free(arg.klens);
+    free(arg.values);
+    free(arg.vlens);
+
+    return merged;
+}
+
+int
+ht_exists(hashtable_t *table, void *key, size_t klen)
+{
+    if (table->flat)
+        return (ht_call_internal(table, key, klen, NULL, NULL, 1) == 0);
+
+    uint64_t hash = ht_hash(table, key, klen);
+    int found = ht_lookup(table, hash, key, klen, NULL, NULL);
+
+    ht_grow_help(table, hash);
+
+    return found;
+}
+
+typedef struct {
+    void *data;
+    size_t *dlen;
+    int copy;
+    ht_deep_copy_callback_t copy_cb;
+    void *user;
+} ht_get_helper_arg_t;
+
+static int
+ht_get_helper(hashtable_t *table __attribute__ ((unused)), void *key __attribute__ ((unused)), size_t klen __attribute__ ((unused)), void **value, size_t *vlen, void *user)
+{
+    ht_get_helper_arg_t *arg = (ht_get_helper_arg_t *)user;
+
+    if (arg->copy) {
+        if (arg->copy_cb) {
+            arg->data = arg->copy_cb(*value, *vlen, arg->user);
+        } else {
+            arg->data = malloc(*vlen);
+            if (!arg->data)
+                return -1;
+            memcpy(arg->data, *value, *vlen);
+        }
+    } else {
+        arg->data = *value;
+    }
+
+    if (arg->dlen)
+        *arg->dlen = *vlen;
+
+
+    return 0;
+}
+
+static inline void *
+ht_get_internal(hashtable_t *table,
+                void *key,
+                size_t klen,
+                size_t *dlen,
+                int copy,
+                ht_deep_copy_callback_t copy_cb,
+                void *user)
+{
+    if (!copy && !table->flat) {
+        void *data = NULL;
+        uint64_t hash = ht_hash(table, key, klen);
+        ht_lookup(table, hash, key, klen, &data, dlen);
+        ht_grow_help(table, hash);
+        return data;
+    }
+
+    ht_get_helper_arg_t arg = {
+        .data = NULL,
+        .dlen = dlen,
+        .copy = copy,
+        .copy_cb = copy_cb,
+        .user = user
+    };
+
+    ht_call_internal(table, key, klen, ht_get_helper, (void *)&arg, 1);
+
+    return arg.data;
+}
+
+void *
+ht_get(hashtable_t *table, void *key, size_t klen, size_t *dlen)
+{
+    return ht_get_internal(table, key, klen, dlen, 0, NULL, NULL);
+}
+
+void *
+ht_get_copy(hashtable_t *table, void *key, size_t klen, size_t *dlen)
+{
+    return ht_get_internal(table, key, klen, dlen, 1, NULL, NULL);
+}
+
+void *
+ht_get_deep_copy(hashtable_t *table, void *key, size_t klen,
+        size_t *dlen, ht_deep_copy_callback_t copy_cb, void *user)
+{
+    return ht_get_internal(table, key, klen, dlen, 1, copy_cb, user);
+}
+
+typedef struct {
+    void *buf;
+    size_t buflen;
+    ssize_t dlen;
+} ht_get_into_arg_t;
+
+static int
+ht_get_into_helper(hashtable_t *table __attribute__ ((unused)), void *key __attribute__ ((unused)), size_t klen __attribute__ ((unused)), void **value, size_t *vlen, void *user)
+{
+    ht_get_into_arg_t *arg = (ht_get_into_arg_t *)user;
+    memcpy(arg->buf, *value, *vlen < arg->buflen ? *vlen : arg->buflen);
+    arg->dlen = *vlen;
+    return 0;
+}
+
+ssize_t
+ht_get_into(hashtable_t *table, void *key, size_t klen, void *buf, size_t buflen)
+{
+    ht_get_into_arg_t arg = {
+        .buf = buf,
+        .buflen = buflen,
+        .dlen = -1
+    };
+
+    // values are released only once no reader can be using them anymore,
+    // so they can be copied without locking their bucket
+    if (ATOMIC_READ(table->deferred_free) && !table->flat) {
+        void *data = NULL;
+        size_t dlen = 0;
+        uint64_t hash = ht_hash(table, key, klen);
+        ht_epoch_enter();
+        if (ht_lookup(table, hash, key, klen, &data, &dlen))
+            ht_get_into_helper(table, key, klen, &data, &dlen, &arg);
+        ht_epoch_exit();
+        ht_grow_help(table, hash);
+        return arg.dlen;
+    }
+
+    ht_call_internal(table, key, klen, ht_get_into_helper, (void *)&arg, 1);
+
+    return arg.dlen;
+}
+
+/*
+ * Numeric values
+ *
+ * int64 and double values are stored in the item itself (see ht_num_t),
+ * so updating them never allocates anything. Existing values are updated
+ * with atomic operations inside an epoch critical section, without locking
+ * their bucket list, which needs to be locked only to create missing keys.
+ */
+
+typedef enum {
+    HT_NUM_ADD,
+    HT_NUM_MIN,
+    HT_NUM_MAX,
+    HT_NUM_CAS
+} ht_num_op_type_t;
+
+typedef struct {
+    ht_num_op_type_t type;
+    int is_double;
+    ht_num_t operand;
+    ht_num_t expected; // only used by HT_NUM_CAS
+    ht_num_t result;   // the new value (or the current one if the cas failed)
+    int swapped;
+} ht_num_op_t;
+
+// NOTE : missing keys count as 0 for a cas, which can't create them otherwise
+static inline int
+ht_num_initial(ht_num_op_t *op, ht_num_t *value)
+{
+    if (op->type == HT_NUM_CAS && (op->is_double ? op->expected.d != 0 : op->expected.i != 0))
+        return -1;
+    *value = op->operand;
+    return 0;
+}
+
+// NOTE : returns -1 if the item holds a number of the other type
+static inline int
+ht_num_apply(ht_item_t *item, ht_num_op_t *op)
+{
+    if (item->num_double != op->is_double)
+        return -1;
+
+    ht_num_t *num = &item->num;
+    op->swapped = 1;
+
+    if (op->type == HT_NUM_ADD && !op->is_double) {
+        op->result.i = ATOMIC_INCREASE(num->i, op->operand.i);
+        return 0;
+    }
+
+    ht_num_t cur, value;
+    cur.i = ATOMIC_READ_RELAXED(num->i);
+    for (;;) {
+        value = cur;
+        switch (op->type) {
+            case HT_NUM_ADD:
+                value.d = cur.d + op->operand.d;
+                break;
+            case HT_NUM_MIN:
+                if (op->is_double ? op->operand.d < cur.d : op->operand.i < cur.i)
+                    value = op->operand;
+                break;
+            case HT_NUM_MAX:
+                if (op->is_double ? op->operand.d > cur.d : op->operand.i > cur.i)
+                    value = op->operand;
+                break;
+            case HT_NUM_CAS:
+                if (op->is_double ? cur.d != op->expected.d : cur.i != op->expected.i) {
+                    op->result = cur;
+                    op->swapped = 0;
+                    return 0;
+                }
+                value = op->operand;
+                break;
+        }
+
+        // don't dirty the cache line if nothing changes
+        if (value.i == cur.i)
+            break;
+
+        int64_t prev = ATOMIC_CAS_RETURN(num->i, cur.i, value.i);
+        if (prev == cur.i)
+            break;
+        cur.i = prev;
+    }
+    op->result = value;
+    return 0;
+}
+
+// return the item holding the numeric value stored at the key, if any
+// NOTE : must be called inside an epoch critical section
+static ht_item_t *
+ht_num_find(hashtable_t *table, uint64_t hash, void *key, size_t klen)
+{
+    if (!ht_bloom_test(table, hash))
+        return NULL;
+
+    for (;;) {
+        ht_buckets_t *buckets = ATOMIC_READ_ACQUIRE(table->buckets);
+        size_t index = HT_BUCKET_INDEX(hash, buckets->size);
+        ht_items_list_t *list = ATOMIC_READ_ACQUIRE(buckets->lists[index]);
+        while (list == HT_BUCKET_MOVED) {
+            buckets = ATOMIC_READ_ACQUIRE(buckets->next);
+            index = HT_BUCKET_INDEX(hash, buckets->size);
+            list = ATOMIC_READ_ACQUIRE(buckets->lists[index]);
+        }
+
+        if (!list)
+            return NULL;
+
+        uint32_t seq = ATOMIC_READ_ACQUIRE(list->seq);
+        if (seq & 1) {
+            HT_STATS_INCREMENT(table, lookup_retries);
+            continue;
+        }
+
+        // NOTE : a matching item is still valid even if the list changed
+        //        in the meanwhile, only a miss must be validated
+        int hops = 0;
+        ht_item_t *item = ATOMIC_READ_ACQUIRE(TAILQ_FIRST(&list->head));
+        while (item) {
+            if (item->hash == hash && HT_KEY_EQUALS(item->key, item->klen, key, klen)) {
+                uint64_t now = 0;
+                if (!HT_VALUE_INLINE(&item->data) || ht_item_expired(item, &now))
+                    return NULL;
+                if (table->cache && !ATOMIC_READ_RELAXED(((ht_cache_item_t *)item)->referenced))
+                    ATOMIC_STORE_RELAXED(((ht_cache_item_t *)item)->referenced, 1);
+                return item;
+            }
+            if (++hops % 16 == 0 && ATOMIC_READ_ACQUIRE(list->seq) != seq)
+                break;
+            item = ATOMIC_READ_ACQUIRE(TAILQ_NEXT(item, next));
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (ATOMIC_READ_RELAXED(list->seq) == seq &&
+            ATOMIC_READ_RELAXED(buckets->lists[index]) == list)
+        {
+            return NULL;
+        }
+        HT_STATS_INCREMENT(table, lookup_retries);
+    }
+}
+
+// create the key if missing (or update it if it has been created meanwhile)
+static int
+ht_num_update_locked(hashtable_t *table, uint64_t hash, void *key, size_t klen, ht_num_op_t *op)
+{
+    ht_items_list_t *list = ht_get_list(table, hash);
+    if (!list)
+        list = ht_set_list(table, hash);
+    if (!list)
+        return -1;
+
+    uint64_t now = 0;
+    ht_item_t *expired = NULL;
+    ht_item_t *item = NULL;
+    ht_item_t *cur = NULL;
+    TAILQ_FOREACH(cur, &list->head, next) {
+        if (cur->hash == hash && HT_KEY_EQUALS(cur->key, cur->klen, key, klen)) {
+            if (ht_item_expired(cur, &now)) {
+                // an expired item is replaced as if it wasn't there
+                ht_item_unlink(table, list, cur);
+                expired = cur;
+            } else {
+                item = cur;
+            }
+            break;
+        }
+    }
+
+    int rc = 0;
+    ht_num_t value;
+    if (item) {
+        // values which are not numeric can't be updated
+        if (HT_VALUE_INLINE(&item->data))
+            rc = ht_num_apply(item, op);
+        else
+            rc = -1;
+        if (rc == 0 && table->cache)
+            ht_cache_update(table, item);
+    } else if (ht_num_initial(op, &value) != 0) {
+        op->result.i = 0;
+        op->swapped = 0;
+    } else {
+        item = ht_item_create(table, hash, key, klen, NULL, sizeof(ht_num_t), 0);
+        if (item) {
+            item->num = value;
+            item->num_double = op->is_double;
+            item->data = &item->num;
+            ht_item_link(table, list, item);
+            op->result = value;
+            op->swapped = 1;
+        } else {
+            rc = -1;
+        }
+    }
+
+    HT_LIST_UNLOCK(list);
+
+    if (expired)
+        ht_item_release(table, expired);
+
+    ht_set_complete(table, hash);
+
+    return rc;
+}
+
+static int
+ht_num_update(hashtable_t *table, void *key, size_t klen, ht_num_op_t *op)
+{
+    if (!klen)
+        return -1;
+
+    uint64_t hash = ht_hash(table, key, klen);
+    if (table->shards)
+        table = HT_SHARD(table, hash);
+
+    // the values of a flat table (and of an image) can't be referenced
+    if (table->flat || table->image)
+        return -1;
+
+    int rc = 0;
+    ht_epoch_enter();
+    ht_item_t *item = ht_num_find(table, hash, key, klen);
+    if (item)
+        rc = ht_num_apply(item, op);
+    ht_epoch_exit();
+
+    if (!item)
+        return ht_num_update_locked(table, hash, key, klen, op);
+
+    if (rc != 0)
+        return rc;
+
+    if (ATOMIC_READ(table->growing))
+        ht_grow_step(table, HT_GROW_STEP);
+
+    return 0;
+}
+
+static int
+ht_num_get(hashtable_t *table, void *key, size_t klen, int is_double, ht_num_t *value)
+{
+    uint64_t hash = ht_hash(table, key, klen);
+    if (table->shards)
+        table = HT_SHARD(table, hash);
+
+    if (table->flat || table->image)
+        return -1;
+
+    int rc = -1;
+    ht_epoch_enter();
+    ht_item_t *item = ht_num_find(table, hash, key, klen);
+    if (item && item->num_double == is_double) {
+        value->i = ATOMIC_READ_RELAXED(item->num.i);
+        rc = 0;
+    }
+    ht_epoch_exit();
+
+    return rc;
+}
+
+int
+ht_incr(hashtable_t *table, void *key, size_t klen, int64_t delta, int64_t *value)
+{
+    ht_num_op_t op = { .type = HT_NUM_ADD, .operand.i = delta };
+    int rc = ht_num_update(table, key, klen, &op);
+    if (rc == 0 && value)
+        *value = op.result.i;
+    return rc;
+}
+
+int
+ht_incr_double(hashtable_t *table, void *key, size_t klen, double delta, double *value)
+{
+    ht_num_op_t op = { .type = HT_NUM_ADD, .is_double = 1, .operand.d = delta };
+    int rc = ht_num_update(table, key, klen, &op);
+    if (rc == 0 && value)
+        *value = op.result.d;
+    return rc;
+}
+
+int
+ht_min_int64(hashtable_t *table, void *key, size_t klen, int64_t operand, int64_t *value)
+{
+    ht_num_op_t op = { .type = HT_NUM_MIN, .operand.i = operand };
+    int rc = ht_num_update(table, key, klen, &op);
+    if (rc == 0 && value)
+        *value = op.result.i;
+    return rc;
+}
+
+int
+ht_max_int64(hashtable_t *table, void *key, size_t klen, int64_t operand, int64_t *value)
+{
+    ht_num_op_t op = { .type = HT_NUM_MAX, .operand.i = operand };
+    int rc = ht_num_update(table, key, klen, &op);
+    if (rc == 0 && value)
+        *value = op.result.i;
+    return rc;
+}
+
+int
+ht_min_double(hashtable_t *table, void *key, size_t klen, double operand, double *value)
+{
+    ht_num_op_t op = { .type = HT_NUM_MIN, .is_double = 1, .operand.d = operand };
+    int rc = ht_num_update(table, key, klen, &op);
+    if (rc == 0 && value)
+        *value = op.result.d;
+    return rc;
+}
+
+int
+ht_max_double(hashtable_t *table, void *key, size_t klen, double operand, double *value)
+{
+    ht_num_op_t op = { .type = HT_NUM_MAX, .is_double = 1, .operand.d = operand };
+    int rc = ht_num_update(table, key, klen, &op);
+    if (rc == 0 && value)
+        *value = op.result.d;
+    return rc;
+}
+
+int
+ht_cas_int64(hashtable_t *table, void *key, size_t klen, int64_t expected, int64_t value, int64_t *current)
+{
+    ht_num_op_t op = { .type = HT_NUM_CAS, .operand.i = value, .expected.i = expected };
+    if (ht_num_update(table, key, klen, &op) != 0)
+        return -1;
+    if (current)
+        *current = op.result.i;
+    return op.swapped ? 0 : 1;
+}
+
+int
+ht_cas_double(hashtable_t *table, void *key, size_t klen, double expected, double value, double *current)
+{
+    ht_num_op_t op = { .type = HT_NUM_CAS, .is_double = 1, .operand.d = value, .expected.d = expected };
+    if (ht_num_update(table, key, klen, &op) != 0)
+        return -1;
+    if (current)
+        *current = op.result.d;
+    return op.swapped ? 0 : 1;
+}
+
+int
+ht_get_int64(hashtable_t *table, void *key, size_t klen, int64_t *value)
+{
+    ht_num_t num;
+    if (ht_num_get(table, key, klen, 0, &num) != 0)
+        return -1;
+    if (value)
+        *value = num.i;
+    return 0;
+}
+
+int
+ht_get_double(hashtable_t *table, void *key, size_t klen, double *value)
+{
+    ht_num_t num;
+    if (ht_num_get(table, key, klen, 1, &num) != 0)
+        return -1;
+    if (value)
+        *value = num.d;
+    return 0;
+}
+
+static void
+free_key(hashtable_key_t *key)
+{
+    free(key->data);
+    free(key);
+}
+
+static linked_list_t *
+ht_flat_get_all_keys(hashtable_t *table, linked_list_t *output)
+{
+    ht_flat_t *flat = table->flat;
+    size_t i;
+
+    RWLOCK_RDLOCK(flat->lock);
+    for (i = 0; i < flat->capacity; i++) {
+        if (flat->ctrl[i] < 0)
+            continue;
+        ht_flat_slot_t *slot = &flat->slots[i];
+        hashtable_key_t *key = malloc(sizeof(hashtable_key_t));
+        if (!key) {
+            RWLOCK_UNLOCK(flat->lock);
+            list_destroy(output);
+            return NULL;
+        }
+        key->data = malloc(slot->klen);
+        if (!key->data) {
+            RWLOCK_UNLOCK(flat->lock);
+            free(key);
+            list_destroy(output);
+            return NULL;
+        }
+        memcpy(key->data, HT_FLAT_SLOT_KEY(slot), slot->klen);
+        key->len = slot->klen;
+        key->vlen = slot->dlen;
+        list_push_value(output, key);
+    }
+    RWLOCK_UNLOCK(flat->lock);
+    return output;
+}
+
+static linked_list_t *
+ht_flat_get_all_values(hashtable_t *table, linked_list_t *output)
+{
+    ht_flat_t *flat = table->flat;
+    size_t i;
+
+    RWLOCK_RDLOCK(flat->lock);
+    for (i = 0; i < flat->capacity; i++) {
+        if (flat->ctrl[i] < 0)
+            continue;
+        ht_flat_slot_t *slot = &flat->slots[i];
+        hashtable_value_t *v = malloc(sizeof(hashtable_value_t));
+        if (!v) {
+            RWLOCK_UNLOCK(flat->lock);
+            list_destroy(output);
+            return NULL;
+        }
+        v->data = slot->data;
+        v->len = slot->dlen;
+        v->key = HT_FLAT_SLOT_KEY(slot);
+        v->klen = slot->klen;
+        list_push_value(output, v);
+    }
+    RWLOCK_UNLOCK(flat->lock);
+    return output;
+}
+
+// visit the i-th key of the image, unless it has been replaced or deleted
+// NOTE : no lock must be held, the key might be removed by the callback
+static int
+ht_image_visit(hashtable_t *table, size_t i, ht_pair_iterator_callback_t cb, void *user)
+{
+    ht_image_t *image = table->image;
+    ht_image_slot_t *slot = &image->slots[i];
+    ht_image_entry_t *entry = ht_image_entry(image, slot);
+    if (!entry)
+        return HT_ITERATOR_CONTINUE;
+    char *key = (char *)(entry + 1);
+    void *value = entry->dlen ? key + HT_IMAGE_ALIGN(entry->klen) : NULL;
+
+    // keys replaced in the overlay have been visited already
+    if (ht_lookup_internal(table, slot->hash, key, entry->klen, NULL, NULL, 1))
+        return HT_ITERATOR_CONTINUE;
+
+    if (ATOMIC_READ(image->deleted->count) && ht_exists(image->deleted, key, entry->klen))
+        return HT_ITERATOR_CONTINUE;
+
+    int rc = cb(table, key, entry->klen, value, entry->dlen, user);
+    if (rc == HT_ITERATOR_REMOVE || rc == HT_ITERATOR_REMOVE_AND_STOP)
+        ht_delete(table, key, entry->klen, NULL, NULL);
+    return rc;
+}
+
+// visit the keys served by the image
+static void
+ht_image_foreach(hashtable_t *table, ht_pair_iterator_callback_t cb, void *user)
+{
+    ht_image_t *image = table->image;
+    size_t i;
+
+    for (i = 0; i < image->count && !ATOMIC_READ(image->hidden); i++) {
+        int rc = ht_image_visit(table, i, cb, user);
+        if (rc == HT_ITERATOR_STOP || rc == HT_ITERATOR_REMOVE_AND_STOP)
+            break;
+    }
+}
+
+typedef struct {
+    linked_list_t *output;
+    int error;
+} ht_image_collect_arg_t;
+
+static int
+ht_image_collect_key(hashtable_t *table __attribute__ ((unused)), void *key, size_t klen, void *value __attribute__ ((unused)), size_t vlen, void *user)
+{
+    ht_image_collect_arg_t *arg = (ht_image_collect_arg_t *)user;
+    hashtable_key_t *hkey = malloc(sizeof(hashtable_key_t));
+    if (!hkey) {
+        arg->error = 1;
+        return HT_ITERATOR_STOP;
+    }
+    hkey->data = malloc(klen);
+    if (!hkey->data) {
+        free(hkey);
+        arg->error = 1;
+        return HT_ITERATOR_STOP;
+    }
+    memcpy(hkey->data, key, klen);
+    hkey->len = klen;
+    hkey->vlen = vlen;
+    list_push_value(arg->output, hkey);
+    return HT_ITERATOR_CONTINUE;
+}
+
+static int
+ht_image_collect_value(hashtable_t *table __attribute__ ((unused)), void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    ht_image_collect_arg_t *arg = (ht_image_collect_arg_t *)user;
+    hashtable_value_t *v = malloc(sizeof(hashtable_value_t));
+    if (!v) {
+        arg->error = 1;
+        return HT_ITERATOR_STOP;
+    }
+    v->data = value;
+    v->len = vlen;
+    v->key = key;
+    v->klen = klen;
+    list_push_value(arg->output, v);
+    return HT_ITERATOR_CONTINUE;
+}
+
+// gather the keys (or the values) of all the shards in a single list
+static linked_list_t *
+ht_shards_collect(hashtable_t *table, linked_list_t *output, linked_list_t *(*collect)(hashtable_t *))
+{
+    size_t i;
+    for (i = 0; i < table->nshards; i++) {
+        linked_list_t *partial = collect(table->shards[i]);
+        if (!partial) {
+            list_destroy(output);
+            return NULL;
+        }
+        void *value;
+        while ((value = list_shift_value(partial)))
+            list_push_value(output, value);
+        list_destroy(partial);
+    }
+    return output;
+}
+
+linked_list_t *
+ht_get_all_keys(hashtable_t *table)
+{
+    linked_list_t *output = list_create();
+    list_set_free_value_callback(output, (free_value_callback_t)free_key);
+
+    if (table->shards)
+        return ht_shards_collect(table, output, ht_get_all_keys);
+
+    if (table->flat)
+        return ht_flat_get_all_keys(table, output);
+
+    uint64_t now = 0;
+    MUTEX_LOCK(table->iterator_lock);
+    ht_items_list_t *list = NULL;
+    TAILQ_FOREACH(list, &table->iterator_list->head, iterator_next) {
+        HT_LIST_LOCK(table, list);
+
+        ht_item_t *item = NULL;
+        TAILQ_FOREACH(item, &list->head, next) {
+            if (ht_item_expired(item, &now))
+                continue;
+            hashtable_key_t *key = malloc(sizeof(hashtable_key_t));
+            if (!key) {
+                HT_LIST_UNLOCK(list);
+                MUTEX_UNLOCK(table->iterator_lock);
+                list_destroy(output);
+                return NULL;
+            }
+            key->data = malloc(item->klen);
+            if (!key->data) {
+                HT_LIST_UNLOCK(list);
+                MUTEX_UNLOCK(table->iterator_lock);
+                free(key);
+                list_destroy(output);
+                return NULL;
+            }
+            memcpy(key->data, item->key, item->klen);
+            key->len = item->klen;
+            key->vlen = item->dlen;
+            list_push_value(output, key);
+        }
+
+        HT_LIST_UNLOCK(list);
+    }
+    MUTEX_UNLOCK(table->iterator_lock);
+
+    if (table->image) {
+        ht_image_collect_arg_t arg = { output, 0 };
+        ht_image_foreach(table, ht_image_collect_key, &arg);
+        if (arg.error) {
+            list_destroy(output);
+            return NULL;
+        }
+    }
+
+    return output;
+}
+
+linked_list_t *
+ht_get_all_values(hashtable_t *table)
+{
+    linked_list_t *output = list_create();
+    list_set_free_value_callback(output, (free_value_callback_t)free);
+
+    if (table->shards)
+        return ht_shards_collect(table, output, ht_get_all_values);
+
+    if (table->flat)
+        return ht_flat_get_all_values(table, output);
+
+    uint64_t now = 0;
+    MUTEX_LOCK(table->iterator_lock);
+    ht_items_list_t *list = NULL;
+    TAILQ_FOREACH(list, &table->iterator_list->head, iterator_next) {
+        HT_LIST_LOCK(table, list);
+
+        ht_item_t *item = NULL;
+        TAILQ_FOREACH(item, &list->head, next) {
+            if (ht_item_expired(item, &now))
+                continue;
+            hashtable_value_t *v = malloc(sizeof(hashtable_value_t));
+            if (!v) {
+                HT_LIST_UNLOCK(list);
+                MUTEX_UNLOCK(table->iterator_lock);
+                list_destroy(output);
+                return NULL;
+            }
+            v->data = item->data;
+            v->len = item->dlen;
+            v->key = item->key;
+            v->klen = item->klen;
+            list_push_value(output, v);
+        }
+
+        HT_LIST_UNLOCK(list);
+    }
+    MUTEX_UNLOCK(table->iterator_lock);
+
+    if (table->image) {
+        ht_image_collect_arg_t arg = { output, 0 };
+        ht_image_foreach(table, ht_image_collect_value, &arg);
+        if (arg.error) {
+            list_destroy(output);
+            return NULL;
+        }
+    }
+
+    return output;
 }
 
 typedef struct {
-    void *data;
-    size_t dlen;
-    void *match;
-    size_t match_size;
-    int matched;
-    void **prev_data;
-    size_t *prev_len;
-} ht_set_if_equals_helper_arg_t;
+    int (*cb)(hashtable_t *, void *, size_t, void *);
+    void *user;
+} ht_iterator_arg_t;
+
+static int
+ht_foreach_key_helper(hashtable_t *table, void *key, size_t klen, void *value __attribute__ ((unused)), size_t vlen __attribute__ ((unused)), void *user)
+{
+    ht_iterator_arg_t *arg = (ht_iterator_arg_t *)user;
+    return arg->cb(table, key, klen, arg->user);
+}
+
+void
+ht_foreach_key(hashtable_t *table, ht_key_iterator_callback_t cb, void *user)
+{
+    ht_iterator_arg_t arg = { cb, user };
+    ht_foreach_pair(table, ht_foreach_key_helper, &arg);
+}
+
+static int
+ht_foreach_value_helper(hashtable_t *table, void *key __attribute__ ((unused)), size_t klen __attribute__ ((unused)), void *value, size_t vlen, void *user)
+{
+    ht_iterator_arg_t *arg = (ht_iterator_arg_t *)user;
+    return arg->cb(table, value, vlen, arg->user);
+}
+
+void
+ht_foreach_value(hashtable_t *table, ht_value_iterator_callback_t cb, void *user)
+{
+    ht_iterator_arg_t arg = { cb, user };
+    ht_foreach_pair(table, ht_foreach_value_helper, &arg);
+}
+
+typedef struct {
+    hashtable_t *table;
+    ht_pair_iterator_callback_t cb;
+    void *user;
+    int stop;
+} ht_shard_iterator_arg_t;
+
+// the callbacks get the sharded table, not the shard being visited
+static int
+ht_shard_foreach_helper(hashtable_t *shard __attribute__ ((unused)), void *key, size_t klen, void *value, size_t vlen, void *user)
+{
+    ht_shard_iterator_arg_t *arg = (ht_shard_iterator_arg_t *)user;
+    int rc = arg->cb(arg->table, key, klen, value, vlen, arg->user);
+    if (rc == HT_ITERATOR_STOP || rc == HT_ITERATOR_REMOVE_AND_STOP)
+        arg->stop = 1;
+    return rc;
+}
+
+void
+ht_foreach_pair(hashtable_t *table, ht_pair_iterator_callback_t cb, void *user)
+{
+    int rc = 0;
+
+    if (table->shards) {
+        ht_shard_iterator_arg_t arg = { table, cb, user, 0 };
+        size_t i;
+        for (i = 0; i < table->nshards && !arg.stop; i++)
+            ht_foreach_pair(table->shards[i], ht_shard_foreach_helper, &arg);
+        return;
+    }
+
+    if (table->flat) {
+        ht_flat_foreach_pair(table, cb, user);
+        return;
+    }
+
+    uint64_t now = 0;
+    MUTEX_LOCK(table->iterator_lock);
+    ht_items_list_t *list = NULL;
+    int stop = 0;
+    TAILQ_FOREACH(list, &table->iterator_list->head, iterator_next) {
+        HT_LIST_LOCK(table, list);
+        ht_item_t *item = NULL;
+        ht_item_t *tmp = NULL;
+        TAILQ_FOREACH_SAFE(item, &list->head, next, tmp) {
+            if (ht_item_expired(item, &now)) {
+                ht_item_unlink(table, list, item);
+                ht_item_value_release(table, item);
+                ht_retire(table, item, ht_item_destroy);
+                continue;
+            }
+            rc = cb(table, item->key, item->klen, item->data, item->dlen, user);
+            if (rc == HT_ITERATOR_CONTINUE) {
+                continue;
+            } else if (rc == HT_ITERATOR_STOP) {
+                stop = 1;
+                break;
+            } else {
+                // rc is either HT_ITERATOR_REMOVE or HT_ITERATOR_REMOVE_AND_STOP
+                ht_item_unlink(table, list, item);
+                ht_item_value_release(table, item);
+                ht_retire(table, item, ht_item_destroy);
+                if (rc == HT_ITERATOR_REMOVE_AND_STOP) {
+                    stop = 1;
+                    break;
+                }
+            }
+        }
+        HT_LIST_UNLOCK(list);
+        if (stop) {
+            break;
+        }
+    }
+    MUTEX_UNLOCK(table->iterator_lock);
+
+    // NOTE : the image is visited without holding any lock,
+    //        so removing its keys is just like calling ht_delete()
+    if (table->image && !stop)
+        ht_image_foreach(table, cb, user);
+}
+
+/*
+ * Parallel iteration
+ *
+ * The bucket arrays of the table (the current one and, if the table is
+ * growing, the one the buckets are being migrated to, for each shard) are
+ * seen as a single sequence of buckets, split in contiguous ranges, one for
+ * each worker. As in ht_foreach_pair() the iterator lock of each table is
+ * held for the whole walk, so no list can be created or migrated in the
+ * meanwhile, and each list is locked while its items are being visited.
+ */
+
+// don't bother starting a thread for less buckets than this
+#define HT_PARALLEL_MIN_BUCKETS 4096
+
+typedef struct {
+    hashtable_t *table; // the table (or shard) owning the buckets
+    ht_buckets_t *buckets;
+    size_t base;        // the position of the first bucket in the sequence
+} ht_parallel_segment_t;
+
+typedef struct _ht_parallel ht_parallel_t;
+
+typedef struct {
+    ht_parallel_t *parallel;
+    size_t from;
+    size_t to;
+    void *user;
+} ht_parallel_worker_t;
+
+struct _ht_parallel {
+    // the table passed to the callback
+    hashtable_t *table;
+    ht_pair_iterator_callback_t cb;
+    ht_parallel_segment_t *segments;
+    size_t nsegments;
+    size_t nbuckets;
+    int stop;
+};
+
+// NOTE : returns 1 if the callback asked to stop the iteration
+static int
+ht_parallel_visit_list(ht_parallel_t *parallel, hashtable_t *table, ht_items_list_t *list, void *user)
+{
+    uint64_t now = 0;
+    int stop = 0;
+
+    HT_LIST_LOCK(table, list);
+    ht_item_t *item = NULL;
+    ht_item_t *tmp = NULL;
+    TAILQ_FOREACH_SAFE(item, &list->head, next, tmp) {
+        if (ht_item_expired(item, &now)) {
+            ht_item_unlink(table, list, item);
+            ht_item_value_release(table, item);
+            ht_retire(table, item, ht_item_destroy);
+            continue;
+        }
+        int rc = parallel->cb(parallel->table, item->key, item->klen, item->data, item->dlen, user);
+        if (rc == HT_ITERATOR_CONTINUE)
+            continue;
+        if (rc != HT_ITERATOR_STOP) {
+            // rc is either HT_ITERATOR_REMOVE or HT_ITERATOR_REMOVE_AND_STOP
+            ht_item_unlink(table, list, item);
+            ht_item_value_release(table, item);
+            ht_retire(table, item, ht_item_destroy);
+        }
+        if (rc == HT_ITERATOR_STOP || rc == HT_ITERATOR_REMOVE_AND_STOP) {
+            stop = 1;
+            break;
+        }
+        // other workers might have been asked to stop in the meanwhile
+        if (ATOMIC_READ_RELAXED(parallel->stop))
+            break;
+    }
+    HT_LIST_UNLOCK(list);
+
+    return stop;
+}
+
+static void *
+ht_parallel_visit(void *arg)
+{
+    ht_parallel_worker_t *worker = (ht_parallel_worker_t *)arg;
+    ht_parallel_t *parallel = worker->parallel;
+    size_t s;
+    for (s = 0; s < parallel->nsegments; s++) {
+        ht_parallel_segment_t *segment = &parallel->segments[s];
+        size_t end = segment->base + segment->buckets->size;
+        size_t from = worker->from > segment->base ? worker->from : segment->base;
+        size_t to = worker->to < end ? worker->to : end;
+        size_t i;
+        for (i = from; i < to; i++) {
+            if (ATOMIC_READ_RELAXED(parallel->stop))
+                return NULL;
+            ht_items_list_t *list = segment->buckets->lists[i - segment->base];
+            if (!list || list == HT_BUCKET_MOVED)
+                continue;
+            if (ht_parallel_visit_list(parallel, segment->table, list, worker->user))
+                ATOMIC_SET(parallel->stop, 1);
+        }
+    }
+    return NULL;
+}
+
+static void
+ht_foreach_pair_internal(hashtable_t *table,
+                         int nthreads,
+                         ht_pair_iterator_callback_t cb,
+                         void *locals,
+                         size_t local_size,
+                         void *user)
+{
+    hashtable_t **targets = &table;
+    size_t ntargets = 1;
+    if (table->shards) {
+        targets = table->shards;
+        ntargets = table->nshards;
+    }
+
+    ht_parallel_t parallel = {
+        .table = table,
+        .cb = cb,
+        .segments = calloc(ntargets * 2, sizeof(ht_parallel_segment_t))
+    };
+    if (!parallel.segments) {
+        // visit all the pairs from the calling thread then
+        ht_foreach_pair(table, cb, locals ? locals : user);
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < ntargets; i++) {
+        if (targets[i]->flat)
+            continue;
+        MUTEX_LOCK(targets[i]->iterator_lock);
+        ht_buckets_t *buckets;
+        for (buckets = targets[i]->buckets; buckets; buckets = buckets->next) {
+            ht_parallel_segment_t *segment = &parallel.segments[parallel.nsegments++];
+            segment->table = targets[i];
+            segment->buckets = buckets;
+            segment->base = parallel.nbuckets;
+            parallel.nbuckets += buckets->size;
+        }
+    }
+
+    int nworkers = ht_workers_count(nthreads, parallel.nbuckets, HT_PARALLEL_MIN_BUCKETS);
+    // there is a local state for each of the requested threads only
+    if (locals && nworkers > nthreads)
+        nworkers = nthreads;
+
+    ht_parallel_worker_t workers[nworkers];
+    int w;
+    for (w = 0; w < nworkers; w++) {
+        workers[w].parallel = &parallel;
+        workers[w].from = parallel.nbuckets * w / nworkers;
+        workers[w].to = parallel.nbuckets * (w + 1) / nworkers;
+        workers[w].user = locals ? (char *)locals + w * local_size : user;
+    }
+
+    ht_workers_run(workers, sizeof(ht_parallel_worker_t), nworkers, ht_parallel_visit);
+
+    for (i = 0; i < ntargets; i++) {
+        if (!targets[i]->flat)
+            MUTEX_UNLOCK(targets[i]->iterator_lock);
+    }
+    free(parallel.segments);
+
+    // flat tables and images are visited by the calling thread
+    user = workers[0].user;
+    for (i = 0; i < ntargets && !parallel.stop; i++) {
+        if (!targets[i]->flat && !targets[i]->image)
+            continue;
+        ht_shard_iterator_arg_t arg = { table, cb, user, 0 };
+        if (targets[i]->flat)
+            ht_flat_foreach_pair(targets[i], ht_shard_foreach_helper, &arg);
+        else
+            ht_image_foreach(targets[i], ht_shard_foreach_helper, &arg);
+        parallel.stop = arg.stop;
+    }
+}
+
+void
+ht_foreach_pair_parallel(hashtable_t *table, int nthreads, ht_pair_iterator_callback_t cb, void *user)
+{
+    ht_foreach_pair_internal(table, nthreads, cb, NULL, 0, user);
+}
+
+void
+ht_foreach_pair_reduce(hashtable_t *table,
+                       int nthreads,
+                       ht_pair_iterator_callback_t cb,
+                       void *locals,
+                       size_t local_size,
+                       ht_reduce_callback_t reduce,
+                       void *user)
+{
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    ht_foreach_pair_internal(table, nthreads, cb, locals, local_size, user);
+
+    int i;
+    for (i = 0; i < nthreads; i++)
+        reduce(table, (char *)locals + i * local_size, user);
+}
+
+/*
+ * Cursor based iteration
+ *
+ * The cursor walks the buckets in reverse binary order (the bits of the
+ * bucket index are incremented starting from the most significant one).
+ * Since growing the table splits each bucket i of an array of size n in the
+ * buckets i and i + n of the new one, the buckets visited before the table
+ * grew map exactly to the ones preceding the cursor in the new order, so no
+ * bucket is ever skipped (and none is visited twice, unless the scan of a
+ * bucket has been interrupted by the callback).
+ * The high bits of the cursor select the shard (if any) or, once all the
+ * buckets have been visited, the position within the image (if any).
+ * A scan interrupted in the first bucket can't return 0 (which means the
+ * scan is complete), so HT_SCAN_FIRST is returned to resume from there.
+ */
+#define HT_SCAN_IMAGE (1ULL << 63)
+#define HT_SCAN_SHARD_SHIFT 47
+#define HT_SCAN_FIRST (1ULL << 46)
+#define HT_SCAN_INDEX_MASK ((1ULL << HT_SCAN_SHARD_SHIFT) - 1)
+
+static inline uint64_t
+ht_reverse_bits(uint64_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return __builtin_bswap64(v);
+}
+
+// visit the items hashed to the bucket selected by the cursor, following it
+// to the next array if it has been already migrated. Only the lock of the
+// list being visited is held while calling the callback
+// NOTE : must be called inside an epoch, returns 1 if the callback
+//        asked to stop the iteration
+static int
+ht_scan_bucket(hashtable_t *table, ht_buckets_t *buckets, uint64_t cursor,
+               ht_pair_iterator_callback_t cb, void *user)
+{
+    size_t index = HT_BUCKET_INDEX(cursor, buckets->size);
+    ht_items_list_t *list;
+    for (;;) {
+        list = ATOMIC_READ_ACQUIRE(buckets->lists[index]);
+        if (!list || list == HT_BUCKET_MOVED)
+            break;
+        HT_LIST_LOCK(table, list);
+        // the bucket might have been migrated while we were waiting for the lock
+        if (ATOMIC_READ_ACQUIRE(buckets->lists[index]) == list)
+            break;
+        HT_LIST_UNLOCK(list);
+    }
+
+    if (list == HT_BUCKET_MOVED) {
+        // the bucket has been split, its items are now in the buckets
+        // of the next array having the same low bits
+        ht_buckets_t *next = ATOMIC_READ_ACQUIRE(buckets->next);
+        size_t i;
+        for (i = index; i < next->size; i += buckets->size) {
+            if (ht_scan_bucket(table, next, i, cb, user))
+                return 1;
+        }
+        return 0;
+    }
 
-static int
-ht_set_if_equals_helper(hashtable_t *table, void *key __attribute__ ((unused)), size_t klen __attribute__ ((unused)), void **value, size_t *vlen, void *user)
+    if (!list)
+        return 0;
+
+    uint64_t now = 0;
+    int stop = 0;
+    ht_item_t *item = NULL;
+    ht_item_t *tmp = NULL;
+    TAILQ_FOREACH_SAFE(item, &list->head, next, tmp) {
+        if (ht_item_expired(item, &now)) {
+            ht_item_unlink(table, list, item);
+            ht_item_value_release(table, item);
+            ht_retire(table, item, ht_item_destroy);
+            continue;
+        }
+        int rc = cb(table, item->key, item->klen, item->data, item->dlen, user);
+        if (rc == HT_ITERATOR_CONTINUE)
+            continue;
+        if (rc == HT_ITERATOR_REMOVE || rc == HT_ITERATOR_REMOVE_AND_STOP) {
+            ht_item_unlink(table, list, item);
+            ht_item_value_release(table, item);
+            ht_retire(table, item, ht_item_destroy);
+        }
+        if (rc == HT_ITERATOR_STOP || rc == HT_ITERATOR_REMOVE_AND_STOP) {
+            stop = 1;
+            break;
+        }
+    }
+    HT_LIST_UNLOCK(list);
+    return stop;
+}
+
+// the flat engine relocates the slots when growing, so the cursor is
+// just the index of the next slot to visit
+static uint64_t
+ht_flat_scan(hashtable_t *table, uint64_t cursor, size_t count,
+             ht_pair_iterator_callback_t cb, void *user)
 {
-    ht_set_if_equals_helper_arg_t *arg = (ht_set_if_equals_helper_arg_t *)user;
-     
-    if (arg->prev_len)
-        *arg->prev_len = *vlen;
+    ht_flat_t *flat = table->flat;
+
+    RWLOCK_WRLOCK(flat->lock);
+    while (count-- && cursor < flat->capacity) {
+        size_t i = cursor++;
+        if (flat->ctrl[i] < 0)
+            continue;
+        ht_flat_slot_t *slot = &flat->slots[i];
+        int rc = cb(table, HT_FLAT_SLOT_KEY(slot), slot->klen, slot->data, slot->dlen, user);
+        if (rc == HT_ITERATOR_REMOVE || rc == HT_ITERATOR_REMOVE_AND_STOP) {
+            ht_value_release(table, slot->data);
+            ht_flat_erase(table, i);
+            ATOMIC_DECREMENT(table->count);
+        }
+        if (rc == HT_ITERATOR_STOP || rc == HT_ITERATOR_REMOVE_AND_STOP)
+            break;
+    }
+    if (cursor >= flat->capacity)
+        cursor = 0;
+    RWLOCK_UNLOCK(flat->lock);
+    return cursor;
+}
 
-    if (arg->prev_data)
-        *arg->prev_data = *value;
+uint64_t
+ht_scan(hashtable_t *table, uint64_t cursor, size_t count, ht_pair_iterator_callback_t cb, void *user)
+{
+    if (!count)
+        return cursor;
+
+    if (table->shards) {
+        size_t shard = (cursor >> HT_SCAN_SHARD_SHIFT) & (table->nshards - 1);
+        ht_shard_iterator_arg_t arg = { table, cb, user, 0 };
+        uint64_t next = ht_scan(table->shards[shard], cursor & HT_SCAN_INDEX_MASK,
+                                count, ht_shard_foreach_helper, &arg);
+        if (!next && ++shard == table->nshards)
+            return 0;
+        return ((uint64_t)shard << HT_SCAN_SHARD_SHIFT) | next;
+    }
 
-    if (arg->match_size == *vlen && ((char *)*value)[0] == *((char *)arg->match) &&
-        memcmp(*value, arg->match, arg->match_size) == 0)
-    {
-        arg->matched = 1;
+    if (table->flat)
+        return ht_flat_scan(table, cursor, count, cb, user);
+
+    ht_image_t *image = table->image;
+    if (!(cursor & HT_SCAN_IMAGE)) {
+        cursor &= ~HT_SCAN_FIRST;
+        while (count) {
+            // NOTE : the array is looked up again for each bucket, the table
+            //        might have grown in the meanwhile, which the reverse
+            //        order of the cursor takes care of
+            ht_epoch_enter();
+            ht_buckets_t *buckets = ATOMIC_READ_ACQUIRE(table->buckets);
+            uint64_t mask = buckets->size - 1;
+            int stop = ht_scan_bucket(table, buckets, cursor, cb, user);
+            ht_epoch_exit();
+
+            // an interrupted bucket will be visited again by the next call
+            if (stop)
+                return cursor ? cursor : HT_SCAN_FIRST;
+
+            count--;
+            cursor = ht_reverse_bits(ht_reverse_bits(cursor | ~mask) + 1);
+            if (!cursor)
+                break;
+        }
 
-        if (!arg->prev_data && table->free_item_cb)
-            table->free_item_cb(*value);
+        if (cursor || !image || ATOMIC_READ(image->hidden))
+            return cursor;
 
-        *value = arg->data;
-        *vlen = arg->dlen;
+        cursor = HT_SCAN_IMAGE;
     }
 
-    return 0;
+    // NOTE : the image never changes, so its slots are just visited in order
+    size_t i = cursor & ~HT_SCAN_IMAGE;
+    while (count-- && i < image->count && !ATOMIC_READ(image->hidden)) {
+        int rc = ht_image_visit(table, i++, cb, user);
+        if (rc == HT_ITERATOR_STOP || rc == HT_ITERATOR_REMOVE_AND_STOP)
+            break;
+    }
+    if (i >= image->count || ATOMIC_READ(image->hidden))
+        return 0;
+    return HT_SCAN_IMAGE | i;
 }
 
-int
-ht_set_if_equals(hashtable_t *table,
-                 void *key,
-                 size_t klen,
-                 void *data,
-                 size_t dlen,
-                 void *match,
-                 size_t match_size,
-                 void **prev_data,
-                 size_t *prev_len)
+size_t
+ht_count(hashtable_t *table)
 {
-    if (!match && match_size == 0)
-        return ht_set_if_not_exists(table, key, klen, data, dlen);
+    if (table->shards) {
+        size_t i, count = 0;
+        for (i = 0; i < table->nshards; i++)
+            count += ht_count(table->shards[i]);
+        return count;
+    }
 
-    ht_set_if_equals_helper_arg_t arg = {
-        .data = data,
-        .dlen = dlen,
-        .match = match,
-        .match_size = match_size,
-        .matched = 0,
-        .prev_data = prev_data,
-        .prev_len = prev_len
-    };
-    if (ht_call_internal(table, key, klen, ht_set_if_equals_helper, (void *)&arg) == 0)
-    {
-        return arg.matched ? 0 : 1;
+    // get rid of the expired items first, so that they are not accounted
+    if (ATOMIC_READ(table->wheel))
+        ht_expire_internal(table, 1);
+
+    size_t count = ATOMIC_READ(table->count);
+
+    ht_image_t *image = table->image;
+    if (image && !ATOMIC_READ(image->hidden)) {
+        count += image->count - ATOMIC_READ(image->shadowed) -
+                 ATOMIC_READ(image->deleted->count);
     }
-    return -1;
+
+    return count;
 }
 
 
-typedef struct
+static void
+ht_stats_collect(hashtable_t *table, ht_stats_t *stats)
 {
-    int  unset;
-    void **prev_data;
-    size_t *prev_len;
-    void *match;
-    size_t match_size;
-} ht_delete_helper_arg_t;
+    int i;
 
-static int
-ht_delete_helper(hashtable_t *table, void *key __attribute__ ((unused)), size_t klen __attribute__ ((unused)), void **value, size_t *vlen, void *user)
-{
-    ht_delete_helper_arg_t *arg = (ht_delete_helper_arg_t *)user;
+    if (table->shards) {
+        size_t n;
+        for (n = 0; n < table->nshards; n++)
+            ht_stats_collect(table->shards[n], stats);
+        return;
+    }
 
-    if (arg->match && (arg->match_size != *vlen || memcmp(arg->match, *value, *vlen) != 0))
-        return -1;
+#ifndef HT_NO_STATS
+    for (i = 0; i < HT_SLAB_SHARDS; i++) {
+        stats->lock_contended += ATOMIC_READ_RELAXED(table->stats[i].lock_contended);
+        stats->lookup_retries += ATOMIC_READ_RELAXED(table->stats[i].lookup_retries);
+    }
+#endif
 
-    if (arg->prev_data)
-        *arg->prev_data = *value;
-    else if (table->free_item_cb)
-        table->free_item_cb(*value);
-    
-    if (arg->prev_len)
-        *arg->prev_len = *vlen;
+    stats->item_bytes += ht_slab_bytes(&table->item_slab) +
+                         ht_slab_bytes(&table->list_slab) +
+                         ht_slab_bytes(&table->timer_slab);
+    for (i = 0; i < HT_KEY_CLASSES; i++)
+        stats->key_bytes += ht_slab_bytes(&table->key_slabs[i]);
+    stats->key_bytes += ATOMIC_READ(table->big_key_bytes);
+    if (table->arena)
+        stats->key_bytes += ATOMIC_READ(table->arena->bytes);
+
+    if (table->flat) {
+        // slots are not chained, the whole group of 16 is probed at once
+        RWLOCK_RDLOCK(table->flat->lock);
+        stats->grows += table->grows;
+        stats->grow_time_ns += table->grow_time_ns;
+        stats->buckets += table->flat->capacity;
+        stats->bucket_bytes += table->flat->capacity * (sizeof(ht_flat_slot_t) + 1);
+        RWLOCK_UNLOCK(table->flat->lock);
+        return;
+    }
 
-    if (arg->unset) {
-        *vlen = 0;
-        *value = NULL;
-        return 0;
+    // holding the iterator lock nobody can create new lists or migrate them
+    MUTEX_LOCK(table->iterator_lock);
+    stats->grows += table->grows;
+    stats->grow_time_ns += table->grow_time_ns;
+    ht_buckets_t *buckets = table->buckets;
+    size_t size = buckets->next ? buckets->next->size : buckets->size;
+    size_t nlists = 0;
+    stats->buckets += size;
+    for (; buckets; buckets = buckets->next)
+        stats->bucket_bytes += sizeof(ht_buckets_t) + buckets->size * sizeof(ht_items_list_t *);
+
+    ht_items_list_t *list = NULL;
+    TAILQ_FOREACH(list, &table->iterator_list->head, iterator_next) {
+        size_t length = 0;
+        ht_item_t *item = NULL;
+        HT_LIST_LOCK(table, list);
+        TAILQ_FOREACH(item, &list->head, next)
+            length++;
+        HT_LIST_UNLOCK(list);
+        stats->chain_lengths[length < HT_STATS_CHAINS ? length : HT_STATS_CHAINS - 1]++;
+        if (length > stats->longest_chain)
+            stats->longest_chain = length;
+        nlists++;
     }
+    MUTEX_UNLOCK(table->iterator_lock);
 
-    return 1; // we want the item to be removed
+    // buckets which never got a list are empty as well
+    // (while growing, not migrated lists might stand for two buckets)
+    if (size > nlists)
+        stats->chain_lengths[0] += size - nlists;
 }
 
 int
-ht_unset(hashtable_t *table,
-         void *key,
-         size_t klen,
-         void **prev_data,
-         size_t *prev_len)
+ht_stats(hashtable_t *table, ht_stats_t *stats)
 {
-    ht_delete_helper_arg_t arg = {
-        .unset = 1,
-        .prev_data = prev_data,
-        .prev_len = prev_len,
-        .match = NULL,
-        .match_size = 0
-    };
-
-    return ht_call_internal(table, key, klen, ht_delete_helper, (void *)&arg);
+    memset(stats, 0, sizeof(ht_stats_t));
+    ht_stats_collect(table, stats);
+    stats->count = ht_count(table);
+    if (stats->buckets)
+        stats->load_factor = (double)stats->count / stats->buckets;
+    return 0;
 }
 
-static inline int
-ht_delete_internal (hashtable_t *table,
-                    void *key,
-                    size_t klen,
-                    void **prev_data,
-                    size_t *prev_len,
-                    void *match,
-                    size_t match_size)
+
+// the hash functions an image can be written with,
+// indexed by the hash_function field of the header
+static ht_hash_callback_t ht_image_hash_functions[] = {
+    ht_hash_wyhash,
+    ht_hash_one_at_a_time,
+    ht_hash_crc32c
+};
+
+#define HT_IMAGE_HASH_FUNCTIONS (sizeof(ht_image_hash_functions) / sizeof(ht_image_hash_functions[0]))
+
+static inline uint32_t
+ht_image_crc(uint32_t crc, const void *data, size_t len)
 {
+    crc = ~crc;
+    if (ht_crc32c_hw_available())
+        crc = ht_crc32c_hw(crc, (const uint8_t *)data, len);
+    else
+        crc = ht_crc32c_sw(crc, (const uint8_t *)data, len);
+    return ~crc;
+}
 
-    ht_delete_helper_arg_t arg = {
-        .unset = 0,
-        .prev_data = prev_data,
-        .prev_len = prev_len,
-        .match = match,
-        .match_size = match_size
-    };
+typedef struct {
+    FILE *out;
+    uint64_t offset;
+    uint32_t crc;
+    ht_hash_callback_t hash_cb;
+    uint64_t seed;
+    ht_image_slot_t *slots;
+    size_t count;
+    size_t size;
+    int error;
+} ht_save_arg_t;
 
-    return ht_call_internal(table, key, klen, ht_delete_helper, (void *)&arg);
+static void
+ht_save_write(ht_save_arg_t *arg, const void *data, size_t len)
+{
+    if (arg->error || !len)
+        return;
+
+    if (fwrite(data, 1, len, arg->out) != len) {
+        arg->error = 1;
+        return;
+    }
+    arg->crc = ht_image_crc(arg->crc, data, len);
+    arg->offset += len;
 }
 
-int
-ht_delete (hashtable_t *table,
-           void *key,
-           size_t klen,
-           void **prev_data,
-           size_t *prev_len)
+static void
+ht_save_pad(ht_save_arg_t *arg)
 {
-    return ht_delete_internal(table, key, klen, prev_data, prev_len, NULL, 0);
+    static const char padding[8] = { 0 };
+    ht_save_write(arg, padding, HT_IMAGE_ALIGN(arg->offset) - arg->offset);
 }
 
-int
-ht_delete_if_equals(hashtable_t *table, void *key, size_t klen, void *match, size_t match_size)
+static int
+ht_save_helper(hashtable_t *table __attribute__ ((unused)), void *key, size_t klen, void *value, size_t vlen, void *user)
 {
-    return ht_delete_internal(table, key, klen, NULL, NULL, match, match_size);
+    ht_save_arg_t *arg = (ht_save_arg_t *)user;
+
+    if (arg->count == arg->size) {
+        size_t size = arg->size ? arg->size * 2 : 1024;
+        ht_image_slot_t *slots = realloc(arg->slots, size * sizeof(ht_image_slot_t));
+        if (!slots) {
+            arg->error = 1;
+            return HT_ITERATOR_STOP;
+        }
+        arg->slots = slots;
+        arg->size = size;
+    }
+
+    ht_image_slot_t *slot = &arg->slots[arg->count++];
+    slot->hash = arg->hash_cb(key, klen, arg->seed);
+    slot->offset = arg->offset;
+
+    ht_image_entry_t entry = { klen, value ? vlen : 0 };
+    ht_save_write(arg, &entry, sizeof(entry));
+    ht_save_write(arg, key, klen);
+    ht_save_pad(arg);
+    ht_save_write(arg, value, entry.dlen);
+    ht_save_pad(arg);
+
+    return arg->error ? HT_ITERATOR_STOP : HT_ITERATOR_CONTINUE;
 }
 
 int
-ht_exists(hashtable_t *table, void *key, size_t klen)
+ht_save(hashtable_t *table, const char *path)
 {
-    return (ht_call_internal(table, key, klen, NULL, NULL) == 0);
-}
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    if (!tmp_path)
+        return -1;
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
 
-typedef struct {
-    void *data;
-    size_t *dlen;
-    int copy;
-    ht_deep_copy_callback_t copy_cb;
-    void *user;
-} ht_get_helper_arg_t;
+    // the image is written aside and then moved in place,
+    // so that an existing image is never left half overwritten
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        free(tmp_path);
+        return -1;
+    }
+
+    // the keys are hashed with the function of the table as long as
+    // it's one of the built-in ones (which the image can be opened with)
+    uint32_t hash_function = 0;
+    uint32_t i;
+    for (i = 0; i < HT_IMAGE_HASH_FUNCTIONS; i++) {
+        if (table->hash_cb == ht_image_hash_functions[i])
+            hash_function = i;
+    }
+
+    ht_save_arg_t arg = {
+        .out = out,
+        .offset = sizeof(ht_image_header_t),
+        .crc = 0,
+        .hash_cb = ht_image_hash_functions[hash_function],
+        .seed = table->seed,
+        .slots = NULL,
+        .count = 0,
+        .size = 0,
+        .error = 0
+    };
+
+    // the header is written last, once everything else is known
+    ht_image_header_t header;
+    memset(&header, 0, sizeof(header));
+    if (fwrite(&header, 1, sizeof(header), out) != sizeof(header))
+        arg.error = 1;
+
+    if (!arg.error)
+        ht_foreach_pair(table, ht_save_helper, &arg);
+
+    uint64_t nbuckets = arg.count ? arg.count : 1;
+    uint64_t *buckets = calloc(nbuckets + 1, sizeof(uint64_t));
+    ht_image_slot_t *sorted = malloc(nbuckets * sizeof(ht_image_slot_t));
+    if (!buckets || !sorted)
+        arg.error = 1;
+
+    if (!arg.error) {
+        // sort the slots by bucket, buckets[b] ends up holding
+        // the index of the first slot of the bucket b
+        size_t n;
+        for (n = 0; n < arg.count; n++)
+            buckets[arg.slots[n].hash % nbuckets]++;
+        uint64_t start = 0;
+        uint64_t b;
+        for (b = 0; b < nbuckets; b++) {
+            uint64_t count = buckets[b];
+            buckets[b] = start;
+            start += count;
+        }
+        for (n = 0; n < arg.count; n++)
+            sorted[buckets[arg.slots[n].hash % nbuckets]++] = arg.slots[n];
+        memmove(&buckets[1], &buckets[0], nbuckets * sizeof(uint64_t));
+        buckets[0] = 0;
+
+        ht_save_pad(&arg);
+        header.data_crc = arg.crc;
+        arg.crc = 0;
+        header.slots_offset = arg.offset;
+        ht_save_write(&arg, sorted, arg.count * sizeof(ht_image_slot_t));
+        header.buckets_offset = arg.offset;
+        ht_save_write(&arg, buckets, (nbuckets + 1) * sizeof(uint64_t));
+        header.index_crc = arg.crc;
+    }
+
+    memcpy(header.magic, HT_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = HT_IMAGE_VERSION;
+    header.hash_function = hash_function;
+    header.seed = table->seed;
+    header.count = arg.count;
+    header.nbuckets = nbuckets;
+    header.size = arg.offset;
+    header.header_crc = ht_image_crc(0, &header, sizeof(header));
+
+    if (!arg.error &&
+        (fseek(out, 0, SEEK_SET) != 0 ||
+         fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
+         fflush(out) != 0 ||
+         fsync(fileno(out)) != 0))
+    {
+        arg.error = 1;
+    }
+
+    if (fclose(out) != 0)
+        arg.error = 1;
+
+    if (!arg.error && rename(tmp_path, path) != 0)
+        arg.error = 1;
+
+    if (arg.error)
+        unlink(tmp_path);
 
+    free(tmp_path);
+    free(arg.slots);
+    free(sorted);
+    free(buckets);
+
+    return arg.error ? -1 : 0;
+}
+
+// the index is trusted by the lookups, so it can't point out of the image
+// (even if its checksum matches)
 static int
-ht_get_helper(hashtable_t *table __attribute__ ((unused)), void *key __attribute__ ((unused)), size_t klen __attribute__ ((unused)), void **value, size_t *vlen, void *user)
+ht_image_index_valid(char *base, ht_image_header_t *header)
 {
-    ht_get_helper_arg_t *arg = (ht_get_helper_arg_t *)user;
+    uint64_t *buckets = (uint64_t *)(base + header->buckets_offset);
+    ht_image_slot_t *slots = (ht_image_slot_t *)(base + header->slots_offset);
+    uint64_t i;
 
-    if (arg->copy) {
-        if (arg->copy_cb) {
-            arg->data = arg->copy_cb(*value, *vlen, arg->user);
-        } else {
-            arg->data = malloc(*vlen);
-            if (!arg->data)
-                return -1;
-            memcpy(arg->data, *value, *vlen);
+    if (buckets[0] != 0 || buckets[header->nbuckets] != header->count)
+        return 0;
+    for (i = 0; i < header->nbuckets; i++) {
+        if (buckets[i] > buckets[i + 1])
+            return 0;
+    }
+
+    // the lengths of the entries are checked by ht_image_entry()
+    for (i = 0; i < header->count; i++) {
+        uint64_t offset = slots[i].offset;
+        if (offset < sizeof(ht_image_header_t) || offset % 8 != 0 ||
+            offset > header->slots_offset - sizeof(ht_image_entry_t))
+        {
+            return 0;
         }
-    } else {
-        arg->data = *value;
     }
 
-    if (arg->dlen)
-        *arg->dlen = *vlen;
+    return 1;
+}
+
+static ht_image_t *
+ht_image_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ht_image_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    char *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    ht_image_header_t header;
+    memcpy(&header, base, sizeof(header));
+    uint32_t header_crc = header.header_crc;
+    header.header_crc = 0;
+
+    if (memcmp(header.magic, HT_IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != HT_IMAGE_VERSION ||
+        ht_image_crc(0, &header, sizeof(header)) != header_crc ||
+        header.hash_function >= HT_IMAGE_HASH_FUNCTIONS ||
+        header.size != size ||
+        header.nbuckets == 0 ||
+        header.count > size / sizeof(ht_image_slot_t) ||
+        header.nbuckets > size / sizeof(uint64_t) ||
+        header.slots_offset < sizeof(header) ||
+        header.slots_offset % 8 != 0 ||
+        header.slots_offset + header.count * sizeof(ht_image_slot_t) != header.buckets_offset ||
+        header.buckets_offset + (header.nbuckets + 1) * sizeof(uint64_t) != size ||
+        ht_image_crc(0, base + header.slots_offset, size - header.slots_offset) != header.index_crc ||
+        !ht_image_index_valid(base, &header))
+    {
+        munmap(base, size);
+        return NULL;
+    }
+
+    ht_image_t *image = calloc(1, sizeof(ht_image_t));
+    if (!image) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    image->base = base;
+    image->size = size;
+    image->count = header.count;
+    image->nbuckets = header.nbuckets;
+    image->hash_function = header.hash_function;
+    image->seed = header.seed;
+    image->data_end = header.slots_offset;
+    image->data_crc = header.data_crc;
+    image->slots = (ht_image_slot_t *)(base + header.slots_offset);
+    image->buckets = (uint64_t *)(base + header.buckets_offset);
+    image->path = strdup(path);
+    image->deleted = ht_create(0, 0, NULL);
+    if (!image->path || !image->deleted) {
+        ht_image_close(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+int
+ht_image_verify(hashtable_t *table)
+{
+    ht_image_t *image = table->image;
+    if (!image)
+        return -1;
+
+    // NOTE : this reads the whole image
+    uint32_t crc = ht_image_crc(0, image->base + sizeof(ht_image_header_t),
+                                image->data_end - sizeof(ht_image_header_t));
+    return crc == image->data_crc ? 0 : -1;
+}
+
+hashtable_t *
+ht_open_mmap(const char *path)
+{
+    ht_image_t *image = ht_image_open(path);
+    if (!image)
+        return NULL;
+
+    // the overlay holding the changes made to the image
+    hashtable_t *table = ht_create(0, 0, NULL);
+    if (!table) {
+        ht_image_close(image);
+        return NULL;
+    }
+
+    table->hash_cb = ht_image_hash_functions[image->hash_function];
+    table->seed = image->seed;
+    table->image = image;
+
+    return table;
+}
+
+int
+ht_compact(hashtable_t *table)
+{
+    ht_image_t *image = table->image;
+    if (!image)
+        return -1;
+
+    if (ht_save(table, image->path) != 0)
+        return -1;
+
+    ht_image_t *compacted = ht_image_open(image->path);
+    if (!compacted)
+        return -1;
+
+    // everything in the overlay is now part of the new image, so it can be
+    // dropped (without recording the keys of the old image as deleted)
+    table->image = NULL;
+    ht_clear(table);
 
+    ht_destroy(image->deleted);
+    image->deleted = NULL;
+    compacted->prev = image;
+    table->image = compacted;
 
     return 0;
 }
 
-static inline void *
-ht_get_internal(hashtable_t *table,
-                void *key,
-                size_t klen,
-                size_t *dlen,
-                int copy,
-                ht_deep_copy_callback_t copy_cb,
-                void *user)
-{
-    ht_get_helper_arg_t arg = {
-        .data = NULL,
-        .dlen = dlen,
-        .copy = copy,
-        .copy_cb = copy_cb,
-        .user = user
-    };
+/*
+ * Integer keyed tables
+ *
+ * Keys and values are stored inline in buckets sized as a cache line, each
+ * one holding up to HT_U64_BUCKET_SLOTS pairs and a link to an overflow
+ * bucket used when more keys end up in the same one.
+ * The sequence counter of the head bucket is also the lock taken by writers
+ * (it's odd while the bucket is being modified), so readers can look up
+ * keys without writing to shared memory, retrying if it changed meanwhile.
+ * Growing the table moves a few buckets at a time to an array twice as
+ * large, the moved buckets are flagged so that both readers and writers
+ * follow them to the new array. Arrays and overflow buckets which are not
+ * reachable anymore are released through the epoch based reclamation.
+ */
+#define HT_U64_BUCKET_SLOTS 3
+#define HT_U64_MOVED (1U << 31)
+#define HT_U64_LOAD_FACTOR 2
+
+// max_size is expressed in number of keys, like the initial size
+#define HT_U64_CAN_GROW(_table, _array) \
+    (!(_table)->max_size || ((_array)->size << 1) * HT_U64_LOAD_FACTOR <= (_table)->max_size)
+
+typedef struct _ht_u64_bucket {
+    uint32_t seq;
+    uint32_t used;
+    uint64_t keys[HT_U64_BUCKET_SLOTS];
+    void *values[HT_U64_BUCKET_SLOTS];
+    struct _ht_u64_bucket *next;
+} __attribute__ ((aligned(64))) ht_u64_bucket_t;
+
+typedef struct _ht_u64_array {
+    size_t size;
+    size_t migrate_index;
+    struct _ht_u64_array *next;
+    ht_u64_bucket_t buckets[];
+} ht_u64_array_t;
 
-    ht_call_internal(table, key, klen, ht_get_helper, (void *)&arg);
+struct _ht_u64_s {
+    ht_u64_array_t *array;
+    size_t count;
+    size_t max_size;
+    uint64_t seed;
+    ht_free_item_callback_t free_item_cb;
+#ifdef THREAD_SAFE
+    pthread_mutex_t grow_lock;
+#endif
+    ht_reclaim_t reclaim;
+};
 
-    return arg.data;
+// mixing all the bits of the key into the low ones
+static inline uint64_t
+ht_u64_mix(uint64_t key, uint64_t seed)
+{
+    return ht_mix64(key ^ seed);
 }
 
-void *
-ht_get(hashtable_t *table, void *key, size_t klen, size_t *dlen)
+static ht_u64_array_t *
+ht_u64_array_create(size_t size)
 {
-    return ht_get_internal(table, key, klen, dlen, 0, NULL, NULL);
+    ht_u64_array_t *array = NULL;
+    size_t array_size = sizeof(ht_u64_array_t) + size * sizeof(ht_u64_bucket_t);
+    if (posix_memalign((void **)&array, sizeof(ht_u64_bucket_t), array_size) != 0)
+        return NULL;
+    memset(array, 0, array_size);
+    array->size = size;
+    return array;
 }
 
-void *
-ht_get_copy(hashtable_t *table, void *key, size_t klen, size_t *dlen)
+static inline ht_u64_bucket_t *
+ht_u64_bucket_create()
 {
-    return ht_get_internal(table, key, klen, dlen, 1, NULL, NULL);
+    ht_u64_bucket_t *bucket = NULL;
+    if (posix_memalign((void **)&bucket, sizeof(ht_u64_bucket_t), sizeof(ht_u64_bucket_t)) != 0)
+        return NULL;
+    memset(bucket, 0, sizeof(ht_u64_bucket_t));
+    return bucket;
 }
 
-void *
-ht_get_deep_copy(hashtable_t *table, void *key, size_t klen,
-        size_t *dlen, ht_deep_copy_callback_t copy_cb, void *user)
+static void
+ht_u64_free(hashtable_t *table __attribute__ ((unused)), void *ptr)
 {
-    return ht_get_internal(table, key, klen, dlen, 1, copy_cb, user);
+    free(ptr);
 }
 
-static void
-free_key(hashtable_key_t *key)
+static inline void
+ht_u64_bucket_lock(ht_u64_bucket_t *bucket)
 {
-    free(key->data);
-    free(key);
+    for (;;) {
+        uint32_t seq = ATOMIC_READ_RELAXED(bucket->seq);
+        if (!(seq & 1) && ATOMIC_CAS_ACQ_REL(bucket->seq, seq, seq + 1))
+            break;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-linked_list_t *
-ht_get_all_keys(hashtable_t *table)
+static inline void
+ht_u64_bucket_unlock(ht_u64_bucket_t *bucket)
 {
-    linked_list_t *output = list_create();
-    list_set_free_value_callback(output, (free_value_callback_t)free_key);
+    ATOMIC_STORE_RELEASE(bucket->seq, ATOMIC_READ_RELAXED(bucket->seq) + 1);
+}
 
-    MUTEX_LOCK(table->iterator_lock);
-    ht_items_list_t *list = NULL;
-    TAILQ_FOREACH(list, &table->iterator_list->head, iterator_next) {
-        SPIN_LOCK(list->lock);
+// lock the head bucket for the given hash, following it to the newer array
+// if it has been moved already
+// NOTE : a locked bucket can't be moved (and hence released)
+static ht_u64_bucket_t *
+ht_u64_lock(ht_u64_t *table, uint64_t hash)
+{
+    ht_epoch_enter();
+    ht_u64_array_t *array = ATOMIC_READ_ACQUIRE(table->array);
+    ht_u64_bucket_t *head;
+    for (;;) {
+        head = &array->buckets[HT_BUCKET_INDEX(hash, array->size)];
+        ht_u64_bucket_lock(head);
+        if (!(head->used & HT_U64_MOVED))
+            break;
+        ht_u64_bucket_unlock(head);
+        array = ATOMIC_READ_ACQUIRE(array->next);
+    }
+    ht_epoch_exit();
+    return head;
+}
 
-        ht_item_t *item = NULL;
-        TAILQ_FOREACH(item, &list->head, next) {
-            hashtable_key_t *key = malloc(sizeof(hashtable_key_t));
-            if (!key) {
-                SPIN_UNLOCK(list->lock);
-                MUTEX_UNLOCK(table->iterator_lock);
-                list_destroy(output);
-                return NULL;
-            }
-            key->data = malloc(item->klen);
-            if (!key->data) {
-                SPIN_UNLOCK(list->lock);
-                MUTEX_UNLOCK(table->iterator_lock);
-                free(key);
-                list_destroy(output);
-                return NULL;
+// find the bucket and the slot holding the key
+// NOTE : the head bucket must be locked
+static inline ht_u64_bucket_t *
+ht_u64_find(ht_u64_bucket_t *head, uint64_t key, int *slot)
+{
+    ht_u64_bucket_t *bucket;
+    for (bucket = head; bucket; bucket = bucket->next) {
+        int i;
+        for (i = 0; i < HT_U64_BUCKET_SLOTS; i++) {
+            if ((bucket->used & (1U << i)) && bucket->keys[i] == key) {
+                *slot = i;
+                return bucket;
             }
-            memcpy(key->data, item->key, item->klen);
-            key->len = item->klen;
-            key->vlen = item->dlen;
-            list_push_value(output, key);
         }
-
-        SPIN_UNLOCK(list->lock);
     }
-    MUTEX_UNLOCK(table->iterator_lock);
-    return output;
+    return NULL;
 }
 
-linked_list_t *
-ht_get_all_values(hashtable_t *table)
+// store a new pair in the first free slot of the chain
+// NOTE : the head bucket must be locked
+static inline int
+ht_u64_put(ht_u64_bucket_t *head, uint64_t key, void *value)
 {
-    linked_list_t *output = list_create();
-    list_set_free_value_callback(output, (free_value_callback_t)free);
+    ht_u64_bucket_t *bucket;
+    for (bucket = head; bucket; bucket = bucket->next) {
+        int i;
+        for (i = 0; i < HT_U64_BUCKET_SLOTS; i++) {
+            if (!(bucket->used & (1U << i))) {
+                ATOMIC_STORE_RELAXED(bucket->keys[i], key);
+                ATOMIC_STORE_RELAXED(bucket->values[i], value);
+                ATOMIC_STORE_RELAXED(bucket->used, bucket->used | (1U << i));
+                return 0;
+            }
+        }
+    }
 
-    MUTEX_LOCK(table->iterator_lock);
-    ht_items_list_t *list = NULL;
-    TAILQ_FOREACH(list, &table->iterator_list->head, iterator_next) {
-        SPIN_LOCK(list->lock);
+    // the chain is full, a new overflow bucket is linked right after the head
+    bucket = ht_u64_bucket_create();
+    if (!bucket)
+        return -1;
+    bucket->keys[0] = key;
+    bucket->values[0] = value;
+    bucket->used = 1;
+    bucket->next = head->next;
+    ATOMIC_STORE_RELEASE(head->next, bucket);
+    return 0;
+}
 
-        ht_item_t *item = NULL;
-        TAILQ_FOREACH(item, &list->head, next) {
-            hashtable_value_t *v = malloc(sizeof(hashtable_value_t));
-            if (!v) {
-                SPIN_UNLOCK(list->lock);
-                MUTEX_UNLOCK(table->iterator_lock);
-                list_destroy(output);
-                return NULL;
+// move the pairs of a bucket to the two buckets of the next array
+// its keys can be hashed to
+// NOTE : the grow lock must be held
+static int
+ht_u64_migrate_bucket(ht_u64_t *table, ht_u64_array_t *array, size_t index)
+{
+    ht_u64_array_t *next = array->next;
+    ht_u64_bucket_t *head = &array->buckets[index];
+    ht_u64_bucket_t *low = &next->buckets[index];
+    ht_u64_bucket_t *high = &next->buckets[index + array->size];
+    ht_u64_bucket_t *bucket;
+
+    ht_u64_bucket_lock(head);
+
+    // NOTE : the destination buckets can't be reached by anyone until the
+    //        bucket is flagged as moved, so they can be filled without locking
+    for (bucket = head; bucket; bucket = bucket->next) {
+        int i;
+        for (i = 0; i < HT_U64_BUCKET_SLOTS; i++) {
+            if (!(bucket->used & (1U << i)))
+                continue;
+            uint64_t hash = ht_u64_mix(bucket->keys[i], table->seed);
+            ht_u64_bucket_t *dest = (HT_BUCKET_INDEX(hash, next->size) == index) ? low : high;
+            if (ht_u64_put(dest, bucket->keys[i], bucket->values[i]) != 0) {
+                // leave the bucket where it is, the migration will be
+                // retried later
+                ht_u64_bucket_t *dests[2] = { low, high };
+                int d;
+                for (d = 0; d < 2; d++) {
+                    while (dests[d]->next) {
+                        ht_u64_bucket_t *overflow = dests[d]->next;
+                        dests[d]->next = overflow->next;
+                        free(overflow);
+                    }
+                    dests[d]->used = 0;
+                }
+                ht_u64_bucket_unlock(head);
+                return -1;
             }
-            v->data = item->data;
-            v->len = item->dlen;
-            v->key = item->key;
-            v->klen = item->klen;
-            list_push_value(output, v);
         }
+    }
 
-        SPIN_UNLOCK(list->lock);
+    ht_u64_bucket_t *overflow = head->next;
+    ATOMIC_STORE_RELAXED(head->used, head->used | HT_U64_MOVED);
+    ht_u64_bucket_unlock(head);
+
+    // readers which are still walking the chain will notice the change
+    // of the sequence counter and look the key up again in the new array
+    while (overflow) {
+        ht_u64_bucket_t *next_overflow = overflow->next;
+        ht_reclaim_retire(&table->reclaim, NULL, overflow, ht_u64_free);
+        overflow = next_overflow;
     }
-    MUTEX_UNLOCK(table->iterator_lock);
-    return output;
+    return 0;
 }
 
-typedef struct {
-    int (*cb)(hashtable_t *, void *, size_t, void *);
-    void *user;
-} ht_iterator_arg_t;
+static void
+ht_u64_grow(ht_u64_t *table)
+{
+    // if someone else is already migrating let's just go ahead,
+    // the migration will progress on the next insertion
+    if (!MUTEX_TRYLOCK(table->grow_lock))
+        return;
 
-static int
-ht_foreach_key_helper(hashtable_t *table, void *key, size_t klen, void *value __attribute__ ((unused)), size_t vlen __attribute__ ((unused)), void *user)
+    ht_u64_array_t *array = table->array;
+    if (!array->next) {
+        if (ATOMIC_READ(table->count) <= array->size * HT_U64_LOAD_FACTOR ||
+            !HT_U64_CAN_GROW(table, array))
+        {
+            MUTEX_UNLOCK(table->grow_lock);
+            return;
+        }
+        ht_u64_array_t *next = ht_u64_array_create(array->size << 1);
+        if (!next) {
+            MUTEX_UNLOCK(table->grow_lock);
+            return;
+        }
+        ATOMIC_STORE_RELEASE(array->next, next);
+    }
+
+    int i;
+    for (i = 0; i < HT_GROW_STEP && array->migrate_index < array->size; i++) {
+        if (ht_u64_migrate_bucket(table, array, array->migrate_index) != 0)
+            break;
+        array->migrate_index++;
+    }
+
+    if (array->migrate_index == array->size) {
+        // all the buckets are flagged as moved, so whoever still sees
+        // the old array will follow the link to the new one
+        ATOMIC_STORE_RELEASE(table->array, array->next);
+        ht_reclaim_retire(&table->reclaim, NULL, array, ht_u64_free);
+    }
+
+    MUTEX_UNLOCK(table->grow_lock);
+}
+
+ht_u64_t *
+ht_u64_create(size_t initial_size, size_t max_size, ht_free_item_callback_t free_item_cb)
 {
-    ht_iterator_arg_t *arg = (ht_iterator_arg_t *)user;
-    return arg->cb(table, key, klen, arg->user);
+    ht_u64_t *table = calloc(1, sizeof(ht_u64_t));
+    if (!table)
+        return NULL;
+
+    size_t size = HT_SIZE_MIN / HT_U64_LOAD_FACTOR;
+    while (size * HT_U64_LOAD_FACTOR < initial_size)
+        size <<= 1;
+
+    table->array = ht_u64_array_create(size);
+    if (!table->array) {
+        free(table);
+        return NULL;
+    }
+    table->max_size = max_size;
+    table->seed = ht_random_seed();
+    table->free_item_cb = free_item_cb;
+    MUTEX_INIT(table->grow_lock);
+    ht_reclaim_init(&table->reclaim);
+    return table;
 }
 
 void
-ht_foreach_key(hashtable_t *table, ht_key_iterator_callback_t cb, void *user)
+ht_u64_destroy(ht_u64_t *table)
 {
-    ht_iterator_arg_t arg = { cb, user };
-    ht_foreach_pair(table, ht_foreach_key_helper, &arg);
+    // nobody can be accessing the table anymore,
+    // so everything can be released right away
+    ht_u64_clear(table);
+    ht_reclaim_destroy(&table->reclaim, NULL);
+
+    ht_u64_array_t *array = table->array;
+    while (array) {
+        ht_u64_array_t *next = array->next;
+        free(array);
+        array = next;
+    }
+
+    MUTEX_DESTROY(table->grow_lock);
+    free(table);
 }
 
-static int
-ht_foreach_value_helper(hashtable_t *table, void *key __attribute__ ((unused)), size_t klen __attribute__ ((unused)), void *value, size_t vlen, void *user)
+// walk all the head buckets which have not been moved, locking one at a time
+// NOTE : the grow lock must be held
+static void
+ht_u64_walk(ht_u64_t *table, ht_u64_iterator_callback_t cb, void *user, int clear)
 {
-    ht_iterator_arg_t *arg = (ht_iterator_arg_t *)user;
-    return arg->cb(table, value, vlen, arg->user);
+    ht_u64_array_t *array;
+    int stop = 0;
+    for (array = table->array; array && !stop; array = array->next) {
+        size_t index;
+        for (index = 0; index < array->size && !stop; index++) {
+            ht_u64_bucket_t *head = &array->buckets[index];
+            ht_u64_bucket_lock(head);
+            if (head->used & HT_U64_MOVED) {
+                ht_u64_bucket_unlock(head);
+                continue;
+            }
+            ht_u64_bucket_t *bucket;
+            for (bucket = head; bucket && !stop; bucket = bucket->next) {
+                int i;
+                for (i = 0; i < HT_U64_BUCKET_SLOTS && !stop; i++) {
+                    if (!(bucket->used & (1U << i)))
+                        continue;
+                    int rc = clear ? HT_ITERATOR_REMOVE
+                                   : cb(table, bucket->keys[i], bucket->values[i], user);
+                    if (rc == HT_ITERATOR_REMOVE || rc == HT_ITERATOR_REMOVE_AND_STOP) {
+                        ATOMIC_STORE_RELAXED(bucket->used, bucket->used & ~(1U << i));
+                        ATOMIC_DECREMENT(table->count);
+                        if (table->free_item_cb)
+                            table->free_item_cb(bucket->values[i]);
+                    }
+                    if (rc == HT_ITERATOR_STOP || rc == HT_ITERATOR_REMOVE_AND_STOP)
+                        stop = 1;
+                }
+            }
+            ht_u64_bucket_t *overflow = NULL;
+            if (clear) {
+                overflow = head->next;
+                ATOMIC_STORE_RELEASE(head->next, NULL);
+            }
+            ht_u64_bucket_unlock(head);
+            while (overflow) {
+                ht_u64_bucket_t *next = overflow->next;
+                ht_reclaim_retire(&table->reclaim, NULL, overflow, ht_u64_free);
+                overflow = next;
+            }
+        }
+    }
 }
 
 void
-ht_foreach_value(hashtable_t *table, ht_value_iterator_callback_t cb, void *user)
+ht_u64_clear(ht_u64_t *table)
 {
-    ht_iterator_arg_t arg = { cb, user };
-    ht_foreach_pair(table, ht_foreach_value_helper, &arg);
+    MUTEX_LOCK(table->grow_lock);
+    ht_u64_walk(table, NULL, NULL, 1);
+    MUTEX_UNLOCK(table->grow_lock);
 }
 
 void
-ht_foreach_pair(hashtable_t *table, ht_pair_iterator_callback_t cb, void *user)
+ht_u64_foreach_pair(ht_u64_t *table, ht_u64_iterator_callback_t cb, void *user)
 {
-    int rc = 0;
+    MUTEX_LOCK(table->grow_lock);
+    ht_u64_walk(table, cb, user, 0);
+    MUTEX_UNLOCK(table->grow_lock);
+}
 
+size_t
+ht_u64_count(ht_u64_t *table)
+{
+    return ATOMIC_READ(table->count);
+}
 
-    MUTEX_LOCK(table->iterator_lock);
-    ht_items_list_t *list = NULL;
-    int stop = 0;
-    TAILQ_FOREACH(list, &table->iterator_list->head, iterator_next) {
-        SPIN_LOCK(list->lock);
-        ht_item_t *item = NULL;
-        ht_item_t *tmp = NULL;
-        TAILQ_FOREACH_SAFE(item, &list->head, next, tmp) {
-            rc = cb(table, item->key, item->klen, item->data, item->dlen, user);
-            if (rc == HT_ITERATOR_CONTINUE) {
-                continue;
-            } else if (rc == HT_ITERATOR_STOP) {
-                stop = 1;
-                break;
-            } else {
-                // rc is either HT_ITERATOR_REMOVE or HT_ITERATOR_REMOVE_AND_STOP
-                TAILQ_REMOVE(&list->head, item, next);
-                if (table->free_item_cb)
-                    table->free_item_cb(item->data);
-                if (item->key != item->kbuf)
-                    free(item->key);
-                free(item);
-                ATOMIC_DECREMENT(table->count);
-                if (rc == HT_ITERATOR_REMOVE_AND_STOP) {
-                    stop = 1;
+/*
+ * Lockless lookup, the chain is walked without taking the lock of the head
+ * bucket and the lookup is retried if its sequence counter changed meanwhile
+ */
+static inline int
+ht_u64_lookup(ht_u64_t *table, uint64_t key, void **value)
+{
+    uint64_t hash = ht_u64_mix(key, table->seed);
+    int found = 0;
+
+    ht_epoch_enter();
+
+    ht_u64_array_t *array = ATOMIC_READ_ACQUIRE(table->array);
+    for (;;) {
+        ht_u64_bucket_t *head = &array->buckets[HT_BUCKET_INDEX(hash, array->size)];
+        uint32_t seq = ATOMIC_READ_ACQUIRE(head->seq);
+        if (seq & 1)
+            continue;
+
+        uint32_t used = ATOMIC_READ_RELAXED(head->used);
+        if (used & HT_U64_MOVED) {
+            array = ATOMIC_READ_ACQUIRE(array->next);
+            continue;
+        }
+
+        void *v = NULL;
+        ht_u64_bucket_t *bucket = head;
+        found = 0;
+        while (bucket && !found) {
+            int i;
+            for (i = 0; i < HT_U64_BUCKET_SLOTS; i++) {
+                if ((used & (1U << i)) && ATOMIC_READ_RELAXED(bucket->keys[i]) == key) {
+                    v = ATOMIC_READ_RELAXED(bucket->values[i]);
+                    found = 1;
                     break;
                 }
             }
+            bucket = ATOMIC_READ_ACQUIRE(bucket->next);
+            if (bucket)
+                used = ATOMIC_READ_RELAXED(bucket->used);
         }
-        SPIN_UNLOCK(list->lock);
-        if (stop) {
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (ATOMIC_READ_RELAXED(head->seq) == seq) {
+            if (found && value)
+                *value = v;
             break;
         }
     }
-    MUTEX_UNLOCK(table->iterator_lock);
+
+    ht_epoch_exit();
+    return found;
 }
 
-size_t
-ht_count(hashtable_t *table)
+void *
+ht_u64_get(ht_u64_t *table, uint64_t key)
 {
-    return ATOMIC_READ(table->count);
+    void *value = NULL;
+    ht_u64_lookup(table, key, &value);
+    return value;
+}
+
+int
+ht_u64_exists(ht_u64_t *table, uint64_t key)
+{
+    return ht_u64_lookup(table, key, NULL);
+}
+
+static int
+ht_u64_set_internal(ht_u64_t *table, uint64_t key, void *value, void **prev, int if_not_exists)
+{
+    uint64_t hash = ht_u64_mix(key, table->seed);
+    ht_u64_bucket_t *head = ht_u64_lock(table, hash);
+
+    int slot = 0;
+    ht_u64_bucket_t *bucket = ht_u64_find(head, key, &slot);
+    if (bucket) {
+        void *old = bucket->values[slot];
+        if (!if_not_exists)
+            ATOMIC_STORE_RELAXED(bucket->values[slot], value);
+        ht_u64_bucket_unlock(head);
+        if (if_not_exists)
+            return 1;
+        if (prev)
+            *prev = old;
+        else if (table->free_item_cb && old != value)
+            table->free_item_cb(old);
+        return 0;
+    }
+
+    int rc = ht_u64_put(head, key, value);
+    ht_u64_bucket_unlock(head);
+    if (rc != 0)
+        return -1;
+
+    if (prev)
+        *prev = NULL;
+
+    ATOMIC_INCREMENT(table->count);
+
+    ht_u64_array_t *array = ATOMIC_READ_ACQUIRE(table->array);
+    if (ATOMIC_READ_RELAXED(array->next) ||
+        (ATOMIC_READ_RELAXED(table->count) > array->size * HT_U64_LOAD_FACTOR &&
+         HT_U64_CAN_GROW(table, array)))
+    {
+        ht_u64_grow(table);
+    }
+
+    return 0;
+}
+
+int
+ht_u64_set(ht_u64_t *table, uint64_t key, void *value)
+{
+    return ht_u64_set_internal(table, key, value, NULL, 0);
+}
+
+int
+ht_u64_get_and_set(ht_u64_t *table, uint64_t key, void *value, void **prev)
+{
+    return ht_u64_set_internal(table, key, value, prev, 0);
+}
+
+int
+ht_u64_set_if_not_exists(ht_u64_t *table, uint64_t key, void *value)
+{
+    return ht_u64_set_internal(table, key, value, NULL, 1);
+}
+
+int
+ht_u64_delete(ht_u64_t *table, uint64_t key, void **prev)
+{
+    uint64_t hash = ht_u64_mix(key, table->seed);
+    ht_u64_bucket_t *head = ht_u64_lock(table, hash);
+
+    int slot = 0;
+    ht_u64_bucket_t *bucket = ht_u64_find(head, key, &slot);
+    if (!bucket) {
+        ht_u64_bucket_unlock(head);
+        return -1;
+    }
+
+    void *old = bucket->values[slot];
+    ATOMIC_STORE_RELAXED(bucket->used, bucket->used & ~(1U << slot));
+    ht_u64_bucket_unlock(head);
+
+    ATOMIC_DECREMENT(table->count);
+
+    if (prev)
+        *prev = old;
+    else if (table->free_item_cb)
+        table->free_item_cb(old);
+
+    return 0;
 }
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
@@ -29,6 +29,39 @@ typedef struct _hashtable_s hashtable_t;
  */
 typedef void (*ht_free_item_callback_t)(void *);
 
+/**
+ * @brief Callback used to compute the hash of a key
+ * @param key  : The key
+ * @param klen : The length of the key
+ * @param seed : The (random) seed of the table
+ * @return The 64-bit hash of the key
+ */
+typedef uint64_t (*ht_hash_callback_t)(const void *key, size_t klen, uint64_t seed);
+
+/**
+ * @brief Jenkins' one-at-a-time hash
+ *
+ * Processes the key one byte at a time and produces only 32 bits,
+ * it's the function used by older versions of this library
+ */
+uint64_t ht_hash_one_at_a_time(const void *key, size_t klen, uint64_t seed);
+
+/**
+ * @brief wyhash, a fast 64-bit hash processing the key 16 bytes at a time
+ *
+ * This is the default hash function used by new tables
+ */
+uint64_t ht_hash_wyhash(const void *key, size_t klen, uint64_t seed);
+
+/**
+ * @brief CRC32C based hash, computed using the crc32 instruction
+ *        if supported by the cpu (SSE4.2 on x86)
+ *
+ * The checksum is spread over 64 bits but it only carries 32 bits of entropy,
+ * so it should be used only for tables which hold far less than 2^32 keys
+ */
+uint64_t ht_hash_crc32c(const void *key, size_t klen, uint64_t seed);
+
 #define HT_SIZE_MIN 128
 
 /**
@@ -42,6 +75,145 @@ typedef void (*ht_free_item_callback_t)(void *);
  */
 hashtable_t *ht_create(size_t initial_size, size_t max_size, ht_free_item_callback_t free_item_cb);
 
+/**
+ * @brief Create a new table descriptor using the open-addressing (flat) engine
+ * @param initial_size : number of items the table should be able to hold before growing;
+ *                       if 0 the table will start with HT_SIZE_MIN slots
+ * @param max_size     : maximum number of slots the table can be grown up to (0 for no limit)
+ * @param free_item_cb : the callback to use when an item needs to be released
+ * @return a newly allocated and initialized table
+ *
+ * The returned table can be used with the exact same API as the ones created
+ * with ht_create(). Items are stored inline in a single array of slots and
+ * lookups probe a parallel array of 1-byte hash tags 16 slots at a time,
+ * so there is no per-item allocation (unless the key is longer than 32 bytes)
+ * and a lookup typically touches two cache lines.
+ *
+ * The whole table is guarded by a single read-write lock: it is a single-writer
+ * table, every ht_set()/ht_delete() takes the lock exclusively (blocking all the
+ * readers) and every lookup takes it for reading, so concurrent readers still
+ * contend on the cache line of the lock. Tables written by multiple threads
+ * should rather be created with ht_create_sharded().
+ *
+ * @note Iterator callbacks (ht_foreach_*) run with the table exclusively locked,
+ *       so they can't call back into the same table.
+ * @note Key pointers exposed by ht_get_all_values() are only valid until the table
+ *       is modified, since growing a flat table relocates its slots
+ */
+hashtable_t *ht_create_flat(size_t initial_size, size_t max_size, ht_free_item_callback_t free_item_cb);
+
+/**
+ * @brief Create a new table split in multiple independent shards
+ * @param nshards      : number of shards (rounded up to the next power of 2)
+ * @param initial_size : number of items the whole table should be able to hold before growing
+ * @param max_size     : maximum number of slots the whole table can be grown up to (0 for no limit)
+ * @param free_item_cb : the callback to use when an item needs to be released
+ * @return a newly allocated and initialized table
+ *
+ * Keys are routed to the shards by the high bits of their hash, and each shard
+ * is a table on its own (with its own buckets, locks and growth), so writers
+ * inserting new keys don't contend with each other unless they hit the same shard.
+ * The returned table can be used with the exact same API as the ones created
+ * with ht_create(); ht_count(), ht_clear() and the iterators span all the shards.
+ *
+ * @note If nshards is less than 2 a regular table is created
+ */
+hashtable_t *ht_create_sharded(size_t nshards, size_t initial_size, size_t max_size, ht_free_item_callback_t free_item_cb);
+
+/**
+ * @brief Eviction policies available for cache tables
+ */
+typedef enum {
+    HT_CACHE_POLICY_CLOCK = 0, //!< referenced items get a second chance before being evicted
+    HT_CACHE_POLICY_SLRU       //!< segmented LRU, items hit more than once are protected
+                               //   from eviction by the ones hit only once (scans)
+} ht_cache_policy_t;
+
+/**
+ * @brief Create a new table which works as a bounded cache
+ * @param max_items : maximum number of items stored in the cache (0 for no limit)
+ * @param max_bytes : maximum number of bytes used by the stored items (0 for no limit),
+ *                    including the size of the keys, the size of the values
+ *                    (as provided to ht_set()) and the per-item overhead
+ * @param policy    : The policy used to select the items to evict
+ * @return a newly allocated and initialized table
+ *
+ * The returned table can be used with the exact same API as the ones created
+ * with ht_create(). When storing a new item (or growing a value through
+ * ht_call()) makes the cache exceed one of its limits, other items are evicted
+ * (before the storing call returns) until the cache is back within them.
+ * Hits only mark the item as referenced, without taking any lock, so a cache
+ * hit costs the same as a plain ht_get() on a table created with ht_create()
+ * @note An item bigger than max_bytes by itself can't be stored
+ */
+hashtable_t *ht_create_cache(size_t max_items, size_t max_bytes, ht_cache_policy_t policy);
+
+/**
+ * @brief Set the callback called to release the values evicted from a cache table
+ * @param table : A valid pointer to an hashtable_t structure created with ht_create_cache()
+ * @param cb    : The callback to call for each evicted value; if NULL (the default)
+ *                the free_item callback of the table (if any) will be used
+ */
+void ht_cache_set_eviction_callback(hashtable_t *table, ht_free_item_callback_t cb);
+
+/**
+ * @brief Get the number of bytes currently accounted to the items of a cache table
+ * @param table : A valid pointer to an hashtable_t structure created with ht_create_cache()
+ * @return The number of bytes used by the stored items
+ */
+size_t ht_cache_bytes(hashtable_t *table);
+
+/**
+ * @brief Save the content of a table to an image file
+ * @param table : A valid pointer to an hashtable_t structure
+ * @param path  : The path of the image file (replaced atomically if it exists)
+ * @return 0 on success, -1 otherwise
+ * @note Only the first dlen bytes pointed by each value are saved,
+ *       the expiration of the keys is not saved either
+ * @note The image is versioned and checksummed, and it doesn't contain
+ *       any pointer, so it can be mapped at any address by ht_open_mmap()
+ */
+int ht_save(hashtable_t *table, const char *path);
+
+/**
+ * @brief Open a table serving the keys straight from a mapped image file
+ * @param path : The path of an image file written by ht_save()
+ * @return A newly created table, NULL if the image couldn't be mapped
+ *         or if its header or its index are corrupted (or it has been
+ *         written by an incompatible version)
+ * @note Nothing is loaded in memory: only the header and the index of the
+ *       image are checked before mapping it (the keys and the values can
+ *       be checked with ht_image_verify()), and lookups for keys not found
+ *       in the overlay go through it
+ * @note The image is never modified, changes go to an overlay table kept
+ *       in memory (which ht_compact() can write back to the image)
+ * @note Values served by the image point into the mapping, so they must not be
+ *       released (nor modified); they are not passed to the free_item_cb either
+ * @note The table is released with ht_destroy() as any other one
+ */
+hashtable_t *ht_open_mmap(const char *path);
+
+/**
+ * @brief Check the keys and the values of the image a table has been opened with
+ * @param table : A valid pointer to an hashtable_t structure created with ht_open_mmap()
+ * @return 0 if they match the checksum stored in the image, -1 if they
+ *         don't or if the table has not been created with ht_open_mmap()
+ * @note The whole image is read, which ht_open_mmap() doesn't do
+ */
+int ht_image_verify(hashtable_t *table);
+
+/**
+ * @brief Merge the changes made to a table opened with ht_open_mmap()
+ *        into a new image, replacing the one the table has been opened with
+ * @param table : A valid pointer to an hashtable_t structure created with ht_open_mmap()
+ * @return 0 on success, -1 otherwise
+ * @note Values of the overlay are written to the image and released
+ *       (through the free_item_cb), values served by the old image
+ *       remain valid until the table is destroyed
+ * @note This must not be called while other threads are accessing the table
+ */
+int ht_compact(hashtable_t *table);
+
 /**
  * @brief Initialize a pre-allocated table descriptor
  *
@@ -57,6 +229,161 @@ int ht_init(hashtable_t *table, size_t initial_size, size_t max_size, ht_free_it
  */
 void ht_set_free_item_callback(hashtable_t *table, ht_free_item_callback_t cb);
 
+/**
+ * @brief Defer the release of the values removed from the table
+ * @param table    : A valid pointer to an hashtable_t structure
+ * @param deferred : 1 to defer the release of the values, 0 to release them
+ *                   as soon as they are removed (the default)
+ * @note Once enabled, the values deleted or replaced are passed to the
+ *       free_item callback only after all the threads which were inside
+ *       ht_read_begin()/ht_read_end() at the time of the removal have left.
+ *       The pointers returned by ht_get() can then be used without copying
+ *       the values until ht_read_end() is called.
+ *       Values are released in batches, ht_reclaim() can be used to release
+ *       the ones which are not in use anymore right away
+ */
+void ht_set_deferred_free(hashtable_t *table, int deferred);
+
+/**
+ * @brief Start a read-side critical section
+ * @note The values obtained from any table with deferred frees enabled
+ *       (see ht_set_deferred_free()) stay valid until ht_read_end() is called.
+ *       Critical sections can be nested, but must be short, since no memory
+ *       removed from any table can be released while a thread is inside one.
+ *       The table can be modified by the same thread in the meanwhile
+ */
+void ht_read_begin();
+
+/**
+ * @brief End a read-side critical section started by ht_read_begin()
+ * @note The values obtained since ht_read_begin() can't be used anymore
+ */
+void ht_read_end();
+
+/**
+ * @brief Release the memory (and the deferred values) removed from the table
+ *        which can't be in use by any reader anymore
+ * @param table : A valid pointer to an hashtable_t structure
+ */
+void ht_reclaim(hashtable_t *table);
+
+/**
+ * @brief Set the function used to hash the keys
+ * @param table : A valid pointer to an hashtable_t structure
+ * @param cb : One of the built-in ht_hash_* functions or a custom
+ *             ht_hash_callback_t function. If NULL the default
+ *             hash function (ht_hash_wyhash) will be used
+ * @return 0 on success, -1 if the table is not empty
+ * @note The hash function can only be changed before any key is stored
+ *       in the table and while no other thread is accessing it
+ */
+int ht_set_hash_function(hashtable_t *table, ht_hash_callback_t cb);
+
+/**
+ * @brief Keep a bloom filter of the keys stored in the table, so that
+ *        lookups of keys which are not in the table (ht_get(), ht_exists(),
+ *        ht_get_copy() ...) can return without accessing any bucket
+ * @param table    : A valid pointer to an hashtable_t structure
+ * @param fp_rate  : The acceptable rate of false positives (0 for 1%)
+ * @param counting : If not zero a counting filter, which forgets the keys
+ *                   as soon as they are removed, will be used
+ * @return 0 on success, -1 if the table is not empty, if it already has
+ *         a filter or if it's a flat (or mapped) table
+ * @note The filter is sized for the number of items at which the table
+ *       grows, and it's rebuilt while the table is growing. Keys removed
+ *       from the table are only forgotten by a plain filter at that point,
+ *       for deletion-heavy tables a counting filter (which uses 4 times
+ *       the memory) keeps the rate of false positives down
+ * @note The filter can only be set before any key is stored in the table
+ *       and while no other thread is accessing it
+ */
+int ht_set_bloom_filter(hashtable_t *table, double fp_rate, int counting);
+
+/**
+ * @brief Store the keys which don't fit in the items in an arena owned
+ *        by the table, instead of rounding them up to the next power of two
+ * @param table : A valid pointer to an hashtable_t structure
+ * @return 0 on success, -1 if the table is not empty, if it already uses
+ *         an arena (or an intern pool) or if it's a flat table
+ * @note Keys are carved out of big chunks, the memory of the released ones
+ *       is recovered by moving the keys still in use out of the emptiest
+ *       chunks, which happens automatically once more than half of the
+ *       memory of the arena is wasted (see ht_compact_keys())
+ * @note The arena can only be set before any key is stored in the table
+ *       and while no other thread is accessing it
+ */
+int ht_set_key_arena(hashtable_t *table);
+
+/**
+ * @brief Release the chunks of the key arena which are less than half full,
+ *        after moving the keys still using them to other chunks
+ * @param table : A valid pointer to an hashtable_t structure
+ * @return The number of bytes released
+ * @note Lookups running concurrently are not affected, the released
+ *       chunks are actually freed only once they are all done
+ */
+size_t ht_compact_keys(hashtable_t *table);
+
+/**
+ * @brief Opaque structure representing a pool of interned keys
+ */
+typedef struct _ht_intern_pool_s ht_intern_pool_t;
+
+/**
+ * @brief Create a new (thread-safe) pool of interned keys
+ * @return A newly allocated and initialized ht_intern_pool_t
+ */
+ht_intern_pool_t *ht_intern_pool_create();
+
+/**
+ * @brief Release all the resources used by an intern pool
+ * @param pool : A valid pointer to an ht_intern_pool_t structure
+ * @note No table can be using the pool anymore
+ */
+void ht_intern_pool_destroy(ht_intern_pool_t *pool);
+
+/**
+ * @brief Get the interned copy of a key, which will be the same
+ *        for all the keys with the same content
+ * @param pool : A valid pointer to an ht_intern_pool_t structure
+ * @param key  : The key to intern
+ * @param klen : The length of the key
+ * @return A pointer to the interned copy of the key (always followed by a
+ *         NUL byte, so interned strings can be used as such), which must be
+ *         released using ht_intern_release(), NULL in case of errors
+ * @note Tables compare keys by pointer first, so looking up an interned
+ *       key in a table using the same pool doesn't need to access
+ *       the copy of the key held by the table
+ */
+const void *ht_intern(ht_intern_pool_t *pool, const void *key, size_t klen);
+
+/**
+ * @brief Release a reference to an interned key
+ * @param pool : A valid pointer to an ht_intern_pool_t structure
+ * @param key  : A pointer returned by ht_intern()
+ */
+void ht_intern_release(ht_intern_pool_t *pool, const void *key);
+
+/**
+ * @brief Return the number of distinct keys held by an intern pool
+ * @param pool : A valid pointer to an ht_intern_pool_t structure
+ * @return The number of keys in the pool
+ */
+size_t ht_intern_count(ht_intern_pool_t *pool);
+
+/**
+ * @brief Store the keys which don't fit in the items in a pool
+ *        of interned keys, possibly shared with other tables
+ * @param table : A valid pointer to an hashtable_t structure
+ * @param pool  : A valid pointer to an ht_intern_pool_t structure
+ * @return 0 on success, -1 if the table is not empty, if it already uses
+ *         an intern pool (or a key arena) or if it's a mapped table
+ * @note The memory used by the interned keys is not accounted by ht_stats()
+ * @note The pool can only be set before any key is stored in the table
+ *       and while no other thread is accessing it
+ */
+int ht_set_intern_pool(hashtable_t *table, ht_intern_pool_t *pool);
+
 /**
  * @brief Clear the table by removing all the stored items
  * @param table : A valid pointer to an hashtable_t structure
@@ -81,6 +408,11 @@ void ht_destroy(hashtable_t *table);
  * @param dlen  : If not NULL, the size of the returned data will be stored
  *                at the address pointed by dlen
  * @return The stored value if any, NULL otherwise
+ * @note   The lookup doesn't take any lock nor write to shared memory,
+ *         so concurrent readers don't contend with each other
+ * @note   The value might be released by a concurrent ht_delete() (or ht_set()),
+ *         unless deferred frees are enabled and the lookup is done between
+ *         ht_read_begin() and ht_read_end() (see ht_set_deferred_free())
  */
 void *ht_get(hashtable_t *table, void *key, size_t klen, size_t *dlen);
 
@@ -128,6 +460,126 @@ typedef void *(*ht_deep_copy_callback_t)(void *data, size_t dlen, void *user);
  */
 void *ht_get_deep_copy(hashtable_t *table, void *key, size_t klen, size_t *dlen, ht_deep_copy_callback_t copy_cb, void *user);
 
+/**
+ * @brief Copy the value stored at a specific key into the provided buffer
+ * @param table  : A valid pointer to an hashtable_t structure
+ * @param key    : The key to use
+ * @param klen   : The length of the key
+ * @param buf    : The buffer to copy the value to
+ * @param buflen : The size of the buffer
+ * @return The size of the stored value if any (if greater than buflen only
+ *         the first buflen bytes have been copied), -1 otherwise
+ * @note No memory is allocated. If deferred frees are enabled
+ *       (see ht_set_deferred_free()) the value is copied without locking
+ */
+ssize_t ht_get_into(hashtable_t *table, void *key, size_t klen, void *buf, size_t buflen);
+
+/**
+ * @brief Atomically add a delta to the int64 value stored at a specific key
+ * @param table : A valid pointer to an hashtable_t structure
+ * @param key   : The key to use
+ * @param klen  : The length of the key
+ * @param delta : The delta to add to the stored value
+ * @param value : If not NULL, the new value will be stored at the address
+ *                pointed by value
+ * @return 0 on success, -1 if the key holds a value which is not numeric
+ *         or a double (or in case of error)
+ * @note Missing keys are created (as if their value was 0). Numeric values
+ *       are stored inside the items themselves, so only creating a key
+ *       allocates memory and existing values are updated without locking.
+ *       ht_get() returns a pointer to the 8 bytes of a numeric value
+ *       and they are never passed to the free_item_callback. When a numeric
+ *       value is replaced or deleted the prev_data pointer (if requested)
+ *       is set to a copy of it, which must be released as any other
+ *       previous value (NULL if the copy can't be allocated)
+ * @note Not supported by flat tables (and by tables with an image)
+ */
+int ht_incr(hashtable_t *table, void *key, size_t klen, int64_t delta, int64_t *value);
+
+/**
+ * @brief Atomically add a delta to the double value stored at a specific key
+ * @note  See ht_incr(), the int64 and the double functions can't be used
+ *        on the same key
+ */
+int ht_incr_double(hashtable_t *table, void *key, size_t klen, double delta, double *value);
+
+/**
+ * @brief Atomically store the minimum between the int64 value stored at
+ *        a specific key and the provided one
+ * @param table   : A valid pointer to an hashtable_t structure
+ * @param key     : The key to use
+ * @param klen    : The length of the key
+ * @param operand : The value to compare with the stored one
+ * @param value   : If not NULL, the resulting value will be stored
+ *                  at the address pointed by value
+ * @return 0 on success, -1 if the key holds a value which is not numeric
+ *         (or in case of error)
+ * @note Missing keys are created with the provided value (see ht_incr())
+ */
+int ht_min_int64(hashtable_t *table, void *key, size_t klen, int64_t operand, int64_t *value);
+
+/**
+ * @brief Atomically store the maximum between the int64 value stored at
+ *        a specific key and the provided one
+ * @note  See ht_min_int64()
+ */
+int ht_max_int64(hashtable_t *table, void *key, size_t klen, int64_t operand, int64_t *value);
+
+/**
+ * @brief Atomically store the minimum between the double value stored at
+ *        a specific key and the provided one
+ * @note  See ht_min_int64()
+ */
+int ht_min_double(hashtable_t *table, void *key, size_t klen, double operand, double *value);
+
+/**
+ * @brief Atomically store the maximum between the double value stored at
+ *        a specific key and the provided one
+ * @note  See ht_min_int64()
+ */
+int ht_max_double(hashtable_t *table, void *key, size_t klen, double operand, double *value);
+
+/**
+ * @brief Atomically set the int64 value stored at a specific key
+ *        only if it's equal to the expected one
+ * @param table    : A valid pointer to an hashtable_t structure
+ * @param key      : The key to use
+ * @param klen     : The length of the key
+ * @param expected : The value expected to be stored at the key
+ * @param value    : The value to store
+ * @param current  : If not NULL, the value stored at the key once done
+ *                   will be stored at the address pointed by current
+ * @return 0 if the value has been set, 1 if the stored value didn't match
+ *         the expected one, -1 if the key holds a value which is not numeric
+ *         (or in case of error)
+ * @note Missing keys count as 0 and are created only if 0 was expected
+ */
+int ht_cas_int64(hashtable_t *table, void *key, size_t klen, int64_t expected, int64_t value, int64_t *current);
+
+/**
+ * @brief Atomically set the double value stored at a specific key
+ *        only if it's equal to the expected one
+ * @note  See ht_cas_int64()
+ */
+int ht_cas_double(hashtable_t *table, void *key, size_t klen, double expected, double value, double *current);
+
+/**
+ * @brief Get the int64 value stored at a specific key
+ * @param table : A valid pointer to an hashtable_t structure
+ * @param key   : The key to use
+ * @param klen  : The length of the key
+ * @param value : The address where to store the value
+ * @return 0 on success, -1 if the key doesn't exist or its value
+ *         is not numeric (or is a double)
+ */
+int ht_get_int64(hashtable_t *table, void *key, size_t klen, int64_t *value);
+
+/**
+ * @brief Get the double value stored at a specific key
+ * @note  See ht_get_int64()
+ */
+int ht_get_double(hashtable_t *table, void *key, size_t klen, double *value);
+
 /**
  * @brief Set the value for a specific key
  * @param table : A valid pointer to an hashtable_t structure
@@ -139,6 +591,45 @@ void *ht_get_deep_copy(hashtable_t *table, void *key, size_t klen, size_t *dlen,
  */
 int ht_set(hashtable_t *table, void *key, size_t klen, void *data, size_t dlen);
 
+/**
+ * @brief Set the value for a specific key and make it expire after a while
+ * @param table : A valid pointer to an hashtable_t structure
+ * @param key   : The key to use
+ * @param klen  : The length of the key
+ * @param data  : A pointer to the data to store
+ * @param dlen  : The size of the data
+ * @param ttl   : The time to live (in milliseconds) of the key,
+ *                0 if the key must never expire
+ * @return 0 on success, -1 otherwise
+ * @note Once expired the key is not visible anymore and it will be removed
+ *       (releasing the value through the free_item_cb) either lazily, when
+ *       accessed, or by the expiration running along with the write operations
+ *       (or explicitly triggered by ht_expire() and ht_count())
+ * @note Updating the value with ht_set() doesn't change the time to live
+ *       of the key
+ * @note Not supported by flat tables
+ */
+int ht_set_with_ttl(hashtable_t *table, void *key, size_t klen, void *data, size_t dlen, uint64_t ttl);
+
+/**
+ * @brief Change the time to live of an existing key
+ * @param table : A valid pointer to an hashtable_t structure
+ * @param key   : The key to use
+ * @param klen  : The length of the key
+ * @param ttl   : The new time to live (in milliseconds) of the key,
+ *                0 if the key must never expire
+ * @return 0 on success, -1 if the key doesn't exist (or the table is flat)
+ */
+int ht_set_ttl(hashtable_t *table, void *key, size_t klen, uint64_t ttl);
+
+/**
+ * @brief Remove all the keys which expired so far
+ * @param table : A valid pointer to an hashtable_t structure
+ * @return The number of removed keys
+ * @note Expiration times have a granularity of 1 millisecond
+ */
+size_t ht_expire(hashtable_t *table);
+
 /**
  * @brief Set the value for a specific key and returns the previous value if any
  * @param table : A valid pointer to an hashtable_t structure
@@ -263,6 +754,140 @@ int ht_delete(hashtable_t *table, void *key, size_t klen, void **prev_data, size
  */
 int ht_delete_if_equals(hashtable_t *table, void *key, size_t klen, void *match, size_t match_size);
 
+/**
+ * @brief Get the values stored at multiple keys at once
+ * @param table  : A valid pointer to an hashtable_t structure
+ * @param keys   : An array of n keys
+ * @param klens  : An array with the length of each key
+ * @param n      : The number of keys to look up
+ * @param values : An array of n pointers where the value stored at each key
+ *                 (or NULL if the key doesn't exist) will be written
+ * @param dlens  : If not NULL, an array of n sizes where the size of each
+ *                 value (or 0 if the key doesn't exist) will be written
+ * @return The number of keys found
+ * @note All the keys are hashed and their buckets prefetched before
+ *       resolving any of them, so this is faster than calling ht_get()
+ *       once for each key. No memory is allocated.
+ */
+size_t ht_get_multi(hashtable_t *table,
+                    void **keys,
+                    size_t *klens,
+                    size_t n,
+                    void **values,
+                    size_t *dlens);
+
+/**
+ * @brief Set the values for multiple keys at once
+ * @param table  : A valid pointer to an hashtable_t structure
+ * @param keys   : An array of n keys
+ * @param klens  : An array with the length of each key
+ * @param n      : The number of items to set
+ * @param values : An array with the value to store at each key
+ * @param dlens  : If not NULL, an array with the size of each value
+ * @return The number of items successfully stored
+ * @note Previous values are released using the free_value callback (if any),
+ *       as ht_set() does
+ */
+size_t ht_set_multi(hashtable_t *table,
+                    void **keys,
+                    size_t *klens,
+                    size_t n,
+                    void **values,
+                    size_t *dlens);
+
+/**
+ * @brief Delete the values stored at multiple keys at once
+ * @param table       : A valid pointer to an hashtable_t structure
+ * @param keys        : An array of n keys
+ * @param klens       : An array with the length of each key
+ * @param n           : The number of keys to delete
+ * @param prev_values : If not NULL, an array of n pointers where the deleted
+ *                      values (or NULL if the key doesn't exist) will be written
+ * @param prev_lens   : If not NULL, an array of n sizes where the size of each
+ *                      deleted value will be written
+ * @return The number of keys deleted
+ * @note If prev_values is not NULL the deleted values will not be released
+ *       using the free_value callback, as for ht_delete()
+ */
+size_t ht_delete_multi(hashtable_t *table,
+                       void **keys,
+                       size_t *klens,
+                       size_t n,
+                       void **prev_values,
+                       size_t *prev_lens);
+
+/**
+ * @brief Store a large number of items at once
+ * @param table    : A valid pointer to an hashtable_t structure
+ * @param keys     : An array of n keys
+ * @param klens    : An array with the length of each key
+ * @param values   : An array with the value to store at each key
+ * @param vlens    : If not NULL, an array with the size of each value
+ * @param n        : The number of items to store
+ * @param nthreads : The number of threads to use
+ *                   (if 0 or negative, as many as the online cpus)
+ * @return The number of items successfully stored
+ * @note The table is grown to its final size before storing any item, then
+ *       the items are partitioned by bucket and each thread builds its own
+ *       buckets, without locking the ones which didn't exist already.
+ *       The same key can appear more than once (the last value wins) and
+ *       previous values are released using the free_value callback (if any),
+ *       as ht_set() does.
+ * @note Other threads can access the table in the meanwhile, but those
+ *       storing new keys might be blocked until the load completes.
+ *       Cache tables, tables with expiring items and images are filled
+ *       one item at a time
+ */
+size_t ht_bulk_load(hashtable_t *table,
+                    void **keys,
+                    size_t *klens,
+                    void **values,
+                    size_t *vlens,
+                    size_t n,
+                    int nthreads);
+
+/**
+ * @brief Callback called by ht_merge() for each key present in both tables
+ * @param table     : The destination table
+ * @param key       : The key present in both tables
+ * @param klen      : The length of the key
+ * @param value     : The value stored in the destination table, which can
+ *                    be replaced by the value to keep
+ * @param vlen      : The size of the value stored in the destination table
+ * @param src_value : The value stored in the source table
+ * @param src_vlen  : The size of the value stored in the source table
+ * @param user      : The private pointer passed to ht_merge()
+ * @note Both values are handed over to the callback, which must release
+ *       the one not kept (if needed)
+ */
+typedef void (*ht_merge_conflict_callback_t)(hashtable_t *table,
+                                             void *key,
+                                             size_t klen,
+                                             void **value,
+                                             size_t *vlen,
+                                             void *src_value,
+                                             size_t src_vlen,
+                                             void *user);
+
+/**
+ * @brief Move all the items of a table into another one
+ * @param dst         : The table to move the items to
+ * @param src         : The table to move the items from
+ * @param conflict_cb : If not NULL, the callback resolving the keys
+ *                      already stored in dst
+ * @param user        : A private pointer which will be passed to conflict_cb
+ * @return The number of items moved
+ * @note The items are stored in dst as ht_bulk_load() does, using all the
+ *       online cpus, and removed from src without releasing their values.
+ *       If no conflict callback is provided the values in src replace the
+ *       ones in dst, which are released using the free_value callback (if any)
+ * @note src must not be modified by other threads while being merged
+ */
+size_t ht_merge(hashtable_t *dst,
+                hashtable_t *src,
+                ht_merge_conflict_callback_t conflict_cb,
+                void *user);
+
 /**
  * @brief Callback called if an item for a given key is found
  * @param table : A valid pointer to an hashtable_t structure
@@ -285,13 +910,67 @@ typedef int (*ht_pair_callback_t)(hashtable_t *table, void *key, size_t klen, vo
  */
 int ht_call(hashtable_t *table, void *key, size_t klen, ht_pair_callback_t cb, void *user);
 
+/**
+ * @brief Migrate a bounded number of buckets if the table is being grown
+ * @param table       : A valid pointer to an hashtable_t structure
+ * @param max_buckets : The maximum number of buckets to migrate
+ * @return The number of buckets still waiting to be migrated,
+ *         0 if the table is not growing
+ *
+ * When the table needs to grow a new (bigger) bucket array is allocated
+ * and linked to the current one, then buckets are moved incrementally
+ * by any ht_set()/ht_get() call. Lookups check both arrays until
+ * the migration is complete.
+ * A background thread can call this function to complete the job
+ * without adding latency to the callers of the other functions.
+ * @note If another thread is migrating or iterating over the table
+ *       the function returns immediately without doing anything
+ */
+size_t ht_grow_step(hashtable_t *table, size_t max_buckets);
+
 /**
  * @brief Return the count of items actually stored in the table
  * @param table : A valid pointer to an hashtable_t structure
  * @return The actual item count
+ * @note Keys which expired are removed before counting
  */
 size_t ht_count(hashtable_t *table);
 
+// the last entry of the chain length histogram
+// accounts for all the chains at least this long
+#define HT_STATS_CHAINS 16
+
+/**
+ * @brief Runtime statistics of a table, as reported by ht_stats()
+ */
+typedef struct {
+    size_t buckets;        //!< number of buckets (slots for flat tables)
+    size_t count;          //!< number of stored items (same as ht_count())
+    double load_factor;    //!< items per bucket
+    size_t chain_lengths[HT_STATS_CHAINS]; //!< number of buckets by length of their chain
+    size_t longest_chain;  //!< length of the longest chain
+    size_t grows;          //!< number of times the table has been grown
+    uint64_t grow_time_ns; //!< cumulative time spent migrating items to the grown tables
+    uint64_t lock_contended; //!< bucket locks which were found busy and had to be waited for
+    uint64_t lookup_retries; //!< lockless lookups repeated because of concurrent writers
+    size_t bucket_bytes;   //!< memory allocated for the bucket arrays (or the slots of flat tables)
+    size_t item_bytes;     //!< memory allocated for the items (and the bucket lists)
+    size_t key_bytes;      //!< memory allocated for the keys not fitting in the items
+} ht_stats_t;
+
+/**
+ * @brief Collect the runtime statistics of a table
+ * @param table : A valid pointer to an hashtable_t structure
+ * @param stats : The ht_stats_t structure to fill in
+ * @return 0 on success, -1 otherwise
+ * @note Chain lengths are not reported for flat tables. Sharded tables report
+ *       the sums of the statistics of their shards (and the longest chain among them).
+ *       lock_contended and lookup_retries are always 0 if libhl has been built
+ *       with HT_NO_STATS defined, which compiles out all the counters on the hot paths.
+ *       Walking all the buckets, this function is as expensive as iterating the table
+ */
+int ht_stats(hashtable_t *table, ht_stats_t *stats);
+
 // use the following two functions only if the hashtable_t contains
 // a small number of keys, use the iterators otherwise
 
@@ -399,6 +1078,205 @@ typedef ht_iterator_status_t (*ht_pair_iterator_callback_t)(hashtable_t *table,
  */
 void ht_foreach_pair(hashtable_t *table, ht_pair_iterator_callback_t cb, void *user);
 
+/**
+ * @brief Pair iterator visiting the buckets from multiple threads
+ * @param table    : A valid pointer to an hashtable_t structure
+ * @param nthreads : The number of threads to use
+ *                   (if 0 or negative, as many as the online cpus)
+ * @param cb       : an ht_pair_iterator_callback_t function
+ * @param user     : A pointer which will be passed to the iterator callback at each call
+ * @note The buckets are split in contiguous ranges, each visited by a different
+ *       thread (the calling one included), so the callback will be called
+ *       concurrently and must synchronize its access to the user pointer.
+ *       As for ht_foreach_pair() the table can't grow during the walk and
+ *       the callback is called with the bucket locked, so it must not modify
+ *       the table (other than by returning HT_ITERATOR_REMOVE).
+ *       Once the callback asks to stop the iteration the other threads stop
+ *       as soon as they are done with the item they are visiting.
+ *       Flat tables (and images) are visited by the calling thread only
+ */
+void ht_foreach_pair_parallel(hashtable_t *table, int nthreads, ht_pair_iterator_callback_t cb, void *user);
+
+/**
+ * @brief Callback called by ht_foreach_pair_reduce() for the local state of each thread
+ * @param table : A valid pointer to the hashtable_t structure being iterated
+ * @param local : The local state of the thread
+ * @param user  : The user pointer passed to ht_foreach_pair_reduce()
+ */
+typedef void (*ht_reduce_callback_t)(hashtable_t *table, void *local, void *user);
+
+/**
+ * @brief Pair iterator visiting the buckets from multiple threads, each
+ *        accumulating its results into its own local state
+ * @param table      : A valid pointer to an hashtable_t structure
+ * @param nthreads   : The maximum number of threads to use
+ * @param cb         : an ht_pair_iterator_callback_t function, which will get
+ *                     the local state of the calling thread as user pointer
+ * @param locals     : An array of nthreads local states
+ * @param local_size : The size of each local state
+ * @param reduce     : The callback which will be called, once the iteration is
+ *                     complete, for each of the local states (in order)
+ * @param user       : A pointer which will be passed to the reduce callback
+ * @note The local states are initialized by the caller, those of the threads
+ *       which haven't been used (if the table is small) are passed to the
+ *       reduce callback as they are. The reduce callback is always called
+ *       by the calling thread, so it doesn't need any synchronization.
+ *       See ht_foreach_pair_parallel()
+ */
+void ht_foreach_pair_reduce(hashtable_t *table,
+                            int nthreads,
+                            ht_pair_iterator_callback_t cb,
+                            void *locals,
+                            size_t local_size,
+                            ht_reduce_callback_t reduce,
+                            void *user);
+
+/**
+ * @brief Incrementally iterate over the pairs stored in the table
+ *
+ * Each call visits a bounded number of buckets, starting from the position
+ * encoded in the cursor, holding only the lock of the bucket being visited.
+ * Start with a cursor set to 0 and call it again with the returned cursor
+ * until 0 is returned.
+ * Every key stored in the table for the whole duration of the scan is
+ * visited at least once, even if the table grows in the meanwhile.
+ * Keys added or removed during the scan might be visited or not
+ * @param table  : A valid pointer to an hashtable_t structure
+ * @param cursor : The cursor returned by the previous call (0 to start a new scan)
+ * @param count  : The maximum number of buckets to visit
+ * @param cb     : an ht_pair_iterator_callback_t function
+ * @param user   : A pointer which will be passed to the iterator callback at each call
+ * @return The cursor to pass to the next call, 0 if the scan is complete
+ * @note The callback is called with the bucket locked, it must not
+ *       modify the table (other than by returning HT_ITERATOR_REMOVE).
+ *       If the callback stops the iteration the bucket being visited
+ *       will be visited again by the next call (the returned cursor is
+ *       never 0 in this case, even if the scan was stopped in the first bucket).
+ *       On tables created with ht_create_flat() the cursor is a plain slot
+ *       index, so keys might be missed if the table grows during the scan
+ */
+uint64_t ht_scan(hashtable_t *table, uint64_t cursor, size_t count, ht_pair_iterator_callback_t cb, void *user);
+
+/**
+ * @brief Opaque structure representing a table mapping 64-bit integers to pointers
+ *
+ * Keys and values are stored inline in buckets as large as a cache line,
+ * so there is no per-item allocation and a lookup typically touches a single
+ * cache line. Lookups are lockless while writers only lock the bucket they
+ * are modifying, the table is grown incrementally by the writers
+ * (exactly like the ones created with ht_create())
+ */
+typedef struct _ht_u64_s ht_u64_t;
+
+/**
+ * @brief Create a new integer keyed table
+ * @param initial_size : number of keys the table should be able to hold before growing;
+ *                       if 0 the table will be sized for HT_SIZE_MIN keys
+ * @param max_size     : maximum number of keys the table can be grown for (0 for no limit)
+ * @param free_item_cb : the callback to use when a value needs to be released
+ * @return a newly allocated and initialized table
+ */
+ht_u64_t *ht_u64_create(size_t initial_size, size_t max_size, ht_free_item_callback_t free_item_cb);
+
+/**
+ * @brief Destroy an integer keyed table releasing all its resources
+ * @param table : A valid pointer to an ht_u64_t structure
+ */
+void ht_u64_destroy(ht_u64_t *table);
+
+/**
+ * @brief Remove all the keys from an integer keyed table
+ * @param table : A valid pointer to an ht_u64_t structure
+ */
+void ht_u64_clear(ht_u64_t *table);
+
+/**
+ * @brief Get the value stored at a specific key
+ * @param table : A valid pointer to an ht_u64_t structure
+ * @param key   : The key to look up
+ * @return The stored value if any, NULL otherwise
+ */
+void *ht_u64_get(ht_u64_t *table, uint64_t key);
+
+/**
+ * @brief Check if a key exists in an integer keyed table
+ * @param table : A valid pointer to an ht_u64_t structure
+ * @param key   : The key to look up
+ * @return 1 If the key exists, 0 otherwise
+ */
+int ht_u64_exists(ht_u64_t *table, uint64_t key);
+
+/**
+ * @brief Set the value for a specific key
+ * @param table : A valid pointer to an ht_u64_t structure
+ * @param key   : The key to use
+ * @param value : The value to store
+ * @return 0 on success, -1 otherwise
+ * @note The previous value (if any) is released using the free_item_cb callback
+ */
+int ht_u64_set(ht_u64_t *table, uint64_t key, void *value);
+
+/**
+ * @brief Set the value for a specific key and return the previous value if any
+ * @param table : A valid pointer to an ht_u64_t structure
+ * @param key   : The key to use
+ * @param value : The value to store
+ * @param prev  : If not NULL, the referenced pointer will be set to point to the previous value
+ * @return 0 on success, -1 otherwise
+ * @note If prev is not NULL, the previous value will not be released using the free_item_cb
+ *       callback, so the caller will be responsible of releasing it
+ */
+int ht_u64_get_and_set(ht_u64_t *table, uint64_t key, void *value, void **prev);
+
+/**
+ * @brief Set the value for a specific key if there is no value already stored
+ * @param table : A valid pointer to an ht_u64_t structure
+ * @param key   : The key to use
+ * @param value : The value to store
+ * @return 0 on success;\n
+ *         1 if a value was already set;\n
+ *         -1 in case of errors
+ */
+int ht_u64_set_if_not_exists(ht_u64_t *table, uint64_t key, void *value);
+
+/**
+ * @brief Delete the value stored at a specific key
+ * @param table : A valid pointer to an ht_u64_t structure
+ * @param key   : The key to use
+ * @param prev  : If not NULL, the referenced pointer will be set to point to the previous value
+ * @return 0 on success, -1 if the key doesn't exist
+ * @note If prev is not NULL, the previous value will not be released using the free_item_cb
+ *       callback, so the caller will be responsible of releasing it
+ */
+int ht_u64_delete(ht_u64_t *table, uint64_t key, void **prev);
+
+/**
+ * @brief Return the count of keys stored in an integer keyed table
+ * @param table : A valid pointer to an ht_u64_t structure
+ * @return The number of keys stored in the table
+ */
+size_t ht_u64_count(ht_u64_t *table);
+
+/**
+ * @brief Callback for the integer keyed table iterator
+ * @param table : A valid pointer to an ht_u64_t structure
+ * @param key   : The key
+ * @param value : The value
+ * @param user  : The user pointer passed as argument to the ht_u64_foreach_pair() function
+ * @return One of the ht_iterator_status_t values
+ */
+typedef ht_iterator_status_t (*ht_u64_iterator_callback_t)(ht_u64_t *table, uint64_t key, void *value, void *user);
+
+/**
+ * @brief Pair iterator for integer keyed tables
+ * @param table : A valid pointer to an ht_u64_t structure
+ * @param cb    : an ht_u64_iterator_callback_t function
+ * @param user  : A pointer which will be passed to the iterator callback at each call
+ * @note The callback is called with the bucket locked, it must not
+ *       modify the table (other than by returning HT_ITERATOR_REMOVE)
+ */
+void ht_u64_foreach_pair(ht_u64_t *table, ht_u64_iterator_callback_t cb, void *user);
+
 #ifdef __cplusplus
 }
 #endif
@@ -322,14 +322,81 @@ queue_push_right(queue_t *q, void *value)
 }
 
 /*
- * Retreive a queue_entry_t from the beginning of a queue (or top of the stack
- * if you are using the queue as a stack)
+ * Pushs multiple values at the end of a queue. The entries are linked
+ * together beforehand, so that the whole chain can be linked to the queue
+ * at once, just like a single entry in queue_push_right()
  */
+size_t
+queue_push_right_batch(queue_t *q, void **values, size_t n)
+{
+    if (!n)
+        return 0;
+
+    queue_entry_t *first = NULL;
+    queue_entry_t *last = NULL;
+    size_t count;
+    for (count = 0; count < n; count++) {
+        queue_entry_t *entry = create_entry(q);
+        if (!entry)
+            break;
+        entry->value = values[count];
+        if (last) {
+            store_ref(q->refcnt, &last->next, ATOMIC_READ(entry->node));
+            store_ref(q->refcnt, &entry->prev, ATOMIC_READ(last->node));
+        } else {
+            first = entry;
+        }
+        last = entry;
+    }
 
-void *
-queue_pop_left(queue_t *q)
+    if (!count)
+        return 0;
+
+    queue_entry_t *next = ATOMIC_READ(q->tail);
+
+    while (1) {
+        queue_entry_t *prev = get_node_ptr(deref_link(q->refcnt, &next->prev));
+        if (!prev) {
+            continue;
+        }
+
+        store_ref(q->refcnt, &last->next, ATOMIC_READ(next->node));
+        store_ref(q->refcnt, &first->prev, ATOMIC_READ(prev->node));
+
+        if (ATOMIC_CAS(prev->next, REFCNT_MARK_OFF(last->next), first->node)) {
+            release_ref(q->refcnt, ATOMIC_READ(next->node));
+            retain_ref(q->refcnt, ATOMIC_READ(first->node));
+            while (!ATOMIC_CAS(next->prev, ATOMIC_READ(prev->node), ATOMIC_READ(last->node))) {
+                release_ref(q->refcnt, prev->node);
+                sched_yield();
+                queue_entry_t *prev2 = get_node_ptr(deref_link(q->refcnt, &next->prev));
+                prev = prev2;
+                store_ref(q->refcnt, &first->prev, ATOMIC_READ(prev->node));
+            }
+            release_ref(q->refcnt, ATOMIC_READ(prev->node));
+            retain_ref(q->refcnt, ATOMIC_READ(last->node));
+            release_ref(q->refcnt, ATOMIC_READ(prev->node));
+            break;
+        }
+
+        if (prev)
+            release_ref(q->refcnt, ATOMIC_READ(prev->node));
+
+        store_ref(q->refcnt, &last->next, NULL);
+        store_ref(q->refcnt, &first->prev, NULL);
+    }
+
+    ATOMIC_INCREASE(q->length, count);
+    return count;
+}
+
+/*
+ * Unlink the first entry of the queue, which is returned still
+ * referenced (see queue_release_entry())
+ */
+static queue_entry_t *
+queue_unlink_left(queue_t *q)
 {
-    void *v = NULL;
     queue_entry_t *entry = NULL;
 
     queue_entry_t *prev = ATOMIC_READ(q->head);
@@ -380,20 +447,77 @@ queue_pop_left(queue_t *q)
     
             release_ref(q->refcnt, ATOMIC_READ(next->node));
 
-            v = entry->value;
             release_ref(q->refcnt, ATOMIC_READ(entry->node));
             break;
         }
         release_ref(q->refcnt, ATOMIC_READ(entry->node));
     }
-    if (entry) {
-        ATOMIC_DECREMENT(q->length);
-        store_ref(q->refcnt, &entry->next, NULL);
-        store_ref(q->refcnt, &entry->prev, NULL);
+    return entry;
+}
+
+static inline void
+queue_release_entry(queue_t *q, queue_entry_t *entry)
+{
+    store_ref(q->refcnt, &entry->next, NULL);
+    store_ref(q->refcnt, &entry->prev, NULL);
+    destroy_entry(q->refcnt, entry);
+}
+
+/*
+ * Retreive a queue_entry_t from the beginning of a queue (or top of the stack
+ * if you are using the queue as a stack)
+ */
+void *
+queue_pop_left(queue_t *q)
+{
+    queue_entry_t *entry = queue_unlink_left(q);
+    if (!entry)
+        return NULL;
+
+    void *v = entry->value;
+    ATOMIC_DECREMENT(q->length);
+    sched_yield();
+    queue_release_entry(q, entry);
+    return v;
+}
+
+// the number of entries released at once by queue_pop_left_batch()
+#define QUEUE_BATCH_CHUNK 64
+
+/*
+ * Retreive multiple values from the beginning of a queue. The entries are
+ * unlinked one by one, but the queue length is updated (and the entries
+ * are released) once for each chunk of the batch
+ */
+size_t
+queue_pop_left_batch(queue_t *q, void **values, size_t max)
+{
+    queue_entry_t *entries[QUEUE_BATCH_CHUNK];
+    size_t count = 0;
+    while (count < max) {
+        size_t chunk = 0;
+        while (chunk < QUEUE_BATCH_CHUNK && count + chunk < max) {
+            queue_entry_t *entry = queue_unlink_left(q);
+            if (!entry)
+                break;
+            values[count + chunk] = entry->value;
+            entries[chunk++] = entry;
+        }
+
+        if (!chunk)
+            break;
+
+        ATOMIC_DECREASE(q->length, chunk);
         sched_yield();
-        destroy_entry(q->refcnt, entry);
+        size_t i;
+        for (i = 0; i < chunk; i++)
+            queue_release_entry(q, entries[i]);
+        count += chunk;
+
+        if (chunk < QUEUE_BATCH_CHUNK)
+            break;
     }
-    return v;
+    return count;
 }
 
 /*
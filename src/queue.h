@@ -111,6 +111,28 @@ int queue_push_right(queue_t *q, void *val);
  */
 int queue_push_left(queue_t *q, void *val);
 
+/**
+ * @brief Append multiple values to the queue (tail)
+ * @param q : A valid pointer to a queue_t structure
+ * @param values : The values to store in the tail of the queue
+ * @param n : The number of values to store
+ * @return : The number of values stored (less than n only if
+ *           the memory for the entries couldn't be allocated)
+ * @note The values are linked together first and then appended
+ *       to the queue at once, so they are never interleaved with
+ *       values appended by other threads
+ */
+size_t queue_push_right_batch(queue_t *q, void **values, size_t n);
+
+/**
+ * @brief Remove multiple values from the beginning of the queue
+ * @param q : A valid pointer to a queue_t structure
+ * @param values : The array where to store the values
+ * @param max : The maximum number of values to remove
+ * @return : The number of values removed, 0 if the queue is empty
+ */
+size_t queue_pop_left_batch(queue_t *q, void **values, size_t max);
+
 /**
  * @brief Remove the first value from the queue
  * @param q : A valid pointer to a queue_t structure
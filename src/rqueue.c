@@ -1,37 +1,76 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <inttypes.h>
+#include <string.h>
 #include <sched.h>
+#include <errno.h>
 #include <time.h>
+#ifdef __linux__
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#endif
 #include "atomic_defs.h"
 #include "rqueue.h"
 
-#define RQUEUE_FLAG_HEAD   (0x01)
-#define RQUEUE_FLAG_UPDATE (0x02)
-#define RQUEUE_FLAG_ALL    (0x03)
+/*
+ * Bounded MPMC ring (Vyukov style)
+ *
+ * The ring is a contiguous array of slots, each holding a value and a
+ * sequence number which tells, for the position mapped to the slot, if the
+ * slot is ready to be written (seq == pos) or read (seq == pos + 1).
+ * Producers claim the position at the tail and consumers the one at the
+ * head with a single CAS, then publish the slot by updating its sequence
+ * (to pos + 1 once written, to pos + size once read, making it ready for
+ * the writer of the next lap), so producers and consumers never touch the
+ * same shared state other than the slot itself.
+ * Positions are 64-bit and never wrap, and the ring can have any size
+ * (the position is masked if the size is a power of two).
+ *
+ * A ring created by rqueue_create_spsc() has a single producer and a single
+ * consumer, so each of them owns its index and the sequence numbers are not
+ * used: the producer publishes the values by storing the tail (and the
+ * consumer releases the slots by storing the head) with release semantics.
+ * Each side keeps a copy of the index of the other side on its own cache
+ * line and reads the actual one only when the copy says the ring is full
+ * (or empty), so no atomic read-modify-write is ever needed.
+ *
+ * Threads waiting for a value (or for room) in rqueue_read_wait() and
+ * rqueue_write_wait() spin for a little while and then park on a futex.
+ * A waiter announces itself by incrementing the waiters count before checking
+ * the indices again, while the other side checks the count only after having
+ * updated its index, so a wakeup can't be lost and nobody needs to enter
+ * the kernel (or even to write to shared memory) if there is nobody waiting.
+ * An eventfd is signaled in the same way, so that consumers can wait for
+ * many rings (or file descriptors) at once.
+ * The side updating the index needs a full barrier before checking the count,
+ * which comes for free with the CAS on a multi-producer (consumer) ring. On a
+ * spsc ring the waiters rather issue the barrier on behalf of the other side
+ * (with membarrier(), if supported), so that the fast path stays fence-free.
+ *
+ * The statistics are kept in RQUEUE_STATS_SHARDS shards, each on its own
+ * cache line (every thread sticks to one of them), and summed up by
+ * rqueue_stats(). Rings created with RQUEUE_FLAG_NO_STATS don't update them,
+ * and building with RQUEUE_NO_STATS defined compiles them out.
+ */
 
-#define RQUEUE_FLAG_ON(_addr, _flag) (rqueue_page_t *)(((intptr_t) (_addr) & -4) | (_flag))
-#define RQUEUE_FLAG_OFF(_addr, _flag) (rqueue_page_t *)((intptr_t) (_addr) & ~(_flag))
+#define RQUEUE_MIN_SIZE 2 // A single-element queue wouldn't make any sense
 
-#define RQUEUE_CHECK_FLAG(_addr, _flag) (((intptr_t) (_addr) & (_flag)) == (_flag))
+#define RQUEUE_CACHE_LINE 64
 
-// Operation-specific retry limits based on operation complexity and expected contention
-#define RQUEUE_READER_MAX_RETRIES     1500    // Complex multi-step operations need more retries
-#define RQUEUE_WRITER_CAS_MAX_RETRIES  100    // Simple atomic operations should fail fast
-#define RQUEUE_BLOCKING_MAX_RETRIES   2000    // Blocking mode can be more patient
-#define RQUEUE_OVERWRITE_MAX_RETRIES    50    // Overwrite should fail fast if can't get reader sync
-#define RQUEUE_MAX_RETRIES RQUEUE_READER_MAX_RETRIES  // Legacy compatibility
+// how many times a waiter tries again before parking
+#define RQUEUE_WAIT_SPINS 128
 
-#define RQUEUE_MIN_SIZE 2 // A single-element queue wouldn't make any sense
+#if defined(__x86_64__) || defined(__i386__)
+#define RQUEUE_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define RQUEUE_CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define RQUEUE_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
 
-// Retry strategies for different operation types
-typedef enum {
-    RQUEUE_RETRY_FAST,        // Simple CAS operations - fail fast with minimal backoff
-    RQUEUE_RETRY_PATIENT,     // Blocking mode waits - exponential backoff
-    RQUEUE_RETRY_COMPLEX,     // Multi-step reader operations - longer delays
-    RQUEUE_RETRY_CRITICAL     // Overwrite mode - very short delays, fail quickly
-} rqueue_retry_strategy_t;
+#define RQUEUE_STATS_SHARDS 8
 
 #ifdef USE_PACKED_STRUCTURES
 #define PACK_IF_NECESSARY __attribute__((packed))
@@ -39,228 +78,131 @@ typedef enum {
 #define PACK_IF_NECESSARY
 #endif
 
-typedef struct _rqueue_page_s {
-    void               *value;
-    struct _rqueue_page_s *next;
-    struct _rqueue_page_s *prev;
-} PACK_IF_NECESSARY rqueue_page_t;
+typedef struct _rqueue_slot_s {
+    uint64_t seq;
+    void     *value;
+} PACK_IF_NECESSARY rqueue_slot_t;
+
+typedef struct _rqueue_stats_shard_s {
+    uint64_t overwrites; // always counted, rqueue_read_count() needs it
+    uint64_t queue_full;
+    uint64_t queue_empty;
+    uint64_t write_retries;
+    uint64_t read_retries;
+    uint64_t write_waits;
+    uint64_t read_waits;
+} __attribute__((aligned(RQUEUE_CACHE_LINE))) rqueue_stats_shard_t;
+
+#ifdef RQUEUE_NO_STATS
+#define RQUEUE_STATS_INCREMENT(_rb, _counter)
+#else
+#define RQUEUE_STATS_INCREMENT(_rb, _counter) do { \
+    if (__builtin_expect((_rb)->stats_enabled, 1)) \
+        __atomic_fetch_add(&(_rb)->stats[rqueue_thread_shard()]._counter, 1, __ATOMIC_RELAXED); \
+} while (0)
+#endif
 
+// NOTE : producers and consumers update their index on different cache lines,
+//        the rest of the descriptor is only read by both
 struct _rqueue_s {
-    rqueue_page_t                *head;
-    rqueue_page_t                *tail;
-    rqueue_page_t                *commit;
-    rqueue_page_t                *reader;
-    rqueue_free_value_callback_t free_value_cb;
+    uint64_t                     tail __attribute__((aligned(RQUEUE_CACHE_LINE)));
+    uint64_t                     head_cache; // spsc only, the producer's copy of the head
+    uint64_t                     head __attribute__((aligned(RQUEUE_CACHE_LINE)));
+    uint64_t                     tail_cache; // spsc only, the consumer's copy of the tail
+    rqueue_slot_t                *slots __attribute__((aligned(RQUEUE_CACHE_LINE)));
     size_t                       size;
+    uint64_t                     mask;
     int                          mode;
-    uint64_t                     writes;
-    uint64_t                     reads;
-    int                          read_sync;
-    int                          write_sync;
-    int                          num_writers;
-    int                          head_swap_failed;
-    int                          reader_next_swap_failed;
-    int                          queue_full_counter;
-    int                          overwrite_counter;
-    int                          is_empty;
-    // Enhanced validation counters
-    int                          topology_change_detected;
-    int                          concurrent_head_movement;
-    int                          commit_advancement_detected;
-    int                          concurrent_writer_detected;
-    int                          overwrite_state_changed;
-    int                          head_next_changed;
-    // Retry statistics for performance monitoring and tuning
-    int                          fast_retries_succeeded;
-    int                          patient_retries_succeeded;
-    int                          complex_retries_succeeded;
-    int                          critical_retries_succeeded;
-    int                          total_retry_failures;
-    uint64_t                     total_retry_attempts;
-    uint64_t                     total_backoff_time_us;
-} PACK_IF_NECESSARY;
-
-// Ensure pointer alignment for flag embedding
-_Static_assert(sizeof(void*) >= 4, "Pointer size must be at least 4 bytes for flag embedding");
-_Static_assert(_Alignof(rqueue_page_t) >= 4, "rqueue_page_t must be 4-byte aligned for flag embedding");
-
-static inline void rqueue_destroy_page(rqueue_page_t *page, rqueue_free_value_callback_t free_value_cb) {
-    if (page->value && free_value_cb)
-        free_value_cb(page->value);
-    free(page);
-}
-
-// VALIDATION HELPERS: Functions to check if topology snapshots are still valid
-static inline int rqueue_validate_reader_snapshot(rqueue_t *rb, 
-    rqueue_page_t *head, rqueue_page_t *commit, rqueue_page_t *next) {
-    return (ATOMIC_READ_ACQUIRE(rb->head) == head &&
-            ATOMIC_READ_ACQUIRE(rb->commit) == commit &&
-            ATOMIC_READ_ACQUIRE(head->next) == next);
-}
-
-static inline int rqueue_validate_writer_snapshot(rqueue_t *rb,
-    rqueue_page_t *tail, rqueue_page_t *commit, rqueue_page_t *head) {
-    return (ATOMIC_READ_ACQUIRE(rb->tail) == tail &&
-            ATOMIC_READ_ACQUIRE(rb->commit) == commit &&
-            ATOMIC_READ_ACQUIRE(rb->head) == head);
-}
-
-// ENHANCED RETRY LOGIC: Exponential backoff with jitter and operation-specific strategies
-static inline void rqueue_backoff_with_strategy(rqueue_t *rb, rqueue_retry_strategy_t strategy, 
-                                               int retry_count, uint64_t *backoff_time_us) {
-    uint64_t start_time = 0;
-    int delay_us = 0;
-    
-    // Record start time for statistics
-    struct timespec ts_start;
-    if (clock_gettime(CLOCK_MONOTONIC, &ts_start) == 0) {
-        start_time = ts_start.tv_sec * 1000000ULL + ts_start.tv_nsec / 1000;
-    }
-    
-    switch (strategy) {
-        case RQUEUE_RETRY_FAST:
-            // Simple CAS operations - minimal backoff, fail fast
-            if (retry_count < 10) {
-                sched_yield();  // First few retries just yield
-            } else if (retry_count < 50) {
-                delay_us = 1 << ((retry_count - 10) / 5);  // 1, 2, 4, 8 μs
-                delay_us = (delay_us > 100) ? 100 : delay_us;  // Cap at 100μs
-            }
-            break;
-            
-        case RQUEUE_RETRY_PATIENT:
-            // Blocking mode - exponential backoff for persistent full conditions
-            if (retry_count < 5) {
-                sched_yield();
-            } else {
-                delay_us = 1 << ((retry_count - 5) / 10);  // 1, 2, 4, 8, 16... μs
-                delay_us = (delay_us > 10000) ? 10000 : delay_us;  // Cap at 10ms
-            }
-            break;
-            
-        case RQUEUE_RETRY_COMPLEX:
-            // Multi-step reader operations - longer delays for complex operations
-            if (retry_count < 3) {
-                sched_yield();
-            } else {
-                delay_us = (1 << ((retry_count - 3) / 8)) * 2;  // 2, 4, 8, 16... μs
-                delay_us = (delay_us > 5000) ? 5000 : delay_us;  // Cap at 5ms
-            }
-            break;
-            
-        case RQUEUE_RETRY_CRITICAL:
-            // Overwrite mode - very short delays, designed to fail quickly
-            if (retry_count < 5) {
-                sched_yield();
-            } else {
-                delay_us = retry_count;  // Linear increase: 5, 6, 7, 8... μs
-                delay_us = (delay_us > 50) ? 50 : delay_us;  // Cap at 50μs
-            }
-            break;
-    }
-    
-    if (delay_us > 0) {
-        // Add jitter to prevent thundering herd (±25% variance)
-        int jitter = (rand() % (delay_us / 2 + 1)) - (delay_us / 4);
-        delay_us = delay_us + jitter;
-        if (delay_us < 1) delay_us = 1;  // Minimum 1μs
-        
-        usleep(delay_us);
-        
-        // Update statistics with actual backoff time
-        if (backoff_time_us && start_time > 0) {
-            struct timespec ts_end;
-            if (clock_gettime(CLOCK_MONOTONIC, &ts_end) == 0) {
-                uint64_t end_time = ts_end.tv_sec * 1000000ULL + ts_end.tv_nsec / 1000;
-                *backoff_time_us += (end_time - start_time);
-            }
-        }
-    }
+    int                          spsc;
+    int                          membarrier; // the waiters issue the barriers
+    int                          stats_enabled;
+    rqueue_free_value_callback_t free_value_cb;
+    // blocking waits, written only while somebody is waiting
+    uint32_t                     read_seq __attribute__((aligned(RQUEUE_CACHE_LINE)));
+    uint32_t                     read_waiters;
+    uint32_t                     write_seq;
+    uint32_t                     write_waiters;
+    uint32_t                     efd_armed;
+    int                          efd;
+    rqueue_stats_shard_t         stats[RQUEUE_STATS_SHARDS];
+};
+
+static int rqueue_thread_shard_next = 0;
+static __thread int rqueue_thread_shard_index = -1;
+
+static inline int rqueue_thread_shard() {
+    if (__builtin_expect(rqueue_thread_shard_index < 0, 0))
+        rqueue_thread_shard_index = __sync_fetch_and_add(&rqueue_thread_shard_next, 1) % RQUEUE_STATS_SHARDS;
+    return rqueue_thread_shard_index;
 }
 
-/*
-static rqueue_page_t *rqueue_create_page() {
-    rqueue_page_t *page = calloc(1, sizeof(rqueue_page_t));
-    return page;
+static inline void rqueue_count_overwrite(rqueue_t *rb) {
+    __atomic_fetch_add(&rb->stats[rqueue_thread_shard()].overwrites, 1, __ATOMIC_RELAXED);
 }
 
-static void *rqueue_page_value(rqueue_page_t *page) {
-    return page->value;
+static inline rqueue_slot_t *rqueue_slot(rqueue_t *rb, uint64_t pos) {
+    return &rb->slots[rb->mask ? (pos & rb->mask) : (pos % rb->size)];
 }
-*/
 
-rqueue_t *rqueue_create(size_t size, rqueue_mode_t mode) {
-    size_t i;
-    rqueue_t *rb = calloc(1, sizeof(rqueue_t));
-    if (!rb)
+static int rqueue_membarrier_register() {
+#ifdef __linux__
+    static int registered = -1;
+    int rc = ATOMIC_READ_RELAXED(registered);
+    if (rc < 0) {
+        int cmds = syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+        rc = cmds > 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+             syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+        ATOMIC_STORE_RELAXED(registered, rc);
+    }
+    return rc;
+#else
+    return 0;
+#endif
+}
+
+rqueue_t *rqueue_create_with_flags(size_t size, rqueue_mode_t mode, int flags) {
+    // the consumer is the only one which can take values from a spsc ring
+    if ((flags & RQUEUE_FLAG_SPSC) && mode != RQUEUE_MODE_BLOCKING)
+        return NULL;
+
+    rqueue_t *rb = NULL;
+    if (posix_memalign((void **)&rb, RQUEUE_CACHE_LINE, sizeof(rqueue_t)) != 0)
         return NULL;
+    memset(rb, 0, sizeof(rqueue_t));
+
     rb->size = (size > RQUEUE_MIN_SIZE) ? size : RQUEUE_MIN_SIZE;
+    rb->mask = (rb->size & (rb->size - 1)) == 0 ? rb->size - 1 : 0;
     rb->mode = mode;
-    rb->is_empty = 1;
-    
-    // MEMORY LIFECYCLE: All ring buffer pages are pre-allocated here and remain at stable
-    // addresses throughout the queue's lifetime. Pages are never individually freed or
-    // reallocated during operations, eliminating classic ABA problems from memory reuse.
-    for (i = 0; i <= rb->size; i++) { // NOTE : we create one page more than the requested size
-        rqueue_page_t *page = calloc(1, sizeof(rqueue_page_t));
-        if (!page) {
-            // CLEANUP SAFETY: Ring is not yet closed and no flags are embedded in next pointers.
-            // All next pointers are clean at this point, so simple traversal is safe.
-            // Flag embedding only happens after successful completion of this allocation loop.
-            rqueue_page_t *current = rb->head;
-            while (current) {
-                rqueue_page_t *next = current->next;  // Safe: no flags embedded yet
-                free(current);
-                current = next;
-            }
-            free(rb);
-            return NULL;
-        }
-        if (!rb->head) {
-            rb->head = rb->tail = page;
-        } else if (rb->tail) {
-            rb->tail->next = page;
-        }
-        page->prev = rb->tail;
-        rb->tail = page;
+    rb->efd = -1;
+    rb->stats_enabled = !(flags & RQUEUE_FLAG_NO_STATS);
+    if (flags & RQUEUE_FLAG_SPSC) {
+        rb->spsc = 1;
+        rb->membarrier = rqueue_membarrier_register();
     }
 
-    if (!rb->head || !rb->tail) {
+    if (posix_memalign((void **)&rb->slots, RQUEUE_CACHE_LINE, rb->size * sizeof(rqueue_slot_t)) != 0) {
         free(rb);
         return NULL;
     }
 
-    // RING CLOSURE: Close the ringbuffer and embed flags. This is the first point where
-    // flags are embedded in next pointers. All previous error cleanup paths deal with
-    // clean pointers only. After this point, any cleanup must use flag-aware traversal.
-    rb->head->prev = rb->tail;
-    rb->tail->next = rb->head;
-    ATOMIC_STORE_RELEASE(rb->tail->next, RQUEUE_FLAG_ON(rb->head, RQUEUE_FLAG_HEAD));
-
-    rb->tail = rb->head;
-
-    rb->commit = rb->tail;
-
-    // the reader page is out of the ringbuffer
-    rb->reader = calloc(1, sizeof(rqueue_page_t));
-    if (!rb->reader) {
-        // CLEANUP SAFETY: Ring is now closed with embedded flags in next pointers.
-        // Must use flag-aware traversal (RQUEUE_FLAG_OFF) to get clean pointers.
-        // This cleanup correctly handles the flagged pointers created during ring closure.
-        rqueue_page_t *page = rb->head;
-        do {
-            rqueue_page_t *next = RQUEUE_FLAG_OFF(page->next, RQUEUE_FLAG_ALL);  // Remove flags
-            free(page);
-            page = next;
-        } while (page != rb->head);
-        free(rb);
-        return NULL;
+    // each slot is ready to be written by the first lap
+    size_t i;
+    for (i = 0; i < rb->size; i++) {
+        rb->slots[i].seq = i;
+        rb->slots[i].value = NULL;
     }
-    rb->reader->prev = rb->head->prev;
-    rb->reader->next = rb->head;
+
     return rb;
 }
 
+rqueue_t *rqueue_create(size_t size, rqueue_mode_t mode) {
+    return rqueue_create_with_flags(size, mode, RQUEUE_FLAG_NONE);
+}
+
+rqueue_t *rqueue_create_spsc(size_t size) {
+    return rqueue_create_with_flags(size, RQUEUE_MODE_BLOCKING, RQUEUE_FLAG_SPSC);
+}
+
 void rqueue_set_free_value_callback(rqueue_t *rb, rqueue_free_value_callback_t cb) {
     if (rb == NULL) {
         // do nothing
@@ -274,381 +216,581 @@ void rqueue_destroy(rqueue_t *rb) {
         // do nothing
         return;
     }
-    
-    // MEMORY LIFECYCLE: Pages are only freed here when the entire queue is destroyed.
-    // During normal operation, pages are reused cyclically but never freed individually.
-    rqueue_page_t *page = rb->head;
-    do {
-        rqueue_page_t *p = page;
-        page = RQUEUE_FLAG_OFF(p->next, RQUEUE_FLAG_ALL);
-        rqueue_destroy_page(p, rb->free_value_cb);
-    } while (__builtin_expect(page != rb->head, 1));
 
-    // release the reader page as well
-    rqueue_destroy_page(rb->reader, rb->free_value_cb);
+    // release the values which have not been read
+    uint64_t pos;
+    for (pos = rb->head; pos != rb->tail; pos++) {
+        rqueue_slot_t *slot = rqueue_slot(rb, pos);
+        if ((rb->spsc || slot->seq == pos + 1) && slot->value && rb->free_value_cb)
+            rb->free_value_cb(slot->value);
+    }
 
-    // and finally release the ringbuffer descriptor
+#ifdef __linux__
+    if (rb->efd >= 0)
+        close(rb->efd);
+#endif
+    free(rb->slots);
     free(rb);
 }
 
-void *rqueue_read(rqueue_t *rb) {
-    if (rb == NULL) {
-        // do nothing
-        return NULL;
+// a full barrier between the update of the index and the check of the waiters
+// (or between the registration of a waiter and the check of the indices)
+static inline void rqueue_spsc_barrier(rqueue_t *rb) {
+    if (rb->membarrier)
+        __asm__ __volatile__("" ::: "memory");
+    else
+        __sync_synchronize();
+}
+
+static void rqueue_waiter_barrier(rqueue_t *rb) {
+#ifdef __linux__
+    // all the running threads execute a barrier before this returns
+    if (rb->membarrier)
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+#endif
+}
+
+static int rqueue_park(uint32_t *addr, uint32_t val, const struct timespec *deadline) {
+    struct timespec timeout, *tp = NULL;
+    if (deadline) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout.tv_sec = deadline->tv_sec - now.tv_sec;
+        timeout.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if (timeout.tv_nsec < 0) {
+            timeout.tv_sec--;
+            timeout.tv_nsec += 1000000000L;
+        }
+        if (timeout.tv_sec < 0)
+            return -1;
+        tp = &timeout;
     }
 
-    int i;
-    void *v = NULL;
+#ifdef __linux__
+    // NOTE : returns immediately if *addr has already changed
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tp, NULL, 0) == -1 && errno == ETIMEDOUT)
+        return -1;
+#else
+    // no futexes, poll the sequence (nobody will wake us up)
+    struct timespec nap = { 0, 50000 };
+    if (tp && tp->tv_sec == 0 && tp->tv_nsec < nap.tv_nsec)
+        nap = *tp;
+    if (ATOMIC_READ_ACQUIRE(*addr) == val)
+        nanosleep(&nap, NULL);
+#endif
+    return 0;
+}
 
-    // READER SYNCHRONIZATION: This loop ensures bounded execution time for read operations.
-    // The read_sync lock is always released within RQUEUE_READER_MAX_RETRIES iterations, preventing
-    // any possibility of indefinite blocking for writers in overwrite mode.
-    uint64_t backoff_time = 0;
-    for (i = 0; i < RQUEUE_READER_MAX_RETRIES; i++) {
-        ATOMIC_INCREMENT(rb->total_retry_attempts);
+static void rqueue_unpark(uint32_t *addr, uint32_t *waiters, size_t n) {
+    if (!ATOMIC_READ_RELAXED(*waiters))
+        return;
+    ATOMIC_INCREMENT(*addr);
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n < INT32_MAX ? (int)n : INT32_MAX, NULL, NULL, 0);
+#endif
+}
 
-        if (__builtin_expect(ATOMIC_CAS(rb->read_sync, 0, 1), 1)) {
-            rqueue_page_t *head = ATOMIC_READ_ACQUIRE(rb->head);
+static void rqueue_signal_readers(rqueue_t *rb, size_t n) {
+#ifdef __linux__
+    if (ATOMIC_READ_RELAXED(rb->efd_armed) && ATOMIC_CAS(rb->efd_armed, 1, 0))
+        eventfd_write(rb->efd, 1);
+#endif
+    rqueue_unpark(&rb->read_seq, &rb->read_waiters, n);
+}
+
+// NOTE : must be called after the index has been updated, with a full barrier
+//        in between (the CAS on the index in the multi-producer case)
+static inline void rqueue_wake_readers(rqueue_t *rb, size_t n) {
+    if (__builtin_expect(ATOMIC_READ_RELAXED(rb->read_waiters) | ATOMIC_READ_RELAXED(rb->efd_armed), 0))
+        rqueue_signal_readers(rb, n);
+}
 
-            rqueue_page_t *commit = ATOMIC_READ_ACQUIRE(rb->commit);
-            rqueue_page_t *next = ATOMIC_READ_ACQUIRE(head->next);
-            rqueue_page_t *old_next = ATOMIC_READ_ACQUIRE(rb->reader->next);
+static inline void rqueue_wake_writers(rqueue_t *rb, size_t n) {
+    if (__builtin_expect(ATOMIC_READ_RELAXED(rb->write_waiters), 0))
+        rqueue_unpark(&rb->write_seq, &rb->write_waiters, n);
+}
 
-            if (rb->reader == commit || ATOMIC_READ_RELAXED(rb->is_empty))
-            { // nothing to read
-                ATOMIC_CAS(rb->read_sync, 1, 0);
-                continue;
+// called by readers which found the ring empty, the next writer
+// will signal the eventfd (if any)
+static void rqueue_arm_eventfd(rqueue_t *rb) {
+#ifdef __linux__
+    if (ATOMIC_READ_RELAXED(rb->efd_armed))
+        return;
+    // reset the eventfd before arming it, or we might
+    // consume the notification of the next writer
+    eventfd_t count;
+    eventfd_read(rb->efd, &count);
+    if (!ATOMIC_CAS(rb->efd_armed, 0, 1))
+        return;
+    rqueue_waiter_barrier(rb);
+    // a writer might have published a value before seeing the flag
+    if (ATOMIC_READ_ACQUIRE(rb->head) != ATOMIC_READ_ACQUIRE(rb->tail) && ATOMIC_CAS(rb->efd_armed, 1, 0))
+        eventfd_write(rb->efd, 1);
+#endif
+}
+
+static inline void rqueue_read_empty(rqueue_t *rb) {
+    RQUEUE_STATS_INCREMENT(rb, queue_empty);
+    if (__builtin_expect(ATOMIC_READ_RELAXED(rb->efd) >= 0, 0))
+        rqueue_arm_eventfd(rb);
+}
+
+// take the value at the given position if it's the oldest one and it's ready
+// NOTE : returns 1 if the value has been taken, 0 if the head moved or
+//        the value has not been published yet
+static inline int rqueue_take(rqueue_t *rb, uint64_t pos, void **value) {
+    rqueue_slot_t *slot = rqueue_slot(rb, pos);
+    if (ATOMIC_READ_ACQUIRE(slot->seq) != pos + 1 || !ATOMIC_CAS(rb->head, pos, pos + 1))
+        return 0;
+
+    *value = slot->value;
+    slot->value = NULL;
+    // the slot is now ready for the writer of the next lap
+    ATOMIC_STORE_RELEASE(slot->seq, pos + rb->size);
+    return 1;
+}
+
+// NOTE : the reads and writes issued while waiting pass count == 0, so that
+//        a wait is counted only once as a read which found the ring empty
+//        (or a write which found it full) instead of once per attempt
+static inline void *rqueue_spsc_read(rqueue_t *rb, int count) {
+    uint64_t pos = rb->head;
+    if (pos == rb->tail_cache) {
+        rb->tail_cache = ATOMIC_READ_ACQUIRE(rb->tail);
+        if (pos == rb->tail_cache) {
+            if (count)
+                rqueue_read_empty(rb);
+            return NULL;
+        }
+    }
+
+    rqueue_slot_t *slot = rqueue_slot(rb, pos);
+    void *v = slot->value;
+    slot->value = NULL;
+    ATOMIC_STORE_RELEASE(rb->head, pos + 1);
+    // order the store of the head with the load of the waiters count
+    rqueue_spsc_barrier(rb);
+    rqueue_wake_writers(rb, 1);
+    return v;
+}
+
+static inline int rqueue_spsc_write(rqueue_t *rb, void *value, int count) {
+    uint64_t pos = rb->tail;
+    if (pos - rb->head_cache >= rb->size) {
+        rb->head_cache = ATOMIC_READ_ACQUIRE(rb->head);
+        if (pos - rb->head_cache >= rb->size) {
+            if (count)
+                RQUEUE_STATS_INCREMENT(rb, queue_full);
+            return -2;
+        }
+    }
+
+    rqueue_slot(rb, pos)->value = value;
+    ATOMIC_STORE_RELEASE(rb->tail, pos + 1);
+    rqueue_spsc_barrier(rb);
+    rqueue_wake_readers(rb, 1);
+    return 0;
+}
+
+static inline void *rqueue_read_internal(rqueue_t *rb, int count) {
+    if (rb->spsc)
+        return rqueue_spsc_read(rb, count);
+
+    uint64_t pos = ATOMIC_READ_RELAXED(rb->head);
+    for (;;) {
+        rqueue_slot_t *slot = rqueue_slot(rb, pos);
+        int64_t diff = (int64_t)(ATOMIC_READ_ACQUIRE(slot->seq) - (pos + 1));
+        if (diff == 0) {
+            uint64_t head = ATOMIC_CAS_RETURN(rb->head, pos, pos + 1);
+            if (head == pos) {
+                void *v = slot->value;
+                slot->value = NULL;
+                ATOMIC_STORE_RELEASE(slot->seq, pos + rb->size);
+                rqueue_wake_writers(rb, 1);
+                return v;
             }
+            // another reader got it, try with the next one
+            RQUEUE_STATS_INCREMENT(rb, read_retries);
+            pos = head;
+        } else if (diff < 0) {
+            // nothing has been written (or published yet) at this position
+            if (count)
+                rqueue_read_empty(rb);
+            return NULL;
+        } else {
+            // we are a lap behind, the head moved in the meanwhile
+            pos = ATOMIC_READ_RELAXED(rb->head);
+        }
+    }
+}
 
-            // VALIDATION POINT 1: Re-validate critical pointers before ring modifications
-            // Check that the topology snapshot we took is still valid
-            if (!rqueue_validate_reader_snapshot(rb, head, commit, next)) {
-                // Topology changed - retry with fresh snapshot
-                ATOMIC_INCREMENT(rb->topology_change_detected);
-                ATOMIC_CAS(rb->read_sync, 1, 0);
-                // Use complex retry strategy for topology changes
-                rqueue_backoff_with_strategy(rb, RQUEUE_RETRY_COMPLEX, i, &backoff_time);
-                continue;
+void *rqueue_read(rqueue_t *rb) {
+    if (rb == NULL) {
+        // do nothing
+        return NULL;
+    }
+
+    return rqueue_read_internal(rb, 1);
+}
+
+static inline int rqueue_write_internal(rqueue_t *rb, void *value, int count) {
+    if (rb->spsc)
+        return rqueue_spsc_write(rb, value, count);
+
+    uint64_t pos = ATOMIC_READ_RELAXED(rb->tail);
+    for (;;) {
+        rqueue_slot_t *slot = rqueue_slot(rb, pos);
+        int64_t diff = (int64_t)(ATOMIC_READ_ACQUIRE(slot->seq) - pos);
+        if (diff == 0) {
+            uint64_t tail = ATOMIC_CAS_RETURN(rb->tail, pos, pos + 1);
+            if (tail == pos) {
+                slot->value = value;
+                ATOMIC_STORE_RELEASE(slot->seq, pos + 1);
+                rqueue_wake_readers(rb, 1);
+                return 0;
+            }
+            // another writer got it, try with the next one
+            RQUEUE_STATS_INCREMENT(rb, write_retries);
+            pos = tail;
+        } else if (diff < 0) {
+            // the slot still holds the value written a lap ago (or that
+            // value is being read), the ringbuffer is full
+            if (ATOMIC_READ_RELAXED(rb->mode) != RQUEUE_MODE_OVERWRITE) {
+                if (count)
+                    RQUEUE_STATS_INCREMENT(rb, queue_full);
+                return -2;
             }
 
-            // ABA PROTECTION: The following CAS operations are protected from ABA problems by:
-            // 1. Pages are pre-allocated at creation and never individually freed (stable addresses)
-            // 2. Only one reader thread can execute this section (read_sync lock above)
-            // 3. Sequential CAS operations validate that ring topology hasn't changed
-            // 4. Reader page is isolated outside the ring during this operation
-            // 5. Enhanced validation points catch topology changes before modifications
-            
-            // first connect the reader page to the head->next page
-            if (ATOMIC_CAS(rb->reader->next, old_next, RQUEUE_FLAG_ON(next, RQUEUE_FLAG_HEAD))) {
-                ATOMIC_STORE_RELEASE(rb->reader->prev, head->prev);
-
-                // VALIDATION POINT 2: Ensure head pointer hasn't moved before critical ring insertion
-                // This catches overwrite mode head advancement between our operations
-                rqueue_page_t *current_head = ATOMIC_READ_ACQUIRE(rb->head);
-                if (current_head != head) {
-                    // Head was advanced (likely by overwrite mode) - abort and retry
-                    ATOMIC_INCREMENT(rb->concurrent_head_movement);
-                    // Restore reader state
-                    ATOMIC_STORE_RELAXED(rb->reader->next, old_next);
-                    ATOMIC_CAS(rb->read_sync, 1, 0);
-                    // Use complex retry strategy for concurrent head movement
-                    rqueue_backoff_with_strategy(rb, RQUEUE_RETRY_COMPLEX, i, &backoff_time);
-                    continue;
-                }
-
-                // now connect head->prev->next to the reader page, replacing the head with the reader
-                // in the ringbuffer. If ring topology changed, this CAS will fail, validating our assumptions
-                if (ATOMIC_CAS(head->prev->next, RQUEUE_FLAG_ON(head, RQUEUE_FLAG_HEAD), rb->reader)) {
-                    // now the head is out of the ringbuffer and we can update the pointer
-                    ATOMIC_CAS(rb->head, head, next);
-
-                    ATOMIC_STORE_RELEASE(next->prev, rb->reader);
-                    ATOMIC_STORE_RELEASE(rb->reader, head); // the head is the new reader
-                    v = ATOMIC_READ_ACQUIRE(rb->reader->value);
-                    if (v == NULL) { 
-                        ATOMIC_CAS(rb->read_sync, 1, 0);
-                        continue;
-                    }
-                    ATOMIC_CAS(rb->reader->value, v, NULL);
-                    ATOMIC_INCREMENT(rb->reads);
-                    
-                    // EMPTY STATE RACE FIX: Prevent TOCTOU race between head/tail comparison and is_empty update
-                    // Use CAS with validation to atomically update is_empty only when head/tail are consistent
-                    rqueue_page_t *head_snap = ATOMIC_READ_ACQUIRE(rb->head);
-                    rqueue_page_t *tail_snap = ATOMIC_READ_ACQUIRE(rb->tail);
-                    
-                    if (head_snap == tail_snap) {
-                        // CAS is_empty from 0 to 1, but only if head/tail still match our snapshots
-                        int expected_empty = 0;
-                        if (ATOMIC_READ_ACQUIRE(rb->head) == head_snap && 
-                            ATOMIC_READ_ACQUIRE(rb->tail) == tail_snap &&
-                            ATOMIC_CAS(rb->is_empty, expected_empty, 1)) {
-                            // Successfully set empty state atomically
-                        }
-                    }
-                    ATOMIC_CAS(rb->read_sync, 1, 0);
-                    break;
-                } else {
-                    ATOMIC_INCREMENT(rb->head_swap_failed);
-                    // SEQUENTIAL CAS VALIDATION: The failure of the second CAS indicates the ring
-                    // topology changed between our pointer reads and this operation. We restore
-                    // the reader state and retry, ensuring consistency.
-                    ATOMIC_STORE_RELAXED(rb->reader->next, old_next);
-                    rqueue_backoff_with_strategy(rb, RQUEUE_RETRY_COMPLEX, i, &backoff_time);
-                }
+            // drop the oldest value as a reader would do, unless
+            // a reader is already taking it
+            void *old = NULL;
+            if (rqueue_take(rb, pos - rb->size, &old)) {
+                rqueue_count_overwrite(rb);
+                if (old && rb->free_value_cb)
+                    rb->free_value_cb(old);
             } else {
-                ATOMIC_INCREMENT(rb->reader_next_swap_failed);
-                // SEQUENTIAL CAS VALIDATION: First CAS failed, indicating another thread modified
-                // the reader->next pointer. This prevents proceeding with stale pointer values.
-                rqueue_backoff_with_strategy(rb, RQUEUE_RETRY_COMPLEX, i, &backoff_time);
+                sched_yield();
             }
-            ATOMIC_CAS(rb->read_sync, 1, 0);
+            pos = ATOMIC_READ_RELAXED(rb->tail);
         } else {
-            // Failed to acquire read_sync - another reader is active
-            rqueue_backoff_with_strategy(rb, RQUEUE_RETRY_COMPLEX, i, &backoff_time);
+            // the tail moved in the meanwhile
+            pos = ATOMIC_READ_RELAXED(rb->tail);
         }
     }
-    
-    // Update retry statistics based on outcome
-    ATOMIC_INCREASE(rb->total_backoff_time_us, backoff_time);
-    if (v != NULL) {
-        ATOMIC_INCREMENT(rb->complex_retries_succeeded);
-    } else {
-        ATOMIC_INCREMENT(rb->total_retry_failures);
-    }
-    
-    // READER SYNC GUARANTEE: All code paths above release read_sync in bounded time.
-    // This ensures writers in overwrite mode cannot be blocked indefinitely.
-    return v;
-}
-
-static inline void
-rqueue_update_value(rqueue_t *rb, rqueue_page_t *page, void *value) {
-    // Only free the old value if we successfully replace it
-    void *old_value;
-    do {
-        old_value = ATOMIC_READ_ACQUIRE(page->value);
-    } while (!ATOMIC_CAS(page->value, old_value, value));
-    
-    if (old_value && rb->free_value_cb)
-        rb->free_value_cb(old_value);
 }
 
 int
 rqueue_write(rqueue_t *rb, void *value) {
-    if (rb == NULL) {
+    if (rb == NULL || value == NULL) {
         // do nothing
-        return -1; // Invalid queue pointer
-    }
-
-    int retries = 0;
-
-    rqueue_page_t *temp_page = NULL;
-    rqueue_page_t *next_page = NULL;
-    rqueue_page_t *tail = NULL;
-    rqueue_page_t *head = NULL;
-    rqueue_page_t *commit;
-    
-    // TODO - get rid of this barrier
-    while (!__builtin_expect(ATOMIC_CAS(rb->write_sync, 0, 1), 1))
-        sched_yield();
-
-    // WRITER COUNTING: Track active writers holding write_sync lock.
-    // This count is used for commit optimization - only increment when we're actively writing.
-    // Must be decremented before releasing write_sync to maintain accurate active count.
-    ATOMIC_INCREMENT(rb->num_writers);
-    do {
-        temp_page = ATOMIC_READ_ACQUIRE(rb->tail);
-        commit = ATOMIC_READ_ACQUIRE(rb->commit);
-        next_page = RQUEUE_FLAG_OFF(ATOMIC_READ_ACQUIRE(temp_page->next), RQUEUE_FLAG_ALL);
-        if (!next_page) {
-            ATOMIC_DECREMENT(rb->num_writers);  // Exit path: single decrement
-            ATOMIC_CAS(rb->write_sync, 1, 0); 
-            return -1;
-        }
-        head = ATOMIC_READ_ACQUIRE(rb->head);
-
-        // VALIDATION POINT 3: Check for rapid reader advancement before proceeding
-        // Readers might have significantly advanced commit pointer since we read it
-        rqueue_page_t *current_commit = ATOMIC_READ_ACQUIRE(rb->commit);
-        if (current_commit != commit) {
-            // Commit advanced significantly - re-read with fresh snapshot
-            ATOMIC_INCREMENT(rb->commit_advancement_detected);
-            continue;  // Restart loop with fresh reads
-        }
+        return -1;
+    }
+
+    return rqueue_write_internal(rb, value, 1);
+}
+
+static inline size_t rqueue_spsc_write_batch(rqueue_t *rb, void **values, size_t n) {
+    uint64_t pos = rb->tail;
+    if (pos - rb->head_cache + n > rb->size)
+        rb->head_cache = ATOMIC_READ_ACQUIRE(rb->head);
+    size_t room = rb->size - (size_t)(pos - rb->head_cache);
+    size_t count = n < room ? n : room;
+    if (!count) {
+        RQUEUE_STATS_INCREMENT(rb, queue_full);
+        return 0;
+    }
+
+    size_t i;
+    for (i = 0; i < count; i++)
+        rqueue_slot(rb, pos + i)->value = values[i];
+    // all the values are published at once
+    ATOMIC_STORE_RELEASE(rb->tail, pos + count);
+    rqueue_spsc_barrier(rb);
+    rqueue_wake_readers(rb, count);
+    return count;
+}
+
+static inline size_t rqueue_spsc_read_batch(rqueue_t *rb, void **values, size_t max) {
+    uint64_t pos = rb->head;
+    if (rb->tail_cache - pos < max)
+        rb->tail_cache = ATOMIC_READ_ACQUIRE(rb->tail);
+    size_t avail = (size_t)(rb->tail_cache - pos);
+    size_t count = max < avail ? max : avail;
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        rqueue_slot_t *slot = rqueue_slot(rb, pos + i);
+        values[i] = slot->value;
+        slot->value = NULL;
+    }
+    if (!count) {
+        rqueue_read_empty(rb);
+        return 0;
+    }
+    ATOMIC_STORE_RELEASE(rb->head, pos + count);
+    rqueue_spsc_barrier(rb);
+    rqueue_wake_writers(rb, count);
+    return count;
+}
 
-        // VALIDATION POINT 4: Verify tail hasn't been advanced by competing writers
-        rqueue_page_t *current_tail = ATOMIC_READ_ACQUIRE(rb->tail);
-        if (current_tail != temp_page) {
-            // Another writer advanced tail - use fresh snapshot
-            ATOMIC_INCREMENT(rb->concurrent_writer_detected);
-            continue;  // Restart with fresh reads
+size_t rqueue_write_batch(rqueue_t *rb, void **values, size_t n) {
+    if (rb == NULL || !n)
+        return 0;
+
+    if (rb->spsc)
+        return rqueue_spsc_write_batch(rb, values, n);
+
+    size_t written = 0;
+    uint64_t pos = ATOMIC_READ_RELAXED(rb->tail);
+    while (written < n) {
+        // the range starting at the tail which is ready to be written
+        size_t count = 0;
+        while (written + count < n) {
+            rqueue_slot_t *slot = rqueue_slot(rb, pos + count);
+            if (ATOMIC_READ_ACQUIRE(slot->seq) != pos + count)
+                break;
+            count++;
         }
 
-        if (rb->mode == RQUEUE_MODE_BLOCKING && commit == temp_page && temp_page != head && next_page != head) {
-            if (retries++ < RQUEUE_BLOCKING_MAX_RETRIES) {
-                ATOMIC_INCREMENT(rb->total_retry_attempts);
-                ATOMIC_CAS(rb->tail, temp_page, next_page);
-                // WRITER COUNTING: Decrement before releasing lock to maintain active writer count
-                ATOMIC_DECREMENT(rb->num_writers);
-                ATOMIC_CAS(rb->write_sync, 1, 0);
-                
-                // Use patient retry strategy for blocking mode (queue full scenario)
-                uint64_t backoff_time = 0;
-                rqueue_backoff_with_strategy(rb, RQUEUE_RETRY_PATIENT, retries, &backoff_time);
-                ATOMIC_INCREASE(rb->total_backoff_time_us, backoff_time);
-
-                while (!__builtin_expect(ATOMIC_CAS(rb->write_sync, 0, 1), 1)) {
-                    rqueue_backoff_with_strategy(rb, RQUEUE_RETRY_PATIENT, retries, &backoff_time);
-                    ATOMIC_INCREASE(rb->total_backoff_time_us, backoff_time);
-                }
-
-                // WRITER COUNTING: Increment when reacquiring lock to resume active writing
-                ATOMIC_INCREMENT(rb->num_writers);
+        if (!count) {
+            rqueue_slot_t *slot = rqueue_slot(rb, pos);
+            if ((int64_t)(ATOMIC_READ_ACQUIRE(slot->seq) - pos) > 0) {
+                // the tail moved in the meanwhile
+                pos = ATOMIC_READ_RELAXED(rb->tail);
                 continue;
+            }
+            if (ATOMIC_READ_RELAXED(rb->mode) != RQUEUE_MODE_OVERWRITE) {
+                RQUEUE_STATS_INCREMENT(rb, queue_full);
+                break;
+            }
+            // drop the oldest value (see rqueue_write())
+            void *old = NULL;
+            if (rqueue_take(rb, pos - rb->size, &old)) {
+                rqueue_count_overwrite(rb);
+                if (old && rb->free_value_cb)
+                    rb->free_value_cb(old);
             } else {
-                ATOMIC_DECREMENT(rb->num_writers);  // Exit path: decrement before releasing lock
-                ATOMIC_CAS(rb->write_sync, 1, 0);
-                ATOMIC_INCREMENT(rb->queue_full_counter);
-                ATOMIC_INCREMENT(rb->total_retry_failures);
-                ATOMIC_INCREMENT(rb->patient_retries_succeeded);  // Reached max retries, but was using patient strategy
-                return -2;
+                sched_yield();
             }
+            pos = ATOMIC_READ_RELAXED(rb->tail);
+            continue;
         }
 
-       if (RQUEUE_CHECK_FLAG(ATOMIC_READ_ACQUIRE(temp_page->next), RQUEUE_FLAG_HEAD) || (next_page == head && !ATOMIC_READ_RELAXED(rb->is_empty))) {
-            if (rb->mode == RQUEUE_MODE_OVERWRITE && ATOMIC_READ_ACQUIRE(commit->next) == temp_page) {
-               // OVERWRITE MODE SYNCHRONIZATION: This synchronization with readers is necessary because
-               // the current reader algorithm assumes head pointer stability during read operations.
-               // Without this sync, concurrent head advancement would corrupt the ring structure.
-               //
-               // DEADLOCK SAFETY: This cannot cause deadlocks because:
-               // 1. Readers always release read_sync in bounded time (max RQUEUE_MAX_RETRIES iterations)
-               // 2. All reader code paths have explicit read_sync release operations
-               // 3. If CAS fails, writer continues with normal retry logic (no blocking)
-               //
-               // PERFORMANCE IMPACT: Writers may retry when readers are active, causing temporary
-               // latency spikes but no correctness issues. This is a performance trade-off, not a bug
-               // and will happen only if the rqueue is full (which is unlikely to happen if there is
-               // contention with active readers)
-               if (ATOMIC_CAS(rb->read_sync, 0, 1)) {
-                    // Successfully acquired reader sync - safe to advance head
-                    ATOMIC_INCREMENT(rb->overwrite_counter);
-                    
-                    // VALIDATION POINT 5: Double-check that overwrite is still needed
-                    // Conditions might have changed while waiting for reader sync
-                    rqueue_page_t *current_head = ATOMIC_READ_ACQUIRE(rb->head);
-                    rqueue_page_t *current_commit = ATOMIC_READ_ACQUIRE(rb->commit);
-                    
-                    if (current_head != head || current_commit != commit) {
-                        // Ring state changed while acquiring sync - restart
-                        ATOMIC_INCREMENT(rb->overwrite_state_changed);
-                        ATOMIC_CAS(rb->read_sync, 1, 0);
-                        continue;  // Retry with fresh snapshot
-                    }
-                    
-                    // Proceed with head advancement
-                    rqueue_page_t *nextpp = RQUEUE_FLAG_OFF(ATOMIC_READ_ACQUIRE(current_head->next), RQUEUE_FLAG_ALL);
-                    
-                    // VALIDATION POINT 6: Ensure head->next is still valid before using it
-                    if (nextpp != RQUEUE_FLAG_OFF(ATOMIC_READ_ACQUIRE(head->next), RQUEUE_FLAG_ALL)) {
-                        // Head->next changed during operation
-                        ATOMIC_INCREMENT(rb->head_next_changed);
-                        ATOMIC_CAS(rb->read_sync, 1, 0);
-                        continue;
-                    }
-                    
-                    // Safe to proceed with atomic head advancement
-                    if (ATOMIC_CAS(current_head->next, nextpp, RQUEUE_FLAG_ON(nextpp, RQUEUE_FLAG_HEAD))) {
-                        ATOMIC_CAS(temp_page->next, RQUEUE_FLAG_ON(current_head, RQUEUE_FLAG_HEAD), current_head);
-                        // Safe to use ATOMIC_STORE since we hold read_sync - no concurrent head modifications
-                        ATOMIC_STORE_RELEASE(rb->head, nextpp);
-                    }
-                   ATOMIC_CAS(rb->read_sync, 1, 0);
-                   continue;
-               }
-               // CAS failed - reader is active. Continue with normal write retry logic.
-            }
-            if (retries++ < RQUEUE_WRITER_CAS_MAX_RETRIES) {
-                ATOMIC_INCREMENT(rb->total_retry_attempts);
-                // WRITER COUNTING: Decrement before releasing lock to maintain active writer count
-                ATOMIC_DECREMENT(rb->num_writers);
-                ATOMIC_CAS(rb->write_sync, 1, 0);
-                
-                // Use fast retry strategy for simple CAS operations
-                uint64_t backoff_time = 0;
-                rqueue_backoff_with_strategy(rb, RQUEUE_RETRY_FAST, retries, &backoff_time);
-                ATOMIC_INCREASE(rb->total_backoff_time_us, backoff_time);
-
-                while (!__builtin_expect(ATOMIC_CAS(rb->write_sync, 0, 1), 1)) {
-                    rqueue_backoff_with_strategy(rb, RQUEUE_RETRY_FAST, retries, &backoff_time);
-                    ATOMIC_INCREASE(rb->total_backoff_time_us, backoff_time);
-                }
-
-                // WRITER COUNTING: Increment when reacquiring lock to resume active writing
-                ATOMIC_INCREMENT(rb->num_writers);
-                continue;
-            } else {
-                ATOMIC_DECREMENT(rb->num_writers);  // Exit path: decrement before releasing lock
-                ATOMIC_CAS(rb->write_sync, 1, 0);
-                ATOMIC_INCREMENT(rb->queue_full_counter);
-                ATOMIC_INCREMENT(rb->total_retry_failures);
-                ATOMIC_INCREMENT(rb->fast_retries_succeeded);  // Reached max retries, but was using fast strategy
-                return -2;
+        // the whole range is claimed at once, no other writer can touch it
+        uint64_t tail = ATOMIC_CAS_RETURN(rb->tail, pos, pos + count);
+        if (tail != pos) {
+            RQUEUE_STATS_INCREMENT(rb, write_retries);
+            pos = tail;
+            continue;
+        }
+
+        size_t i;
+        for (i = 0; i < count; i++) {
+            rqueue_slot_t *slot = rqueue_slot(rb, pos + i);
+            slot->value = values[written + i];
+            ATOMIC_STORE_RELEASE(slot->seq, pos + i + 1);
+        }
+        rqueue_wake_readers(rb, count);
+        written += count;
+        pos += count;
+    }
+
+    return written;
+}
+
+size_t rqueue_read_batch(rqueue_t *rb, void **values, size_t max) {
+    if (rb == NULL || !max)
+        return 0;
+
+    if (rb->spsc)
+        return rqueue_spsc_read_batch(rb, values, max);
+
+    uint64_t pos = ATOMIC_READ_RELAXED(rb->head);
+    for (;;) {
+        // the range starting at the head which has been published
+        size_t count = 0;
+        while (count < max) {
+            rqueue_slot_t *slot = rqueue_slot(rb, pos + count);
+            if (ATOMIC_READ_ACQUIRE(slot->seq) != pos + count + 1)
+                break;
+            count++;
+        }
+
+        if (!count) {
+            rqueue_slot_t *slot = rqueue_slot(rb, pos);
+            if ((int64_t)(ATOMIC_READ_ACQUIRE(slot->seq) - (pos + 1)) < 0) {
+                rqueue_read_empty(rb);
+                return 0;
             }
+            // the head moved in the meanwhile
+            pos = ATOMIC_READ_RELAXED(rb->head);
+            continue;
+        }
 
-        } 
-       
-        if (!RQUEUE_CHECK_FLAG(ATOMIC_READ_ACQUIRE(temp_page->next), RQUEUE_FLAG_HEAD)) {
-            // ABA PROTECTION: This CAS is safe from ABA because pages have stable addresses
-            // (never freed/reallocated) and the write_sync lock ensures only one writer
-            // can modify the tail pointer at a time.
-            tail = ATOMIC_CAS_RETURN(rb->tail, temp_page, next_page);
+        uint64_t head = ATOMIC_CAS_RETURN(rb->head, pos, pos + count);
+        if (head != pos) {
+            RQUEUE_STATS_INCREMENT(rb, read_retries);
+            pos = head;
+            continue;
         }
-    } while (tail != temp_page && retries++ < RQUEUE_WRITER_CAS_MAX_RETRIES);
 
-    if (!tail || tail != temp_page) {
-        ATOMIC_DECREMENT(rb->num_writers);  // Exit path: single decrement
-        ATOMIC_CAS(rb->write_sync, 1, 0);
-        return -1;
-    } 
+        size_t i;
+        for (i = 0; i < count; i++) {
+            rqueue_slot_t *slot = rqueue_slot(rb, pos + i);
+            values[i] = slot->value;
+            slot->value = NULL;
+            ATOMIC_STORE_RELEASE(slot->seq, pos + i + rb->size);
+        }
+        rqueue_wake_writers(rb, count);
+        return count;
+    }
+}
 
+static void rqueue_deadline(struct timespec *deadline, int timeout) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (long)(timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
 
-    // Use helper function to safely replace value and free old one
-    rqueue_update_value(rb, tail, value);
+void *rqueue_read_wait(rqueue_t *rb, int timeout) {
+    if (rb == NULL)
+        return NULL;
 
+    if (timeout == 0)
+        return rqueue_read(rb);
 
-    ATOMIC_INCREMENT(rb->writes);
-    ATOMIC_STORE_RELEASE(rb->is_empty, 0);
+    void *v = NULL;
+    int i;
+    for (i = 0; i < RQUEUE_WAIT_SPINS; i++) {
+        v = rqueue_read_internal(rb, 0);
+        if (v)
+            return v;
+        RQUEUE_CPU_RELAX();
+    }
+    // the whole wait counts as a single read which found the ring empty
+    rqueue_read_empty(rb);
+
+    struct timespec deadline;
+    if (timeout > 0)
+        rqueue_deadline(&deadline, timeout);
+
+    ATOMIC_INCREMENT(rb->read_waiters);
+    rqueue_waiter_barrier(rb);
+    for (;;) {
+        uint32_t seq = ATOMIC_READ_ACQUIRE(rb->read_seq);
+        v = rqueue_read_internal(rb, 0);
+        if (v)
+            break;
+        if (ATOMIC_READ_ACQUIRE(rb->head) != ATOMIC_READ_ACQUIRE(rb->tail)) {
+            // a writer claimed a slot but didn't publish it yet
+            sched_yield();
+            continue;
+        }
+        RQUEUE_STATS_INCREMENT(rb, read_waits);
+        if (rqueue_park(&rb->read_seq, seq, timeout > 0 ? &deadline : NULL) != 0)
+            break;
+    }
+    ATOMIC_DECREMENT(rb->read_waiters);
 
-    // COMMIT OPTIMIZATION: If this is the only active writer, advance the commit pointer.
-    // This optimization relies on num_writers tracking active writers holding write_sync.
-    if (ATOMIC_READ_RELAXED(rb->num_writers) == 1)
-        ATOMIC_CAS(rb->commit, ATOMIC_READ_ACQUIRE(rb->commit), tail);
-    
-    // Update retry statistics for successful write
-    if (retries > 0) {
-        ATOMIC_INCREMENT(rb->fast_retries_succeeded);  // Most writes use fast strategy
+    return v;
+}
+
+int rqueue_write_wait(rqueue_t *rb, void *value, int timeout) {
+    if (rb == NULL || value == NULL)
+        return -1;
+
+    if (timeout == 0)
+        return rqueue_write(rb, value);
+
+    int rc = 0;
+    int i;
+    for (i = 0; i < RQUEUE_WAIT_SPINS; i++) {
+        rc = rqueue_write_internal(rb, value, 0);
+        if (rc != -2)
+            return rc;
+        RQUEUE_CPU_RELAX();
     }
-    
-    ATOMIC_DECREMENT(rb->num_writers);  // Success path: single decrement
-    ATOMIC_CAS(rb->write_sync, 1, 0);
+    // the whole wait counts as a single write which found the ring full
+    RQUEUE_STATS_INCREMENT(rb, queue_full);
+
+    struct timespec deadline;
+    if (timeout > 0)
+        rqueue_deadline(&deadline, timeout);
+
+    ATOMIC_INCREMENT(rb->write_waiters);
+    rqueue_waiter_barrier(rb);
+    for (;;) {
+        uint32_t seq = ATOMIC_READ_ACQUIRE(rb->write_seq);
+        rc = rqueue_write_internal(rb, value, 0);
+        if (rc != -2)
+            break;
+        if (ATOMIC_READ_ACQUIRE(rb->tail) - ATOMIC_READ_ACQUIRE(rb->head) < rb->size) {
+            // a reader claimed a slot but didn't release it yet
+            sched_yield();
+            continue;
+        }
+        RQUEUE_STATS_INCREMENT(rb, write_waits);
+        if (rqueue_park(&rb->write_seq, seq, timeout > 0 ? &deadline : NULL) != 0)
+            break;
+    }
+    ATOMIC_DECREMENT(rb->write_waiters);
 
-    return 0;
+    return rc;
+}
+
+int rqueue_eventfd(rqueue_t *rb) {
+    if (rb == NULL)
+        return -1;
+
+#ifdef __linux__
+    int efd = ATOMIC_READ_ACQUIRE(rb->efd);
+    if (efd >= 0)
+        return efd;
+
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0)
+        return -1;
+    int prev = ATOMIC_CAS_RETURN(rb->efd, -1, efd);
+    if (prev != -1) {
+        // somebody else created it in the meanwhile
+        close(efd);
+        return prev;
+    }
+    // the ring might already hold some values
+    rqueue_arm_eventfd(rb);
+    return efd;
+#else
+    return -1;
+#endif
 }
 
+// NOTE : the counts are derived from the positions, so that producers
+//        and consumers don't need to update any shared counter
 uint64_t rqueue_write_count(rqueue_t *rb) {
     if (rb == NULL) {
         return 0;
     }
-    return ATOMIC_READ_RELAXED(rb->writes);
+    return ATOMIC_READ_RELAXED(rb->tail);
+}
+
+static uint64_t rqueue_overwrite_count(rqueue_t *rb) {
+    uint64_t count = 0;
+    int i;
+    for (i = 0; i < RQUEUE_STATS_SHARDS; i++)
+        count += ATOMIC_READ_RELAXED(rb->stats[i].overwrites);
+    return count;
 }
 
 uint64_t rqueue_read_count(rqueue_t *rb) {
     if (rb == NULL) {
         return 0;
     }
-    return ATOMIC_READ_RELAXED(rb->reads);
+    // overwritten values have been taken from the head, but not read
+    return ATOMIC_READ_RELAXED(rb->head) - rqueue_overwrite_count(rb);
 }
 
 void rqueue_set_mode(rqueue_t *rb, rqueue_mode_t mode) {
@@ -656,7 +798,10 @@ void rqueue_set_mode(rqueue_t *rb, rqueue_mode_t mode) {
         // do nothing
         return;
     }
-    rb->mode = mode;
+    // the consumer is the only one which can take values from a spsc ring
+    if (rb->spsc && mode == RQUEUE_MODE_OVERWRITE)
+        return;
+    ATOMIC_SET(rb->mode, mode);
 }
 
 rqueue_mode_t rqueue_mode(rqueue_t *rb) {
@@ -664,98 +809,33 @@ rqueue_mode_t rqueue_mode(rqueue_t *rb) {
         // do nothing
         return RQUEUE_MODE_INVALID;
     }
-    return rb->mode;
+    return ATOMIC_READ_RELAXED(rb->mode);
 }
 
-// Only for debugging purposes
-char *rqueue_stats(rqueue_t *rb) {
-    if (!rb) {
-        return "Invalid pointer";
-    }
-
-    // Take snapshot of key pointers
-    rqueue_page_t *reader = ATOMIC_READ_RELAXED(rb->reader);
-    rqueue_page_t *head = ATOMIC_READ_RELAXED(rb->head);
-    rqueue_page_t *tail = ATOMIC_READ_RELAXED(rb->tail);
-    rqueue_page_t *commit = ATOMIC_READ_RELAXED(rb->commit);
-    rqueue_page_t *tail_next = tail ? ATOMIC_READ_RELAXED(tail->next) : NULL;
-    rqueue_page_t *commit_next = commit ? ATOMIC_READ_RELAXED(commit->next) : NULL;
-
-    const char *format = 
-           "reader:                    %p \n"
-           "head:                      %p \n"
-           "tail:                      %p \n"
-           "tail_next:                 %p \n"
-           "commit:                    %p \n"
-           "commit_next:               %p \n"
-           "reads:                     %"PRId64" \n"
-           "writes:                    %"PRId64" \n"
-           "mode:                      %s \n"
-           "is_empty:                  %s \n"
-           "head_swap_failed:          %d \n"
-           "reader_next_swap_failed:   %d \n"
-           "queue_full_counter:        %d \n"
-           "overwrite_counter:         %d \n"
-           "topology_change_detected:  %d \n"
-           "concurrent_head_movement:  %d \n"
-           "commit_advancement_detected: %d \n"
-           "concurrent_writer_detected: %d \n"
-           "overwrite_state_changed:   %d \n"
-           "head_next_changed:         %d \n"
-           "fast_retries_succeeded:    %d \n"
-           "patient_retries_succeeded: %d \n"
-           "complex_retries_succeeded: %d \n"
-           "critical_retries_succeeded: %d \n"
-           "total_retry_failures:      %d \n"
-           "total_retry_attempts:      %"PRIu64" \n"
-           "total_backoff_time_us:     %"PRIu64" \n"
-           "avg_backoff_per_retry_us:  %.2f \n";
-
-#define STATS_ARGS \
-           reader, \
-           head, \
-           tail, \
-           tail_next, \
-           commit, \
-           commit_next, \
-           ATOMIC_READ_RELAXED(rb->reads), \
-           ATOMIC_READ_RELAXED(rb->writes), \
-           rb->mode == RQUEUE_MODE_BLOCKING ? "blocking" : "overwrite", \
-           ATOMIC_READ_RELAXED(rb->is_empty) ? "true" : "false", \
-           ATOMIC_READ_RELAXED(rb->head_swap_failed), \
-           ATOMIC_READ_RELAXED(rb->reader_next_swap_failed), \
-           ATOMIC_READ_RELAXED(rb->queue_full_counter), \
-           ATOMIC_READ_RELAXED(rb->overwrite_counter), \
-           ATOMIC_READ_RELAXED(rb->topology_change_detected), \
-           ATOMIC_READ_RELAXED(rb->concurrent_head_movement), \
-           ATOMIC_READ_RELAXED(rb->commit_advancement_detected), \
-           ATOMIC_READ_RELAXED(rb->concurrent_writer_detected), \
-           ATOMIC_READ_RELAXED(rb->overwrite_state_changed), \
-           ATOMIC_READ_RELAXED(rb->head_next_changed), \
-           ATOMIC_READ_RELAXED(rb->fast_retries_succeeded), \
-           ATOMIC_READ_RELAXED(rb->patient_retries_succeeded), \
-           ATOMIC_READ_RELAXED(rb->complex_retries_succeeded), \
-           ATOMIC_READ_RELAXED(rb->critical_retries_succeeded), \
-           ATOMIC_READ_RELAXED(rb->total_retry_failures), \
-           ATOMIC_READ_RELAXED(rb->total_retry_attempts), \
-           ATOMIC_READ_RELAXED(rb->total_backoff_time_us), \
-           (ATOMIC_READ_RELAXED(rb->total_retry_attempts) > 0) ? \
-               ((double)ATOMIC_READ_RELAXED(rb->total_backoff_time_us) / ATOMIC_READ_RELAXED(rb->total_retry_attempts)) : 0.0 \
-
-    // First pass: calculate exact size needed
-    int needed = snprintf(NULL, 0, format, STATS_ARGS);
-    
-    if (needed < 0)
-        return NULL;
-        
-    char *buf = malloc(needed + 1);
-    if (!buf)
-        return NULL;
+int rqueue_stats(rqueue_t *rb, rqueue_stats_t *stats) {
+    if (rb == NULL || stats == NULL)
+        return -1;
+
+    memset(stats, 0, sizeof(rqueue_stats_t));
+    stats->size = rb->size;
+    stats->mode = rqueue_mode(rb);
+    stats->spsc = rb->spsc;
+    stats->writes = rqueue_write_count(rb);
+    stats->reads = rqueue_read_count(rb);
 
-    snprintf(buf, needed + 1, format, STATS_ARGS);
+    int i;
+    for (i = 0; i < RQUEUE_STATS_SHARDS; i++) {
+        rqueue_stats_shard_t *shard = &rb->stats[i];
+        stats->overwrites += ATOMIC_READ_RELAXED(shard->overwrites);
+        stats->queue_full += ATOMIC_READ_RELAXED(shard->queue_full);
+        stats->queue_empty += ATOMIC_READ_RELAXED(shard->queue_empty);
+        stats->write_retries += ATOMIC_READ_RELAXED(shard->write_retries);
+        stats->read_retries += ATOMIC_READ_RELAXED(shard->read_retries);
+        stats->write_waits += ATOMIC_READ_RELAXED(shard->write_waits);
+        stats->read_waits += ATOMIC_READ_RELAXED(shard->read_waits);
+    }
 
-#undef STATS_ARGS
-    return buf;
+    return 0;
 }
 
 size_t rqueue_size(rqueue_t *rb)
@@ -770,7 +850,9 @@ int rqueue_isempty(rqueue_t *rb) {
     if (!rb) {
         return -1;
     }
-    return ATOMIC_READ_RELAXED(rb->is_empty);
+    // NOTE : a position claimed by a writer counts as not empty
+    //        even if the value has not been published yet
+    return ATOMIC_READ_ACQUIRE(rb->head) == ATOMIC_READ_ACQUIRE(rb->tail);
 }
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -3,6 +3,10 @@
  * @author Andrea Guzzo
  * @date   15/10/2013
  * @brief  Fast lock-free (thread-safe) ringbuffer implementation
+ *
+ * The ringbuffer is a contiguous array of slots, each carrying a sequence
+ * number, so that multiple producers and consumers can claim a slot with
+ * a single CAS on their own index and publish it without any other lock.
  */
 #ifndef HL_RQUEUE_H
 #define HL_RQUEUE_H
@@ -58,6 +62,39 @@ typedef enum {
  */
 rqueue_t *rqueue_create(size_t size, rqueue_mode_t mode);
 
+/**
+ * @brief Create a new ringbuffer for a single producer and a single consumer
+ * @param size : the size of the ringbuffer
+ *               (the maximum number of pointers that can fit in the ringbuffer)
+ * @return a newly allocated and initialized ringbuffer
+ * @note Writes and reads are wait-free and don't use any atomic
+ *       read-modify-write operation, but only one thread at a time can
+ *       call rqueue_write() and only one thread at a time can call
+ *       rqueue_read(). The mode is always RQUEUE_MODE_BLOCKING
+ */
+rqueue_t *rqueue_create_spsc(size_t size);
+
+/**
+ * @brief Flags which can be passed to rqueue_create_with_flags()
+ */
+typedef enum {
+    RQUEUE_FLAG_NONE     = 0,
+    RQUEUE_FLAG_SPSC     = 1 << 0, //!< single producer and single consumer (see rqueue_create_spsc())
+    RQUEUE_FLAG_NO_STATS = 1 << 1  //!< don't collect statistics (see rqueue_stats())
+} rqueue_flags_t;
+
+/**
+ * @brief Create a new ringbuffer descriptor
+ * @param size : the size of the ringbuffer
+ *               (the maximum number of pointers that can fit in the ringbuffer)
+ * @param mode : the mode of the ringbuffer
+ *               (RQUEUE_MODE_BLOCKING or RQUEUE_MODE_OVERWRITE)
+ * @param flags : A bitmask of rqueue_flags_t values
+ * @return a newly allocated and initialized ringbuffer,
+ *         NULL if RQUEUE_FLAG_SPSC is requested in RQUEUE_MODE_OVERWRITE mode
+ */
+rqueue_t *rqueue_create_with_flags(size_t size, rqueue_mode_t mode, int flags);
+
 
 /**
  * @brief Change the mode of an existing ringbuffer
@@ -77,19 +114,85 @@ rqueue_mode_t rqueue_mode(rqueue_t *rb);
 /**
  * @brief Push a new value into the ringbuffer
  * @param rb : A valid pointer to a rqueue_t structure
- * @param value : The pointer to store in the ringbuffer
+ * @param value : The pointer to store in the ringbuffer (can't be NULL)
  * @return 0 on success, -1 on failure, -2 if the buffer is full
  *         and the mode is RQUEUE_MODE_BLOCKING
+ * @note In RQUEUE_MODE_OVERWRITE mode the oldest value is dropped (and released
+ *       using the free_value_callback, if any) to make room for the new one
  */
 int rqueue_write(rqueue_t *rb, void *value);
 
+/**
+ * @brief Push multiple values into the ringbuffer
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @param values : The pointers to store in the ringbuffer (none can be NULL)
+ * @param n : The number of values to store
+ * @return The number of values stored, which is less than n only if
+ *         the buffer is full and the mode is RQUEUE_MODE_BLOCKING
+ * @note The slots are claimed with a single atomic operation for each run of
+ *       slots found ready to be written (usually just one). The values are
+ *       stored in order, but might be interleaved with the ones stored by
+ *       other writers if the ring gets full in the meanwhile
+ */
+size_t rqueue_write_batch(rqueue_t *rb, void **values, size_t n);
+
+/**
+ * @brief Read the next values in the ringbuffer
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @param values : The array where to store the values
+ * @param max : The maximum number of values to read
+ * @return The number of values read, 0 if the ringbuffer is empty
+ * @note All the values are claimed with a single atomic operation
+ */
+size_t rqueue_read_batch(rqueue_t *rb, void **values, size_t max);
+
 /**
  * @brief Read the next value in the ringbuffer
  * @param rb : A valid pointer to a rqueue_t structure
- * @return The next value in the ringbuffer
+ * @return The next value in the ringbuffer,
+ *         NULL if the ringbuffer is empty
+ * @note This function never blocks
  */
 void *rqueue_read(rqueue_t *rb);
 
+/**
+ * @brief Read the next value in the ringbuffer, waiting for it if necessary
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @param timeout : The maximum time to wait (in milliseconds),
+ *                  a negative value means forever, 0 is the same as rqueue_read()
+ * @return The next value in the ringbuffer,
+ *         NULL if the ringbuffer is still empty once the timeout expired
+ * @note The caller spins for a little while and then sleeps (on a futex, on
+ *       linux) until a writer stores a new value. Writers don't pay anything
+ *       for the wakeups unless some reader is actually waiting
+ */
+void *rqueue_read_wait(rqueue_t *rb, int timeout);
+
+/**
+ * @brief Push a new value into the ringbuffer, waiting for room if necessary
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @param value : The pointer to store in the ringbuffer (can't be NULL)
+ * @param timeout : The maximum time to wait (in milliseconds),
+ *                  a negative value means forever, 0 is the same as rqueue_write()
+ * @return 0 on success, -1 on failure, -2 if the buffer is still full
+ *         once the timeout expired
+ * @note Only a ringbuffer in RQUEUE_MODE_BLOCKING mode can be full
+ */
+int rqueue_write_wait(rqueue_t *rb, void *value, int timeout);
+
+/**
+ * @brief Return an eventfd which becomes readable when values are available
+ * @param rb : A valid pointer to a rqueue_t structure
+ * @return The file descriptor (owned by the ringbuffer, which closes it
+ *         when destroyed), -1 on failure or if eventfds are not supported
+ * @note The eventfd is signaled by the first write following a read
+ *       (rqueue_read() or rqueue_read_batch()) which found the ringbuffer
+ *       empty, so a consumer can add it to an epoll set and, once it's
+ *       readable, read from the ringbuffer until it's empty before waiting
+ *       again. The eventfd is reset by the ringbuffer itself
+ */
+int rqueue_eventfd(rqueue_t *rb);
+
 /**
  * @brief Release all resources associated to the ringbuffer
  * @param rb : A valid pointer to a rqueue_t structure
@@ -115,15 +218,35 @@ uint64_t rqueue_write_count(rqueue_t *rb);
 uint64_t rqueue_read_count(rqueue_t *rb);
 
 /**
- * @brief Return a string descriptions of the ringbuffer internals
+ * @brief Runtime statistics of a ringbuffer, as reported by rqueue_stats()
+ */
+typedef struct {
+    size_t size;            //!< number of slots
+    rqueue_mode_t mode;     //!< the current mode
+    int spsc;               //!< 1 if the ringbuffer has been created with rqueue_create_spsc()
+    uint64_t writes;        //!< values written (same as rqueue_write_count())
+    uint64_t reads;         //!< values read (same as rqueue_read_count())
+    uint64_t overwrites;    //!< values dropped to make room for new ones
+    uint64_t queue_full;    //!< writes which found the ringbuffer full (once per rqueue_write_wait())
+    uint64_t queue_empty;   //!< reads which found the ringbuffer empty (once per rqueue_read_wait())
+    uint64_t write_retries; //!< slots claimed by other writers while trying to claim them
+    uint64_t read_retries;  //!< slots claimed by other readers while trying to claim them
+    uint64_t write_waits;   //!< times a writer went to sleep in rqueue_write_wait()
+    uint64_t read_waits;    //!< times a reader went to sleep in rqueue_read_wait()
+} rqueue_stats_t;
+
+/**
+ * @brief Collect the runtime statistics of a ringbuffer
  * @param rb : A valid pointer to a rqueue_t structure
- * @return : a string containing the description of the ringbuffer structure
- *
- * This function is intended for debugging purposes.
- * Note that for being thread-safe the returned buffer is malloc'd
- * and the caller MUST release it when done
+ * @param stats : The rqueue_stats_t structure to fill in
+ * @return 0 on success, -1 otherwise
+ * @note The counters are kept per thread (on separate cache lines) and summed
+ *       up here, so the result is not an atomic snapshot if the ringbuffer is
+ *       being used. All the counters but writes, reads and overwrites are
+ *       always 0 if the ringbuffer has been created with RQUEUE_FLAG_NO_STATS,
+ *       or if libhl has been built with RQUEUE_NO_STATS defined
  */
-char *rqueue_stats(rqueue_t *rb);
+int rqueue_stats(rqueue_t *rb, rqueue_stats_t *stats);
 
 size_t rqueue_size(rqueue_t *rb);
 
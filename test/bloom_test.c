@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <ut.h>
+#include "bloom.h"
+
+#define NUM_KEYS 100000
+#define NUM_THREADS 4
+
+static void *
+parallel_add(void *user)
+{
+    bloom_filter_t *bf = (bloom_filter_t *)user;
+    int i;
+    for (i = 0; i < NUM_KEYS; i++)
+        bloom_add(bf, &i, sizeof(i));
+    return NULL;
+}
+
+static int
+count_missing(bloom_filter_t *bf, int from, int to)
+{
+    int i, missing = 0;
+    for (i = from; i < to; i++) {
+        if (!bloom_test(bf, &i, sizeof(i)))
+            missing++;
+    }
+    return missing;
+}
+
+int
+main(int argc, char **argv)
+{
+    ut_init(basename(argv[0]));
+
+    ut_testing("bloom_create(100000, 0.01)");
+    bloom_filter_t *bf = bloom_create(NUM_KEYS, 0.01);
+    if (bf)
+        ut_success();
+    else
+        ut_failure("Can't create a new bloom filter");
+
+    ut_testing("bloom_test() on an empty filter");
+    ut_validate_int(count_missing(bf, 0, NUM_KEYS), NUM_KEYS);
+
+    ut_testing("bloom_add(0..99999) / bloom_test(0..99999)");
+    int i;
+    for (i = 0; i < NUM_KEYS; i++)
+        bloom_add(bf, &i, sizeof(i));
+    ut_validate_int(count_missing(bf, 0, NUM_KEYS), 0);
+
+    ut_testing("false positive rate is close to 1%%");
+    int false_positives = NUM_KEYS - count_missing(bf, NUM_KEYS, NUM_KEYS * 2);
+    if (false_positives < NUM_KEYS / 100 * 2)
+        ut_success();
+    else
+        ut_failure("%d false positives out of %d keys", false_positives, NUM_KEYS);
+
+    ut_testing("bloom_serialize() / bloom_deserialize()");
+    size_t size = bloom_serialized_size(bf);
+    char *buf = malloc(size);
+    int rc = (bloom_serialize(bf, buf, size - 1) == 0 && bloom_serialize(bf, buf, size) == size);
+    bloom_filter_t *copy = bloom_deserialize(buf, size);
+    if (rc && copy && bloom_deserialize(buf, size - 1) == NULL)
+        ut_validate_int(count_missing(copy, 0, NUM_KEYS), 0);
+    else
+        ut_failure("Can't serialize the bloom filter");
+
+    ut_testing("bloom_deserialize() rejects a header not matching the buffer size");
+    // the number of blocks follows the magic, the version and the type
+    uint64_t nblocks;
+    memcpy(&nblocks, buf + 16, sizeof(nblocks));
+    uint64_t huge = UINT32_MAX;
+    memcpy(buf + 16, &huge, sizeof(huge));
+    bloom_filter_t *bogus = bloom_deserialize(buf, size);
+    huge = nblocks + 1;
+    memcpy(buf + 16, &huge, sizeof(huge));
+    if (!bogus && !bloom_deserialize(buf, size))
+        ut_success();
+    else
+        ut_failure("A corrupted buffer has been accepted");
+    free(buf);
+
+    ut_testing("bloom_merge()");
+    bloom_filter_t *other = bloom_create(NUM_KEYS, 0.01);
+    for (i = NUM_KEYS; i < NUM_KEYS * 2; i++)
+        bloom_add(other, &i, sizeof(i));
+    bloom_clear(copy);
+    rc = bloom_merge(copy, bf);
+    rc |= bloom_merge(copy, other);
+    if (rc == 0)
+        ut_validate_int(count_missing(copy, 0, NUM_KEYS * 2), 0);
+    else
+        ut_failure("Can't merge the bloom filters");
+
+    ut_testing("bloom_merge() with a different geometry fails");
+    bloom_filter_t *small = bloom_create(100, 0.01);
+    ut_validate_int(bloom_merge(small, bf), -1);
+
+    ut_testing("bloom_remove() on a plain filter fails");
+    ut_validate_int(bloom_remove(bf, &i, sizeof(i)), -1);
+
+    bloom_destroy(small);
+    bloom_destroy(other);
+    bloom_destroy(copy);
+    bloom_destroy(bf);
+
+    ut_testing("bloom_add() from 4 threads");
+    bf = bloom_create(NUM_KEYS, 0.01);
+    pthread_t threads[NUM_THREADS];
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, parallel_add, bf);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    ut_validate_int(count_missing(bf, 0, NUM_KEYS), 0);
+    bloom_destroy(bf);
+
+    ut_testing("bloom_create_counting() / bloom_remove()");
+    bf = bloom_create_counting(NUM_KEYS, 0.01);
+    for (i = 0; i < NUM_KEYS; i++)
+        bloom_add(bf, &i, sizeof(i));
+    for (i = 0; i < NUM_KEYS; i += 2)
+        bloom_remove(bf, &i, sizeof(i));
+    int odd_missing = 0;
+    for (i = 1; i < NUM_KEYS; i += 2) {
+        if (!bloom_test(bf, &i, sizeof(i)))
+            odd_missing++;
+    }
+    if (odd_missing)
+        ut_failure("%d keys not removed are missing", odd_missing);
+    else if (count_missing(bf, 0, NUM_KEYS) < NUM_KEYS / 2 - NUM_KEYS / 100 * 2)
+        ut_failure("Removed keys are still in the filter");
+    else
+        ut_success();
+
+    ut_testing("bloom_serialize() / bloom_deserialize() of a counting filter");
+    size = bloom_serialized_size(bf);
+    buf = malloc(size);
+    bloom_serialize(bf, buf, size);
+    copy = bloom_deserialize(buf, size);
+    free(buf);
+    if (copy) {
+        for (i = 1; i < NUM_KEYS; i += 2)
+            bloom_remove(copy, &i, sizeof(i));
+        ut_validate_int(count_missing(copy, 0, NUM_KEYS), NUM_KEYS);
+        bloom_destroy(copy);
+    } else {
+        ut_failure("Can't deserialize the counting filter");
+    }
+
+    bloom_destroy(bf);
+
+    ut_summary();
+
+    return ut_failed;
+}
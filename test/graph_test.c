@@ -97,6 +97,22 @@ int main(int argc, char **argv)
 
     graph_destroy(graph);
 
+    ut_testing("Graphs sharing an intern pool store each label once");
+    ht_intern_pool_t *pool = ht_intern_pool_create();
+    graph_t *graphs[2] = { graph_create("first", NULL), graph_create("second", NULL) };
+    rc = graph_set_intern_pool(graphs[0], pool) | graph_set_intern_pool(graphs[1], pool);
+    char *label = "a label which doesn't fit in the table items";
+    node1 = graph_node_add(graphs[0], label, NULL, 0);
+    node2 = graph_node_add(graphs[1], label, NULL, 0);
+    ut_result(rc == 0 && node1 && node2 && ht_intern_count(pool) == 1 &&
+              graph_node_get(graphs[0], label) == node1 &&
+              graph_node_get(graphs[1], label) == node2 &&
+              graph_set_intern_pool(graphs[0], pool) == -1,
+              "%zu labels in the pool", ht_intern_count(pool));
+    graph_destroy(graphs[0]);
+    graph_destroy(graphs[1]);
+    ht_intern_pool_destroy(pool);
+
     ut_summary();
     exit(ut_failed);
 }
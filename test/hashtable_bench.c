@@ -0,0 +1,520 @@
+/*
+ * Hashtable benchmark
+ *
+ * build and run using:
+ *   make bench
+ * or:
+ *   cc -O3 -DTHREAD_SAFE -Isrc test/hashtable_bench.c libhl.a -lpthread -lm -o test/hashtable_bench
+ *
+ * Each run preloads a table and then lets a number of threads perform a mix
+ * of lookups (hitting or missing the stored keys) and updates, reporting the
+ * throughput and the latency percentiles (sampled one operation out of
+ * BENCH_SAMPLE_RATE) as JSON on the standard output.
+ * Starting from a base configuration one parameter at a time is swept:
+ * key size, table size, hit ratio, read ratio and number of threads.
+ * The insert runs measure filling a table created empty (growing) against
+ * one created with the final size (presized).
+ * Every configuration is run against all the engines and against a plain
+ * chained table protected by a single mutex, as a baseline.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "hashtable.h"
+
+#define BENCH_SAMPLE_RATE 16
+
+/*
+ * Baseline: chained table protected by a single mutex
+ */
+typedef struct _bench_node {
+    struct _bench_node *next;
+    uint64_t hash;
+    void *value;
+    size_t klen;
+    char key[];
+} bench_node_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    bench_node_t **buckets;
+    size_t size;
+    size_t count;
+} bench_mutex_table_t;
+
+static void *
+mutex_create(size_t initial_size)
+{
+    bench_mutex_table_t *table = calloc(1, sizeof(bench_mutex_table_t));
+    table->size = 128;
+    while (table->size < initial_size)
+        table->size <<= 1;
+    table->buckets = calloc(table->size, sizeof(bench_node_t *));
+    pthread_mutex_init(&table->lock, NULL);
+    return table;
+}
+
+static void
+mutex_destroy(void *ptr)
+{
+    bench_mutex_table_t *table = (bench_mutex_table_t *)ptr;
+    size_t i;
+    for (i = 0; i < table->size; i++) {
+        bench_node_t *node = table->buckets[i];
+        while (node) {
+            bench_node_t *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table->buckets);
+    free(table);
+}
+
+static void
+mutex_grow(bench_mutex_table_t *table)
+{
+    size_t size = table->size << 1;
+    bench_node_t **buckets = calloc(size, sizeof(bench_node_t *));
+    if (!buckets)
+        return;
+    size_t i;
+    for (i = 0; i < table->size; i++) {
+        bench_node_t *node = table->buckets[i];
+        while (node) {
+            bench_node_t *next = node->next;
+            node->next = buckets[node->hash & (size - 1)];
+            buckets[node->hash & (size - 1)] = node;
+            node = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
+}
+
+static int
+mutex_set(void *ptr, void *key, size_t klen, void *value)
+{
+    bench_mutex_table_t *table = (bench_mutex_table_t *)ptr;
+    uint64_t hash = ht_hash_wyhash(key, klen, 0);
+    pthread_mutex_lock(&table->lock);
+    bench_node_t *node = table->buckets[hash & (table->size - 1)];
+    while (node && (node->klen != klen || memcmp(node->key, key, klen) != 0))
+        node = node->next;
+    if (node) {
+        node->value = value;
+    } else {
+        node = malloc(sizeof(bench_node_t) + klen);
+        node->hash = hash;
+        node->value = value;
+        node->klen = klen;
+        memcpy(node->key, key, klen);
+        node->next = table->buckets[hash & (table->size - 1)];
+        table->buckets[hash & (table->size - 1)] = node;
+        if (++table->count > table->size)
+            mutex_grow(table);
+    }
+    pthread_mutex_unlock(&table->lock);
+    return 0;
+}
+
+static void *
+mutex_get(void *ptr, void *key, size_t klen)
+{
+    bench_mutex_table_t *table = (bench_mutex_table_t *)ptr;
+    uint64_t hash = ht_hash_wyhash(key, klen, 0);
+    void *value = NULL;
+    pthread_mutex_lock(&table->lock);
+    bench_node_t *node = table->buckets[hash & (table->size - 1)];
+    while (node && (node->klen != klen || memcmp(node->key, key, klen) != 0))
+        node = node->next;
+    if (node)
+        value = node->value;
+    pthread_mutex_unlock(&table->lock);
+    return value;
+}
+
+/*
+ * Engines
+ */
+static void *
+chained_create(size_t initial_size)
+{
+    return ht_create(initial_size, 0, NULL);
+}
+
+static void *
+flat_create(size_t initial_size)
+{
+    return ht_create_flat(initial_size, 0, NULL);
+}
+
+static void *
+sharded_create(size_t initial_size)
+{
+    return ht_create_sharded(16, initial_size, 0, NULL);
+}
+
+static void
+ht_engine_destroy(void *table)
+{
+    ht_destroy((hashtable_t *)table);
+}
+
+static int
+ht_engine_set(void *table, void *key, size_t klen, void *value)
+{
+    return ht_set((hashtable_t *)table, key, klen, value, 0);
+}
+
+static void *
+ht_engine_get(void *table, void *key, size_t klen)
+{
+    return ht_get((hashtable_t *)table, key, klen, NULL);
+}
+
+static void *
+u64_create(size_t initial_size)
+{
+    return ht_u64_create(initial_size, 0, NULL);
+}
+
+static void
+u64_destroy(void *table)
+{
+    ht_u64_destroy((ht_u64_t *)table);
+}
+
+static int
+u64_set(void *table, void *key, size_t klen, void *value)
+{
+    uint64_t id;
+    memcpy(&id, key, sizeof(id));
+    return ht_u64_set((ht_u64_t *)table, id, value);
+}
+
+static void *
+u64_get(void *table, void *key, size_t klen)
+{
+    uint64_t id;
+    memcpy(&id, key, sizeof(id));
+    return ht_u64_get((ht_u64_t *)table, id);
+}
+
+typedef struct {
+    const char *name;
+    size_t klen; // 0 if any key size is supported
+    void *(*create)(size_t initial_size);
+    void (*destroy)(void *table);
+    int (*set)(void *table, void *key, size_t klen, void *value);
+    void *(*get)(void *table, void *key, size_t klen);
+} bench_engine_t;
+
+static bench_engine_t engines[] = {
+    { "chained", 0, chained_create, ht_engine_destroy, ht_engine_set, ht_engine_get },
+    { "flat", 0, flat_create, ht_engine_destroy, ht_engine_set, ht_engine_get },
+    { "sharded", 0, sharded_create, ht_engine_destroy, ht_engine_set, ht_engine_get },
+    { "u64", sizeof(uint64_t), u64_create, u64_destroy, u64_set, u64_get },
+    { "mutex_baseline", 0, mutex_create, mutex_destroy, mutex_set, mutex_get }
+};
+
+#define BENCH_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/*
+ * Workload
+ */
+typedef struct {
+    const char *workload; // "mixed" or "insert"
+    size_t key_size;
+    size_t table_size;
+    double hit_ratio;
+    double read_ratio;
+    int threads;
+    int presized;
+} bench_config_t;
+
+typedef struct {
+    bench_engine_t *engine;
+    bench_config_t *config;
+    void *table;
+    char *keys;        // table_size stored keys followed by table_size missing keys
+    size_t ops;
+    int id;
+    pthread_barrier_t *barrier;
+    uint64_t *samples;
+    size_t nsamples;
+} bench_worker_t;
+
+static size_t ops_per_thread = 200000;
+static int max_threads = 0;
+static int first_result = 1;
+
+static inline uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t
+xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// keys are unique integers padded to the requested size,
+// the first table_size are stored in the table, the others never are
+static char *
+bench_keys_create(size_t count, size_t key_size)
+{
+    char *keys = calloc(count, key_size);
+    size_t i;
+    for (i = 0; i < count; i++) {
+        uint64_t id = i * 0x9E3779B97F4A7C15ULL;
+        memcpy(keys + i * key_size, &id, key_size < sizeof(id) ? key_size : sizeof(id));
+        if (key_size > sizeof(id))
+            memset(keys + i * key_size + sizeof(id), 'k', key_size - sizeof(id));
+    }
+    return keys;
+}
+
+static void *
+bench_worker(void *user)
+{
+    bench_worker_t *worker = (bench_worker_t *)user;
+    bench_config_t *config = worker->config;
+    bench_engine_t *engine = worker->engine;
+    size_t ksize = config->key_size;
+    uint64_t rng = 0x2545F4914F6CDD1DULL * (worker->id + 1);
+    uint64_t read_threshold = (uint64_t)(config->read_ratio * 1000);
+    uint64_t hit_threshold = (uint64_t)(config->hit_ratio * 1000);
+    int insert = (strcmp(config->workload, "insert") == 0);
+    size_t i;
+
+    pthread_barrier_wait(worker->barrier);
+
+    for (i = 0; i < worker->ops; i++) {
+        char *key;
+        int read = 1;
+        if (insert) {
+            // each worker inserts its own slice of the keys
+            key = worker->keys + (worker->id * worker->ops + i) * ksize;
+            read = 0;
+        } else {
+            uint64_t r = xorshift64(&rng);
+            size_t index = (r >> 20) % config->table_size;
+            read = (r % 1000) < read_threshold;
+            if (read && ((r >> 10) % 1000) >= hit_threshold)
+                index += config->table_size;
+            key = worker->keys + index * ksize;
+        }
+
+        uint64_t start = (i % BENCH_SAMPLE_RATE == 0) ? now_ns() : 0;
+        if (read)
+            engine->get(worker->table, key, ksize);
+        else
+            engine->set(worker->table, key, ksize, key);
+        if (start)
+            worker->samples[worker->nsamples++] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y);
+}
+
+static void
+bench_run(bench_engine_t *engine, bench_config_t *config)
+{
+    int insert = (strcmp(config->workload, "insert") == 0);
+    size_t ops = insert ? config->table_size / config->threads : ops_per_thread;
+    char *keys = bench_keys_create(config->table_size * 2, config->key_size);
+    void *table = engine->create(config->presized ? config->table_size : 0);
+    size_t i;
+
+    if (!insert) {
+        for (i = 0; i < config->table_size; i++)
+            engine->set(table, keys + i * config->key_size, config->key_size, keys);
+    }
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, config->threads + 1);
+    bench_worker_t *workers = calloc(config->threads, sizeof(bench_worker_t));
+    pthread_t *threads = calloc(config->threads, sizeof(pthread_t));
+    int t;
+    for (t = 0; t < config->threads; t++) {
+        workers[t].engine = engine;
+        workers[t].config = config;
+        workers[t].table = table;
+        workers[t].keys = keys;
+        workers[t].ops = ops;
+        workers[t].id = t;
+        workers[t].barrier = &barrier;
+        workers[t].samples = malloc((ops / BENCH_SAMPLE_RATE + 1) * sizeof(uint64_t));
+        pthread_create(&threads[t], NULL, bench_worker, &workers[t]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    uint64_t start = now_ns();
+    for (t = 0; t < config->threads; t++)
+        pthread_join(threads[t], NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    size_t nsamples = 0;
+    for (t = 0; t < config->threads; t++)
+        nsamples += workers[t].nsamples;
+    uint64_t *samples = malloc((nsamples + 1) * sizeof(uint64_t));
+    nsamples = 0;
+    for (t = 0; t < config->threads; t++) {
+        memcpy(samples + nsamples, workers[t].samples, workers[t].nsamples * sizeof(uint64_t));
+        nsamples += workers[t].nsamples;
+        free(workers[t].samples);
+    }
+    qsort(samples, nsamples, sizeof(uint64_t), compare_u64);
+
+    double seconds = elapsed / 1e9;
+    size_t total_ops = ops * config->threads;
+    printf("%s\n    {\"engine\": \"%s\", \"workload\": \"%s\", \"key_size\": %zu, "
+           "\"table_size\": %zu, \"presized\": %s, \"hit_ratio\": %.2f, \"read_ratio\": %.2f, "
+           "\"threads\": %d, \"ops\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+           "\"latency_ns\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+           first_result ? "" : ",",
+           engine->name, config->workload, config->key_size, config->table_size,
+           config->presized ? "true" : "false", config->hit_ratio, config->read_ratio,
+           config->threads, total_ops, seconds, total_ops / seconds,
+           (unsigned long long)(nsamples ? samples[nsamples * 50 / 100] : 0),
+           (unsigned long long)(nsamples ? samples[nsamples * 90 / 100] : 0),
+           (unsigned long long)(nsamples ? samples[nsamples * 99 / 100] : 0),
+           (unsigned long long)(nsamples ? samples[nsamples * 999 / 1000] : 0),
+           (unsigned long long)(nsamples ? samples[nsamples - 1] : 0));
+    fflush(stdout);
+    first_result = 0;
+
+    free(samples);
+    free(threads);
+    free(workers);
+    pthread_barrier_destroy(&barrier);
+    engine->destroy(table);
+    free(keys);
+}
+
+static void
+bench_all_engines(bench_config_t *config)
+{
+    size_t i;
+    for (i = 0; i < BENCH_ENGINES; i++) {
+        if (engines[i].klen && engines[i].klen != config->key_size)
+            continue;
+        bench_run(&engines[i], config);
+    }
+}
+
+static void
+usage(char *progname)
+{
+    fprintf(stderr, "Usage: %s [-n ops_per_thread] [-t max_threads] [-s table_size]\n", progname);
+}
+
+int
+main(int argc, char **argv)
+{
+    bench_config_t base = { "mixed", 16, 100000, 0.9, 0.9, 1, 1 };
+    size_t key_sizes[] = { 8, 16, 32, 64, 128 };
+    size_t table_sizes[] = { 1000, 100000, 1000000 };
+    double hit_ratios[] = { 1.0, 0.5, 0.0 };
+    double read_ratios[] = { 1.0, 0.9, 0.5, 0.0 };
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:s:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                ops_per_thread = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 's':
+                base.table_size = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? 0 : -1);
+        }
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads <= 0)
+        max_threads = cpus > 0 ? cpus : 1;
+
+    printf("{\n  \"benchmark\": \"hashtable\",\n  \"cpus\": %ld,\n"
+           "  \"ops_per_thread\": %zu,\n  \"sample_rate\": %d,\n  \"results\": [",
+           cpus, ops_per_thread, BENCH_SAMPLE_RATE);
+
+    bench_config_t config;
+    for (i = 0; i < sizeof(key_sizes) / sizeof(key_sizes[0]); i++) {
+        config = base;
+        config.key_size = key_sizes[i];
+        bench_all_engines(&config);
+    }
+
+    for (i = 0; i < sizeof(table_sizes) / sizeof(table_sizes[0]); i++) {
+        config = base;
+        config.table_size = table_sizes[i];
+        bench_all_engines(&config);
+    }
+
+    for (i = 0; i < sizeof(hit_ratios) / sizeof(hit_ratios[0]); i++) {
+        config = base;
+        config.hit_ratio = hit_ratios[i];
+        config.read_ratio = 1.0;
+        bench_all_engines(&config);
+    }
+
+    for (i = 0; i < sizeof(read_ratios) / sizeof(read_ratios[0]); i++) {
+        config = base;
+        config.read_ratio = read_ratios[i];
+        bench_all_engines(&config);
+    }
+
+    // 1, 2, 4 ... threads, always ending with max_threads
+    int threads = 1;
+    for (;;) {
+        config = base;
+        config.threads = threads;
+        bench_all_engines(&config);
+        config.read_ratio = 0.5;
+        bench_all_engines(&config);
+        if (threads == max_threads)
+            break;
+        threads = (threads << 1) < max_threads ? threads << 1 : max_threads;
+    }
+
+    for (i = 0; i < 2; i++) {
+        config = base;
+        config.workload = "insert";
+        config.table_size = 1000000;
+        config.presized = i;
+        config.threads = max_threads;
+        bench_all_engines(&config);
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
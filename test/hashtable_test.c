@@ -5,6 +5,7 @@
 #include <hashtable.h>
 #include <pthread.h>
 #include <libgen.h>
+#include <unistd.h>
 
 typedef struct {
     int start;
@@ -25,6 +26,24 @@ static void *parallel_insert(void *user) {
     return NULL;
 }
 
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    ht_u64_t *table;
+} u64_insert_arg;
+
+static void *u64_insert(void *user) {
+    u64_insert_arg *arg = (u64_insert_arg *)user;
+    uint64_t i;
+    for (i = arg->start; i <= arg->end; i++)
+        ht_u64_set(arg->table, i, (void *)(uintptr_t)(i + 1));
+    return NULL;
+}
+
+static int u64_remove_odd(ht_u64_t *table, uint64_t key, void *value, void *user) {
+    return (key & 1) ? HT_ITERATOR_REMOVE : HT_ITERATOR_CONTINUE;
+}
+
 int remove_item(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user) {
     char *key_to_remove = (char *)user;
     size_t key_len = strlen(key_to_remove);
@@ -60,6 +79,82 @@ int check_item(hashtable_t *table, void *key, size_t klen, void *value, size_t v
     return HT_ITERATOR_CONTINUE;
 }
 
+typedef struct {
+    hashtable_t *table;
+    int num_items;
+    int stop;
+    int failed;
+} concurrent_get_arg;
+
+static void *concurrent_get(void *user) {
+    concurrent_get_arg *arg = (concurrent_get_arg *)user;
+    int i = 0;
+    while (!__sync_fetch_and_add(&arg->stop, 0)) {
+        char k[21];
+        sprintf(k, "%d", i);
+        if (ht_get(arg->table, k, strlen(k), NULL) != (void *)(long)(i + 1))
+            __sync_fetch_and_add(&arg->failed, 1);
+        i = (i + 1) % arg->num_items;
+    }
+    return NULL;
+}
+
+static int count_pairs(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user) {
+    (*(size_t *)user)++;
+    return HT_ITERATOR_CONTINUE;
+}
+
+static char big_key[2048];
+
+static int mark_seen(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user) {
+    char k[21];
+    if (klen >= sizeof(k) || memcmp(key, "new", 3) == 0)
+        return HT_ITERATOR_CONTINUE;
+    memcpy(k, key, klen);
+    k[klen] = 0;
+    ((char *)user)[atoi(k)] = 1;
+    return HT_ITERATOR_CONTINUE;
+}
+
+// stops the scan at each key not seen before
+static int mark_seen_and_stop(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user) {
+    char k[21];
+    memcpy(k, key, klen);
+    k[klen] = 0;
+    if (((char *)user)[atoi(k)])
+        return HT_ITERATOR_CONTINUE;
+    ((char *)user)[atoi(k)] = 1;
+    return HT_ITERATOR_STOP;
+}
+
+static int grow_value(hashtable_t *table, void *key, size_t klen, void **value, size_t *vlen, void *user) {
+    *vlen = 1000;
+    return 0;
+}
+
+static int evict_count = 0;
+
+static void count_evicted(void *value) {
+    __sync_fetch_and_add(&evict_count, 1);
+}
+
+typedef struct {
+    hashtable_t *table;
+    int id;
+} cache_worker_arg;
+
+static void *cache_worker(void *user) {
+    cache_worker_arg *arg = (cache_worker_arg *)user;
+    int i;
+    for (i = 0; i < 50000; i++) {
+        char k[21];
+        sprintf(k, "%d_%d", arg->id, i % 5000);
+        if (!ht_get(arg->table, k, strlen(k), NULL))
+            ht_set(arg->table, k, strlen(k), (void *)(long)(i + 1), 100);
+    }
+    return NULL;
+}
+
 static int free_count = 0;
 
 void free_item(void *item) {
@@ -73,6 +168,92 @@ void free_item(void *item) {
     }
 }
 
+static int released_count = 0;
+
+static void count_released(void *value) {
+    released_count++;
+}
+
+static void sum_values(hashtable_t *table, void *key, size_t klen, void **value, size_t *vlen, void *src_value, size_t src_vlen, void *user) {
+    *value = (void *)((long)*value + (long)src_value);
+    (*(int *)user)++;
+}
+
+typedef struct {
+    long sum;
+    long count;
+} sum_state_t;
+
+static int sum_pairs(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user) {
+    sum_state_t *state = (sum_state_t *)user;
+    __sync_fetch_and_add(&state->sum, (long)value);
+    __sync_fetch_and_add(&state->count, 1);
+    // odd values are removed
+    return ((long)value & 1) ? HT_ITERATOR_REMOVE : HT_ITERATOR_CONTINUE;
+}
+
+static int sum_local(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user) {
+    sum_state_t *state = (sum_state_t *)user;
+    state->sum += (long)value;
+    state->count++;
+    return HT_ITERATOR_CONTINUE;
+}
+
+static void reduce_sums(hashtable_t *table, void *local, void *user) {
+    ((sum_state_t *)user)->sum += ((sum_state_t *)local)->sum;
+    ((sum_state_t *)user)->count += ((sum_state_t *)local)->count;
+}
+
+static int stop_pairs(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user) {
+    __sync_fetch_and_add((long *)user, 1);
+    return HT_ITERATOR_STOP;
+}
+
+#define NUM_COUNTERS 1000
+
+static void *incr_worker(void *user) {
+    hashtable_t *table = (hashtable_t *)user;
+    int i;
+    for (i = 0; i < NUM_COUNTERS * 100; i++) {
+        char k[21];
+        sprintf(k, "counter%d", i % NUM_COUNTERS);
+        ht_incr(table, k, strlen(k), 1, NULL);
+    }
+    return NULL;
+}
+
+// the offsets of the fields of the image header patched by the tests
+#define IMAGE_SLOTS_OFFSET 40
+#define IMAGE_BUCKETS_OFFSET 48
+#define IMAGE_INDEX_CRC 68
+#define IMAGE_HEADER_CRC 72
+#define IMAGE_HEADER_SIZE 80
+
+static uint32_t image_crc(const unsigned char *p, size_t len) {
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        int b;
+        crc ^= *p++;
+        for (b = 0; b < 8; b++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// write a patched image, with the checksums of its index and header fixed
+static void write_image(const char *path, unsigned char *buf, size_t size) {
+    uint64_t slots_offset;
+    memcpy(&slots_offset, buf + IMAGE_SLOTS_OFFSET, sizeof(slots_offset));
+    uint32_t crc = image_crc(buf + slots_offset, size - slots_offset);
+    memcpy(buf + IMAGE_INDEX_CRC, &crc, sizeof(crc));
+    memset(buf + IMAGE_HEADER_CRC, 0, sizeof(crc));
+    crc = image_crc(buf, IMAGE_HEADER_SIZE);
+    memcpy(buf + IMAGE_HEADER_CRC, &crc, sizeof(crc));
+    FILE *out = fopen(path, "w");
+    fwrite(buf, 1, size, out);
+    fclose(out);
+}
+
 int main(int argc, char **argv) {
     int i;
 
@@ -209,6 +390,1019 @@ int main(int argc, char **argv) {
     list_destroy(values);
     ht_destroy(tmptable);
 
+    ut_testing("ht_grow_step() completes the migration of a growing table");
+    tmptable = ht_create(HT_SIZE_MIN, 0, NULL);
+    for (i = 0; i < HT_SIZE_MIN * 2; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), (void *)(long)(i + 1), 0);
+    }
+    while (ht_grow_step(tmptable, 1))
+        ;
+    failed = 0;
+    for (i = 0; i < HT_SIZE_MIN * 2; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        if (ht_get(tmptable, k, strlen(k), NULL) != (void *)(long)(i + 1))
+            failed++;
+    }
+    ut_result(failed == 0 && ht_count(tmptable) == HT_SIZE_MIN * 2,
+              "%d items not found after the migration", failed);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_get() completes the migration of the growing shards");
+    tmptable = ht_create_sharded(4, HT_SIZE_MIN, 0, NULL);
+    // stop inserting as soon as a shard starts growing
+    // (ht_grow_step() returns the buckets left to migrate without moving any)
+    size_t left_before = 0;
+    int nkeys = 0;
+    while (!left_before && nkeys < HT_SIZE_MIN * 64) {
+        char k[21];
+        sprintf(k, "%d", nkeys);
+        ht_set(tmptable, k, strlen(k), (void *)(long)(nkeys + 1), 0);
+        nkeys++;
+        left_before = ht_grow_step(tmptable, 0);
+    }
+    failed = 0;
+    int pass;
+    for (pass = 0; pass < 16; pass++) {
+        for (i = 0; i < nkeys; i++) {
+            char k[21];
+            sprintf(k, "%d", i);
+            if (ht_get(tmptable, k, strlen(k), NULL) != (void *)(long)(i + 1))
+                failed++;
+        }
+    }
+    size_t left_after = ht_grow_step(tmptable, 0);
+    ut_result(failed == 0 && left_before > 0 && left_after == 0,
+              "%d items not found, %zu buckets left to migrate (%zu before)",
+              failed, left_after, left_before);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_get() while other threads insert, delete and grow the table");
+    tmptable = ht_create(HT_SIZE_MIN, 0, NULL);
+    concurrent_get_arg get_arg = { tmptable, 1000, 0, 0 };
+    for (i = 0; i < get_arg.num_items; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), (void *)(long)(i + 1), 0);
+    }
+    pthread_t readers[4];
+    for (i = 0; i < 4; i++)
+        pthread_create(&readers[i], NULL, concurrent_get, &get_arg);
+    for (i = 0; i < 200000; i++) {
+        char k[21];
+        sprintf(k, "w%d", i);
+        ht_set(tmptable, k, strlen(k), (void *)(long)(i + 1), 0);
+        if (i % 2)
+            ht_delete(tmptable, k, strlen(k), NULL, NULL);
+    }
+    __sync_fetch_and_add(&get_arg.stop, 1);
+    for (i = 0; i < 4; i++)
+        pthread_join(readers[i], NULL);
+    ut_result(get_arg.failed == 0 && ht_count(tmptable) == (size_t)get_arg.num_items + 100000,
+              "%d lookups failed", get_arg.failed);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_set_multi()/ht_get_multi()/ht_delete_multi()");
+    char multi_keybufs[100][21];
+    void *multi_keys[100];
+    size_t multi_klens[100];
+    void *multi_values[100];
+    size_t multi_dlens[100];
+    for (i = 0; i < 100; i++) {
+        sprintf(multi_keybufs[i], "m%d", i);
+        multi_keys[i] = multi_keybufs[i];
+        multi_klens[i] = strlen(multi_keybufs[i]);
+        multi_values[i] = (void *)(long)(i + 1);
+        multi_dlens[i] = i;
+    }
+    hashtable_t *multi_tables[] = { ht_create(0, 0, NULL), ht_create_flat(0, 0, NULL) };
+    failed = 0;
+    for (i = 0; i < 2; i++) {
+        int n;
+        if (ht_set_multi(multi_tables[i], multi_keys, multi_klens, 50, multi_values, multi_dlens) != 50)
+            failed++;
+        void *got[100];
+        size_t got_lens[100];
+        if (ht_get_multi(multi_tables[i], multi_keys, multi_klens, 100, got, got_lens) != 50)
+            failed++;
+        for (n = 0; n < 100; n++) {
+            if (n < 50 && (got[n] != multi_values[n] || got_lens[n] != multi_dlens[n]))
+                failed++;
+            else if (n >= 50 && (got[n] != NULL || got_lens[n] != 0))
+                failed++;
+        }
+        if (ht_delete_multi(multi_tables[i], multi_keys, multi_klens, 100, got, NULL) != 50 ||
+            ht_count(multi_tables[i]) != 0 || got[49] != multi_values[49] || got[50] != NULL)
+        {
+            failed++;
+        }
+        ht_destroy(multi_tables[i]);
+    }
+    ut_result(failed == 0, "%d multi-key operations failed", failed);
+
+    ut_testing("ht_bulk_load() with 4 threads (plain, sharded and flat tables)");
+    int num_bulk_items = 100000;
+    char (*bulk_keybufs)[21] = malloc(num_bulk_items * sizeof(*bulk_keybufs));
+    void **bulk_keys = malloc(num_bulk_items * sizeof(void *));
+    size_t *bulk_klens = malloc(num_bulk_items * sizeof(size_t));
+    void **bulk_values = malloc(num_bulk_items * sizeof(void *));
+    for (i = 0; i < num_bulk_items; i++) {
+        // the last 1000 keys are duplicates of the first ones
+        sprintf(bulk_keybufs[i], "b%d", i < num_bulk_items - 1000 ? i : i - (num_bulk_items - 1000));
+        bulk_keys[i] = bulk_keybufs[i];
+        bulk_klens[i] = strlen(bulk_keybufs[i]);
+        bulk_values[i] = (void *)(long)(i + 1);
+    }
+    hashtable_t *bulk_tables[] = { ht_create(0, 0, NULL), ht_create_sharded(4, 0, 0, NULL), ht_create_flat(0, 0, NULL) };
+    failed = 0;
+    for (i = 0; i < 3; i++) {
+        int n;
+        ht_set(bulk_tables[i], "b5", 2, "old", 3);
+        ht_set(bulk_tables[i], "existing", 8, "value", 5);
+        if (ht_bulk_load(bulk_tables[i], bulk_keys, bulk_klens, bulk_values, NULL, num_bulk_items, 4) != (size_t)num_bulk_items)
+            failed++;
+        if (ht_count(bulk_tables[i]) != (size_t)num_bulk_items - 1000 + 1)
+            failed++;
+        for (n = 0; n < num_bulk_items - 1000; n++) {
+            long expected = n < 1000 ? num_bulk_items - 1000 + n + 1 : n + 1;
+            if (ht_get(bulk_tables[i], bulk_keys[n], bulk_klens[n], NULL) != (void *)expected)
+                failed++;
+        }
+        if (ht_get(bulk_tables[i], "existing", 8, NULL) == NULL)
+            failed++;
+    }
+    ut_result(failed == 0, "%d bulk loaded keys are missing or wrong", failed);
+
+    ut_testing("ht_merge() moves the items and resolves the conflicts");
+    int conflicts = 0;
+    failed = 0;
+    hashtable_t *merge_src = ht_create_sharded(4, 0, 0, free);
+    ht_set(merge_src, "existing", 8, (void *)10, 0);
+    for (i = 0; i < 1000; i++)
+        ht_set(merge_src, bulk_keys[i], bulk_klens[i], (void *)1, 0);
+    ht_set(merge_src, "new", 3, (void *)1, 0);
+    ht_set(bulk_tables[1], "existing", 8, (void *)5, 0);
+    if (ht_merge(bulk_tables[1], merge_src, sum_values, &conflicts) != 1002 || ht_count(merge_src) != 0)
+        failed++;
+    for (i = 0; i < 1000; i++) {
+        if (ht_get(bulk_tables[1], bulk_keys[i], bulk_klens[i], NULL) != (void *)(long)(num_bulk_items - 1000 + i + 2))
+            failed++;
+    }
+    if (ht_get(bulk_tables[1], "existing", 8, NULL) != (void *)15 ||
+        ht_get(bulk_tables[1], "new", 3, NULL) != (void *)1 || conflicts != 1001)
+    {
+        failed++;
+    }
+    ut_result(failed == 0, "%d merged keys are missing or wrong", failed);
+
+    ht_destroy(merge_src);
+    for (i = 0; i < 3; i++)
+        ht_destroy(bulk_tables[i]);
+    free(bulk_values);
+    free(bulk_klens);
+    free(bulk_keys);
+    free(bulk_keybufs);
+
+    ut_testing("ht_get_into() copies the value into the provided buffer");
+    hashtable_t *into_tables[] = { ht_create(0, 0, NULL), ht_create_flat(0, 0, NULL) };
+    failed = 0;
+    for (i = 0; i < 2; i++) {
+        char into_buf[16];
+        ht_set(into_tables[i], "key1", 4, "value1", 6);
+        memset(into_buf, 0, sizeof(into_buf));
+        if (ht_get_into(into_tables[i], "key1", 4, into_buf, sizeof(into_buf)) != 6 || strcmp(into_buf, "value1") != 0)
+            failed++;
+        memset(into_buf, 0, sizeof(into_buf));
+        if (ht_get_into(into_tables[i], "key1", 4, into_buf, 4) != 6 || strcmp(into_buf, "valu") != 0)
+            failed++;
+        if (ht_get_into(into_tables[i], "key2", 4, into_buf, sizeof(into_buf)) != -1)
+            failed++;
+        ht_destroy(into_tables[i]);
+    }
+    ut_result(failed == 0, "%d copies failed", failed);
+
+    ut_testing("ht_set_deferred_free() releases values only after ht_read_end()");
+    tmptable = ht_create_sharded(4, 0, 0, count_released);
+    ht_set_deferred_free(tmptable, 1);
+    ht_set(tmptable, "key1", 4, "value1", 6);
+    ht_set(tmptable, "key2", 4, "value2", 6);
+    ht_read_begin();
+    char *deferred_value = ht_get(tmptable, "key1", 4, NULL);
+    ht_delete(tmptable, "key1", 4, NULL, NULL);
+    ht_set(tmptable, "key2", 4, "value3", 6);
+    ht_reclaim(tmptable);
+    failed = (released_count != 0 || strcmp(deferred_value, "value1") != 0);
+    char deferred_buf[16] = { 0 };
+    if (ht_get_into(tmptable, "key2", 4, deferred_buf, sizeof(deferred_buf)) != 6 || strcmp(deferred_buf, "value3") != 0)
+        failed++;
+    ht_read_end();
+    ht_reclaim(tmptable);
+    if (released_count != 2)
+        failed++;
+    ht_destroy(tmptable);
+    ut_result(failed == 0 && released_count == 3, "%d values released", released_count);
+
+    ut_testing("ht_incr(), ht_min_int64(), ht_max_int64() and ht_cas_int64()");
+    tmptable = ht_create(0, 0, count_released);
+    int64_t num = 0;
+    failed = 0;
+    if (ht_incr(tmptable, "hits", 4, 5, &num) != 0 || num != 5)
+        failed++;
+    if (ht_incr(tmptable, "hits", 4, -2, &num) != 0 || num != 3)
+        failed++;
+    if (ht_min_int64(tmptable, "low", 3, 10, &num) != 0 || num != 10 ||
+        ht_min_int64(tmptable, "low", 3, 20, &num) != 0 || num != 10 ||
+        ht_min_int64(tmptable, "low", 3, -1, &num) != 0 || num != -1)
+    {
+        failed++;
+    }
+    if (ht_max_int64(tmptable, "high", 4, 10, NULL) != 0 ||
+        ht_max_int64(tmptable, "high", 4, 5, &num) != 0 || num != 10)
+    {
+        failed++;
+    }
+    if (ht_cas_int64(tmptable, "hits", 4, 2, 7, &num) != 1 || num != 3 ||
+        ht_cas_int64(tmptable, "hits", 4, 3, 7, &num) != 0 || num != 7)
+    {
+        failed++;
+    }
+    if (ht_cas_int64(tmptable, "missing", 7, 1, 2, NULL) != 1 || ht_exists(tmptable, "missing", 7) ||
+        ht_cas_int64(tmptable, "missing", 7, 0, 2, NULL) != 0)
+    {
+        failed++;
+    }
+    size_t num_len = 0;
+    int64_t *num_ptr = ht_get(tmptable, "missing", 7, &num_len);
+    if (ht_get_int64(tmptable, "hits", 4, &num) != 0 || num != 7 ||
+        !num_ptr || *num_ptr != 2 || num_len != sizeof(int64_t))
+    {
+        failed++;
+    }
+    ut_result(failed == 0, "%d numeric operations failed", failed);
+
+    ut_testing("ht_incr_double(), ht_min_double(), ht_max_double() and ht_cas_double()");
+    double dnum = 0;
+    failed = 0;
+    if (ht_incr_double(tmptable, "avg", 3, 0.5, &dnum) != 0 || dnum != 0.5 ||
+        ht_incr_double(tmptable, "avg", 3, 0.25, &dnum) != 0 || dnum != 0.75)
+    {
+        failed++;
+    }
+    if (ht_min_double(tmptable, "dlow", 4, 1.5, NULL) != 0 ||
+        ht_min_double(tmptable, "dlow", 4, -0.5, &dnum) != 0 || dnum != -0.5 ||
+        ht_max_double(tmptable, "dhigh", 4, 1.5, NULL) != 0 ||
+        ht_max_double(tmptable, "dhigh", 4, 0.5, &dnum) != 0 || dnum != 1.5)
+    {
+        failed++;
+    }
+    if (ht_cas_double(tmptable, "avg", 3, 0.5, 1.0, &dnum) != 1 || dnum != 0.75 ||
+        ht_cas_double(tmptable, "avg", 3, 0.75, 1.0, NULL) != 0 ||
+        ht_get_double(tmptable, "avg", 3, &dnum) != 0 || dnum != 1.0)
+    {
+        failed++;
+    }
+    ut_result(failed == 0, "%d numeric operations failed", failed);
+
+    ut_testing("Numeric values are never passed to the free_item_callback");
+    released_count = 0;
+    failed = 0;
+    ht_set(tmptable, "string", 6, "value", 5);
+    if (ht_incr(tmptable, "string", 6, 1, NULL) != -1 || ht_get_int64(tmptable, "string", 6, &num) != -1)
+        failed++;
+    ht_delete(tmptable, "hits", 4, NULL, NULL);
+    ht_set(tmptable, "low", 3, "value", 5);
+    if (ht_get_int64(tmptable, "low", 3, &num) != -1 || ht_get_int64(tmptable, "hits", 4, &num) != -1)
+        failed++;
+    ht_clear(tmptable);
+    ut_result(failed == 0 && released_count == 2, "%d values released", released_count);
+    ht_destroy(tmptable);
+
+    ut_testing("The int64 and the double functions fail on each other's keys");
+    tmptable = ht_create(0, 0, NULL);
+    failed = 0;
+    ht_incr_double(tmptable, "double", 6, 1.5, NULL);
+    ht_incr(tmptable, "int64", 5, 3, NULL);
+    if (ht_incr(tmptable, "double", 6, 1, NULL) != -1 || ht_max_int64(tmptable, "double", 6, 1, NULL) != -1 ||
+        ht_cas_int64(tmptable, "double", 6, 0, 1, NULL) != -1 || ht_get_int64(tmptable, "double", 6, &num) != -1)
+    {
+        failed++;
+    }
+    if (ht_incr_double(tmptable, "int64", 5, 1, NULL) != -1 || ht_min_double(tmptable, "int64", 5, 1, NULL) != -1 ||
+        ht_get_double(tmptable, "int64", 5, &dnum) != -1)
+    {
+        failed++;
+    }
+    if (ht_get_double(tmptable, "double", 6, &dnum) != 0 || dnum != 1.5 ||
+        ht_get_int64(tmptable, "int64", 5, &num) != 0 || num != 3)
+    {
+        failed++;
+    }
+    ht_destroy(tmptable);
+    ut_result(failed == 0, "%d numeric operations didn't fail", failed);
+
+    ut_testing("Numeric values replaced or deleted are returned as a copy");
+    tmptable = ht_create(0, 0, NULL);
+    failed = 0;
+    void *prev_num = NULL;
+    size_t prev_num_len = 0;
+    ht_incr(tmptable, "deleted", 7, 42, NULL);
+    ht_incr(tmptable, "replaced", 8, 7, NULL);
+    ht_incr(tmptable, "matched", 7, 3, NULL);
+    if (ht_delete(tmptable, "deleted", 7, &prev_num, &prev_num_len) != 0 ||
+        prev_num_len != sizeof(int64_t))
+    {
+        failed++;
+    }
+    // the released item gets reused by the new keys
+    for (i = 0; i < 1000; i++) {
+        char k[21];
+        sprintf(k, "churn%d", i);
+        ht_incr(tmptable, k, strlen(k), i, NULL);
+    }
+    if (!prev_num || *(int64_t *)prev_num != 42)
+        failed++;
+    free(prev_num);
+    prev_num = NULL;
+    if (ht_get_and_set(tmptable, "replaced", 8, "value", 5, &prev_num, NULL) != 0 ||
+        !prev_num || *(int64_t *)prev_num != 7)
+    {
+        failed++;
+    }
+    free(prev_num);
+    prev_num = NULL;
+    int64_t match_num = 3;
+    if (ht_set_if_equals(tmptable, "matched", 7, "value", 5, &match_num, sizeof(match_num), &prev_num, NULL) != 0 ||
+        !prev_num || prev_num == ht_get(tmptable, "matched", 7, NULL) || *(int64_t *)prev_num != 3)
+    {
+        failed++;
+    }
+    free(prev_num);
+    ht_destroy(tmptable);
+    ut_result(failed == 0, "%d previous values are wrong", failed);
+
+    ut_testing("Parallel ht_incr() on %d keys from 4 threads (plain and sharded tables)", NUM_COUNTERS);
+    hashtable_t *incr_tables[] = { ht_create(HT_SIZE_MIN, 0, NULL), ht_create_sharded(4, HT_SIZE_MIN, 0, NULL) };
+    failed = 0;
+    for (i = 0; i < 2; i++) {
+        pthread_t incr_threads[4];
+        int t;
+        for (t = 0; t < 4; t++)
+            pthread_create(&incr_threads[t], NULL, incr_worker, incr_tables[i]);
+        for (t = 0; t < 4; t++)
+            pthread_join(incr_threads[t], NULL);
+        int n;
+        for (n = 0; n < NUM_COUNTERS; n++) {
+            char k[21];
+            sprintf(k, "counter%d", n);
+            if (ht_get_int64(incr_tables[i], k, strlen(k), &num) != 0 || num != 400)
+                failed++;
+        }
+        ht_destroy(incr_tables[i]);
+    }
+    ut_result(failed == 0, "%d counters are wrong", failed);
+
+    ut_testing("ht_incr() on a flat table fails");
+    tmptable = ht_create_flat(0, 0, NULL);
+    ut_validate_int(ht_incr(tmptable, "hits", 4, 1, NULL), -1);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_foreach_pair_parallel() with 4 threads (plain, sharded and flat tables)");
+    hashtable_t *parallel_tables[] = { ht_create(HT_SIZE_MIN, 0, NULL), ht_create_sharded(4, HT_SIZE_MIN, 0, NULL), ht_create_flat(0, 0, NULL) };
+    int num_parallel_keys = 100000;
+    failed = 0;
+    for (i = 0; i < 3; i++) {
+        int n;
+        for (n = 0; n < num_parallel_keys; n++) {
+            char k[21];
+            sprintf(k, "%d", n);
+            ht_set(parallel_tables[i], k, strlen(k), (void *)(long)(n + 1), 0);
+        }
+        sum_state_t state = { 0, 0 };
+        ht_foreach_pair_parallel(parallel_tables[i], 4, sum_pairs, &state);
+        if (state.count != num_parallel_keys || state.sum != (long)num_parallel_keys * (num_parallel_keys + 1) / 2 ||
+            ht_count(parallel_tables[i]) != (size_t)num_parallel_keys / 2)
+        {
+            failed++;
+        }
+    }
+    ut_result(failed == 0, "%d tables were not fully visited", failed);
+
+    ut_testing("ht_foreach_pair_reduce() sums up the local state of each thread");
+    failed = 0;
+    for (i = 0; i < 3; i++) {
+        sum_state_t locals[4];
+        memset(locals, 0, sizeof(locals));
+        sum_state_t total = { 0, 0 };
+        ht_foreach_pair_reduce(parallel_tables[i], 4, sum_local, locals, sizeof(sum_state_t), reduce_sums, &total);
+        // only the even values are left
+        if (total.count != num_parallel_keys / 2 || total.sum != (long)num_parallel_keys / 2 * (num_parallel_keys / 2 + 1))
+            failed++;
+    }
+    ut_result(failed == 0, "%d sums are wrong", failed);
+
+    ut_testing("HT_ITERATOR_STOP stops all the threads of ht_foreach_pair_parallel()");
+    failed = 0;
+    for (i = 0; i < 3; i++) {
+        long visited = 0;
+        ht_foreach_pair_parallel(parallel_tables[i], 4, stop_pairs, &visited);
+        if (visited < 1 || visited >= num_parallel_keys / 2)
+            failed++;
+        ht_destroy(parallel_tables[i]);
+    }
+    ut_result(failed == 0, "%d iterations didn't stop", failed);
+
+    ut_testing("Churning keys of different sizes");
+    tmptable = ht_create(HT_SIZE_MIN, 0, NULL);
+    size_t churn_sizes[] = { 8, 40, 200, 2000 };
+    char *churn_key = malloc(2000);
+    failed = 0;
+    for (i = 0; i < 20000; i++) {
+        size_t klen = churn_sizes[i % 4];
+        memset(churn_key, 'a' + (i % 26), klen);
+        sprintf(churn_key, "%d", i);
+        ht_set(tmptable, churn_key, klen, (void *)(long)(i + 1), 0);
+        if (i >= 100) {
+            // keep only the last 100 keys in the table
+            int old = i - 100;
+            size_t old_klen = churn_sizes[old % 4];
+            memset(churn_key, 'a' + (old % 26), old_klen);
+            sprintf(churn_key, "%d", old);
+            if (ht_get(tmptable, churn_key, old_klen, NULL) != (void *)(long)(old + 1))
+                failed++;
+            ht_delete(tmptable, churn_key, old_klen, NULL, NULL);
+        }
+    }
+    free(churn_key);
+    ut_result(failed == 0 && ht_count(tmptable) == 100,
+              "%d lookups failed, %zu items left", failed, ht_count(tmptable));
+    ht_destroy(tmptable);
+
+    ht_cache_policy_t policies[] = { HT_CACHE_POLICY_CLOCK, HT_CACHE_POLICY_SLRU };
+    const char *policy_names[] = { "CLOCK", "SLRU" };
+    for (i = 0; i < 2; i++) {
+        ut_testing("Cache (%s) keeps the number of items within max_items", policy_names[i]);
+        tmptable = ht_create_cache(100, 0, policies[i]);
+        ht_cache_set_eviction_callback(tmptable, count_evicted);
+        evict_count = 0;
+        int n, hot_missing = 0;
+        ht_set(tmptable, "hot", 3, "hot", 3);
+        for (n = 0; n < 1000; n++) {
+            char k[21];
+            sprintf(k, "%d", n);
+            ht_set(tmptable, k, strlen(k), (void *)(long)(n + 1), 0);
+            if (!ht_get(tmptable, "hot", 3, NULL))
+                hot_missing++;
+        }
+        ut_result(ht_count(tmptable) == 100 && evict_count == 901,
+                  "%zu items in the cache, %d evicted", ht_count(tmptable), evict_count);
+
+        ut_testing("Cache (%s) doesn't evict items which keep being hit", policy_names[i]);
+        ut_result(hot_missing == 0, "The hot item has been evicted %d times", hot_missing);
+        ht_destroy(tmptable);
+    }
+
+    ut_testing("Cache keeps the memory used within max_bytes");
+    tmptable = ht_create_cache(0, 64 << 10, HT_CACHE_POLICY_CLOCK);
+    failed = 0;
+    for (i = 0; i < 1000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), (void *)(long)(i + 1), 1000);
+        if (ht_cache_bytes(tmptable) > (64 << 10))
+            failed++;
+    }
+    ut_result(failed == 0 && ht_count(tmptable) > 0 && ht_count(tmptable) < 64 &&
+              ht_set(tmptable, "big", 3, "big", 64 << 10) == -1,
+              "%d times over budget, %zu items", failed, ht_count(tmptable));
+    ht_destroy(tmptable);
+
+    ut_testing("Values grown by ht_call() don't exceed max_bytes");
+    tmptable = ht_create_cache(0, 64 << 10, HT_CACHE_POLICY_CLOCK);
+    for (i = 0; i < 60; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), (void *)(long)(i + 1), 10);
+    }
+    for (i = 0, failed = 0; i < 60; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_call(tmptable, k, strlen(k), grow_value, NULL);
+        if (ht_cache_bytes(tmptable) > (64 << 10))
+            failed++;
+    }
+    ut_result(failed == 0 && ht_count(tmptable) < 60, "%d times over budget, %zu items", failed, ht_count(tmptable));
+    ht_destroy(tmptable);
+
+    ut_testing("Parallel hits and misses on a cache");
+    tmptable = ht_create_cache(1000, 0, HT_CACHE_POLICY_SLRU);
+    pthread_t cache_threads[4];
+    cache_worker_arg cache_args[4];
+    for (i = 0; i < 4; i++) {
+        cache_args[i].table = tmptable;
+        cache_args[i].id = i;
+        pthread_create(&cache_threads[i], NULL, cache_worker, &cache_args[i]);
+    }
+    for (i = 0; i < 4; i++)
+        pthread_join(cache_threads[i], NULL);
+    ut_result(ht_count(tmptable) == 1000,
+              "%zu items in the cache", ht_count(tmptable));
+    ht_destroy(tmptable);
+
+    ut_testing("ht_set_with_ttl() expires the keys and releases their values");
+    tmptable = ht_create(0, 0, count_evicted);
+    evict_count = 0;
+    for (i = 0; i < 100; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        if (i % 2)
+            ht_set_with_ttl(tmptable, k, strlen(k), NULL, 0, 80);
+        else
+            ht_set_with_ttl(tmptable, k, strlen(k), "persistent", 10, 0);
+    }
+    int visible = ht_count(tmptable) == 100 && ht_exists(tmptable, "1", 1);
+    usleep(150000);
+    ut_result(visible && !ht_exists(tmptable, "1", 1) && ht_count(tmptable) == 50 &&
+              evict_count == 50 && ht_get(tmptable, "2", 1, NULL) != NULL,
+              "%zu items left, %d released", ht_count(tmptable), evict_count);
+
+    ut_testing("ht_set_ttl() changes the expiration of existing keys only");
+    ht_set(tmptable, "a", 1, "a", 1);
+    ht_set_with_ttl(tmptable, "b", 1, "b", 1, 60);
+    rc = ht_set_ttl(tmptable, "a", 1, 60) | ht_set_ttl(tmptable, "b", 1, 0);
+    // a plain set doesn't change the expiration
+    ht_set(tmptable, "a", 1, "A", 1);
+    usleep(120000);
+    ut_result(rc == 0 && ht_set_ttl(tmptable, "missing", 7, 10) == -1 &&
+              !ht_exists(tmptable, "a", 1) && ht_exists(tmptable, "b", 1) &&
+              ht_count(tmptable) == 51,
+              "%zu items left", ht_count(tmptable));
+
+    ut_testing("ht_expire() removes expired keys not being accessed");
+    evict_count = 0;
+    for (i = 0; i < 1000; i++) {
+        char k[21];
+        sprintf(k, "ttl%d", i);
+        ht_set_with_ttl(tmptable, k, strlen(k), NULL, 0, 1 + i % 20);
+    }
+    usleep(50000);
+    // some of them might have been already removed along with the writes
+    size_t expired = ht_expire(tmptable);
+    ut_result(expired > 0 && evict_count == 1000 && ht_count(tmptable) == 51,
+              "%zu expired, %d released", expired, evict_count);
+    ht_destroy(tmptable);
+
+    ut_testing("Parallel insert on a sharded table");
+    tmptable = ht_create_sharded(8, 0, 0, free);
+    for (i = 0; i < 4; i++) {
+        args[i].start = i * 25000;
+        args[i].end = args[i].start + 24999;
+        args[i].table = tmptable;
+        pthread_create(&threads[i], NULL, parallel_insert, &args[i]);
+    }
+    for (i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    size_t visited = 0;
+    ht_foreach_pair(tmptable, count_pairs, &visited);
+    linked_list_t *shard_keys = ht_get_all_keys(tmptable);
+    ut_result(ht_count(tmptable) == 100000 && visited == 100000 &&
+              list_count(shard_keys) == 100000 && ht_exists(tmptable, "99999", 5),
+              "%zu items, %zu visited", ht_count(tmptable), visited);
+    list_destroy(shard_keys);
+
+    ut_testing("ht_clear() on a sharded table");
+    ht_clear(tmptable);
+    ut_result(ht_count(tmptable) == 0 && !ht_exists(tmptable, "1", 1),
+              "%zu items left", ht_count(tmptable));
+    ht_destroy(tmptable);
+
+    ut_testing("A sharded table with a 32-bit hash function uses all the shards");
+    // each shard can't grow beyond 4096 buckets, if all the keys
+    // ended up in the same shard the chains would be ~25 items long
+    tmptable = ht_create_sharded(8, 0, 8 * 4096, NULL);
+    ht_set_hash_function(tmptable, ht_hash_one_at_a_time);
+    for (i = 0; i < 100000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), NULL, 0);
+    }
+    while (ht_grow_step(tmptable, 1024))
+        ;
+    ht_stats_t shard_stats;
+    ht_stats(tmptable, &shard_stats);
+    ut_result(shard_stats.count == 100000 && shard_stats.buckets == 8 * 4096 && shard_stats.longest_chain < 16,
+              "%zu buckets, longest chain: %zu", shard_stats.buckets, shard_stats.longest_chain);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_scan() visits all the keys while the table grows");
+    tmptable = ht_create(HT_SIZE_MIN, 0, NULL);
+    for (i = 0; i < 10000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), NULL, 0);
+    }
+    char *seen = calloc(1, 10000);
+    uint64_t cursor = 0;
+    int calls = 0;
+    do {
+        cursor = ht_scan(tmptable, cursor, 16, mark_seen, seen);
+        // keep the table growing along with the scan
+        for (i = 0; i < 100; i++) {
+            char k[21];
+            sprintf(k, "new%d", calls * 100 + i);
+            ht_set(tmptable, k, strlen(k), NULL, 0);
+        }
+        calls++;
+    } while (cursor);
+    for (i = 0, failed = 0; i < 10000; i++)
+        failed += !seen[i];
+    ut_result(failed == 0 && calls > 1, "%d keys not visited", failed);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_scan() on a sharded table");
+    tmptable = ht_create_sharded(8, 0, 0, NULL);
+    for (i = 0; i < 10000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), NULL, 0);
+    }
+    memset(seen, 0, 10000);
+    cursor = 0;
+    do {
+        cursor = ht_scan(tmptable, cursor, 64, mark_seen, seen);
+    } while (cursor);
+    for (i = 0, failed = 0; i < 10000; i++)
+        failed += !seen[i];
+    ut_result(failed == 0, "%d keys not visited", failed);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_scan() resumes a scan stopped by the callback at the first item");
+    int t;
+    for (t = 0, failed = 0; t < 2; t++) {
+        tmptable = t ? ht_create_sharded(8, 0, 0, NULL) : ht_create(HT_SIZE_MIN, 0, NULL);
+        for (i = 0; i < 1000; i++) {
+            char k[21];
+            sprintf(k, "%d", i);
+            ht_set(tmptable, k, strlen(k), NULL, 0);
+        }
+        memset(seen, 0, 1000);
+        cursor = 0;
+        do {
+            cursor = ht_scan(tmptable, cursor, 64, mark_seen_and_stop, seen);
+        } while (cursor);
+        for (i = 0; i < 1000; i++)
+            failed += !seen[i];
+        ht_destroy(tmptable);
+    }
+    ut_result(failed == 0, "%d keys not visited", failed);
+    free(seen);
+
+    ut_testing("ht_stats() reports buckets, chains and grows");
+    tmptable = ht_create(HT_SIZE_MIN, 0, NULL);
+    for (i = 0; i < 10000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), NULL, 0);
+    }
+    ht_set(tmptable, big_key, sizeof(big_key), NULL, 0);
+    while (ht_grow_step(tmptable, 1024))
+        ;
+    ht_stats_t stats;
+    rc = ht_stats(tmptable, &stats);
+    size_t chained = 0;
+    for (i = 0; i < HT_STATS_CHAINS; i++)
+        chained += stats.chain_lengths[i] * i;
+    ut_result(rc == 0 && stats.count == 10001 && stats.buckets >= 4096 &&
+              stats.grows >= 5 && stats.load_factor > 0 && stats.longest_chain > 0 &&
+              chained <= stats.count && chained > stats.count / 2 &&
+              stats.item_bytes >= 10001 * sizeof(void *) && stats.key_bytes >= sizeof(big_key),
+              "%zu buckets, %zu grows, longest chain %zu",
+              stats.buckets, stats.grows, stats.longest_chain);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_set_bloom_filter() while the table grows");
+    tmptable = ht_create(HT_SIZE_MIN, 0, NULL);
+    rc = ht_set_bloom_filter(tmptable, 0.01, 0);
+    rc |= !ht_set_bloom_filter(tmptable, 0.01, 0);
+    for (i = 0, failed = 0; i < 10000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), NULL, 0);
+        // look up all the keys set so far while the buckets are migrated
+        sprintf(k, "%d", i / 2);
+        failed += !ht_exists(tmptable, k, strlen(k));
+        sprintf(k, "new%d", i);
+        failed += ht_exists(tmptable, k, strlen(k));
+    }
+    ht_delete(tmptable, "0", 1, NULL, NULL);
+    ut_result(rc == 0 && failed == 0 && !ht_exists(tmptable, "0", 1) &&
+              ht_set_bloom_filter(tmptable, 0.01, 0) == -1,
+              "%d lookups failed", failed);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_set_bloom_filter() with a counting filter on a sharded table");
+    tmptable = ht_create_sharded(4, 0, 0, NULL);
+    rc = ht_set_bloom_filter(tmptable, 0.01, 1);
+    for (i = 0; i < 10000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set(tmptable, k, strlen(k), NULL, 0);
+    }
+    for (i = 0; i < 10000; i += 2) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_delete(tmptable, k, strlen(k), NULL, NULL);
+    }
+    for (i = 0, failed = 0; i < 10000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        if (ht_exists(tmptable, k, strlen(k)) != (i & 1))
+            failed++;
+    }
+    ht_set(tmptable, "0", 1, NULL, 0);
+    ut_result(rc == 0 && failed == 0 && ht_exists(tmptable, "0", 1) && ht_count(tmptable) == 5001,
+              "%d lookups failed", failed);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_set_key_arena() and ht_compact_keys()");
+    tmptable = ht_create(0, 0, NULL);
+    rc = ht_set_key_arena(tmptable);
+    for (i = 0; i < 20000; i++) {
+        char k[65];
+        sprintf(k, "%064d", i);
+        ht_set(tmptable, k, 64, (void *)(intptr_t)(i + 1), 0);
+    }
+    ht_stats(tmptable, &stats);
+    size_t key_bytes = stats.key_bytes;
+    for (i = 0; i < 20000; i++) {
+        char k[65];
+        sprintf(k, "%064d", i);
+        if (i % 4)
+            ht_delete(tmptable, k, 64, NULL, NULL);
+    }
+    ht_compact_keys(tmptable);
+    ht_stats(tmptable, &stats);
+    for (i = 0, failed = 0; i < 20000; i++) {
+        char k[65];
+        sprintf(k, "%064d", i);
+        void *value = ht_get(tmptable, k, 64, NULL);
+        if (value != (i % 4 ? NULL : (void *)(intptr_t)(i + 1)))
+            failed++;
+    }
+    ut_result(rc == 0 && failed == 0 && stats.key_bytes < key_bytes / 2 &&
+              ht_set_key_arena(tmptable) == -1,
+              "%d keys mismatching, %zu key bytes (were %zu)", failed, stats.key_bytes, key_bytes);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_set_intern_pool() stores keys shared by two tables once");
+    ht_intern_pool_t *pool = ht_intern_pool_create();
+    hashtable_t *tables[2] = { ht_create(0, 0, NULL), ht_create_sharded(4, 0, 0, NULL) };
+    rc = ht_set_intern_pool(tables[0], pool) | ht_set_intern_pool(tables[1], pool);
+    for (i = 0; i < 1000; i++) {
+        char k[65];
+        sprintf(k, "%064d", i);
+        ht_set(tables[0], k, 64, (void *)(intptr_t)(i + 1), 0);
+        ht_set(tables[1], k, 64, (void *)(intptr_t)(i + 2), 0);
+        if (i % 2)
+            ht_delete(tables[0], k, 64, NULL, NULL);
+    }
+    char k[65];
+    sprintf(k, "%064d", 10);
+    const char *interned = ht_intern(pool, k, 64);
+    failed = (interned != ht_intern(pool, k, 64) || strcmp(interned, k) != 0 ||
+              ht_get(tables[0], (void *)interned, 64, NULL) != (void *)11 ||
+              ht_get(tables[1], (void *)interned, 64, NULL) != (void *)12);
+    ht_intern_release(pool, interned);
+    ht_intern_release(pool, interned);
+    size_t interned_count = ht_intern_count(pool);
+    ht_destroy(tables[1]);
+    ht_destroy(tables[0]);
+    ut_result(rc == 0 && !failed && interned_count == 1000 && ht_intern_count(pool) == 0,
+              "%zu interned keys", interned_count);
+    ht_intern_pool_destroy(pool);
+
+    ut_testing("ht_u64_set()/ht_u64_get()/ht_u64_delete()");
+    ht_u64_t *u64table = ht_u64_create(0, 0, NULL);
+    for (i = 0; i < 10000; i++)
+        ht_u64_set(u64table, (uint64_t)i << 32, (void *)(uintptr_t)(i + 1));
+    void *prev = NULL;
+    for (i = 0, failed = 0; i < 10000; i++) {
+        if (ht_u64_get(u64table, (uint64_t)i << 32) != (void *)(uintptr_t)(i + 1))
+            failed++;
+    }
+    ut_result(failed == 0 && ht_u64_count(u64table) == 10000 &&
+              ht_u64_set_if_not_exists(u64table, 0, (void *)2) == 1 &&
+              ht_u64_get_and_set(u64table, 0, (void *)3, &prev) == 0 && prev == (void *)1 &&
+              ht_u64_delete(u64table, 0, &prev) == 0 && prev == (void *)3 &&
+              !ht_u64_exists(u64table, 0) && ht_u64_delete(u64table, 0, NULL) == -1,
+              "%d keys not found", failed);
+
+    ut_testing("Parallel insert on an integer keyed table");
+    ht_u64_clear(u64table);
+    u64_insert_arg u64_args[4];
+    for (i = 0; i < 4; i++) {
+        u64_args[i].start = i * 25000;
+        u64_args[i].end = u64_args[i].start + 24999;
+        u64_args[i].table = u64table;
+        pthread_create(&threads[i], NULL, u64_insert, &u64_args[i]);
+    }
+    for (i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    for (i = 0, failed = 0; i < 100000; i++) {
+        if (ht_u64_get(u64table, i) != (void *)(uintptr_t)(i + 1))
+            failed++;
+    }
+    ut_result(failed == 0 && ht_u64_count(u64table) == 100000,
+              "%d keys not found, %zu items", failed, ht_u64_count(u64table));
+
+    ut_testing("ht_u64_foreach_pair() can remove items");
+    ht_u64_foreach_pair(u64table, u64_remove_odd, NULL);
+    ut_result(ht_u64_count(u64table) == 50000 && ht_u64_exists(u64table, 2) &&
+              !ht_u64_exists(u64table, 3),
+              "%zu items", ht_u64_count(u64table));
+    ht_u64_destroy(u64table);
+
+    char image_path[64];
+    snprintf(image_path, sizeof(image_path), "/tmp/hashtable_test_%d.img", (int)getpid());
+
+    ut_testing("ht_save() and ht_open_mmap()");
+    tmptable = ht_create(0, 0, free);
+    for (i = 0; i < 10000; i++) {
+        char k[21];
+        char *v = malloc(21);
+        sprintf(k, "%d", i);
+        sprintf(v, "value%d", i);
+        ht_set(tmptable, k, strlen(k), v, strlen(v) + 1);
+    }
+    rc = ht_save(tmptable, image_path);
+    ht_destroy(tmptable);
+    tmptable = ht_open_mmap(image_path);
+    failed = 0;
+    for (i = 0; tmptable && i < 10000; i++) {
+        char k[21];
+        char v[21];
+        size_t vlen = 0;
+        sprintf(k, "%d", i);
+        sprintf(v, "value%d", i);
+        char *value = ht_get(tmptable, k, strlen(k), &vlen);
+        if (!value || vlen != strlen(v) + 1 || strcmp(value, v) != 0)
+            failed++;
+    }
+    ut_result(rc == 0 && tmptable && failed == 0 && ht_count(tmptable) == 10000 &&
+              !ht_exists(tmptable, "missing", 7) && ht_image_verify(tmptable) == 0,
+              "%d keys not found in the image", failed);
+
+    ut_testing("Changes to a mapped table go to the overlay");
+    ht_set_free_item_callback(tmptable, free);
+    ht_set(tmptable, "1", 1, strdup("changed"), 8);
+    ht_set(tmptable, "new", 3, strdup("new"), 4);
+    ht_delete(tmptable, "2", 1, NULL, NULL);
+    ht_delete(tmptable, "3", 1, NULL, NULL);
+    ht_set(tmptable, "3", 1, strdup("back"), 5);
+    ht_set_if_not_exists(tmptable, "4", 1, "ignored", 8);
+    visited = 0;
+    ht_foreach_pair(tmptable, count_pairs, &visited);
+    ut_result(strcmp(ht_get(tmptable, "1", 1, NULL), "changed") == 0 &&
+              strcmp(ht_get(tmptable, "3", 1, NULL), "back") == 0 &&
+              strcmp(ht_get(tmptable, "4", 1, NULL), "value4") == 0 &&
+              !ht_exists(tmptable, "2", 1) && ht_exists(tmptable, "new", 3) &&
+              ht_count(tmptable) == 10000 && visited == 10000,
+              "%zu items, %zu visited", ht_count(tmptable), visited);
+
+    ut_testing("ht_compact() merges the overlay into the image");
+    rc = ht_compact(tmptable);
+    ht_destroy(tmptable);
+    tmptable = ht_open_mmap(image_path);
+    ut_result(rc == 0 && tmptable && ht_count(tmptable) == 10000 &&
+              strcmp(ht_get(tmptable, "1", 1, NULL), "changed") == 0 &&
+              strcmp(ht_get(tmptable, "new", 3, NULL), "new") == 0 &&
+              !ht_exists(tmptable, "2", 1),
+              "%zu items", tmptable ? ht_count(tmptable) : 0);
+    ht_destroy(tmptable);
+
+    ut_testing("ht_image_verify() detects corrupted entries");
+    FILE *image = fopen(image_path, "r+");
+    fseek(image, 100, SEEK_SET);
+    int byte = fgetc(image);
+    fseek(image, 100, SEEK_SET);
+    fputc(byte ^ 0xff, image);
+    fclose(image);
+    tmptable = ht_open_mmap(image_path);
+    ut_validate_int(tmptable && ht_image_verify(tmptable) == -1, 1);
+    if (tmptable)
+        ht_destroy(tmptable);
+
+    ut_testing("ht_open_mmap() rejects a corrupted index");
+    image = fopen(image_path, "r+");
+    fseek(image, -12, SEEK_END);
+    byte = fgetc(image);
+    fseek(image, -12, SEEK_END);
+    fputc(byte ^ 0xff, image);
+    fclose(image);
+    tmptable = ht_open_mmap(image_path);
+    ut_validate_int(tmptable == NULL, 1);
+    if (tmptable)
+        ht_destroy(tmptable);
+    unlink(image_path);
+
+    ut_testing("ht_open_mmap() rejects an index pointing out of the image");
+    tmptable = ht_create(0, 0, NULL);
+    for (i = 0; i < 1000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        ht_set_copy(tmptable, k, strlen(k), k, strlen(k) + 1, NULL, NULL);
+    }
+    ht_save(tmptable, image_path);
+    ht_destroy(tmptable);
+    image = fopen(image_path, "r");
+    fseek(image, 0, SEEK_END);
+    size_t image_size = ftell(image);
+    unsigned char *image_buf = malloc(image_size);
+    unsigned char *patched = malloc(image_size);
+    fseek(image, 0, SEEK_SET);
+    if (fread(image_buf, 1, image_size, image) != image_size)
+        image_size = 0;
+    fclose(image);
+    uint64_t slots_offset, buckets_offset, bogus;
+    memcpy(&slots_offset, image_buf + IMAGE_SLOTS_OFFSET, sizeof(slots_offset));
+    memcpy(&buckets_offset, image_buf + IMAGE_BUCKETS_OFFSET, sizeof(buckets_offset));
+    failed = 0;
+    // the first slot points beyond the entries
+    memcpy(patched, image_buf, image_size);
+    bogus = image_size;
+    memcpy(patched + slots_offset + sizeof(uint64_t), &bogus, sizeof(bogus));
+    write_image(image_path, patched, image_size);
+    tmptable = ht_open_mmap(image_path);
+    if (tmptable) {
+        failed++;
+        ht_destroy(tmptable);
+    }
+    // the first bucket ends beyond the slots
+    memcpy(patched, image_buf, image_size);
+    bogus = 1001;
+    memcpy(patched + buckets_offset + sizeof(uint64_t), &bogus, sizeof(bogus));
+    write_image(image_path, patched, image_size);
+    tmptable = ht_open_mmap(image_path);
+    if (tmptable) {
+        failed++;
+        ht_destroy(tmptable);
+    }
+    ut_result(failed == 0, "%d bad images opened", failed);
+
+    ut_testing("Entries whose lengths exceed the image are ignored");
+    uint64_t entry_offset;
+    memcpy(patched, image_buf, image_size);
+    memcpy(&entry_offset, patched + slots_offset + sizeof(uint64_t), sizeof(entry_offset));
+    bogus = UINT64_MAX - 8;
+    memcpy(patched + entry_offset, &bogus, sizeof(bogus));
+    write_image(image_path, patched, image_size);
+    tmptable = ht_open_mmap(image_path);
+    failed = 0;
+    for (i = 0; tmptable && i < 1000; i++) {
+        char k[21];
+        sprintf(k, "%d", i);
+        char *value = ht_get(tmptable, k, strlen(k), NULL);
+        if (!value || strcmp(value, k) != 0)
+            failed++;
+    }
+    visited = 0;
+    if (tmptable)
+        ht_foreach_pair(tmptable, count_pairs, &visited);
+    ut_result(tmptable && failed == 1 && visited == 999 && ht_image_verify(tmptable) == -1,
+              "%d keys not found, %zu visited", failed, visited);
+    if (tmptable)
+        ht_destroy(tmptable);
+    free(image_buf);
+    free(patched);
+    unlink(image_path);
+
+    ut_testing("ht_set_hash_function() fails on a non-empty table");
+    ut_validate_int(ht_set_hash_function(table, ht_hash_crc32c), -1);
+
+    ut_testing("ht_set_hash_function() with the built-in hash functions");
+    ht_hash_callback_t hash_functions[] = { ht_hash_one_at_a_time, ht_hash_crc32c, ht_hash_wyhash };
+    failed = 0;
+    for (i = 0; i < (int)(sizeof(hash_functions)/sizeof(hash_functions[0])); i++) {
+        tmptable = ht_create(0, 0, NULL);
+        if (ht_set_hash_function(tmptable, hash_functions[i]) != 0)
+            failed++;
+        int n;
+        for (n = 0; n < 1000; n++) {
+            char k[21];
+            sprintf(k, "%d", n);
+            ht_set(tmptable, k, strlen(k), (void *)(long)(n + 1), 0);
+        }
+        for (n = 0; n < 1000; n++) {
+            char k[21];
+            sprintf(k, "%d", n);
+            if (ht_get(tmptable, k, strlen(k), NULL) != (void *)(long)(n + 1))
+                failed++;
+        }
+        ht_destroy(tmptable);
+    }
+    ut_result(failed == 0, "%d lookups failed", failed);
+
     ht_set_free_item_callback(table, free_item);
     ut_testing("ht_clear() and free_item_callback");
     ht_clear(table);
@@ -218,6 +1412,56 @@ int main(int argc, char **argv) {
 
     ht_destroy(table);
 
+    ut_testing("Create flat hash table");
+    table = ht_create_flat(0, 0, NULL);
+    ut_result(table != NULL, "Can't create a new flat hash table");
+
+    ut_testing("ht_set()/ht_get() on a flat table");
+    ht_set(table, "key1", 4, "value1", 6);
+    ht_set(table, "a_key_way_longer_than_the_inline_key_buffer", 43, "value2", 6);
+    if (ht_count(table) != 2)
+        ut_failure("Count is not 2 after setting two items in the table");
+    else
+        ut_validate_string(ht_get(table, "a_key_way_longer_than_the_inline_key_buffer", 43, NULL), "value2");
+
+    ut_testing("ht_delete() on a flat table");
+    ht_delete(table, "key1", 4, NULL, NULL);
+    ut_result(ht_get(table, "key1", 4, NULL) == NULL && ht_count(table) == 1, "ht_delete() failed");
+
+    ht_clear(table);
+
+    ut_testing("Parallel insert on a flat table (%d items, %d threads)", num_parallel_items, num_parallel_threads);
+    for (i = 0; i < num_parallel_threads; i++) {
+        args[i].start = 0 + (i * (num_parallel_items / num_parallel_threads));
+        args[i].end = args[i].start + (num_parallel_items / num_parallel_threads) -1;
+        args[i].table = table;
+        pthread_create(&threads[i], NULL, parallel_insert, &args[i]);
+    }
+
+    for (i = 0; i < num_parallel_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ut_result(ht_count(table) == num_parallel_items,
+            "Count is not %d after parallel insert (%d)",
+            num_parallel_items, ht_count(table));
+
+    ut_testing("ht_foreach_pair() iterator on a flat table");
+    check_item_count = 0;
+    ht_foreach_pair(table, check_item, &check_item_count);
+    ut_result(check_item_count == num_parallel_items,
+              "not all items were valid (%d were valid, should have been %d)",
+              check_item_count,
+              num_parallel_items);
+
+    ut_testing("ht_foreach_pair() can remove items from a flat table");
+    count2 = 0;
+    ht_foreach_pair(table, remove_all, &count2);
+    ut_result(count2 == num_parallel_items && ht_count(table) == 0,
+              "Not all items have been removed (%d removed, %d left)", count2, ht_count(table));
+
+    ht_destroy(table);
+
     ut_summary();
 
     exit(ut_failed);
@@ -52,6 +52,19 @@ void *queue_worker(void *user) {
     return NULL;
 }
 
+void *queue_batch_worker(void *user) {
+    void *values[16];
+    queue_worker_arg *arg = (queue_worker_arg *)user;
+    while (!__sync_fetch_and_add(&arg->leave, 0)) {
+        size_t n = queue_pop_left_batch(arg->queue, values, 16);
+        size_t i;
+        for (i = 0; i < n; i++)
+            free(values[i]);
+        __sync_add_and_fetch(&arg->count, n);
+    }
+    return NULL;
+}
+
 int main(int argc, char **argv) {
     int i;
 
@@ -173,6 +186,56 @@ int main(int argc, char **argv) {
 
     queue_destroy(arg.queue);
 
+    ut_testing("queue_push_right_batch() and queue_pop_left_batch() keep the order");
+    q = queue_create();
+    long batch_values[200];
+    for (i = 0; i < 200; i++)
+        batch_values[i] = i + 1;
+    queue_push_right(q, (void *)(long)-1);
+    size_t pushed = queue_push_right_batch(q, (void **)batch_values, 100);
+    pushed += queue_push_right_batch(q, (void **)batch_values + 100, 100);
+    long popped[300];
+    size_t npopped = queue_pop_left_batch(q, (void **)popped, 150);
+    npopped += queue_pop_left_batch(q, (void **)popped + npopped, 150);
+    int failed = (pushed != 200 || npopped != 201 || popped[0] != -1 || queue_count(q) != 0);
+    for (i = 0; !failed && i < 200; i++) {
+        if (popped[i + 1] != i + 1)
+            failed = 1;
+    }
+    ut_result(!failed, "Batch pushed %d, popped %d values", (int)pushed, (int)npopped);
+    queue_destroy(q);
+
+    arg.queue = queue_create();
+    arg.count = 0;
+    arg.leave = 0;
+
+    ut_testing("Threaded queue with batches (%d pull-workers, %d items pushed in batches of 100)",
+              num_parallel_threads, num_queued_items);
+
+    for (i = 0; i < num_parallel_threads; i++) {
+        pthread_create(&threads[i], NULL, queue_batch_worker, &arg);
+    }
+
+    for (i = 0; i < num_queued_items; i += 100) {
+        void *vals[100];
+        int j;
+        for (j = 0; j < 100; j++)
+            vals[j] = malloc(21);
+        queue_push_right_batch(arg.queue, vals, 100);
+    }
+
+    while(queue_count(arg.queue))
+        usleep(500);
+
+    __sync_add_and_fetch(&arg.leave, 1);
+    for (i = 0; i < num_parallel_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ut_result(arg.count == num_queued_items, "Handled items should have been %d (was %d)", num_queued_items, arg.count);
+
+    queue_destroy(arg.queue);
+
     ut_summary();
 
     exit(ut_failed);
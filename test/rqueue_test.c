@@ -2,10 +2,14 @@
 #include <ut.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <libgen.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
 
 #define SIZE_OF_BUFFER 512
 #define NUM_OF_WRITER 5
@@ -23,6 +27,8 @@ void *write_thread(void *ptr) {
         if(p) {
             if(rqueue_write(ring, p) == 0) {
                 __sync_fetch_and_add(&write_count, 1);
+            } else {
+                free(p);
             }
         }
     }
@@ -137,6 +143,132 @@ static void wait_for_readers(int num_readers, pthread_t *th) {
     }
 }
 
+#define MPMC_ITEMS 200000
+#define MPMC_THREADS 4
+
+static rqueue_t *mpmc_ring;
+static unsigned char mpmc_seen[MPMC_ITEMS * MPMC_THREADS];
+static int mpmc_read = 0;
+
+static void *mpmc_writer(void *user) {
+    long base = (long)user * MPMC_ITEMS;
+    long i;
+    for (i = 0; i < MPMC_ITEMS; i++) {
+        while (rqueue_write(mpmc_ring, (void *)(base + i + 1)) != 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *mpmc_reader(void *user) {
+    while (__sync_fetch_and_add(&mpmc_read, 0) < MPMC_ITEMS * MPMC_THREADS) {
+        long v = (long)rqueue_read(mpmc_ring);
+        if (!v) {
+            sched_yield();
+            continue;
+        }
+        __sync_fetch_and_add(&mpmc_seen[v - 1], 1);
+        __sync_fetch_and_add(&mpmc_read, 1);
+    }
+    return NULL;
+}
+
+static int overwrite_freed = 0;
+
+static void count_overwritten(void *v) {
+    __sync_fetch_and_add(&overwrite_freed, 1);
+}
+
+static void *overwrite_writer(void *user) {
+    int i;
+    for (i = 0; i < MPMC_ITEMS; i++)
+        rqueue_write((rqueue_t *)user, (void *)(long)(i + 1));
+    return NULL;
+}
+
+#define SPSC_ITEMS 1000000
+
+static void *spsc_producer(void *user) {
+    long i;
+    for (i = 0; i < SPSC_ITEMS; i++) {
+        while (rqueue_write((rqueue_t *)user, (void *)(i + 1)) != 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *mpmc_batch_writer(void *user) {
+    long base = (long)user * MPMC_ITEMS;
+    void *values[32];
+    long i = 0;
+    while (i < MPMC_ITEMS) {
+        size_t n = 0;
+        while (n < 32 && i + (long)n < MPMC_ITEMS) {
+            values[n] = (void *)(base + i + n + 1);
+            n++;
+        }
+        size_t written = rqueue_write_batch(mpmc_ring, values, n);
+        if (written < n)
+            sched_yield();
+        i += written;
+    }
+    return NULL;
+}
+
+static void *mpmc_batch_reader(void *user) {
+    void *values[32];
+    while (__sync_fetch_and_add(&mpmc_read, 0) < MPMC_ITEMS * MPMC_THREADS) {
+        size_t n = rqueue_read_batch(mpmc_ring, values, 32);
+        if (!n) {
+            sched_yield();
+            continue;
+        }
+        size_t i;
+        for (i = 0; i < n; i++)
+            __sync_fetch_and_add(&mpmc_seen[(long)values[i] - 1], 1);
+        __sync_fetch_and_add(&mpmc_read, n);
+    }
+    return NULL;
+}
+
+#define WAIT_ITEMS 100000
+
+static void *wait_producer(void *user) {
+    long i;
+    for (i = 0; i < WAIT_ITEMS; i++)
+        rqueue_write_wait((rqueue_t *)user, (void *)(i + 1), -1);
+    return NULL;
+}
+
+static void *wait_consumer(void *user) {
+    long i, sum = 0;
+    for (i = 0; i < WAIT_ITEMS; i++)
+        sum += (long)rqueue_read_wait((rqueue_t *)user, -1);
+    return (void *)sum;
+}
+
+static long idle_cpu_us = 0;
+
+static void *idle_consumer(void *user) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    void *v = rqueue_read_wait((rqueue_t *)user, 1000);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    idle_cpu_us = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+    return v;
+}
+
+static long elapsed_ms(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000L + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+static int fd_readable(int fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) == 1;
+}
+
 int main(int argc, char **argv) {
 
     do_free = 1;
@@ -166,9 +298,10 @@ int main(int argc, char **argv) {
              "reads: %d, writes: %d, size: %d", reads_count, rqueue_write_count(rb), rqueue_size);
 
     if (reads_count < rqueue_size) {
-        char *stats = rqueue_stats(rb);
-        printf("%s\n", stats);
-        free(stats);
+        rqueue_stats_t stats;
+        rqueue_stats(rb, &stats);
+        printf("reads: %"PRIu64", writes: %"PRIu64", full: %"PRIu64", empty: %"PRIu64"\n",
+               stats.reads, stats.writes, stats.queue_full, stats.queue_empty);
     }
 
     rqueue_destroy(rb);
@@ -188,9 +321,10 @@ int main(int argc, char **argv) {
              "reads: %d, writes: %d, size: %d", reads_count, rqueue_write_count(rb), rqueue_size);
 
     if (reads_count < rqueue_size) {
-        char *stats = rqueue_stats(rb);
-        printf("%s\n", stats);
-        free(stats);
+        rqueue_stats_t stats;
+        rqueue_stats(rb, &stats);
+        printf("reads: %"PRIu64", writes: %"PRIu64", full: %"PRIu64", empty: %"PRIu64"\n",
+               stats.reads, stats.writes, stats.queue_full, stats.queue_empty);
     }
 
     ut_testing("rqueue_set_free_value_callback()");
@@ -230,6 +364,274 @@ int main(int argc, char **argv) {
 
     test_multiple_writers_one_reader();
 
+    ut_testing("Ringbuffer with a size which is not a power of two (3)");
+    rb = rqueue_create(3, RQUEUE_MODE_BLOCKING);
+    rc = rqueue_write(rb, "1") | rqueue_write(rb, "2") | rqueue_write(rb, "3");
+    if (rc == 0 && rqueue_write(rb, "4") == -2) {
+        int i, failed = 0;
+        // go around the ring a few times
+        for (i = 0; i < 10; i++) {
+            char *v = rqueue_read(rb);
+            if (!v || rqueue_write(rb, v) != 0)
+                failed++;
+        }
+        ut_result(failed == 0 && rqueue_isempty(rb) == 0, "%d values have been lost", failed);
+    } else {
+        ut_failure("Can't fill the ringbuffer");
+    }
+    rqueue_destroy(rb);
+
+    ut_testing("%d writers and %d readers see each value exactly once", MPMC_THREADS, MPMC_THREADS);
+    mpmc_ring = rqueue_create(1024, RQUEUE_MODE_BLOCKING);
+    pthread_t mpmc_writers[MPMC_THREADS];
+    pthread_t mpmc_readers[MPMC_THREADS];
+    int t;
+    for (t = 0; t < MPMC_THREADS; t++) {
+        pthread_create(&mpmc_writers[t], NULL, mpmc_writer, (void *)(long)t);
+        pthread_create(&mpmc_readers[t], NULL, mpmc_reader, NULL);
+    }
+    for (t = 0; t < MPMC_THREADS; t++) {
+        pthread_join(mpmc_writers[t], NULL);
+        pthread_join(mpmc_readers[t], NULL);
+    }
+    int missing = 0;
+    for (t = 0; t < MPMC_ITEMS * MPMC_THREADS; t++) {
+        if (mpmc_seen[t] != 1)
+            missing++;
+    }
+    ut_result(missing == 0 && rqueue_isempty(mpmc_ring), "%d values have been lost or read twice", missing);
+    rqueue_destroy(mpmc_ring);
+
+    ut_testing("Concurrent writers in RQUEUE_MODE_OVERWRITE release each dropped value");
+    rb = rqueue_create(100, RQUEUE_MODE_OVERWRITE);
+    rqueue_set_free_value_callback(rb, count_overwritten);
+    for (t = 0; t < MPMC_THREADS; t++)
+        pthread_create(&mpmc_writers[t], NULL, overwrite_writer, rb);
+    for (t = 0; t < MPMC_THREADS; t++)
+        pthread_join(mpmc_writers[t], NULL);
+    int left = 0;
+    while (rqueue_read(rb))
+        left++;
+    ut_result(left == 100 && overwrite_freed + left == MPMC_ITEMS * MPMC_THREADS,
+              "%d values left, %d released", left, overwrite_freed);
+    rqueue_destroy(rb);
+
+    ut_testing("rqueue_create_spsc() delivers %d values in order", SPSC_ITEMS);
+    rb = rqueue_create_spsc(1000);
+    pthread_t spsc_th;
+    pthread_create(&spsc_th, NULL, spsc_producer, rb);
+    long expected = 1;
+    while (expected <= SPSC_ITEMS) {
+        long v = (long)rqueue_read(rb);
+        if (!v) {
+            sched_yield();
+            continue;
+        }
+        if (v != expected)
+            break;
+        expected++;
+    }
+    pthread_join(spsc_th, NULL);
+    ut_result(expected == SPSC_ITEMS + 1 && rqueue_isempty(rb) && rqueue_read_count(rb) == SPSC_ITEMS,
+              "Got value %ld out of order", expected);
+
+    ut_testing("Write fails if a spsc ringbuffer is full and the values left are released");
+    free_count = 0;
+    rqueue_set_free_value_callback(rb, free_item);
+    rqueue_set_mode(rb, RQUEUE_MODE_OVERWRITE);
+    rc = 0;
+    for (t = 0; t < 1000; t++)
+        rc |= rqueue_write(rb, malloc(1));
+    void *spsc_extra = malloc(1);
+    if (rc == 0 && rqueue_write(rb, spsc_extra) == -2 && rqueue_mode(rb) == RQUEUE_MODE_BLOCKING) {
+        free(spsc_extra);
+        free(rqueue_read(rb));
+        rqueue_destroy(rb);
+        ut_validate_int(free_count, 999);
+    } else {
+        ut_failure("The spsc ringbuffer accepted too many values");
+    }
+
+    ut_testing("rqueue_write_batch() and rqueue_read_batch() keep the order");
+    int failed = 0;
+    for (t = 0; t < 2; t++) {
+        rb = t ? rqueue_create_spsc(10) : rqueue_create(10, RQUEUE_MODE_BLOCKING);
+        long batch[16], out[16];
+        int i;
+        for (i = 0; i < 16; i++)
+            batch[i] = i + 1;
+        rqueue_write(rb, (void *)100L);
+        if (rqueue_write_batch(rb, (void **)batch, 16) != 9 || rqueue_read(rb) != (void *)100L)
+            failed++;
+        // wrap around the end of the ring
+        if (rqueue_read_batch(rb, (void **)out, 5) != 5 || rqueue_write_batch(rb, (void **)batch + 9, 7) != 6 ||
+            rqueue_read_batch(rb, (void **)out + 5, 16) != 10 || !rqueue_isempty(rb))
+        {
+            failed++;
+        }
+        for (i = 0; i < 15; i++) {
+            if (out[i] != i + 1)
+                failed++;
+        }
+        rqueue_destroy(rb);
+    }
+    ut_result(failed == 0, "%d batches failed", failed);
+
+    ut_testing("rqueue_write_batch() in RQUEUE_MODE_OVERWRITE drops the oldest values");
+    rb = rqueue_create(10, RQUEUE_MODE_OVERWRITE);
+    long batch[16], out[16];
+    for (t = 0; t < 16; t++)
+        batch[t] = t + 1;
+    if (rqueue_write_batch(rb, (void **)batch, 16) == 16 && rqueue_read_batch(rb, (void **)out, 16) == 10)
+        ut_validate_int(out[0], 7);
+    else
+        ut_failure("Wrong number of values written or read");
+    rqueue_destroy(rb);
+
+    ut_testing("%d batch writers and %d batch readers see each value exactly once", MPMC_THREADS, MPMC_THREADS);
+    mpmc_ring = rqueue_create(1000, RQUEUE_MODE_BLOCKING);
+    memset(mpmc_seen, 0, sizeof(mpmc_seen));
+    mpmc_read = 0;
+    for (t = 0; t < MPMC_THREADS; t++) {
+        pthread_create(&mpmc_writers[t], NULL, mpmc_batch_writer, (void *)(long)t);
+        pthread_create(&mpmc_readers[t], NULL, mpmc_batch_reader, NULL);
+    }
+    for (t = 0; t < MPMC_THREADS; t++) {
+        pthread_join(mpmc_writers[t], NULL);
+        pthread_join(mpmc_readers[t], NULL);
+    }
+    missing = 0;
+    for (t = 0; t < MPMC_ITEMS * MPMC_THREADS; t++) {
+        if (mpmc_seen[t] != 1)
+            missing++;
+    }
+    ut_result(missing == 0 && rqueue_isempty(mpmc_ring), "%d values have been lost or read twice", missing);
+    rqueue_destroy(mpmc_ring);
+
+    ut_testing("rqueue_read_wait() / rqueue_write_wait() time out");
+    rb = rqueue_create(2, RQUEUE_MODE_BLOCKING);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    void *nothing = rqueue_read_wait(rb, 50);
+    long read_ms = elapsed_ms(&start);
+    rqueue_write(rb, (void *)1L);
+    rqueue_write(rb, (void *)2L);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = rqueue_write_wait(rb, (void *)3L, 50);
+    long write_ms = elapsed_ms(&start);
+    if (nothing == NULL && rc == -2 && read_ms >= 45 && write_ms >= 45)
+        ut_success();
+    else
+        ut_failure("Waited %ldms for a read and %ldms for a write (rc: %d)", read_ms, write_ms, rc);
+    rqueue_destroy(rb);
+
+    ut_testing("A reader waiting on an empty ringbuffer doesn't use the cpu");
+    rb = rqueue_create(10, RQUEUE_MODE_BLOCKING);
+    pthread_t waiter;
+    pthread_create(&waiter, NULL, idle_consumer, rb);
+    usleep(100000);
+    rqueue_write(rb, (void *)1L);
+    void *waited = NULL;
+    pthread_join(waiter, &waited);
+    if (waited != (void *)1L)
+        ut_failure("The reader hasn't been woken up");
+    else if (idle_cpu_us > 20000)
+        ut_failure("The reader used %ldus of cpu time while waiting", idle_cpu_us);
+    else
+        ut_success();
+    rqueue_destroy(rb);
+
+    ut_testing("rqueue_read_wait() / rqueue_write_wait() don't lose any wakeup");
+    failed = 0;
+    for (t = 0; t < 2; t++) {
+        rb = t ? rqueue_create_spsc(4) : rqueue_create(4, RQUEUE_MODE_BLOCKING);
+        pthread_t producer, consumer;
+        void *sum = NULL;
+        pthread_create(&consumer, NULL, wait_consumer, rb);
+        pthread_create(&producer, NULL, wait_producer, rb);
+        pthread_join(producer, NULL);
+        pthread_join(consumer, &sum);
+        if ((long)sum != (long)WAIT_ITEMS * (WAIT_ITEMS + 1) / 2)
+            failed++;
+        rqueue_destroy(rb);
+    }
+    ut_result(failed == 0, "%d rings lost some values", failed);
+
+    ut_testing("rqueue_eventfd() becomes readable when the ringbuffer is not empty");
+    rb = rqueue_create(10, RQUEUE_MODE_BLOCKING);
+    int efd = rqueue_eventfd(rb);
+    if (efd < 0) {
+        ut_failure("Can't create the eventfd");
+    } else {
+        failed = fd_readable(efd);
+        rqueue_write(rb, (void *)1L);
+        rqueue_write(rb, (void *)2L);
+        failed |= !fd_readable(efd) << 1;
+        while (rqueue_read(rb))
+            ;
+        failed |= fd_readable(efd) << 2;
+        rqueue_write(rb, (void *)3L);
+        failed |= !fd_readable(efd) << 3;
+        ut_result(failed == 0 && rqueue_eventfd(rb) == efd, "Wrong eventfd state (%d)", failed);
+    }
+    rqueue_destroy(rb);
+
+    ut_testing("rqueue_stats() counts full and empty rings, overwrites and waits");
+    rqueue_stats_t stats;
+    failed = 0;
+    for (t = 0; t < 2; t++) {
+        rb = rqueue_create_with_flags(2, RQUEUE_MODE_BLOCKING, t ? RQUEUE_FLAG_NO_STATS : RQUEUE_FLAG_NONE);
+        rqueue_write(rb, (void *)1L);
+        rqueue_write(rb, (void *)2L);
+        rqueue_write(rb, (void *)3L);
+        rqueue_set_mode(rb, RQUEUE_MODE_OVERWRITE);
+        rqueue_write(rb, (void *)4L);
+        rqueue_read(rb);
+        rqueue_read(rb);
+        rqueue_read_wait(rb, 1);
+        rqueue_stats(rb, &stats);
+        // the counters derived from the positions are always there
+        if (stats.writes != 3 || stats.reads != 2 || stats.overwrites != 1 || stats.size != 2 ||
+            stats.mode != RQUEUE_MODE_OVERWRITE || stats.spsc)
+        {
+            failed++;
+        }
+#ifndef RQUEUE_NO_STATS
+        if (t == 0 && (stats.queue_full != 1 || stats.queue_empty != 1 || stats.read_waits != 1))
+            failed++;
+#endif
+        if (t == 1 && (stats.queue_full || stats.queue_empty || stats.read_waits))
+            failed++;
+        rqueue_destroy(rb);
+    }
+    if (failed == 0 && rqueue_stats(NULL, &stats) == -1 &&
+        rqueue_create_with_flags(2, RQUEUE_MODE_OVERWRITE, RQUEUE_FLAG_SPSC) == NULL)
+    {
+        ut_success();
+    } else {
+        ut_failure("Wrong statistics (%d)", failed);
+    }
+
+    ut_testing("rqueue_read_wait() and rqueue_write_wait() count a single empty or full ring per wait");
+    failed = 0;
+    for (t = 0; t < 2; t++) {
+        rb = t ? rqueue_create_spsc(2) : rqueue_create(2, RQUEUE_MODE_BLOCKING);
+        rqueue_read_wait(rb, 1);
+        rqueue_write(rb, (void *)1L);
+        rqueue_write(rb, (void *)2L);
+        rqueue_write_wait(rb, (void *)3L, 1);
+        rqueue_stats(rb, &stats);
+#ifndef RQUEUE_NO_STATS
+        if (stats.queue_empty != 1 || stats.read_waits != 1 ||
+            stats.queue_full != 1 || stats.write_waits != 1)
+        {
+            failed++;
+        }
+#endif
+        rqueue_destroy(rb);
+    }
+    ut_result(failed == 0, "Wrong statistics (%d)", failed);
+
     ut_summary();
 
     exit(ut_failed);